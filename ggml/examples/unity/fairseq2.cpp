@@ -1,8 +1,11 @@
 #include <algorithm>
+#include <cctype>
 #include <fnmatch.h>
 #include <iostream>
 #include <math.h>
+#include <memory>
 #include <queue>
+#include <stdexcept>
 #include <unordered_map>
 
 #include "kaldi-native-fbank/csrc/feature-fbank.h"
@@ -10,6 +13,7 @@
 #include "fairseq2.h"
 #include "ggml.h"
 #include "ggml-alloc.h"
+#include "profiler.h"
 
 #include <numeric>
 
@@ -59,8 +63,13 @@ extern "C" void fairseq2_kv_cache_alloc(fairseq2_model& model, ggml_context* kv_
     GGML_ASSERT(kv_cache_ctx);
     GGML_ASSERT(!ggml_get_no_alloc(kv_cache_ctx));  // We need to be able to alloc the kv_cache buffers
     auto attn_glob = "text_decoder.*_attn.k_proj.weight";
+    // The causal mask is written once here rather than by a graph op: the buffer of
+    // `kv_cache_ctx` isn't zeroed, and the steps would recompute it in place.
     FORCE_ALLOC(self_attn_mask, kv_cache_ctx, ggml_new_tensor_2d(kv_cache_ctx, GGML_TYPE_F32, max_seq_len, max_seq_len));
-    self_attn_mask = ggml_diag_mask_inf_inplace(kv_cache_ctx, self_attn_mask, 0);
+    float* mask_data = (float*)self_attn_mask->data;
+    for (int i = 0; i < max_seq_len; ++i) {
+        for (int j = 0; j < max_seq_len; ++j) mask_data[i * max_seq_len + j] = j > i ? -INFINITY : 0.0f;
+    }
     ggml_format_name(self_attn_mask, "self_attn_mask[%d]", max_seq_len);
 
     for (auto named_tensor : model.tensors) {
@@ -102,9 +111,28 @@ inline ggml_tensor* ggml_unsqueeze(ggml_context* ctx, ggml_tensor* x, int dim) {
 }
 
 
+/// Storage type of the keys in the KV cache, see fairseq2_model::kv_cache_type.
+static ggml_type kv_cache_k_type(const fairseq2_model& model, int head_dim) {
+    // the attention reads the keys of each head, a Q8_0 block can't straddle two heads
+    if (head_dim % ggml_blck_size(model.kv_cache_type) != 0) return GGML_TYPE_F16;
+    return model.kv_cache_type;
+}
+
+/// Storage type of the values in the KV cache, read transposed by the attention.
+static ggml_type kv_cache_v_type(const fairseq2_model& model) {
+    return model.kv_cache_type == GGML_TYPE_F32 ? GGML_TYPE_F32 : GGML_TYPE_F16;
+}
+
+/// `x` converted to `type`, or a copy of it.
+static ggml_tensor* kv_cache_cpy(ggml_context* ctx, ggml_tensor* x, ggml_type type) {
+    if (type == GGML_TYPE_F32) return ggml_dup(ctx, x);
+    return ggml_cpy(ctx, x, ggml_new_tensor(ctx, type, x->n_dims, x->ne));
+}
+
 // copy k and v to kv cache
 // kv.full_k[step_nr] = k;
 // kv.full_v[step_nr] = v;
+// F16 values are stored transposed, (B, V_proj, S_kv), so that the attention reads them in place.
 void append_to_prev_kv(const fairseq2_model& model, const std::string& prefix, ggml_tensor** k, ggml_tensor** v, ggml_tensor** self_attn_mask) {
     KeyValueTensor& kv = model.kv_cache[prefix];
     int step_nr = kv.step_nr;
@@ -121,14 +149,24 @@ void append_to_prev_kv(const fairseq2_model& model, const std::string& prefix, g
         batch_size = kv.full_k->ne[2];
         ggml_detach(kv.full_k);
         ggml_detach(kv.full_v);
-        kv.full_k = ggml_squeeze(ctx, ggml_concat(ctx, ggml_unsqueeze(ctx, kv.full_k, 1), ggml_unsqueeze(ctx, *k, 1)), 1);
-        kv.full_v = ggml_squeeze(ctx, ggml_concat(ctx, ggml_unsqueeze(ctx, kv.full_v, 1), ggml_unsqueeze(ctx, *v, 1)), 1);
+        ggml_tensor* new_k = kv.full_k->type == GGML_TYPE_F32 ? *k : kv_cache_cpy(ctx, *k, kv.full_k->type);
+        kv.full_k = ggml_squeeze(ctx, ggml_concat(ctx, ggml_unsqueeze(ctx, kv.full_k, 1), ggml_unsqueeze(ctx, new_k, 1)), 1);
+        if (kv.full_v->type == GGML_TYPE_F32) {
+            kv.full_v = ggml_squeeze(ctx, ggml_concat(ctx, ggml_unsqueeze(ctx, kv.full_v, 1), ggml_unsqueeze(ctx, *v, 1)), 1);
+        } else {
+            // only the new steps are transposed, each row of the cache grows by n_steps
+            ggml_tensor* new_v = kv_cache_cpy(ctx, ggml_transpose(ctx, *v), kv.full_v->type);
+            kv.full_v = ggml_concat_0(ctx, kv.full_v, new_v);
+            kv.full_v = ggml_reshape_3d(ctx, kv.full_v, kv.full_v->ne[0], kv.full_v->ne[1], kv.full_v->ne[2]);
+        }
     } else {
         GGML_ASSERT(step_nr == 0);
         k_proj = (*k)->ne[0];
         batch_size = (*v)->ne[2];
-        kv.full_k = ggml_dup(ctx, *k);
-        kv.full_v = ggml_dup(ctx, *v);
+        int head_dim = k_proj / model.layer_config.at(prefix + ".num_heads");
+        kv.full_k = kv_cache_cpy(ctx, *k, kv_cache_k_type(model, head_dim));
+        ggml_type v_type = kv_cache_v_type(model);
+        kv.full_v = kv_cache_cpy(ctx, v_type == GGML_TYPE_F32 ? *v : ggml_transpose(ctx, *v), v_type);
     }
     *k = kv.full_k;
     *v = kv.full_v;
@@ -143,7 +181,7 @@ void append_to_prev_kv(const fairseq2_model& model, const std::string& prefix, g
     if (self_attn_mask != nullptr) {
         *self_attn_mask = ggml_slice(
             ctx, ggml_slice(ctx, kv.self_attn_mask, 0, 0, step_nr),
-            1, step_nr - 1, step_nr
+            1, step_nr - n_steps, step_nr
         );
     }
 
@@ -213,8 +251,30 @@ extern "C" std::int64_t fairseq2_model_layer_config_int(const fairseq2_model& mo
 }
 
 
+/// Options, mel banks, FFT tables and window function of the fbank features of a speech encoder.
+/// knf::FbankComputer::Compute only reads them once a first frame has filled the FFT tables,
+/// so that one extractor serves the concurrent requests of a model.
+struct fairseq2_fbank {
+    knf::FbankOptions opts;
+    knf::FbankComputer computer;
+    knf::FeatureWindowFunction window_fn;
+    // Consecutive frames stacked into one encoder input.
+    int stride;
+
+    fairseq2_fbank(const knf::FbankOptions& fbank_opts, int stride)
+        : opts(fbank_opts), computer(fbank_opts), window_fn(fbank_opts.frame_opts), stride(stride) {
+        std::vector<float> frame(opts.frame_opts.PaddedWindowSize(), 0.0f);
+        std::vector<float> features(computer.Dim());
+        computer.Compute(/*signal_raw_log_energy=*/0, /*vtln_warp=*/1.0, &frame, features.data());
+    }
+};
+
 extern "C" void fairseq2_model_free(fairseq2_model* model) {
     if (model->tensors_ctx) ggml_free(model->tensors_ctx);
+    delete model->profiler;
+    model->profiler = nullptr;
+    delete model->fbank;
+    model->fbank = nullptr;
     // delete model;
 }
 
@@ -234,6 +294,11 @@ bool has_layer(fairseq2_model& model, const std::string& name) {
     return model.tensors.find(name) != model.tensors.end();
 }
 
+static std::int64_t _layer_config_or(const fairseq2_model& model, const std::string& name, std::int64_t default_value) {
+    auto it = model.layer_config.find(name);
+    return it == model.layer_config.end() ? default_value : it->second;
+}
+
 ggml_tensor* mul_mat(ggml_context* ctx, ggml_tensor* a, ggml_tensor* b) {
     if (b->ne[1] == 1 && b->ne[2] > 1 &&  a->n_dims == 2) {
         // `b` has shape (B, 1, D).
@@ -253,6 +318,7 @@ extern "C" ggml_tensor* Linear_forward(
     const std::string &prefix,
     ggml_tensor* input  // (d_in)
 ) {
+    FAIRSEQ2_PROFILE_SCOPE(model, prefix);
     // Note: for now we assumed un-batched input
     ggml_tensor* weight = model.tensors[prefix + ".weight"];  // (d_in, d_out)
     GGML_ASSERT(weight != nullptr);
@@ -268,6 +334,7 @@ extern "C" ggml_tensor* LayerNorm_forward(
     const std::string &prefix,
     ggml_tensor* input
 ) {
+    FAIRSEQ2_PROFILE_SCOPE(model, prefix);
     ggml_tensor* weight = model.tensors[prefix + ".weight"];
     GGML_ASSERT(weight != nullptr);
     ggml_tensor* bias = model.tensors[prefix + ".bias"];
@@ -276,12 +343,7 @@ extern "C" ggml_tensor* LayerNorm_forward(
     auto ctx = model.ctx;
     double eps = model_layer_config_d(model, prefix + ".eps");
 
-    input = ggml_norm(ctx, input, /*eps*/eps);
-    return ggml_add_inplace(
-        ctx,
-        ggml_mul_inplace(ctx, ggml_repeat(ctx, weight, input), input),
-        ggml_repeat(ctx, bias, input)
-    );
+    return ggml_layer_norm(ctx, input, weight, bias, /*eps*/eps);
 }
 
 
@@ -290,6 +352,7 @@ extern "C" ggml_tensor* StandardFeedForwardNetwork_forward(
     const std::string& prefix,
     ggml_tensor* seqs
 ) {
+    FAIRSEQ2_PROFILE_SCOPE(model, prefix);
     seqs = Linear_forward(model, prefix + ".inner_proj", seqs);
     // inner_activation = ReLu // TODO: allow other activation
     seqs = ggml_relu_inplace(model.ctx, seqs);
@@ -307,6 +370,7 @@ extern "C" ggml_tensor* SiluFeedForwardNetwork_forward(
     const std::string& prefix,
     ggml_tensor* seqs
 ) {
+    FAIRSEQ2_PROFILE_SCOPE(model, prefix);
     seqs = Linear_forward(model, prefix + ".inner_proj", seqs);
     seqs = ggml_silu(model.ctx, seqs);
 
@@ -351,18 +415,21 @@ ggml_tensor* ggml_unflatten_1d(ggml_context* ctx, ggml_tensor* x, int dim, int n
     GGML_ASSERT(dim < n_dims);
     GGML_ASSERT(n_dims < 4);
     GGML_ASSERT(x->ne[dim] % num_el == 0);
-    GGML_ASSERT(x->nb[dim + 1] == x->nb[dim] * x->ne[dim]);  // `x` isn't contiguous along `dim`
+    // quantized types pack ggml_blck_size elements of dim 0 in nb[0] bytes
+    std::size_t blck_size = dim == 0 ? ggml_blck_size(x->type) : 1;
+    GGML_ASSERT(num_el % blck_size == 0);
+    GGML_ASSERT(x->nb[dim + 1] * blck_size == x->nb[dim] * x->ne[dim]);  // `x` isn't contiguous along `dim`
     if (n_dims == 1) {
-        return ggml_view_2d(ctx, x, num_el, x->ne[0] / num_el, x->nb[0] * num_el, 0);
+        return ggml_view_2d(ctx, x, num_el, x->ne[0] / num_el, x->nb[0] * num_el / blck_size, 0);
     } else if (n_dims == 2) {
         if (dim == 0) {
-            return ggml_view_3d(ctx, x, num_el, x->ne[0] / num_el, x->ne[1], x->nb[0] * num_el, x->nb[1], 0);
+            return ggml_view_3d(ctx, x, num_el, x->ne[0] / num_el, x->ne[1], x->nb[0] * num_el / blck_size, x->nb[1], 0);
         } else { // dim == 1
             return ggml_view_3d(ctx, x, x->ne[0], num_el, x->ne[1] / num_el, x->nb[1], num_el * x->nb[1], 0);
         }
     } else { // (n_dims == 3)
         if (dim == 0) {
-            return ggml_view_4d(ctx, x, num_el, x->ne[0] / num_el, x->ne[1], x->ne[2], x->nb[0] * num_el, x->nb[1], x->nb[2], 0);
+            return ggml_view_4d(ctx, x, num_el, x->ne[0] / num_el, x->ne[1], x->ne[2], x->nb[0] * num_el / blck_size, x->nb[1], x->nb[2], 0);
         } else if (dim == 1) {
             return ggml_view_4d(ctx, x, x->ne[0], num_el, x->ne[1] / num_el, x->ne[2], x->nb[1], num_el * x->nb[1], x->nb[2], 0);
         } else { // dim == 2
@@ -404,6 +471,7 @@ extern "C" ggml_tensor* MultiheadAttention_forward(
     ggml_tensor* values,  // (klen, d_out)
     ggml_tensor* attn_mask // (klen, slen)
 ) {
+    FAIRSEQ2_PROFILE_SCOPE(model, prefix);
     int model_dim = queries->ne[0];
     int num_heads = model.layer_config.at(prefix + ".num_heads");
     int head_dim = model_dim / num_heads;
@@ -415,6 +483,10 @@ extern "C" ggml_tensor* MultiheadAttention_forward(
     ggml_set_name(q, "q");
 
     ggml_tensor *k, *v;
+    // Set when the encoder-decoder attention reads a single encoder output for all the beams.
+    bool shared_kv = false;
+    // Set when `v` is already (B, H, H_dim, Sk), see fairseq2_model::kv_cache_type.
+    bool v_transposed = false;
     if (!has_kv_cache(model)) {
         k = Linear_forward(model, prefix + ".k_proj", keys);
         ggml_set_name(k, "k");
@@ -435,6 +507,12 @@ extern "C" ggml_tensor* MultiheadAttention_forward(
                 ggml_set_name(k, "k");
                 v = Linear_forward(model, prefix + ".v_proj", values);
                 ggml_set_name(v, "v");
+                if (model.kv_cache_type != GGML_TYPE_F32) {
+                    k = kv_cache_cpy(model.ctx, k, kv_cache_k_type(model, head_dim));
+                    // the values are transposed once here rather than at every step
+                    v = ggml_permute(model.ctx, ggml_unflatten_1d(model.ctx, v, 0, head_dim), 1, 2, 0, 3);
+                    v = ggml_cpy(model.ctx, v, ggml_new_tensor(model.ctx, kv_cache_v_type(model), 4, v->ne));
+                }
                 // Note we are only storing a pointer to the buffer, not the full graph
                 kv_cache.full_k = ggml_detach(ggml_dup_inplace(model.ctx, k));
                 ggml_format_name(kv_cache.full_k, "%s.k_cache", prefix.c_str());
@@ -446,8 +524,11 @@ extern "C" ggml_tensor* MultiheadAttention_forward(
                 k = kv_cache.full_k;
                 v = kv_cache.full_v;
                 GGML_ASSERT(keys->ne[1] == k->ne[1]);  // cache content doesn't match the input sequence
-                GGML_ASSERT(values->ne[1] == v->ne[1]); // cache content doesn't match the input sequence
+                GGML_ASSERT(values->ne[1] == (v->type == GGML_TYPE_F32 ? v->ne[1] : v->ne[0])); // cache content doesn't match the input sequence
             }
+            v_transposed = v->type != GGML_TYPE_F32;
+            // The K and V of the encoder output are computed once and broadcast to the beams.
+            shared_kv = k->ne[2] == 1 && queries->ne[2] > 1;
         } else { // self attention
             // (1, K) -> (N, 1, K_proj)
             k = Linear_forward(model, prefix + ".k_proj", keys);
@@ -457,12 +538,75 @@ extern "C" ggml_tensor* MultiheadAttention_forward(
             ggml_set_name(v, "v");
 
             append_to_prev_kv(model, prefix, &k, &v, &attn_mask);
+            if (v->type != GGML_TYPE_F32) {
+                v = ggml_unflatten_1d(ctx, v, 1, head_dim);  // (B, H, H_dim, Sk)
+                v_transposed = true;
+            }
         }
     }
+    if (k->type != GGML_TYPE_F32 || v->type != GGML_TYPE_F32) {
+        // F16 or Q8_0 KV cache, read in place by the matmuls rather than copied to F32 at every step.
+        q = ggml_unflatten_1d(ctx, q, 2, num_heads);  // (B, H, S, H_dim)
+        k = ggml_permute(ctx, ggml_unflatten_1d(ctx, k, 0, head_dim), 0, 2, 1, 3);  // (B?, H, Sk, H_dim)
+        // the caches store F16 values transposed, (B?, H, H_dim, Sk)
+        GGML_ASSERT(v_transposed);
+
+        // (B?, H, Sk, H_dim) x (B, H, S, H_dim) -> (B, H, S, Sk), broadcast over B with the shared encoder output
+        ggml_tensor* qk = ggml_mul_mat(ctx, k, q);
+        ggml_set_name(qk, "qk");
+        FORCE_ALLOC(qk_scale, ctx, ggml_new_tensor_1d(ctx, qk->type, 1));
+        ggml_set_f32(qk_scale, 1.0f/sqrtf(float(head_dim)));
+        qk = ggml_scale(ctx, qk, qk_scale);
+        ggml_set_name(qk, "qk_scaled");
+
+        if (attn_mask) qk = ggml_add_inplace(ctx, qk, attn_mask);
+        ggml_tensor* attn_weights = ggml_soft_max(ctx, qk);  // (B, H, S, Sk)
+        ggml_set_name(attn_weights, "attn_weights");
+
+        // (B?, H, H_dim, Sk) x (B, H, S, Sk) -> (B, H, S, H_dim)
+        ggml_tensor* attn = ggml_mul_mat(ctx, v, attn_weights);
+        ggml_set_name(attn, "attn");
+        attn = ggml_permute(ctx, attn, 0, 2, 1, 3); // (B, S, H, H_dim)
+        attn = ggml_cont(ctx, attn);
+        attn = ggml_flatten_1d(ctx, attn, 0); // (B, S, H * H_dim)
+        ggml_tensor* out = Linear_forward(model, prefix + ".output_proj", attn);
+        ggml_set_name(out, "out");
+        return out;
+    }
+
     k = _reshape_num_head(ctx, k, head_dim);  // (B * H, Sk, H_dim)
     v = _reshape_num_head_values(ctx, v, head_dim); // (B * H, H_dim, Sk)
     v = ggml_cont(ctx, v);
 
+    if (shared_kv) {
+        q = ggml_unflatten_1d(ctx, q, 2, num_heads);  // (B, H, S, H_dim)
+        k = ggml_unflatten_1d(ctx, k, 2, num_heads);  // (1, H, Sk, H_dim)
+        v = ggml_unflatten_1d(ctx, v, 2, num_heads);  // (1, H, H_dim, Sk)
+
+        // (1, H, Sk, H_dim) x (B, H, S, H_dim) -> (B, H, S, Sk)
+        ggml_tensor* qk = ggml_mul_mat(ctx, k, q);
+        ggml_set_name(qk, "qk");
+        FORCE_ALLOC(qk_scale, ctx, ggml_new_tensor_1d(ctx, qk->type, 1));
+        ggml_set_f32(qk_scale, 1.0f/sqrtf(float(head_dim)));
+        qk = ggml_scale(ctx, qk, qk_scale);
+        ggml_set_name(qk, "qk_scaled");
+
+        // the padding mask of the encoder output is the same for all the beams
+        if (attn_mask) qk = ggml_add_inplace(ctx, qk, attn_mask);
+        ggml_tensor* attn_weights = ggml_soft_max(ctx, qk);  // (B, H, S, Sk)
+        ggml_set_name(attn_weights, "attn_weights");
+
+        // (1, H, H_dim, Sk) x (B, H, S, Sk) -> (B, H, S, H_dim)
+        ggml_tensor* attn = ggml_mul_mat(ctx, v, attn_weights);
+        ggml_set_name(attn, "attn");
+        attn = ggml_permute(ctx, attn, 0, 2, 1, 3); // (B, S, H, H_dim)
+        attn = ggml_cont(ctx, attn);
+        attn = ggml_flatten_1d(ctx, attn, 0); // (B, S, H * H_dim)
+        ggml_tensor* out = Linear_forward(model, prefix + ".output_proj", attn);
+        ggml_set_name(out, "out");
+        return out;
+    }
+
 #if UNITY_FLASH_ATTN
     // For flash_attn, we assume either no masks, or triangular masks.
     ggml_tensor* attn = ggml_flash_attn(ctx, q, k, v, /*masked*/attn_mask != nullptr);  // (B * H, S, H_dim)
@@ -505,6 +649,7 @@ extern "C" ggml_tensor* StandardTransformerEncoderLayer_forward(
     ggml_tensor* seqs,
     ggml_tensor* padding_mask
 ) {
+    FAIRSEQ2_PROFILE_SCOPE(model, prefix);
     ggml_context* ctx = model.ctx;
     auto norm_order = model.layer_config.at(prefix + ".norm_order");
 
@@ -551,29 +696,42 @@ extern "C" ggml_tensor* StandardTransformerEncoderLayer_forward(
     return seqs;
 }
 
+static fairseq2_fbank* _fbank_create(const fairseq2_model& model, const std::string& prefix) {
+    std::string extractor = prefix + "_frontend.feature_extractor";
+    knf::FbankOptions opts{};
+    opts.mel_opts.num_bins = _layer_config_or(model, extractor + ".num_fbank_channels", 80);
+    opts.frame_opts.samp_freq = _layer_config_or(model, extractor + ".sample_rate", 16000);
+    return new fairseq2_fbank(opts, _layer_config_or(model, extractor + ".stride", 2));
+}
+
+void fairseq2_fbank_init(fairseq2_model& model, const std::string& prefix) {
+    if (model.fbank != nullptr || !has_layer(model, prefix + "_frontend")) return;
+    model.fbank = _fbank_create(model, prefix);
+}
+
 extern "C" ggml_tensor* WaveformToFbank_forward(
     fairseq2_model& model,
     const std::string &prefix,
     ggml_tensor* waveform
 ) {
-    // Hardcoding: num_bins 80, sample rate 16k, always standardize
+    FAIRSEQ2_PROFILE_SCOPE(model, prefix);
+    fairseq2_profiler_region fbank_region(model, "fbank");
+    std::int64_t t_start_us = ggml_time_us();
+    // Always standardized. Models not built by the loader get an extractor for this call only.
     ggml_context* ctx = model.ctx;
-    knf::MelBanksOptions mel_opts{};
-    mel_opts.num_bins = 80;
-
-    knf::FrameExtractionOptions frame_opts{};
-    frame_opts.samp_freq = 16000;
-
-    knf::FbankOptions opts{};
-    opts.frame_opts = frame_opts;
-    opts.mel_opts = mel_opts;
-
+    std::unique_ptr<fairseq2_fbank> local_fbank;
+    fairseq2_fbank* fbank = model.fbank;
+    if (fbank == nullptr) {
+        local_fbank.reset(_fbank_create(model, prefix));
+        fbank = local_fbank.get();
+    }
+    const knf::FrameExtractionOptions& frame_opts = fbank->opts.frame_opts;
+    const int num_bins = fbank->opts.mel_opts.num_bins;
 
-    std::vector<float_t> signal_frame{};
+    // Reused by the requests of the thread.
+    thread_local std::vector<float> signal_frame;
     std::int32_t num_frames = knf::NumFrames(/*num_samples=*/waveform->ne[0], frame_opts);
-    FORCE_ALLOC(output, ctx, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 80, num_frames));
-    knf::FbankComputer native_(opts);
-    knf::FeatureWindowFunction window_fn_(native_.GetFrameOptions());
+    FORCE_ALLOC(output, ctx, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, num_bins, num_frames));
 
     for (std::int32_t frame_nr = 0; frame_nr < num_frames; ++frame_nr) {
         signal_frame.resize(0);
@@ -585,28 +743,181 @@ extern "C" ggml_tensor* WaveformToFbank_forward(
             waveform->ne[0],
             frame_nr,
             frame_opts,
-            window_fn_,
+            fbank->window_fn,
             &signal_frame);
 
-        native_.Compute(
-            /*signal_raw_log_energy=*/0, /*vtln_warp=*/1.0, &signal_frame, ((float *)(output->data) + frame_nr * 80));
+        fbank->computer.Compute(
+            /*signal_raw_log_energy=*/0, /*vtln_warp=*/1.0, &signal_frame, ((float *)(output->data) + frame_nr * num_bins));
     }
     output = ggml_dup(ctx, ggml_transpose(ctx, output));
     output = ggml_norm(ctx, output, 1e-5);
     output = ggml_dup(ctx, ggml_transpose(ctx, output));
-    if (output->ne[1] % 2 == 1) {
-        output = ggml_dup(ctx, ggml_slice(ctx, output, 1, 0, output->ne[1]-1));
+    if (output->ne[1] % fbank->stride != 0) {
+        output = ggml_dup(ctx, ggml_slice(ctx, output, 1, 0, output->ne[1] - output->ne[1] % fbank->stride));
     }
-    output = ggml_reshape_2d(ctx, output, output->ne[0] * 2, output->ne[1] / 2);
+    output = ggml_reshape_2d(ctx, output, output->ne[0] * fbank->stride, output->ne[1] / fbank->stride);
+    if (model.stats) model.stats->fbank_us += ggml_time_us() - t_start_us;
     return output;
 }
 
+extern "C" ggml_tensor* KmeansQuantizer_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* seqs  // (S, M)
+) {
+    FAIRSEQ2_PROFILE_SCOPE(model, prefix);
+    ggml_context* ctx = model.ctx;
+    ggml_tensor* centroids = model.tensors[prefix + ".centroids"];  // (K, M)
+    // argmin_k |x - c_k|^2 = argmax_k x.c_k - |c_k|^2 / 2, the norm of x doesn't change the nearest centroid.
+    ggml_tensor* scores = ggml_mul_mat(ctx, centroids, seqs);  // (S, K)
+    ggml_tensor* norms = ggml_sum_rows(ctx, ggml_sqr(ctx, centroids));  // (K, 1)
+    norms = ggml_reshape_2d(ctx, norms, centroids->ne[1], 1);  // (1, K)
+    FORCE_ALLOC(half, ctx, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 1));
+    ggml_set_f32(half, -0.5f);
+    scores = ggml_add_inplace(ctx, scores, ggml_scale(ctx, norms, half));
+    return ggml_argmax(ctx, scores);  // (S,)
+}
+
+/// Largest position of the sinusoidal encodings, for which _sincos reduces the angles exactly.
+static const std::int64_t MAX_SINUSOIDAL_POS = 1 << 16;
+
+/// sin and cos of `n` angles, |x| <= MAX_SINUSOIDAL_POS. The reduction to [-pi/4, pi/4] and the
+/// float-accurate polynomials are branch free float ops, so that the loop is vectorized.
+static void _sincos(const float* x, float* out_sin, float* out_cos, std::int64_t n) {
+    for (std::int64_t i = 0; i < n; ++i) {
+        // x = k * pi/2 + r, k rounded to nearest by adding 1.5 * 2^23
+        float k = (x[i] * 0.636619772f + 12582912.0f) - 12582912.0f;
+        // pi/2 in three parts, the first two with 8 significant bits so that k * part is exact for |k| < 2^16
+        float r = ((x[i] - k * 1.5703125f) - k * 4.84466552734375e-4f) - k * -6.397578431e-7f;
+        float r2 = r * r;
+        float s = r + r * r2 * (-1.6666654611e-1f + r2 * (8.3321608736e-3f + r2 * -1.9515295891e-4f));
+        float c = 1.0f - 0.5f * r2 + r2 * r2 * (4.166664568e-2f + r2 * (-1.388731625e-3f + r2 * 2.443315711e-5f));
+        std::int32_t q = (std::int32_t)k;
+        float sin_x = (q & 1) ? c : s;
+        float cos_x = (q & 1) ? s : c;
+        out_sin[i] = (q & 2) ? -sin_x : sin_x;
+        out_cos[i] = ((q + 1) & 2) ? -cos_x : cos_x;
+    }
+}
+
+void fairseq2_sinusoidal_encodings(float* out, int dim, std::int64_t start, std::int64_t n) {
+    GGML_ASSERT(dim % 2 == 0 && dim >= 4);
+    GGML_ASSERT(start >= 0 && start + n <= MAX_SINUSOIDAL_POS);
+    int num_sin = dim / 2;
+    // Same float32 steps as the torch buffers the models were trained with.
+    std::vector<float> freqs(num_sin);
+    float coef = (float)(-std::log(10000.0) / (num_sin - 1));
+    for (int i = 0; i < num_sin; ++i) freqs[i] = std::exp((float)i * coef);
+    std::vector<float> angles(num_sin);
+    for (std::int64_t pos = 0; pos < n; ++pos) {
+        float step = (float)(start + pos);
+        for (int i = 0; i < num_sin; ++i) angles[i] = step * freqs[i];
+        float* row = out + pos * dim;
+        _sincos(angles.data(), row, row + num_sin, num_sin);
+    }
+}
+
+void fairseq2_relative_sinusoidal_encodings(float* out, int dim, std::int64_t start, std::int64_t n) {
+    GGML_ASSERT(dim % 2 == 0);
+    GGML_ASSERT(std::abs(start) <= MAX_SINUSOIDAL_POS && std::abs(start - n + 1) <= MAX_SINUSOIDAL_POS);
+    int half = dim / 2;
+    std::vector<float> freqs(half);
+    float coef = (float)(-std::log(10000.0) / dim);
+    for (int i = 0; i < half; ++i) freqs[i] = std::exp((float)(2 * i) * coef);
+    std::vector<float> angles(half), sin_row(half), cos_row(half);
+    for (std::int64_t row = 0; row < n; ++row) {
+        // the negative positions are the mirror of the positive ones
+        std::int64_t pos = start - row;
+        float step = (float)std::abs(pos);
+        float sign = pos < 0 ? -1.0f : 1.0f;
+        for (int i = 0; i < half; ++i) angles[i] = sign * (step * freqs[i]);
+        _sincos(angles.data(), sin_row.data(), cos_row.data(), half);
+        float* dst = out + row * dim;
+        for (int i = 0; i < half; ++i) {
+            dst[2 * i] = sin_row[i];
+            dst[2 * i + 1] = cos_row[i];
+        }
+    }
+}
+
+/// Position encodings generated at load time, see fixup_model in ggml_convert.py: the tables of
+/// SinusoidalPositionEncoder, marked by `<prefix>.sin_offset`, and the table of RelativePositionalEncoding
+/// shared by the conformer layers. Files which store the tables are used as is.
+static const char* REL_POS_ENC = "speech_encoder.pos_enc";
+
+static std::vector<std::string> _generated_position_encodings(const fairseq2_model& model) {
+    std::vector<std::string> prefixes;
+    static const std::string sin_offset = ".sin_offset";
+    for (const auto& kv : model.layer_config) {
+        const std::string& name = kv.first;
+        if (name.size() <= sin_offset.size() || name.compare(name.size() - sin_offset.size(), sin_offset.size(), sin_offset) != 0) continue;
+        prefixes.push_back(name.substr(0, name.size() - sin_offset.size()));
+    }
+    if (model.layer_config.count(std::string(REL_POS_ENC) + ".max_seq_len")) prefixes.push_back(REL_POS_ENC);
+    std::sort(prefixes.begin(), prefixes.end());
+    // tables stored by older converters
+    prefixes.erase(std::remove_if(prefixes.begin(), prefixes.end(), [&](const std::string& prefix) {
+        auto it = model.tensors.find(prefix);
+        return it != model.tensors.end() && it->second != nullptr;
+    }), prefixes.end());
+    return prefixes;
+}
+
+static std::int64_t _position_encodings_rows(const fairseq2_model& model, const std::string& prefix) {
+    std::int64_t max_seq_len = model.layer_config.at(prefix + ".max_seq_len");
+    return prefix == REL_POS_ENC ? 2 * max_seq_len - 1 : max_seq_len;
+}
+
+std::size_t fairseq2_position_encodings_size(const fairseq2_model& model) {
+    std::size_t size = 0;
+    for (const std::string& prefix : _generated_position_encodings(model)) {
+        std::int64_t dim = model.layer_config.at(prefix + ".encoding_dim");
+        size += dim * _position_encodings_rows(model, prefix) * sizeof(float) + ggml_tensor_overhead() + GGML_MEM_ALIGN;
+    }
+    return size;
+}
+
+void fairseq2_position_encodings_init(fairseq2_model& model, ggml_context* ctx) {
+    for (const std::string& prefix : _generated_position_encodings(model)) {
+        std::int64_t dim = model.layer_config.at(prefix + ".encoding_dim");
+        std::int64_t rows = _position_encodings_rows(model, prefix);
+        ggml_tensor* table = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, dim, rows);
+        if (prefix == REL_POS_ENC) {
+            fairseq2_relative_sinusoidal_encodings((float*)table->data, dim, (rows - 1) / 2, rows);
+        } else {
+            fairseq2_sinusoidal_encodings((float*)table->data, dim, model.layer_config.at(prefix + ".sin_offset"), rows);
+        }
+        ggml_set_name(table, prefix.c_str());
+        model.tensors[prefix] = table;
+    }
+}
+
+/// Whether the position encodings `prefix` are generated past the end of their table.
+static bool _extends_position_encodings(const fairseq2_model& model, const std::string& prefix) {
+    return model.layer_config.count(prefix + ".sin_offset") > 0;
+}
+
+/// Encodings of the positions [start, start + n) of the SinusoidalPositionEncoder `prefix`, (dim, n).
+/// The ones past the table are generated for this graph only.
+static ggml_tensor* _position_encodings(fairseq2_model& model, const std::string& prefix, std::int64_t start, std::int64_t n) {
+    ggml_tensor* table = model.tensors[prefix];
+    GGML_ASSERT(table != nullptr);
+    if (start + n <= table->ne[1]) return ggml_slice(model.ctx, table, /*axis*/1, start, start + n);
+    if (!_extends_position_encodings(model, prefix)) {
+        throw std::invalid_argument("Sequence longer than the stored position encodings " + prefix + ", convert the model again to lift the limit");
+    }
+    FORCE_ALLOC(pos_embeds, model.ctx, ggml_new_tensor_2d(model.ctx, GGML_TYPE_F32, table->ne[0], n));
+    fairseq2_sinusoidal_encodings((float*)pos_embeds->data, table->ne[0], start + model.layer_config.at(prefix + ".sin_offset"), n);
+    return pos_embeds;
+}
+
 // TODO: Check if it's possible to merge with standard MHA
 extern "C" ggml_tensor* RelativePositionMHA_forward(
     fairseq2_model& model,
     const std::string& prefix,
     ggml_tensor* seqs
 ) {
+    FAIRSEQ2_PROFILE_SCOPE(model, prefix);
     ggml_context* ctx = model.ctx;
 
     ggml_tensor* residual = seqs;
@@ -619,23 +930,26 @@ extern "C" ggml_tensor* RelativePositionMHA_forward(
     // self_attn: rel_pos SDPA
     int32_t S = seqs->ne[1];
     int32_t H = 16; // TODO: Make this configurable
-    int32_t n_ctx = 4096;
     int32_t K_h = seqs->ne[0] / H;
 
-    int32_t start_index = n_ctx - S;
-    int32_t end_index = n_ctx + S - 1;
-
-    int num_indices = end_index - start_index;
-
-    FORCE_ALLOC(rows, ctx, ggml_new_tensor_1d(ctx, GGML_TYPE_I32, num_indices));
-    for (int i = 0; i < num_indices; i++) {
-        ((int32_t *)rows->data)[i] = start_index + i;
+    // self_attn: pos_enc rows of the positions S - 1 down to 1 - S & compute_r
+    // The table holds the positions n_ctx - 1 down to 1 - n_ctx, longer inputs get their own rows.
+    ggml_tensor* pos_enc = model.tensors[REL_POS_ENC];
+    GGML_ASSERT(pos_enc != nullptr);
+    int32_t n_ctx = (pos_enc->ne[1] + 1) / 2;
+    int num_indices = 2 * S - 1;
+    ggml_tensor* r;
+    if (S <= n_ctx) {
+        FORCE_ALLOC(rows, ctx, ggml_new_tensor_1d(ctx, GGML_TYPE_I32, num_indices));
+        for (int i = 0; i < num_indices; i++) {
+            ((int32_t *)rows->data)[i] = n_ctx - S + i;
+        }
+        r = ggml_get_rows(ctx, pos_enc, rows);
+    } else {
+        FORCE_ALLOC(r_rows, ctx, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, pos_enc->ne[0], num_indices));
+        fairseq2_relative_sinusoidal_encodings((float*)r_rows->data, pos_enc->ne[0], S - 1, num_indices);
+        r = r_rows;
     }
-
-    // self_attn: load pos_enc weights & compute_r
-    // In fairseq2 pos_enc weights are calculated on the fly, since some more custom operators might be needed to enable this,
-    // we store the results (fixed) in checkpoint as model.audio_enc_pos_enc_w and load directly.
-    ggml_tensor* r = ggml_get_rows(ctx, model.tensors["speech_encoder.pos_enc"], rows);
     r = mul_mat(ctx, model.tensors[prefix + ".sdpa.r_proj.weight"], r);
     r = ggml_dup(ctx, ggml_permute(ctx, ggml_unflatten_1d(ctx, r, 0, K_h), 0, 2, 1, 3));
 
@@ -700,6 +1014,7 @@ extern "C" ggml_tensor* ConvModule_forward(
     const std::string& prefix,
     ggml_tensor* seqs
 ) {
+        FAIRSEQ2_PROFILE_SCOPE(model, prefix);
         ggml_context* ctx = model.ctx;
         ggml_tensor* residual = seqs;
         seqs = LayerNorm_forward(model, prefix + "_layer_norm", seqs);
@@ -736,6 +1051,7 @@ extern "C" ggml_tensor* StandardConformerEncoderLayer_forward(
     ggml_tensor* seqs,
     ggml_tensor* padding_mask
 ) {
+    FAIRSEQ2_PROFILE_SCOPE(model, prefix);
     ggml_context* ctx = model.ctx;
     FORCE_ALLOC(ffn_scale, ctx, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 1, 1));
     ggml_set_f32(ffn_scale, 0.5f);
@@ -755,28 +1071,43 @@ extern "C" ggml_tensor* StandardConformerEncoderLayer_forward(
     return seqs;
 }
 
-extern "C" ggml_tensor* StandardConformerEncoder_forward(
+extern "C" ggml_tensor* StandardConformerEncoderLayerOutput_forward(
     fairseq2_model& model,
     const std::string& prefix,
     ggml_tensor* seqs,
-    ggml_tensor* padding_mask
+    ggml_tensor* padding_mask,
+    int out_layer_idx
 ) {
-    ggml_context* ctx = model.ctx;
     seqs = WaveformToFbank_forward(model, prefix, seqs);
     seqs = LayerNorm_forward(model, prefix + "_frontend.post_extract_layer_norm", seqs);
     seqs = Linear_forward(model, prefix + "_frontend.model_dim_proj", seqs);
     int layer_idx = 0;
 
     std::string layer_name = prefix + ".inner.layers." + std::to_string(layer_idx);
+    GGML_ASSERT(out_layer_idx < 0 || has_layer(model, prefix + ".inner.layers." + std::to_string(out_layer_idx)));
 
     while (has_layer(model, layer_name)) {
         seqs = StandardConformerEncoderLayer_forward(
             model, layer_name, seqs, padding_mask
         );
         ggml_set_name(seqs, ("x_enc_" + std::to_string(layer_idx)).c_str());
+        // We don't need to execute the remaining layers.
+        if (layer_idx == out_layer_idx) break;
         layer_idx += 1;
         layer_name = prefix + ".inner.layers." + std::to_string(layer_idx);
     }
+    return seqs;
+}
+
+extern "C" ggml_tensor* StandardConformerEncoder_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* seqs,
+    ggml_tensor* padding_mask
+) {
+    FAIRSEQ2_PROFILE_SCOPE(model, prefix);
+    ggml_context* ctx = model.ctx;
+    seqs = StandardConformerEncoderLayerOutput_forward(model, prefix, seqs, padding_mask, -1);
 
     seqs = LayerNorm_forward(model, prefix + ".inner_layer_norm", seqs);
     ggml_tensor* residual = seqs;
@@ -787,8 +1118,8 @@ extern "C" ggml_tensor* StandardConformerEncoder_forward(
     ggml_set_f32(ffn_scale, 0.5f);
     seqs = ggml_mul(ctx, ggml_repeat(ctx, ffn_scale, seqs), seqs);
     seqs = ggml_add_inplace(ctx, seqs, residual);
-    layer_idx = 0;
-    layer_name = prefix + ".adaptor_layers." + std::to_string(layer_idx);
+    int layer_idx = 0;
+    std::string layer_name = prefix + ".adaptor_layers." + std::to_string(layer_idx);
     while (has_layer(model, layer_name)) {
         seqs = StandardConformerEncoderAdaptorLayer_forward(
             model, layer_name, seqs, padding_mask
@@ -808,6 +1139,7 @@ extern "C" ggml_tensor* StandardConformerEncoderAdaptorLayer_forward(
     ggml_tensor* seqs,
     ggml_tensor* padding_mask
 ) {
+    FAIRSEQ2_PROFILE_SCOPE(model, prefix);
     ggml_context* ctx = model.ctx;
     ggml_tensor* residual = seqs;
     residual = LayerNorm_forward(model, prefix + ".residual_layer_norm", residual);
@@ -902,15 +1234,16 @@ extern "C" ggml_tensor* PositionalEmbedding_forward(
     const std::string& prefix,
     ggml_tensor* embeds
 ) {
+    FAIRSEQ2_PROFILE_SCOPE(model, prefix);
     // This only work with the simple pos encoders
     int seq_len = embeds->ne[1];
-    ggml_tensor* full_pos_embeds = model.tensors[prefix];
 
     int start_step = 0;
     if (has_kv_cache(model)) {
-        start_step = model.kv_cache[prefix].step_nr++;
+        start_step = model.kv_cache[prefix].step_nr;
+        model.kv_cache[prefix].step_nr += seq_len;
     }
-    ggml_tensor* pos_embeds = ggml_slice(model.ctx, full_pos_embeds, /*axis*/1, start_step, seq_len + start_step);
+    ggml_tensor* pos_embeds = _position_encodings(model, prefix, start_step, seq_len);
     return ggml_add(model.ctx, embeds, pos_embeds);
 }
 
@@ -919,6 +1252,7 @@ extern "C" ggml_tensor* TransformerEmbeddingFrontend_forward(
     const std::string& prefix,
     ggml_tensor* seqs
 ) {
+    FAIRSEQ2_PROFILE_SCOPE(model, prefix);
     GGML_ASSERT(seqs->n_dims < GGML_MAX_DIMS);
     ggml_context* ctx = model.ctx;
     ggml_tensor* embed_weights = model.tensors[prefix + ".embed.weight"];
@@ -938,6 +1272,14 @@ extern "C" ggml_tensor* TransformerEmbeddingFrontend_forward(
         embeds->n_dims = seqs->n_dims + 1;
     }
 
+    // Embeddings tied to another weight are stored unscaled, see fixup_model in ggml_convert.py
+    auto embed_scale = model.layer_config.find(prefix + ".embed_scale");
+    if (embed_scale != model.layer_config.end()) {
+        FORCE_ALLOC(scale_t, ctx, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 1));
+        ggml_set_f32(scale_t, model_layer_config_d(model, embed_scale->first));
+        embeds = ggml_scale(ctx, embeds, scale_t);
+    }
+
     // padding mask ?
     // padding_mask = to_padding_mask(embeds, seq_lens)
 
@@ -958,6 +1300,7 @@ extern "C" ggml_tensor* StandardTransformerEncoder_forward(
     ggml_tensor* seqs,
     ggml_tensor* padding_mask
 ) {
+    FAIRSEQ2_PROFILE_SCOPE(model, prefix);
     int layer_idx = 0;
     std::string layer_name = prefix + ".layers." + std::to_string(layer_idx);
     while (has_layer(model, layer_name)) {
@@ -984,6 +1327,7 @@ extern "C" ggml_tensor* StandardTransformerDecoderLayer_forward(
     ggml_tensor* encoder_output,
     ggml_tensor* encoder_padding_mask
 ) {
+    FAIRSEQ2_PROFILE_SCOPE(model, prefix);
     ggml_context* ctx = model.ctx;
     auto norm_order = model.layer_config.at(prefix + ".norm_order");
 
@@ -1062,7 +1406,9 @@ extern "C" ggml_tensor* StandardTransformerDecoderLayer_forward(
 extern "C" ggml_tensor* causal_attention_mask(ggml_context* ctx, ggml_tensor* seqs) {
     auto seq_len = seqs->ne[1];
     // TODO: allow other ggml_type
-    ggml_tensor* mask = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, seq_len, seq_len);
+    // Zero-filled here, because diag_mask_inf keeps the lower triangle of its input.
+    FORCE_ALLOC(mask, ctx, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, seq_len, seq_len));
+    ggml_set_f32(mask, 0.0f);
     return ggml_diag_mask_inf(ctx, mask, 0);
 }
 
@@ -1074,6 +1420,7 @@ extern "C" ggml_tensor* StandardTransformerDecoder_forward(
     ggml_tensor* encoder_output,
     ggml_tensor* encoder_padding_mask
 ) {
+    FAIRSEQ2_PROFILE_SCOPE(model, prefix);
     int layer_idx = 0;
     std::string layer_name = prefix + ".layers." + std::to_string(layer_idx);
     ggml_tensor* self_attn_mask = causal_attention_mask(model.ctx, seqs);
@@ -1125,27 +1472,6 @@ int _determine_max_seq_len(const SequenceGeneratorJob& job, int source_seq_len)
     return max_seq_len;
 }
 
-void _fan_out_encoder_output(
-    ggml_context* ctx,
-    ggml_tensor** encoder_output_out,
-    ggml_tensor** encoder_padding_mask_out,
-    int beam_size
-) {
-    // (S_enc, M)
-    ggml_tensor* encoder_output = *encoder_output_out;
-    ggml_tensor* encoder_padding_mask = *encoder_padding_mask_out;
-
-    // (B, S_enc, M)
-    ggml_tensor* shape = ggml_new_tensor_3d(ctx, GGML_TYPE_I8, encoder_output->ne[0], encoder_output->ne[1], beam_size);
-    // (S_enc, M) -> (B, S_enc, M)
-    *encoder_output_out = ggml_repeat(ctx, encoder_output, shape);
-    // (S_enc) -> (B, S_enc)
-    if (encoder_padding_mask != nullptr) {
-        ggml_tensor* shape_mask = ggml_new_tensor_3d(ctx, GGML_TYPE_I8, encoder_padding_mask->ne[0], 1, beam_size);
-        *encoder_padding_mask_out = ggml_repeat(ctx, encoder_padding_mask, shape_mask);
-    }
-}
-
 ggml_tensor* ggml_log_softmax(ggml_context* ctx, ggml_tensor* logits) {
     // TODO: this isn't the most precise way of doing this
     return ggml_log_inplace(ctx, ggml_soft_max_inplace(ctx, logits));
@@ -1161,38 +1487,41 @@ ggml_tensor* ggml_expand_2d(ggml_context* ctx, ggml_tensor* x, int64_t ne0, int6
 
 void _bootstrap_seqs_and_scores(
     fairseq2_model& model,
-    const SequenceGeneratorJob& job,
-    ggml_tensor* full_seqs,
-    ggml_tensor* scores,
+    const SequenceGeneratorJob* jobs,
+    int n_jobs,
+    ggml_tensor* full_seqs,  // (n_jobs x B, S)
+    ggml_tensor* scores,  // (n_jobs x B, S)
     ggml_tensor* encoder_output,
     ggml_tensor* encoder_padding_mask,
-    ggml_tensor* lid_scores,
+    ggml_tensor** lid_scores,  // one per job
     int n_threads,
     const std::vector<int>& lang_ids
 ) {
     // Returns LID score map
-    int prefix_seq_len = job.prefix_seq->ne[0];
+    int prefix_seq_len = jobs[0].prefix_seq->ne[0];
     int max_seq_len = scores->ne[0];
-    int beam_size = scores->ne[1];
+    int beam_size = scores->ne[1] / n_jobs;
     GGML_ASSERT(prefix_seq_len > 0);
     ggml_context* ctx = model.ctx;
+
+    // full_seqs[:, : prefix_seq_len] = job.prefix_seq, for the beams of each job
+    for (int j = 0; j < n_jobs; ++j) {
+        for (int b = j * beam_size; b < (j + 1) * beam_size; ++b) {
+            for (int i = 0; i < prefix_seq_len; ++i) {
+                ggml_set_i32_1d(full_seqs, b * max_seq_len + i, ggml_get_i32_1d(jobs[j].prefix_seq, i));
+            }
+        }
+    }
     if (prefix_seq_len == 1) {
-        // We only have one token in prefix, we won't compute decoding scores,
-        // we just need to copy the token to seqs.
+        // We only have one token in prefix, we won't compute decoding scores.
         // Note: it also means the enc_kv_cache will be populated later.
-        ggml_tensor* seqs = ggml_slice(ctx, full_seqs, 0, 0, prefix_seq_len);
-        ggml_set_i32(seqs, ggml_get_i32_1d(job.prefix_seq, 0));
         return;
     }
 
-    // full_seqs[:, : prefix_seq_len] = job.prefix_seq;
-    ggml_tensor* seqs = ggml_slice(ctx, full_seqs, 0, 0, prefix_seq_len);
-    seqs = ggml_cpy(ctx, ggml_repeat(ctx, job.prefix_seq, seqs), seqs);
-
-    // We have to bootstrap the model with the already fanned-out encoder
-    // output to correctly initialize its incremental state.
+    // We have to bootstrap the model with the encoder output to correctly
+    // initialize its incremental state.
     // Note: we don't start decoding the last prefix token just yet.
-    seqs = ggml_slice(ctx, seqs, 0, 0, prefix_seq_len - 1);
+    ggml_tensor* seqs = ggml_slice(ctx, full_seqs, 0, 0, prefix_seq_len - 1);
 
     // Bootstrap the model state with prefix sequence.
     seqs = TransformerEmbeddingFrontend_forward(model, "text_decoder_frontend", seqs);
@@ -1208,39 +1537,48 @@ void _bootstrap_seqs_and_scores(
     // logits, lprobs: (N, S_pfx - 1, V)
     ggml_tensor* logits = Linear_forward(model, "final_proj", decoder_output);
     int vocab_size = logits->ne[0];
-    ggml_tensor* lprobs = ggml_log_softmax(ctx, ggml_slice(ctx, logits, 1, 0, 1));
+    ggml_tensor* lprobs = ggml_log_softmax(ctx, logits);
     struct ggml_cgraph * gf = ggml_new_graph(ctx);
     ggml_build_forward_expand(gf, lprobs);
-    ggml_graph_compute_with_ctx(ctx, gf, n_threads);
-
-    full_seqs->type = GGML_TYPE_I32;
-    job.prefix_seq->type = GGML_TYPE_I32;
-    // For LID
-    for (std::size_t i = 0; i < lang_ids.size(); ++i) {
-        ggml_set_f32_1d(lid_scores, i, std::exp(ggml_get_f32_1d(lprobs, lang_ids[i])));
-    }
-
-    // Fetch scores of next steps from "lprobs"
-    float p_score = 0;
-    for (int i = 1; i < prefix_seq_len; ++i) {
-        int p = 0;
-        if (ggml_get_i32_1d(job.prefix_seq, i) == model.vocab.token_to_id["<unk>"]) {
-            // If tgt_lang is unk, use the most probable lang tag predicted by model
-            int max_value = std::numeric_limits<float>::min();
-            for (std::size_t j = 0; j < lang_ids.size(); j++) {
-                if(ggml_get_f32_1d(lprobs, lang_ids[j]) > max_value) {
-                    max_value = ggml_get_f32_1d(lprobs, lang_ids[j]);
-                    p = lang_ids[j];
+    fairseq2_graph_compute(model, ctx, gf, n_threads);
+
+    if (fairseq2_cancelled(model)) {
+        // The graph stopped early, generate_sequence returns the prefix alone.
+        for (int j = 0; j < n_jobs; ++j) ggml_set_f32(lid_scores[j], 0.0f);
+        return;
+    }
+    for (int j = 0; j < n_jobs; ++j) {
+        // lprobs of the first beam of the job
+        std::int64_t offset = (std::int64_t)j * beam_size * (prefix_seq_len - 1) * vocab_size;
+
+        // For LID
+        for (std::size_t i = 0; i < lang_ids.size(); ++i) {
+            ggml_set_f32_1d(lid_scores[j], i, std::exp(ggml_get_f32_1d(lprobs, offset + lang_ids[i])));
+        }
+
+        // Fetch scores of next steps from "lprobs"
+        float p_score = 0;
+        for (int i = 1; i < prefix_seq_len; ++i) {
+            int p = 0;
+            if (ggml_get_i32_1d(jobs[j].prefix_seq, i) == model.vocab.token_to_id["<unk>"]) {
+                // If tgt_lang is unk, use the most probable lang tag predicted by model
+                float max_value = -INFINITY;
+                for (std::size_t k = 0; k < lang_ids.size(); k++) {
+                    if(ggml_get_f32_1d(lprobs, offset + lang_ids[k]) > max_value) {
+                        max_value = ggml_get_f32_1d(lprobs, offset + lang_ids[k]);
+                        p = lang_ids[k];
+                    }
                 }
+            } else {
+                p = ggml_get_i32_1d(jobs[j].prefix_seq, i);
+            }
+            // the score of prefix token `i` is predicted at step `i - 1`
+            p_score += ggml_get_f32_1d(lprobs, offset + (i - 1) * vocab_size + p);
+            for (int b = j * beam_size; b < (j + 1) * beam_size; ++b) {
+                // scores: (N, S)
+                // Note: First step (e.g. BOS)'s score is always 0.
+                ggml_set_f32_1d(scores, b * max_seq_len + i, p_score);
             }
-        } else {
-            p = ggml_get_i32_1d(job.prefix_seq, i);
-        }
-        p_score += ggml_get_f32_1d(lprobs, i * vocab_size + p);
-        for (int b = 0; b < beam_size; ++b) {
-            // scores: (N, S)
-            // Note: First step (e.g. BOS)'s score is always 0.
-            ggml_set_f32_1d(scores, b * max_seq_len + i, p_score);
         }
     }
 }
@@ -1267,7 +1605,7 @@ int topk(
 }
 
 void _tweak_lprobs(const SequenceGeneratorJob& job, ggml_tensor* lprobs, int step_nr, int max_seq_len, std::size_t vocab_size) {
-    std::size_t beam_size = job.opts.beam_size;
+    std::size_t beam_size = lprobs->ne[1];
     std::size_t eos_idx = job.eos_idx;
 
     // Do not allow EOS before reaching the minimum sequence length.
@@ -1347,6 +1685,26 @@ void _finalize_hypothesis(
     hypothesis->lid_scores = lid_scores;
 }
 
+/// Turns `n_beams` beams from `first_beam` into hypotheses, as if they had produced EOS at `step_nr`.
+/// Used to return the best partial hypotheses when the search is cancelled.
+void _finalize_ongoing_beams(
+    const SequenceGeneratorJob& job,
+    ggml_context* ctx,
+    int step_nr,
+    std::size_t first_beam,
+    std::size_t n_beams,
+    ggml_tensor* seqs, // (beam_size, seq_len)
+    ggml_tensor* scores, // (beam_size, seq_len)
+    ggml_tensor* lid_scores,
+    Hypothesis* finished_searches,
+    Hypothesis* finished_searches_end
+) {
+    for (std::size_t beam = first_beam; beam < first_beam + n_beams && finished_searches != finished_searches_end; ++beam) {
+        float score = ggml_get_f32_1d(scores, scores->ne[0] * beam + step_nr);
+        _finalize_hypothesis(job, ctx, step_nr, beam, job.eos_idx, score, seqs, scores, lid_scores, finished_searches++);
+    }
+}
+
 // Uses ggml_context to store any object.
 #define GGML_CTX_ALLOC(ctx, Type, n) \
     (Type*)(ggml_new_tensor_1d(ctx, GGML_TYPE_I8, sizeof(Type) * n)->data);
@@ -1364,18 +1722,65 @@ ggml_allocr* new_arena_allocr(std::vector<uint8_t>& buffer) {
     return ggml_allocr_new(buffer.data(), buffer.capacity(), 8);
 }
 
+extern "C" void fairseq2_graph_fuse(fairseq2_model& model, ggml_cgraph* gf) {
+    if (model.fuse_graphs) ggml_graph_fuse(gf);
+}
 
+static bool fairseq2_abort_callback(void* data) {
+    return ((const CancellationToken*)data)->is_cancelled();
+}
 
-/// Generates a translation for a single sequence
+extern "C" void fairseq2_graph_compute(fairseq2_model& model, ggml_context* ctx, ggml_cgraph* gf, int n_threads) {
+    ggml_cplan cplan = ggml_graph_plan(gf, n_threads);
+    cplan.numa_node = model.numa_node;
+    if (model.spin_count != INT_MIN) {
+        cplan.spin_count = model.spin_count;
+    }
+    if (cplan.work_size > 0) {
+        FORCE_ALLOC(work_buffer, ctx, ggml_new_tensor_1d(ctx, GGML_TYPE_I8, cplan.work_size));
+        cplan.work_data = (uint8_t*)work_buffer->data;
+    }
+    if (model.profiler != nullptr && model.profiler->enabled) {
+        cplan.node_callback = fairseq2_profiler_record_node;
+        cplan.node_callback_data = model.profiler;
+    }
+    if (model.cancel != nullptr) {
+        cplan.abort_callback = fairseq2_abort_callback;
+        cplan.abort_callback_data = (void*)model.cancel;
+    }
+    if (model.stats) model.stats->n_graph_nodes += gf->n_nodes;
+    ggml_graph_compute(gf, &cplan);
+}
+
+bool fairseq2_cancelled(const fairseq2_model& model) {
+    return model.cancel != nullptr && model.cancel->is_cancelled();
+}
+
+
+
+void _record_step(fairseq2_model& model, std::int64_t t_step_us) {
+    if (model.stats == nullptr) return;
+    model.stats->n_steps += 1;
+    model.stats->decode_step_us.push_back(ggml_time_us() - t_step_us);
+}
+
+/// Generates the translations of several jobs over the same encoder output, in lockstep.
 /// The results Hypothesis are written inside `result_ctx`.
-extern "C" Hypothesis* generate_sequence(
+extern "C" Hypothesis** generate_sequences(
     fairseq2_model& model,
-    const SequenceGeneratorJob& job,
+    const SequenceGeneratorJob* jobs,
+    int n_jobs,
     ggml_tensor* encoder_output,
     ggml_tensor* encoder_padding_mask,
     ggml_context* result_ctx,
     int n_threads
 ) {
+    GGML_ASSERT(n_jobs > 0);
+    const SequenceGeneratorJob& job = jobs[0];
+    for (int j = 1; j < n_jobs; ++j) {
+        GGML_ASSERT(jobs[j].opts.beam_size == job.opts.beam_size);
+        GGML_ASSERT(jobs[j].prefix_seq->ne[0] == job.prefix_seq->ne[0]);
+    }
     // Pre allocate memory buffers.
     // * step_ctx: contains metadata for the model graph, as well as some explicit
     // buffers for the lprobs tweaking.
@@ -1384,14 +1789,14 @@ extern "C" Hypothesis* generate_sequence(
     // * search_ctx contains tensors that should live for the full search,
     // like encoder kv cache.
     // * step_alloc contains buffer for the forward pass of the model.
-    // Split mem_mb into the different context we need to use.
-    int mem_mb = job.opts.mem_mb;
-    std::vector<uint8_t> local_bufs[4] = {
-        std::vector<uint8_t>(mem_mb * MB * 3 / 10),  // step_ctx
-        std::vector<uint8_t>(mem_mb * MB * 3 / 10),  // prev_step_ctx
-        std::vector<uint8_t>(mem_mb * MB * 3 / 10),  // search_ctx
-        std::vector<uint8_t>(mem_mb * MB * 1 / 10),  // step_alloc
-    };
+    // Split mem_mb into the different context we need to use, each job needs mem_mb.
+    // Reserved but not zeroed, so that only the pages actually used are touched.
+    int mem_mb = job.opts.mem_mb * n_jobs;
+    std::vector<uint8_t> local_bufs[4];
+    local_bufs[0].reserve(mem_mb * MB * 3 / 10);  // step_ctx
+    local_bufs[1].reserve(mem_mb * MB * 3 / 10);  // prev_step_ctx
+    local_bufs[2].reserve(mem_mb * MB * 3 / 10);  // search_ctx
+    local_bufs[3].reserve(mem_mb * MB * 1 / 10);  // step_alloc
     ggml_allocr* step_alloc = new_arena_allocr(local_bufs[3]);
 
     std::vector<int> lang_ids;
@@ -1406,30 +1811,38 @@ extern "C" Hypothesis* generate_sequence(
     ggml_tensor* embed = model.tensors["text_decoder_frontend.embed.weight"];
     std::size_t vocab_size = embed->ne[1];
     std::size_t beam_size = job.opts.beam_size;
+    // The beams of each job are contiguous rows of the search buffers.
+    std::size_t n_rows = beam_size * n_jobs;
     ggml_detach(encoder_output);
     int source_seq_len = encoder_output->ne[1];
     int max_seq_len = _determine_max_seq_len(job, source_seq_len);
 
     ggml_context* search_ctx = ctx_from_buffer(local_bufs[2]);
     ggml_context* original_ctx = model.ctx;
-    fairseq2_kv_cache_alloc(model, search_ctx, beam_size, max_seq_len);
+    fairseq2_kv_cache_alloc(model, search_ctx, n_rows, max_seq_len);
 
-    // (S_enc, M) -> (B, S_enc, M)
+    // The encoder output isn't fanned out to the beams: the encoder-decoder attention
+    // projects it once, see MultiheadAttention_forward.
     model.ctx = search_ctx;
-    _fan_out_encoder_output(search_ctx, &encoder_output, &encoder_padding_mask, beam_size);
 
     // Allocate results in the context provided by the caller.
     ggml_set_no_alloc(result_ctx, false);
-    Hypothesis* finished_searches_begin = GGML_CTX_ALLOC(result_ctx, Hypothesis, beam_size);
-    Hypothesis* finished_searches = finished_searches_begin;
-    for (std::size_t i = 0; i < beam_size; ++i) finished_searches[i] = {nullptr, -INFINITY, nullptr};
-    Hypothesis* finished_searches_end = finished_searches + beam_size;
+    Hypothesis** results = GGML_CTX_ALLOC(result_ctx, Hypothesis*, n_jobs);
+    // Next hypothesis of each job
+    std::vector<Hypothesis*> finished_searches(n_jobs);
+    std::vector<ggml_tensor*> lid_scores(n_jobs);
+    for (int j = 0; j < n_jobs; ++j) {
+        results[j] = GGML_CTX_ALLOC(result_ctx, Hypothesis, beam_size);
+        for (std::size_t i = 0; i < beam_size; ++i) results[j][i] = {nullptr, -INFINITY, nullptr};
+        finished_searches[j] = results[j];
+        lid_scores[j] = ggml_new_tensor_1d(result_ctx, GGML_TYPE_F32, std::max<std::size_t>(lang_ids.size(), 1));
+    }
 
     // Initialize buffers. (B, S)
-    ggml_tensor* seqs = ggml_new_tensor_2d(search_ctx, GGML_TYPE_I32, max_seq_len, beam_size);
+    ggml_tensor* seqs = ggml_new_tensor_2d(search_ctx, GGML_TYPE_I32, max_seq_len, n_rows);
     ggml_set_i32(seqs, 0);
     ggml_set_name(seqs, "seqs_0");
-    ggml_tensor* scores = ggml_new_tensor_2d(search_ctx, GGML_TYPE_F32, max_seq_len, beam_size);
+    ggml_tensor* scores = ggml_new_tensor_2d(search_ctx, GGML_TYPE_F32, max_seq_len, n_rows);
     ggml_set_name(scores, "scores_0");
     ggml_set_f32(scores, 0.0);
     int prefix_seq_len = job.prefix_seq->ne[0];
@@ -1438,45 +1851,69 @@ extern "C" Hypothesis* generate_sequence(
     ggml_context* step_ctx = ctx_from_buffer(local_bufs[start_step % 2]);
     GGML_ASSERT(step_ctx != search_ctx);
     model.enc_kv_cache_ctx = search_ctx;
-    ggml_tensor* lid_scores = ggml_new_tensor_1d(result_ctx, GGML_TYPE_F32, 1); // Dummy initialization to get rid of warnings
-    if (lang_ids.size()) {
-        lid_scores = ggml_new_tensor_1d(result_ctx, GGML_TYPE_F32, lang_ids.size());
-    } 
     // Multilingual models: Bootstrap LID scores
+    std::int64_t t_bootstrap_us = ggml_time_us();
     _bootstrap_seqs_and_scores(
-        model, job, seqs, scores, encoder_output, encoder_padding_mask, lid_scores, n_threads, lang_ids
+        model, jobs, n_jobs, seqs, scores, encoder_output, encoder_padding_mask, lid_scores.data(), n_threads, lang_ids
     );
+    if (model.stats) model.stats->bootstrap_us += ggml_time_us() - t_bootstrap_us;
 
     // Holds the indices of beams (a beam can occur more than once) that we
     // should continue with in the next step.
-    ggml_tensor* beam_indices = ggml_new_tensor_1d(search_ctx, GGML_TYPE_I32, beam_size);
-    ggml_tensor* next_tokens = ggml_new_tensor_1d(search_ctx, GGML_TYPE_I32, beam_size);
-    ggml_tensor* next_scores = ggml_new_tensor_1d(search_ctx, GGML_TYPE_F32, beam_size);
+    ggml_tensor* beam_indices = ggml_new_tensor_1d(search_ctx, GGML_TYPE_I32, n_rows);
+    ggml_tensor* next_tokens = ggml_new_tensor_1d(search_ctx, GGML_TYPE_I32, n_rows);
+    ggml_tensor* next_scores = ggml_new_tensor_1d(search_ctx, GGML_TYPE_F32, n_rows);
 
-    // Array with integers up to 'vocab_size * beam_size' to represent next beams to explore
-    ggml_tensor* candidate_indices = ggml_new_tensor_1d(search_ctx, GGML_TYPE_I32, vocab_size * beam_size);
-    for (std::size_t i = 0; i < vocab_size * beam_size; ++i)
-        ((int32_t *)(candidate_indices->data))[i] = i;
+    // Array with integers up to 'vocab_size * beam_size' to represent next beams to explore, for each job
+    ggml_tensor* candidate_indices = ggml_new_tensor_1d(search_ctx, GGML_TYPE_I32, vocab_size * n_rows);
+    for (std::size_t i = 0; i < vocab_size * n_rows; ++i)
+        ((int32_t *)(candidate_indices->data))[i] = i % (vocab_size * beam_size);
 
     printf_mem_usage(search_ctx, "search_ctx");
 
+    // Jobs still searching, in the order of their beams in `seqs`. Finished jobs are dropped
+    // from the buffers, so that the next steps only compute the remaining beams.
+    std::vector<int> active_jobs(n_jobs);
+    std::iota(active_jobs.begin(), active_jobs.end(), 0);
+
+    std::int64_t t_step_us = 0;
+    // Checked after each graph: once the request is cancelled, fills the remaining hypotheses
+    // with the ongoing beams. `seqs` and `scores` are only updated at the end of a step, so
+    // the partial step is dropped.
+    auto cancel_search = [&](int step_nr) {
+        if (!fairseq2_cancelled(model)) return false;
+        std::size_t n_beams = step_nr == start_step ? 1 : beam_size;
+        for (std::size_t a = 0; a < active_jobs.size(); ++a) {
+            int j = active_jobs[a];
+            _finalize_ongoing_beams(
+                jobs[j], result_ctx, step_nr, a * beam_size, n_beams, seqs, scores, lid_scores[j], finished_searches[j], results[j] + beam_size
+            );
+        }
+        if (model.stats) model.stats->cancelled = true;
+        _record_step(model, t_step_us);
+        return true;
+    };
+
     for (int step_nr = start_step; step_nr < max_seq_len - 1; ++step_nr) {
+        t_step_us = ggml_time_us();
         model.ctx = step_ctx;
         ggml_set_no_alloc(step_ctx, true); // Use allocr for the model forward pass
-        int p = 0;
-        if (step_nr == start_step) {
+        if (step_nr == start_step && lang_ids.size()) {
             // Find the most probable lang_tok and assign it to all beams, when prefix_seq[1] is <unk>
-            if (lang_ids.size() && ggml_get_i32_1d(job.prefix_seq, 1) == model.vocab.token_to_id["<unk>"]) {
-                float max_lprob = std::numeric_limits<float>::min();
-                for(std::size_t j = 0; j < lang_ids.size(); j++) {
-                    auto val = ggml_get_f32_1d(lid_scores, j);
+            for (std::size_t a = 0; a < active_jobs.size(); ++a) {
+                int j = active_jobs[a];
+                if (ggml_get_i32_1d(jobs[j].prefix_seq, 1) != model.vocab.token_to_id["<unk>"]) continue;
+                int p = 0;
+                float max_lprob = -INFINITY;
+                for(std::size_t k = 0; k < lang_ids.size(); k++) {
+                    auto val = ggml_get_f32_1d(lid_scores[j], k);
                     if (val > max_lprob) {
                         max_lprob = val;
-                        p = lang_ids[j];
+                        p = lang_ids[k];
                     }
                 }
-                for (std::size_t k = 0; k < beam_size; k++) {
-                    ggml_set_i32_1d(seqs, k * vocab_size + step_nr, p);
+                for (std::size_t k = a * beam_size; k < (a + 1) * beam_size; k++) {
+                    ggml_set_i32_1d(seqs, k * max_seq_len + step_nr, p);
                 }
             }
         }
@@ -1502,84 +1939,128 @@ extern "C" Hypothesis* generate_sequence(
         // TODO: use ggml properly compute the tweaks
         struct ggml_cgraph * gf = ggml_new_graph(step_ctx);
         ggml_build_forward_expand(gf, lprobs);
+        fairseq2_graph_fuse(model, gf);
         std::size_t fwd_mem = ggml_allocr_alloc_graph(step_alloc, gf);
-        GGML_UNUSED(fwd_mem);
-        ggml_graph_compute_with_ctx(step_ctx, gf, n_threads);
+        if (model.stats) model.stats->peak_arena_bytes = std::max(model.stats->peak_arena_bytes, fwd_mem);
+        fairseq2_graph_compute(model, step_ctx, gf, n_threads);
         ggml_detach(lprobs);
         ggml_allocr_reset(step_alloc);
+        if (cancel_search(step_nr)) goto end_of_beam_search;
 #if DEBUG_MEM_USAGE
         printf("beam search step %d. Graph.n_nodes: %d.\n", step_nr, gf.n_nodes);
         printf("  Fwd mem: %.1fMB, reserved %.1fMb\n", fwd_mem/(double)MB, local_bufs[3].capacity()/(double)MB);
-        std::fill(local_bufs[3].begin(), local_bufs[3].end(), 0xAA);
+        std::fill(local_bufs[3].data(), local_bufs[3].data() + local_bufs[3].capacity(), 0xAA);
 #endif
-        _tweak_lprobs(job, lprobs, step_nr, max_seq_len, vocab_size);
-
-        ggml_tensor* last_scores = ggml_slice(step_ctx, scores, 0, step_nr, step_nr+1);
-        if (step_nr == start_step) {
-            // At the initial step, all hypotheses are equally likely, so we use
-            // only the first beam.
-            lprobs = ggml_slice(step_ctx, lprobs, 1, 0, 1);
-            lprobs = ggml_cont(step_ctx, lprobs);
-            // The first step always indicates the beginning of the sequence and has no score.
-            if (step_nr > 0) {
-                last_scores = ggml_slice(step_ctx, last_scores, 1, 0, 1);
-                lprobs = ggml_add_inplace(step_ctx, lprobs, ggml_repeat(step_ctx, last_scores, lprobs));
+        {
+            fairseq2_profiler_region region(model, "beam_search.tweak_lprobs");
+            for (std::size_t a = 0; a < active_jobs.size(); ++a) {
+                ggml_tensor* job_lprobs = ggml_slice(step_ctx, lprobs, 1, a * beam_size, (a + 1) * beam_size);
+                _tweak_lprobs(jobs[active_jobs[a]], job_lprobs, step_nr, max_seq_len, vocab_size);
             }
-        } else {
+        }
+
+        {
             // Make probabilities contain cumulative scores for each hypothesis.
+            // The first step always indicates the beginning of the sequence and has a score of 0.
+            ggml_tensor* last_scores = ggml_slice(step_ctx, scores, 0, step_nr, step_nr+1);
             lprobs = ggml_add_inplace(step_ctx, lprobs, ggml_repeat(step_ctx, last_scores, lprobs));
         }
-        ggml_build_forward_expand(gf, lprobs);
-        ggml_graph_compute_with_ctx(step_ctx, gf, n_threads);
+        // Use a new graph, recomputing `gf` would run the decoder again and overwrite the tweaked lprobs.
+        struct ggml_cgraph * gf_scores = ggml_new_graph(step_ctx);
+        ggml_build_forward_expand(gf_scores, lprobs);
+        fairseq2_graph_compute(model, step_ctx, gf_scores, n_threads);
+        if (cancel_search(step_nr)) goto end_of_beam_search;
+
+        std::vector<int> next_active_jobs;
+        // Number of beams of the next step, the first ones of `beam_indices`.
+        std::size_t n_next_beams = 0;
+        for (std::size_t a = 0; a < active_jobs.size(); ++a) {
+            int j = active_jobs[a];
+            // At the initial step, all hypotheses are equally likely, so we use
+            // only the first beam.
+            std::size_t active_beams = step_nr == start_step ? 1 : beam_size;
+            ggml_tensor* job_lprobs = ggml_slice(step_ctx, lprobs, 1, a * beam_size, a * beam_size + active_beams);
+            ggml_tensor* job_candidates = ggml_slice(step_ctx, candidate_indices, 0, j * vocab_size * beam_size, (j + 1) * vocab_size * beam_size);
+
+            // Determine (beam, token) candidates for the next step.
+            // (N, 2 x B)
+            std::int64_t K = 0;
+            {
+                fairseq2_profiler_region region(model, "beam_search.topk");
+                K = topk(job_lprobs, std::min(2 * beam_size, vocab_size - 1), job_candidates);
+            }
 
-        // Determine (beam, token) candidates for the next step.
-        // (N, 2 x B)
-        std::int64_t K = topk(
-            lprobs, std::min(2 * beam_size, vocab_size - 1), candidate_indices
-        );
+            std::size_t ongoing_beams = 0;
+            bool finished = false;
+            // Beams with at least one continuation or finished hypothesis.
+            std::vector<bool> kept_beams(beam_size, false);
+            for (std::int32_t i = 0; i < K; ++i) {
+                int c = ggml_get_i32_1d(job_candidates, i);
+                std::int32_t beam = c / vocab_size;
+                std::int32_t token = c % vocab_size;
+                float tok_score = ggml_get_f32_1d(job_lprobs, c);
+                kept_beams[beam] = true;
+                // row of the beam in `seqs`
+                std::int32_t row = a * beam_size + beam;
+
+                // Detect beams that reached the minimum length and that end with an EOS.
+                bool eos = token == jobs[j].eos_idx;
+                eos &= tok_score != -INFINITY;
+                if (eos) {
+                    _finalize_hypothesis(jobs[j], result_ctx, step_nr, row, token, tok_score, seqs, scores, lid_scores[j], finished_searches[j]++);
+                    if (finished_searches[j] == results[j] + beam_size) {
+                        finished = true;
+                        break;
+                    }
+                    continue;
+                }
 
-        std::size_t ongoing_beams = 0;
-        for (std::int32_t i = 0; i < K; ++i) {
-            int c = ggml_get_f32_1d(candidate_indices, i);
-            std::int32_t beam = c / vocab_size;
-            std::int32_t token = c % vocab_size;
-            float tok_score = ggml_get_f32_1d(lprobs, c);
-
-            // Detect beams that reached the minimum length and that end with an EOS.
-            bool eos = token == job.eos_idx;
-            eos &= tok_score != -INFINITY;
-            if (eos) {
-                _finalize_hypothesis(job, result_ctx, step_nr, beam, token, tok_score, seqs, scores, lid_scores, finished_searches++);
-                if (finished_searches == finished_searches_end)
-                    goto end_of_beam_search;
-                continue;
+                ggml_set_i32_1d(beam_indices, n_next_beams + ongoing_beams, row);
+                ggml_set_i32_1d(next_tokens, n_next_beams + ongoing_beams, token);
+                ggml_set_f32_1d(next_scores, n_next_beams + ongoing_beams, tok_score);
+                ongoing_beams += 1;
+                if (ongoing_beams >= beam_size) break;
             }
-
-            ggml_set_f32_1d(beam_indices, ongoing_beams, beam);
-            ggml_set_f32_1d(next_tokens, ongoing_beams, token);
-            ggml_set_f32_1d(next_scores, ongoing_beams, tok_score);
-            ongoing_beams += 1;
-            if (ongoing_beams >= beam_size) break;
+            if (finished) continue;
+            if (model.stats) {
+                std::size_t n_kept = std::count(kept_beams.begin(), kept_beams.end(), true);
+                model.stats->n_beams_pruned += active_beams - std::min(n_kept, active_beams);
+            }
+            next_active_jobs.push_back(j);
+            n_next_beams += beam_size;
+        }
+        if (next_active_jobs.empty()) {
+            _record_step(model, t_step_us);
+            goto end_of_beam_search;
         }
 
         // Reorder beams in the `seq` and `score` buffers. The same beam can
-        // be selected more than once.
+        // be selected more than once, and the beams of finished jobs are dropped.
         // (B, S), (B) -> (B, S)
         // don't use allocr API, cause it might reuse a kv cache buffer several time.
         ggml_set_no_alloc(step_ctx, false);
-        ggml_tensor* new_seqs = ggml_get_rows(step_ctx, seqs, beam_indices);
-        ggml_tensor* new_scores = ggml_get_rows(step_ctx, scores, beam_indices);
         struct ggml_cgraph * gf_reorder = ggml_new_graph(step_ctx);
-        ggml_build_forward_expand(gf_reorder, new_seqs);
-        ggml_build_forward_expand(gf_reorder, new_scores);
-        reorder_kv_cache(model, step_ctx, gf_reorder, beam_indices);
-        ggml_graph_compute_with_ctx(step_ctx, gf_reorder, n_threads);
+        ggml_tensor* new_seqs;
+        ggml_tensor* new_scores;
+        {
+            FAIRSEQ2_PROFILE_SCOPE(model, "beam_search.reorder");
+            ggml_tensor* new_order = ggml_slice(step_ctx, beam_indices, 0, 0, n_next_beams);
+            new_seqs = ggml_get_rows(step_ctx, seqs, new_order);
+            new_scores = ggml_get_rows(step_ctx, scores, new_order);
+            ggml_build_forward_expand(gf_reorder, new_seqs);
+            ggml_build_forward_expand(gf_reorder, new_scores);
+            reorder_kv_cache(model, step_ctx, gf_reorder, new_order);
+        }
+        fairseq2_graph_compute(model, step_ctx, gf_reorder, n_threads);
+        // The EOS candidates of this step are already in `finished_searches`.
+        if (cancel_search(step_nr)) goto end_of_beam_search;
         seqs = ggml_detach(new_seqs);
         scores = ggml_detach(new_scores);
+        active_jobs = next_active_jobs;
 
         // seqs[:, step_nr + 1] = next_tokens
         // scores[:, step_nr + 1] = next_scores
-        for (std::size_t i = 0; i < beam_size; ++i) {
+        for (std::size_t i = 0; i < n_next_beams; ++i) {
             ((std::int32_t*)seqs->data)[step_nr + 1 + i * max_seq_len] = ggml_get_i32_1d(next_tokens, i);
             ((float*)scores->data)[step_nr + 1 + i * max_seq_len] = ggml_get_f32_1d(next_scores, i);
         }
@@ -1588,23 +2069,39 @@ extern "C" Hypothesis* generate_sequence(
         ggml_free(prev_step_ctx);
         prev_step_ctx = step_ctx;
 #if DEBUG_MEM_USAGE
-        std::fill(local_bufs[(step_nr + 1) % 2].begin(), local_bufs[(step_nr + 1) % 2].end(), 0xAA);
+        std::fill(local_bufs[(step_nr + 1) % 2].data(), local_bufs[(step_nr + 1) % 2].data() + local_bufs[(step_nr + 1) % 2].capacity(), 0xAA);
 #endif
         step_ctx = ctx_from_buffer(local_bufs[(step_nr + 1) % 2]);
+        _record_step(model, t_step_us);
     }
 
 end_of_beam_search:
     // Ensure that hypotheses are sorted by decreasing scores before returning.
-    std::sort(
-        finished_searches_begin,
-        finished_searches_end,
-        [](Hypothesis a, Hypothesis b) { return a.score > b.score; }
-    );
+    for (int j = 0; j < n_jobs; ++j) {
+        std::sort(
+            results[j],
+            results[j] + beam_size,
+            [](Hypothesis a, Hypothesis b) { return a.score > b.score; }
+        );
+    }
 
     printf_mem_usage(search_ctx, "search_ctx");
     fairseq2_kv_cache_reset(model);
     model.ctx = original_ctx;
-    return finished_searches_begin;
+    return results;
+}
+
+/// Generates a translation for a single sequence
+/// The results Hypothesis are written inside `result_ctx`.
+extern "C" Hypothesis* generate_sequence(
+    fairseq2_model& model,
+    const SequenceGeneratorJob& job,
+    ggml_tensor* encoder_output,
+    ggml_tensor* encoder_padding_mask,
+    ggml_context* result_ctx,
+    int n_threads
+) {
+    return generate_sequences(model, &job, 1, encoder_output, encoder_padding_mask, result_ctx, n_threads)[0];
 }
 
 extern "C" Hypothesis* _testing_return_hypothesis_ptr(ggml_context* ctx) {
@@ -1858,3 +2355,946 @@ std::pair<std::vector<std::string>, std::vector<float>> fairseq2_spm_detokenize(
     *out = '0';
     return std::make_pair(result_text, word_scores);
 }
+
+
+// Non-autoregressive T2U decoder of UnitY models, see
+// seamless_communication/models/unity/{nar_decoder_frontend,length_regulator,fft_decoder}.py
+// Only single sequences are supported, so padding masks are never needed.
+
+/// Conv1d with "same" padding over (S, M) sequences.
+ggml_tensor* _conv1d_same_padding(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* seqs
+) {
+    ggml_context* ctx = model.ctx;
+    ggml_tensor* weight = model.tensors[prefix + ".weight"];  // (C_out, C_in, K)
+    GGML_ASSERT(weight != nullptr);
+    int K = weight->ne[0];
+    // torch pads even kernels asymmetrically, which ggml_conv_1d can't express.
+    GGML_ASSERT(K % 2 == 1);
+    // (S, M) -> (M, S) -> (C_out, S) -> (S, C_out)
+    seqs = ggml_dup(ctx, ggml_permute(ctx, seqs, 1, 0, 2, 3));
+    seqs = ggml_conv_1d(ctx, weight, seqs, 1, K / 2, 1, 1);
+    seqs = ggml_dup(ctx, ggml_permute(ctx, seqs, 1, 0, 2, 3));
+    ggml_tensor* bias = model.tensors[prefix + ".bias"];
+    if (bias == nullptr) return seqs;
+
+    return ggml_add_inplace(ctx, seqs, ggml_repeat(ctx, bias, seqs));
+}
+
+extern "C" ggml_tensor* HardUpsampling_forward(
+    fairseq2_model& model,
+    ggml_tensor* seqs,  // (S, M)
+    ggml_tensor* durations  // (S), I32 already computed
+) {
+    GGML_ASSERT(durations->type == GGML_TYPE_I32);
+    GGML_ASSERT(durations->ne[0] == seqs->ne[1]);
+    ggml_context* ctx = model.ctx;
+    const std::int32_t* durations_data = (const std::int32_t*)durations->data;
+    std::int64_t upsampled_len = 0;
+    for (std::int64_t i = 0; i < durations->ne[0]; ++i) upsampled_len += durations_data[i];
+    GGML_ASSERT(upsampled_len > 0);
+
+    // repeat_interleave is a gather of the rows: all positions are copied in parallel.
+    FORCE_ALLOC(indices, ctx, ggml_new_tensor_1d(ctx, GGML_TYPE_I32, upsampled_len));
+    std::int32_t* indices_data = (std::int32_t*)indices->data;
+    for (std::int64_t i = 0; i < durations->ne[0]; ++i) {
+        indices_data = std::fill_n(indices_data, durations_data[i], (std::int32_t)i);
+    }
+    return ggml_get_rows(ctx, seqs, indices);  // (S_upsampled, M)
+}
+
+extern "C" ggml_tensor* VariancePredictor_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* seqs  // (S, M)
+) {
+    FAIRSEQ2_PROFILE_SCOPE(model, prefix);
+    ggml_context* ctx = model.ctx;
+    seqs = _conv1d_same_padding(model, prefix + ".conv1.0", seqs);
+    seqs = ggml_relu_inplace(ctx, seqs);
+    seqs = LayerNorm_forward(model, prefix + ".ln1", seqs);
+    seqs = _conv1d_same_padding(model, prefix + ".conv2.0", seqs);
+    seqs = ggml_relu_inplace(ctx, seqs);
+    seqs = LayerNorm_forward(model, prefix + ".ln2", seqs);
+    seqs = Linear_forward(model, prefix + ".proj", seqs);  // (S, 1)
+    return ggml_reshape_1d(ctx, seqs, seqs->ne[1]);  // (S)
+}
+
+extern "C" ggml_tensor* NARDecoderFrontend_character_level_upsampling(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* seqs,  // (S_text, M)
+    ggml_tensor* char_seqs,  // (S_char), I32
+    ggml_tensor* char_lens  // (S_text), I32
+) {
+    FAIRSEQ2_PROFILE_SCOPE(model, prefix);
+    ggml_context* ctx = model.ctx;
+    seqs = HardUpsampling_forward(model, seqs, char_lens);  // (S_char, M)
+    GGML_ASSERT(seqs->ne[1] == char_seqs->ne[0]);
+
+    ggml_tensor* pos_embeds = _position_encodings(model, prefix + ".char_pos_encoder", 0, seqs->ne[1]);
+    pos_embeds = ggml_scale_inplace(ctx, ggml_cont(ctx, pos_embeds), model.tensors[prefix + ".pos_emb_alpha_char"]);
+    ggml_tensor* char_embeds = ggml_get_rows(ctx, model.tensors[prefix + ".embed_char.weight"], char_seqs);
+    float scale = model_layer_config_d(model, prefix + ".scale");
+    if (scale != 1.0f) {
+        FORCE_ALLOC(scale_t, ctx, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 1));
+        ggml_set_f32(scale_t, scale);
+        char_embeds = ggml_scale_inplace(ctx, char_embeds, scale_t);
+    }
+    seqs = ggml_add_inplace(ctx, seqs, pos_embeds);
+    return ggml_add_inplace(ctx, seqs, char_embeds);
+}
+
+extern "C" ggml_tensor* NARDecoderFrontend_forward_unit_pos_embedding(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* seqs  // (S_unit, M)
+) {
+    FAIRSEQ2_PROFILE_SCOPE(model, prefix);
+    ggml_context* ctx = model.ctx;
+    ggml_tensor* pos_embeds = _position_encodings(model, prefix + ".unit_pos_encoder", 0, seqs->ne[1]);
+    pos_embeds = ggml_scale_inplace(ctx, ggml_cont(ctx, pos_embeds), model.tensors[prefix + ".pos_emb_alpha"]);
+    return ggml_add_inplace(ctx, seqs, pos_embeds);
+}
+
+extern "C" ggml_tensor* Conv1dBlock_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* seqs  // (S, M)
+) {
+    FAIRSEQ2_PROFILE_SCOPE(model, prefix);
+    seqs = _conv1d_same_padding(model, prefix + ".conv1", seqs);
+    seqs = ggml_relu_inplace(model.ctx, seqs);
+    return _conv1d_same_padding(model, prefix + ".conv2", seqs);
+}
+
+extern "C" ggml_tensor* FeedForwardTransformerLayer_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* seqs  // (S, M)
+) {
+    FAIRSEQ2_PROFILE_SCOPE(model, prefix);
+    ggml_context* ctx = model.ctx;
+    // _forward_self_attn(seqs, padding_mask)
+    ggml_tensor* residual = seqs;
+    seqs = MultiheadAttention_forward(
+        model,
+        prefix + ".self_attn",
+        seqs,
+        seqs,
+        seqs,
+        /*attn_mask=*/nullptr
+    );
+    seqs = ggml_add_inplace(ctx, seqs, residual);
+    seqs = LayerNorm_forward(model, prefix + ".self_attn_layer_norm", seqs);
+
+    // _forward_conv1d(seqs, padding_mask)
+    residual = seqs;
+    seqs = Conv1dBlock_forward(model, prefix + ".conv1d", seqs);
+    seqs = ggml_add_inplace(ctx, seqs, residual);
+    return LayerNorm_forward(model, prefix + ".conv1d_layer_norm", seqs);
+}
+
+extern "C" ggml_tensor* FeedForwardTransformer_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* seqs  // (S, M)
+) {
+    FAIRSEQ2_PROFILE_SCOPE(model, prefix);
+    int layer_idx = 0;
+    std::string layer_name = prefix + ".layers." + std::to_string(layer_idx);
+    while (has_layer(model, layer_name)) {
+        seqs = FeedForwardTransformerLayer_forward(model, layer_name, seqs);
+        ggml_set_name(seqs, ("x_fft_" + std::to_string(layer_idx)).c_str());
+        layer_idx += 1;
+        layer_name = prefix + ".layers." + std::to_string(layer_idx);
+    }
+
+    if (has_layer(model, prefix + ".layer_norm"))
+        seqs = LayerNorm_forward(model, prefix + ".layer_norm", seqs);
+
+    return seqs;
+}
+
+static std::size_t utf8_strlen(const std::string& text) {
+    std::size_t n = 0;
+    for (std::size_t offs = 0; offs < text.size(); offs += utf8_len(text[offs])) ++n;
+    return n;
+}
+
+/// Port of NARDecoderFrontend.text_to_char_seqs.
+/// Python's str.isalpha is approximated: only single ASCII chars are considered as punctuation.
+std::pair<ggml_tensor*, ggml_tensor*> fairseq2_t2u_char_seqs(
+    fairseq2_model& model,
+    ggml_context* ctx,
+    ggml_tensor* text_seqs
+) {
+    GGML_ASSERT(!model.char_vocab.id_to_token.empty());
+    int pad_idx = model.vocab.token_to_id["<pad>"];
+    int unk_idx = model.vocab.token_to_id["<unk>"];
+    int eos_idx = model.vocab.token_to_id["</s>"];
+    int char_unk_idx = model.char_vocab.token_to_id["<unk>"];
+
+    // Skip the prefix tokens (EOS and target language).
+    std::vector<int> subword_ids;
+    std::vector<std::string> subwords;
+    for (std::int64_t i = 2; i < text_seqs->ne[0]; ++i) {
+        int id = ggml_get_i32_1d(text_seqs, i);
+        if (id == pad_idx || id == eos_idx) break;
+        subword_ids.push_back(id);
+        subwords.push_back(model.vocab.id_to_token.at(id).text);
+    }
+
+    // Spaces are stored as ' ' in the vocabularies, instead of '▁'.
+    std::size_t n = subwords.size();
+    std::vector<bool> is_next_start_with_space(n, false);
+    std::vector<bool> is_punc(n, false);
+    for (std::size_t i = 0; i < n; ++i) {
+        if (i + 1 < n)
+            is_next_start_with_space[i] = utf8_strlen(subwords[i + 1]) > 1 && subwords[i + 1][0] == ' ';
+        const std::string& w = subwords[i];
+        is_punc[i] = w.size() == 1 && !std::isalnum((unsigned char)w[0]) && w[0] != ' ';
+    }
+
+    // char_lens is padded with a 0 for each of the prefix tokens, and the text decoder
+    // output is aligned on it (see TagManager.postprocess_dur_or_len).
+    FORCE_ALLOC(char_lens, ctx, ggml_new_tensor_1d(ctx, GGML_TYPE_I32, n + 2));
+    ggml_set_i32(char_lens, 0);
+    std::vector<std::int32_t> char_ids;
+    for (std::size_t i = 0; i < n; ++i) {
+        int char_len;
+        if (subword_ids[i] == unk_idx) {
+            char_len = 1;
+            char_ids.push_back(unk_idx);
+        } else {
+            const std::string& w = subwords[i];
+            char_len = utf8_strlen(w);
+            if (is_punc[i] && is_next_start_with_space[i]) {
+                char_len += 1;
+            } else if (i > 0 && is_punc[i - 1] && is_next_start_with_space[i - 1]) {
+                char_len -= 1;
+            }
+            for (std::size_t offs = 0; offs < w.size(); offs += utf8_len(w[offs])) {
+                auto it = model.char_vocab.token_to_id.find(w.substr(offs, utf8_len(w[offs])));
+                char_ids.push_back(it == model.char_vocab.token_to_id.end() ? char_unk_idx : it->second);
+            }
+        }
+        ggml_set_i32_1d(char_lens, i + 1, char_len);
+    }
+
+    if (char_ids.empty()) return {nullptr, char_lens};
+    FORCE_ALLOC(char_seqs, ctx, ggml_new_tensor_1d(ctx, GGML_TYPE_I32, char_ids.size()));
+    std::copy(char_ids.begin(), char_ids.end(), (std::int32_t*)char_seqs->data);
+    return {char_seqs, char_lens};
+}
+
+extern "C" ggml_tensor* generate_units_nar(
+    fairseq2_model& model,
+    ggml_tensor* text_seqs,
+    ggml_tensor* text_decoder_output,
+    float duration_factor,
+    int mem_mb,
+    ggml_context* result_ctx,
+    int n_threads
+) {
+    const std::string prefix = "t2u_model";
+    GGML_ASSERT(text_decoder_output->ne[1] == text_seqs->ne[0]);
+    std::vector<uint8_t> local_bufs[2];
+    local_bufs[0].reserve(8 * MB);  // graph metadata, work buffers and host inputs
+    local_bufs[1].reserve(mem_mb * MB);  // fwd_alloc
+    ggml_context* original_ctx = model.ctx;
+    ggml_context* ctx = ctx_from_buffer(local_bufs[0]);
+    ggml_set_no_alloc(ctx, true);
+    ggml_allocr* fwd_alloc = new_arena_allocr(local_bufs[1]);
+    model.ctx = ctx;
+    // Computed by the caller: the graphs below must not run the text decoder again.
+    ggml_detach(text_decoder_output);
+
+    std::pair<ggml_tensor*, ggml_tensor*> char_inputs = fairseq2_t2u_char_seqs(model, ctx, text_seqs);
+    ggml_tensor* char_seqs = char_inputs.first;
+    ggml_tensor* char_lens = char_inputs.second;
+    ggml_tensor* units = nullptr;
+    if (char_seqs != nullptr) {
+        // Characters: the durations need to be known before building the unit graph.
+        ggml_cgraph* gf = ggml_new_graph(ctx);
+        ggml_tensor* seqs = text_decoder_output;
+        if (has_layer(model, prefix + ".encoder"))
+            seqs = StandardTransformerEncoder_forward(model, prefix + ".encoder", seqs, nullptr);
+        seqs = NARDecoderFrontend_character_level_upsampling(
+            model, prefix + ".decoder_frontend", seqs, char_seqs, char_lens
+        );
+        ggml_tensor* char_embeds = ggml_dup(ctx, seqs);
+        ggml_tensor* log_durations = VariancePredictor_forward(
+            model, prefix + ".decoder_frontend.variance_adaptor.duration_predictor", seqs
+        );
+        ggml_build_forward_expand(gf, char_embeds);
+        ggml_build_forward_expand(gf, log_durations);
+        fairseq2_graph_fuse(model, gf);
+        ggml_allocr_alloc_graph(fwd_alloc, gf);
+        fairseq2_graph_compute(model, ctx, gf, n_threads);
+        // The unit graph starts from char_embeds, its inputs are freed already.
+        ggml_detach(char_embeds);
+
+        // The durations are garbage if the graph stopped early.
+        if (!fairseq2_cancelled(model)) {
+            // Same rounding as torch.round, and min_duration=1.
+            FORCE_ALLOC(durations, ctx, ggml_new_tensor_1d(ctx, GGML_TYPE_I32, log_durations->ne[0]));
+            for (std::int64_t i = 0; i < durations->ne[0]; ++i) {
+                float d = std::nearbyint((std::exp(ggml_get_f32_1d(log_durations, i)) - 1.0f) * duration_factor);
+                ggml_set_i32_1d(durations, i, std::max(1, (int)d));
+            }
+
+            // Units: the full sequence is decoded at once.
+            gf = ggml_new_graph(ctx);
+            seqs = HardUpsampling_forward(model, char_embeds, durations);
+            seqs = NARDecoderFrontend_forward_unit_pos_embedding(model, prefix + ".decoder_frontend", seqs);
+            seqs = FeedForwardTransformer_forward(model, prefix + ".decoder", seqs);
+            ggml_tensor* logits = Linear_forward(model, prefix + ".final_proj", seqs);  // (S_unit, V_unit)
+            units = ggml_argmax(ctx, logits);
+            ggml_build_forward_expand(gf, units);
+            fairseq2_graph_fuse(model, gf);
+            ggml_allocr_alloc_graph(fwd_alloc, gf);
+            fairseq2_graph_compute(model, ctx, gf, n_threads);
+        }
+    }
+
+    ggml_tensor* result = nullptr;
+    if (units != nullptr && !fairseq2_cancelled(model)) {
+        FORCE_ALLOC(units_copy, result_ctx, ggml_dup_tensor(result_ctx, units));
+        std::copy_n((const std::int32_t*)units->data, units->ne[0], (std::int32_t*)units_copy->data);
+        result = units_copy;
+    }
+    ggml_allocr_free(fwd_alloc);
+    ggml_free(ctx);
+    model.ctx = original_ctx;
+    return result;
+}
+
+
+// CodeHiFiGAN vocoder, see seamless_communication/models/vocoder/{codehifigan,hifigan}.py
+// Unlike the rest of this file, signals are (T, C): time is the contiguous dimension,
+// which is the layout of torch Conv1d, and the one expected by ggml_conv_1d and ggml_conv_transpose_1d.
+
+/// Adds a bias of shape (1, C), as written by ggml_convert.py, to a (T, C) signal.
+static ggml_tensor* _add_channel_bias(ggml_context* ctx, ggml_tensor* x, ggml_tensor* bias) {
+    if (bias == nullptr) return x;
+    return ggml_add(ctx, x, ggml_reshape_2d(ctx, bias, 1, ggml_nelements(bias)));
+}
+
+/// Concatenates two (T, C_a) and (T, C_b) signals in a (T, C_a + C_b) one.
+static ggml_tensor* _concat_channels(ggml_context* ctx, ggml_tensor* a, ggml_tensor* b) {
+    GGML_ASSERT(a->ne[0] == b->ne[0]);
+    // ggml_concat only concatenates on dim 2.
+    ggml_tensor* x = ggml_concat(
+        ctx,
+        ggml_reshape_3d(ctx, a, a->ne[0], 1, a->ne[1]),
+        ggml_reshape_3d(ctx, b, b->ne[0], 1, b->ne[1])
+    );
+    return ggml_reshape_2d(ctx, x, x->ne[0], x->ne[2]);
+}
+
+extern "C" ggml_tensor* Conv1d_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* x  // (T, C_in)
+) {
+    ggml_tensor* weight = model.tensors[prefix + ".weight"];  // (C_out, C_in, K)
+    GGML_ASSERT(weight != nullptr);
+    int stride = _layer_config_or(model, prefix + ".stride", 1);
+    int dilation = _layer_config_or(model, prefix + ".dilation", 1);
+    int padding = _layer_config_or(model, prefix + ".padding", dilation * (weight->ne[0] - 1) / 2);
+    x = ggml_conv_1d(model.ctx, weight, x, stride, padding, dilation, 1);  // (T_out, C_out)
+    return _add_channel_bias(model.ctx, x, model.tensors[prefix + ".bias"]);
+}
+
+extern "C" ggml_tensor* ConvTranspose1d_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* x  // (T, C_in)
+) {
+    ggml_tensor* weight = model.tensors[prefix + ".weight"];  // (C_in, C_out, K)
+    GGML_ASSERT(weight != nullptr);
+    int stride = _layer_config_or(model, prefix + ".stride", 1);
+    int padding = _layer_config_or(model, prefix + ".padding", 0);
+    GGML_ASSERT(_layer_config_or(model, prefix + ".output_padding", 0) == 0);
+    // ggml_conv_transpose_1d has no padding: crop the full output instead.
+    x = ggml_conv_transpose_1d(model.ctx, weight, x, stride, 0, 1);  // ((T - 1) * stride + K, C_out)
+    if (padding > 0) x = ggml_slice(model.ctx, x, 0, padding, x->ne[0] - padding);
+    ggml_tensor* bias = model.tensors[prefix + ".bias"];
+    if (bias == nullptr) return padding > 0 ? ggml_cont(model.ctx, x) : x;
+    return _add_channel_bias(model.ctx, x, bias);
+}
+
+static const float HIFIGAN_LRELU_SLOPE = 0.1f;
+
+extern "C" ggml_tensor* ResBlock_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* x  // (T, C)
+) {
+    ggml_context* ctx = model.ctx;
+    for (int i = 0; has_layer(model, prefix + ".convs1." + std::to_string(i)); ++i) {
+        std::string idx = std::to_string(i);
+        ggml_tensor* xt = ggml_leaky_relu(ctx, x, HIFIGAN_LRELU_SLOPE, false);
+        xt = Conv1d_forward(model, prefix + ".convs1." + idx, xt);
+        xt = ggml_leaky_relu(ctx, xt, HIFIGAN_LRELU_SLOPE, true);
+        xt = Conv1d_forward(model, prefix + ".convs2." + idx, xt);
+        x = ggml_add(ctx, xt, x);
+    }
+    return x;
+}
+
+extern "C" ggml_tensor* Generator_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* x  // (T, model_in_dim)
+) {
+    FAIRSEQ2_PROFILE_SCOPE(model, prefix);
+    ggml_context* ctx = model.ctx;
+    int num_upsamples = 0;
+    while (has_layer(model, prefix + ".ups." + std::to_string(num_upsamples))) ++num_upsamples;
+    int num_resblocks = 0;
+    while (has_layer(model, prefix + ".resblocks." + std::to_string(num_resblocks))) ++num_resblocks;
+    GGML_ASSERT(num_upsamples > 0 && num_resblocks % num_upsamples == 0);
+    int num_kernels = num_resblocks / num_upsamples;
+    FORCE_ALLOC(inv_num_kernels, ctx, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 1));
+    ggml_set_f32(inv_num_kernels, 1.0f / num_kernels);
+
+    x = Conv1d_forward(model, prefix + ".conv_pre", x);
+    for (int i = 0; i < num_upsamples; ++i) {
+        x = ggml_leaky_relu(ctx, x, HIFIGAN_LRELU_SLOPE, true);
+        x = ConvTranspose1d_forward(model, prefix + ".ups." + std::to_string(i), x);
+        ggml_tensor* xs = nullptr;
+        for (int j = 0; j < num_kernels; ++j) {
+            std::string resblock = prefix + ".resblocks." + std::to_string(i * num_kernels + j);
+            ggml_tensor* y = ResBlock_forward(model, resblock, x);
+            xs = xs == nullptr ? y : ggml_add_inplace(ctx, xs, y);
+        }
+        x = ggml_scale_inplace(ctx, xs, inv_num_kernels);
+    }
+    // F.leaky_relu default slope
+    x = ggml_leaky_relu(ctx, x, 0.01f, true);
+    x = Conv1d_forward(model, prefix + ".conv_post", x);  // (T_wav, 1)
+    x = ggml_tanh_inplace(ctx, x);
+    return ggml_reshape_1d(ctx, x, x->ne[0]);
+}
+
+extern "C" ggml_tensor* CodeGenerator_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* units,  // (T), I32, already upsampled by the durations
+    ggml_tensor* lang,  // (1), I32
+    ggml_tensor* spkr  // (1), I32
+) {
+    ggml_context* ctx = model.ctx;
+    ggml_tensor* x = ggml_get_rows(ctx, model.tensors[prefix + ".dict.weight"], units);  // (T, E)
+    std::int64_t T = x->ne[1];
+    x = ggml_cont(ctx, ggml_transpose(ctx, x));  // (E, T)
+    ggml_tensor* lang_embed = ggml_get_rows(ctx, model.tensors[prefix + ".lang.weight"], lang);
+    lang_embed = ggml_reshape_2d(ctx, lang_embed, 1, lang_embed->ne[0]);
+    ggml_tensor* spkr_embed = ggml_get_rows(ctx, model.tensors[prefix + ".spkr.weight"], spkr);
+    spkr_embed = ggml_reshape_2d(ctx, spkr_embed, 1, spkr_embed->ne[0]);
+    ggml_tensor* like = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, T, lang_embed->ne[1]);
+    x = _concat_channels(ctx, ggml_repeat(ctx, lang_embed, like), x);
+    like = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, T, spkr_embed->ne[1]);
+    x = _concat_channels(ctx, x, ggml_repeat(ctx, spkr_embed, like));
+    return Generator_forward(model, prefix, x);
+}
+
+/// Radius of the receptive field of the generator, in frames.
+/// It's computed backward from the output, rounding up at each upsampling.
+extern "C" std::int64_t fairseq2_vocoder_context_frames(fairseq2_model& model, const std::string& prefix) {
+    auto conv_radius = [&](const std::string& conv) {
+        std::int64_t K = model.tensors[conv + ".weight"]->ne[0];
+        return _layer_config_or(model, conv + ".dilation", 1) * (K - 1) / 2;
+    };
+    int num_upsamples = 0;
+    while (has_layer(model, prefix + ".ups." + std::to_string(num_upsamples))) ++num_upsamples;
+    int num_resblocks = 0;
+    while (has_layer(model, prefix + ".resblocks." + std::to_string(num_resblocks))) ++num_resblocks;
+    int num_kernels = num_resblocks / num_upsamples;
+
+    std::int64_t radius = conv_radius(prefix + ".conv_post");
+    for (int i = num_upsamples - 1; i >= 0; --i) {
+        // The parallel resblocks are averaged.
+        std::int64_t resblocks_radius = 0;
+        for (int j = 0; j < num_kernels; ++j) {
+            std::string resblock = prefix + ".resblocks." + std::to_string(i * num_kernels + j);
+            std::int64_t resblock_radius = 0;
+            for (int c = 0; has_layer(model, resblock + ".convs1." + std::to_string(c)); ++c) {
+                resblock_radius += conv_radius(resblock + ".convs1." + std::to_string(c));
+                resblock_radius += conv_radius(resblock + ".convs2." + std::to_string(c));
+            }
+            resblocks_radius = std::max(resblocks_radius, resblock_radius);
+        }
+        radius += resblocks_radius;
+        std::string up = prefix + ".ups." + std::to_string(i);
+        std::int64_t K = model.tensors[up + ".weight"]->ne[0];
+        std::int64_t stride = _layer_config_or(model, up + ".stride", 1);
+        radius = (radius + K + stride - 1) / stride;
+    }
+    return radius + conv_radius(prefix + ".conv_pre");
+}
+
+static const char* VOCODER_PREFIX = "code_generator";
+
+/// Radius of the receptive field of the duration predictor, in units.
+static std::int64_t _vocoder_duration_context(fairseq2_model& model) {
+    std::string predictor = std::string(VOCODER_PREFIX) + ".dur_predictor";
+    if (!has_layer(model, predictor)) return 0;
+    return model.tensors[predictor + ".conv1.0.weight"]->ne[0] / 2 + model.tensors[predictor + ".conv2.0.weight"]->ne[0] / 2;
+}
+
+VocoderStream vocoder_stream_init(fairseq2_model& model, const std::string& lang, int spkr, bool dur_prediction, int mem_mb) {
+    VocoderStream stream;
+    auto lang_idx = model.layer_config.find("lang_spkr_idx_map.multilingual." + lang);
+    if (lang_idx == model.layer_config.end()) {
+        throw std::invalid_argument("Language not supported by the vocoder: " + lang);
+    }
+    stream.lang_idx = lang_idx->second;
+    // Like Vocoder.forward, defaults to the first speaker of the language.
+    stream.spkr_idx = spkr >= 0 ? spkr : model.layer_config.at("lang_spkr_idx_map.multispkr." + lang);
+    stream.dur_prediction = dur_prediction && has_layer(model, std::string(VOCODER_PREFIX) + ".dur_predictor");
+    stream.context_frames = fairseq2_vocoder_context_frames(model, VOCODER_PREFIX);
+    stream.context_units = stream.dur_prediction ? _vocoder_duration_context(model) : 0;
+    // The work buffer of ggml_conv_transpose_1d holds a copy of its kernel and input, and goes in the context.
+    std::size_t ctx_size = 8 * MB + (std::size_t)mem_mb * MB / 4;
+    for (int i = 0; has_layer(model, std::string(VOCODER_PREFIX) + ".ups." + std::to_string(i)); ++i) {
+        ctx_size += ggml_nbytes(model.tensors[std::string(VOCODER_PREFIX) + ".ups." + std::to_string(i) + ".weight"]);
+    }
+    // Only the capacity is used by ctx_from_buffer and new_arena_allocr, this avoids zeroing the buffers.
+    stream.ctx_buf.reserve(ctx_size);
+    stream.fwd_buf.reserve((std::size_t)mem_mb * MB);
+    return stream;
+}
+
+std::vector<float> vocoder_stream_push(
+    fairseq2_model& model,
+    VocoderStream& stream,
+    const std::int32_t* units,
+    std::size_t n_units,
+    bool flush,
+    int n_threads
+) {
+    const std::string prefix = VOCODER_PREFIX;
+    stream.units.insert(stream.units.end(), units, units + n_units);
+    ggml_context* original_ctx = model.ctx;
+    ggml_context* ctx = ctx_from_buffer(stream.ctx_buf);
+    ggml_set_no_alloc(ctx, true);
+    ggml_allocr* fwd_alloc = new_arena_allocr(stream.fwd_buf);
+    model.ctx = ctx;
+
+    // Durations: a unit's duration is final once the right context of the predictor has arrived.
+    std::int64_t units_end = stream.units_offset + stream.units.size();
+    std::int64_t durations_end = flush ? units_end : std::max(stream.n_units_done, units_end - stream.context_units);
+    if (durations_end > stream.n_units_done) {
+        std::int64_t window_start = std::max(stream.units_offset, stream.n_units_done - stream.context_units);
+        std::int64_t n_window = units_end - window_start;
+        std::vector<std::int32_t> durations(n_window, 1);
+        if (stream.dur_prediction) {
+            FORCE_ALLOC(window, ctx, ggml_new_tensor_1d(ctx, GGML_TYPE_I32, n_window));
+            std::copy_n(stream.units.begin() + (window_start - stream.units_offset), n_window, (std::int32_t*)window->data);
+            ggml_cgraph* gf = ggml_new_graph(ctx);
+            ggml_tensor* seqs = ggml_get_rows(ctx, model.tensors[prefix + ".dict.weight"], window);
+            ggml_tensor* log_durations = VariancePredictor_forward(model, prefix + ".dur_predictor", seqs);
+            ggml_build_forward_expand(gf, log_durations);
+            fairseq2_graph_fuse(model, gf);
+            ggml_allocr_alloc_graph(fwd_alloc, gf);
+            fairseq2_graph_compute(model, ctx, gf, n_threads);
+            // Same rounding as torch.round, and clamped to 1.
+            for (std::int64_t i = 0; i < n_window; ++i) {
+                float d = std::nearbyint(std::exp(ggml_get_f32_1d(log_durations, i)) - 1.0f);
+                durations[i] = std::max(1, (int)d);
+            }
+            ggml_allocr_reset(fwd_alloc);
+        }
+        for (std::int64_t u = stream.n_units_done; u < durations_end; ++u) {
+            stream.frames.insert(stream.frames.end(), durations[u - window_start], stream.units[u - stream.units_offset]);
+        }
+        stream.n_units_done = durations_end;
+        std::int64_t units_start = std::max(stream.units_offset, stream.n_units_done - stream.context_units);
+        stream.units.erase(stream.units.begin(), stream.units.begin() + (units_start - stream.units_offset));
+        stream.units_offset = units_start;
+    }
+
+    // Samples: a frame is final once the right context of the generator has arrived.
+    std::vector<float> samples;
+    std::int64_t frames_end = stream.frames_offset + stream.frames.size();
+    std::int64_t emit_end = flush ? frames_end : frames_end - stream.context_frames;
+    if (emit_end > stream.n_frames_emitted) {
+        std::int64_t window_start = std::max(stream.frames_offset, stream.n_frames_emitted - stream.context_frames);
+        std::int64_t n_window = frames_end - window_start;
+        FORCE_ALLOC(window, ctx, ggml_new_tensor_1d(ctx, GGML_TYPE_I32, n_window));
+        std::copy_n(stream.frames.begin() + (window_start - stream.frames_offset), n_window, (std::int32_t*)window->data);
+        FORCE_ALLOC(lang, ctx, ggml_new_i32(ctx, stream.lang_idx));
+        FORCE_ALLOC(spkr, ctx, ggml_new_i32(ctx, stream.spkr_idx));
+        ggml_cgraph* gf = ggml_new_graph(ctx);
+        ggml_tensor* wav = CodeGenerator_forward(model, prefix, window, lang, spkr);
+        ggml_build_forward_expand(gf, wav);
+        fairseq2_graph_fuse(model, gf);
+        ggml_allocr_alloc_graph(fwd_alloc, gf);
+        fairseq2_graph_compute(model, ctx, gf, n_threads);
+
+        std::int64_t samples_per_frame = wav->ne[0] / n_window;
+        const float* wav_data = ggml_get_data_f32(wav);
+        samples.assign(
+            wav_data + (stream.n_frames_emitted - window_start) * samples_per_frame,
+            wav_data + (emit_end - window_start) * samples_per_frame
+        );
+        stream.n_frames_emitted = emit_end;
+        std::int64_t frames_start = std::max(stream.frames_offset, stream.n_frames_emitted - stream.context_frames);
+        stream.frames.erase(stream.frames.begin(), stream.frames.begin() + (frames_start - stream.frames_offset));
+        stream.frames_offset = frames_start;
+    }
+
+    ggml_allocr_free(fwd_alloc);
+    ggml_free(ctx);
+    model.ctx = original_ctx;
+    return samples;
+}
+
+std::vector<float> generate_waveform(
+    fairseq2_model& model,
+    const std::vector<std::int32_t>& units,
+    const std::string& lang,
+    int spkr,
+    int mem_mb,
+    int n_threads
+) {
+    VocoderStream stream = vocoder_stream_init(model, lang, spkr, /*dur_prediction*/true, mem_mb);
+    return vocoder_stream_push(model, stream, units.data(), units.size(), /*flush*/true, n_threads);
+}
+
+
+// Monotonic (EMMA) text decoder of the streaming models, see
+// seamless_communication/models/monotonic_decoder and streaming/agents/online_text_decoder.py
+
+extern "C" ggml_tensor* EnergyProjection_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* seqs
+) {
+    FAIRSEQ2_PROFILE_SCOPE(model, prefix);
+    // Each Linear is followed by a ReLU, which has no weights and takes the odd indices.
+    for (int i = 0; has_layer(model, prefix + ".layers." + std::to_string(i)); i += 2) {
+        seqs = Linear_forward(model, prefix + ".layers." + std::to_string(i), seqs);
+        seqs = ggml_relu_inplace(model.ctx, seqs);
+    }
+    return seqs;
+}
+
+/// AvgPool1d over the sequence dim of (S, M) `seqs`, with ceil_mode: the last window can be partial.
+/// The pooling is a matmul with the (S_p, S) averaging matrix, computed once per source.
+static ggml_tensor* _avg_pool_seqs(ggml_context* ctx, ggml_tensor* seqs, std::int64_t kernel_size) {
+    std::int64_t seq_len = seqs->ne[1];
+    std::int64_t pooled_len = (seq_len + kernel_size - 1) / kernel_size;
+    FORCE_ALLOC(weights, ctx, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, seq_len, pooled_len));
+    float* weights_data = ggml_get_data_f32(weights);
+    std::fill_n(weights_data, seq_len * pooled_len, 0.0f);
+    for (std::int64_t p = 0; p < pooled_len; ++p) {
+        std::int64_t start = p * kernel_size;
+        std::int64_t end = std::min(start + kernel_size, seq_len);
+        std::fill(weights_data + p * seq_len + start, weights_data + p * seq_len + end, 1.0f / (end - start));
+    }
+    // (S, M) -> (M, S) x (S_p, S) -> (S_p, M)
+    return ggml_mul_mat(ctx, ggml_cont(ctx, ggml_transpose(ctx, seqs)), weights);
+}
+
+extern "C" ggml_tensor* PChooseLayer_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* seqs,  // (S, M)
+    ggml_tensor* keys  // (S_kv, M)
+) {
+    FAIRSEQ2_PROFILE_SCOPE(model, prefix);
+    ggml_context* ctx = model.ctx;
+    int model_dim = seqs->ne[0];
+    int num_heads = model.layer_config.at(prefix + ".num_heads");
+    int head_dim = model_dim / num_heads;
+    GGML_ASSERT(model_dim % num_heads == 0);
+
+    ggml_tensor* q = EnergyProjection_forward(model, prefix + ".q_energy_proj", seqs);
+    q = _reshape_num_head(ctx, q, head_dim);  // (H, S, H_dim)
+
+    // Like the encoder-decoder attention K and V, the keys energy only depends on the encoder output.
+    auto kv_cache = has_kv_cache(model) ? model.kv_cache.find(prefix) : model.kv_cache.end();
+    ggml_tensor* k;
+    if (kv_cache != model.kv_cache.end() && kv_cache->second.step_nr > 0) {
+        k = kv_cache->second.full_k;
+        GGML_ASSERT(keys->ne[1] == kv_cache->second.step_nr);  // cache content doesn't match the input sequence
+    } else {
+        bool cached = kv_cache != model.kv_cache.end();
+        if (cached && model.enc_kv_cache_ctx) model.ctx = model.enc_kv_cache_ctx;
+        k = _avg_pool_seqs(model.ctx, keys, model.layer_config.at(prefix + ".keys_pooling.kernel_size"));
+        k = EnergyProjection_forward(model, prefix + ".k_energy_proj", k);
+        k = _reshape_num_head(model.ctx, k, head_dim);  // (H, S_p, H_dim)
+        if (cached) {
+            kv_cache->second.full_k = ggml_detach(ggml_dup_inplace(model.ctx, k));
+            ggml_format_name(kv_cache->second.full_k, "%s.k_cache", prefix.c_str());
+            kv_cache->second.step_nr = keys->ne[1];
+        }
+        model.ctx = ctx;
+    }
+
+    // (H, S_p, H_dim) x (H, S, H_dim) -> (H, S, S_p)
+    ggml_tensor* energy = mul_mat(ctx, k, q);
+    FORCE_ALLOC(energy_scale, ctx, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 1));
+    ggml_set_f32(energy_scale, 1.0f / sqrtf(float(head_dim)));
+    energy = ggml_scale(ctx, energy, energy_scale);
+    ggml_tensor* energy_bias = model.tensors[prefix + ".energy_bias"];
+    if (energy_bias != nullptr) energy = ggml_add_inplace(ctx, energy, energy_bias);
+
+    // sigmoid(x / T) = 0.5 + 0.5 * tanh(x / 2T)
+    double temperature = model_layer_config_d(model, prefix + ".monotonic_temperature");
+    FORCE_ALLOC(tanh_scale, ctx, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 1));
+    ggml_set_f32(tanh_scale, 0.5f / temperature);
+    FORCE_ALLOC(half, ctx, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 1));
+    ggml_set_f32(half, 0.5f);
+    ggml_tensor* p_choose = ggml_tanh_inplace(ctx, ggml_scale_inplace(ctx, energy, tanh_scale));
+    p_choose = ggml_add_inplace(ctx, ggml_scale_inplace(ctx, p_choose, half), half);
+    return p_choose;
+}
+
+extern "C" ggml_tensor* MonotonicTransformerDecoderLayer_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* seqs,
+    ggml_tensor* self_attn_mask,
+    ggml_tensor* encoder_output,
+    ggml_tensor* encoder_padding_mask,
+    ggml_tensor** p_choose  // (H, S, S_p), optional
+) {
+    FAIRSEQ2_PROFILE_SCOPE(model, prefix);
+    ggml_context* ctx = model.ctx;
+
+    ggml_tensor* residual = seqs;
+    seqs = LayerNorm_forward(model, prefix + ".self_attn_layer_norm", seqs);
+    seqs = MultiheadAttention_forward(model, prefix + ".self_attn", seqs, seqs, seqs, self_attn_mask);
+    seqs = ggml_add_inplace(ctx, seqs, residual);
+
+    residual = seqs;
+    seqs = LayerNorm_forward(model, prefix + ".encoder_decoder_attn_layer_norm", seqs);
+    if (p_choose != nullptr) *p_choose = PChooseLayer_forward(model, prefix + ".p_choose_layer", seqs, encoder_output);
+    seqs = MultiheadAttention_forward(
+        model,
+        prefix + ".encoder_decoder_attn",
+        seqs,
+        encoder_output,
+        encoder_output,
+        /*attention masks=*/encoder_padding_mask
+    );
+    seqs = ggml_add_inplace(ctx, seqs, residual);
+
+    residual = seqs;
+    seqs = LayerNorm_forward(model, prefix + ".ffn_layer_norm", seqs);
+    seqs = StandardFeedForwardNetwork_forward(model, prefix + ".ffn", seqs);
+    seqs = ggml_add_inplace(ctx, seqs, residual);
+    return seqs;
+}
+
+extern "C" ggml_tensor* MonotonicTransformerDecoder_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* seqs,
+    ggml_tensor* padding_mask,
+    ggml_tensor* encoder_output,
+    ggml_tensor* encoder_padding_mask,
+    ggml_tensor** p_choose  // (L * H, S, S_p), optional
+) {
+    FAIRSEQ2_PROFILE_SCOPE(model, prefix);
+    ggml_tensor* self_attn_mask = causal_attention_mask(model.ctx, seqs);
+    if (p_choose != nullptr) *p_choose = nullptr;
+    for (int i = 0; has_layer(model, prefix + ".layers." + std::to_string(i)); ++i) {
+        ggml_tensor* layer_p_choose = nullptr;
+        seqs = MonotonicTransformerDecoderLayer_forward(
+            model,
+            prefix + ".layers." + std::to_string(i),
+            seqs,
+            self_attn_mask,
+            encoder_output,
+            encoder_padding_mask,
+            p_choose != nullptr ? &layer_p_choose : nullptr
+        );
+        if (p_choose != nullptr) {
+            *p_choose = *p_choose == nullptr ? layer_p_choose : ggml_concat(model.ctx, *p_choose, layer_p_choose);
+        }
+    }
+    return LayerNorm_forward(model, prefix + ".layer_norm", seqs);
+}
+
+static const char* MONOTONIC_DECODER_PREFIX = "text_decoder";
+
+/// Caches which grow with each decoded token, as opposed to the ones computed from the encoder output.
+static bool _is_step_cache(const std::string& name) {
+    static const std::string self_attn = ".self_attn";
+    return name == "text_decoder_frontend.pos_encoder" || (
+        name.size() > self_attn.size() && name.compare(name.size() - self_attn.size(), self_attn.size(), self_attn) == 0
+    );
+}
+
+MonotonicDecoderState monotonic_decoder_init(fairseq2_model& model, const std::string& tgt_lang, const MonotonicDecoderOptions& opts) {
+    MonotonicDecoderState state;
+    state.opts = opts;
+    // stored tables bound the decoded length, generated ones are extended as needed
+    ggml_tensor* pos_encoder = model.tensors["text_decoder_frontend.pos_encoder"];
+    if (pos_encoder != nullptr && !_extends_position_encodings(model, "text_decoder_frontend.pos_encoder")) {
+        state.opts.hard_max_seq_len = std::min<std::int64_t>(opts.hard_max_seq_len, pos_encoder->ne[1]);
+    }
+    auto tgt_lang_idx = model.vocab.token_to_id.find("__" + tgt_lang + "__");
+    if (tgt_lang_idx == model.vocab.token_to_id.end()) {
+        throw std::invalid_argument("Unknown language " + tgt_lang);
+    }
+    state.eos_idx = model.vocab.token_to_id.at("</s>");
+    state.pending = {state.eos_idx, tgt_lang_idx->second};
+
+    std::int64_t mem_mb = opts.mem_mb;
+    // The self attention mask is computed in place from its zero-initialized buffer.
+    state.bufs[0].resize((std::size_t)state.opts.hard_max_seq_len * state.opts.hard_max_seq_len * sizeof(float) + MB);
+    // Only the capacity is used by ctx_from_buffer and new_arena_allocr, this avoids zeroing the other buffers.
+    state.bufs[1].reserve(mem_mb * MB * 3 / 10);
+    state.bufs[2].reserve(mem_mb * MB * 3 / 10);
+    state.bufs[3].reserve(mem_mb * MB * 3 / 10);
+    state.bufs[4].reserve(mem_mb * MB * 1 / 10);
+
+    state.search_ctx = ctx_from_buffer(state.bufs[0]);
+    std::swap(model.kv_cache, state.kv_cache);
+    fairseq2_kv_cache_alloc(model, state.search_ctx, 1, state.opts.hard_max_seq_len);
+    for (int i = 0; has_layer(model, std::string(MONOTONIC_DECODER_PREFIX) + ".layers." + std::to_string(i)); ++i) {
+        model.kv_cache[std::string(MONOTONIC_DECODER_PREFIX) + ".layers." + std::to_string(i) + ".p_choose_layer"] = {nullptr, nullptr, nullptr, 0};
+    }
+    std::swap(model.kv_cache, state.kv_cache);
+    return state;
+}
+
+void monotonic_decoder_free(MonotonicDecoderState& state) {
+    for (ggml_context* ctx : {state.search_ctx, state.kv_ctx, state.source_ctx}) {
+        if (ctx != nullptr) ggml_free(ctx);
+    }
+    state.search_ctx = state.kv_ctx = state.source_ctx = nullptr;
+    state.kv_cache.clear();
+}
+
+/// Aggregates the p_choose of the heads of the layers after `p_choose_start_layer`.
+static float _monotonic_decision_prob(const std::vector<float>& p_choose, MonotonicDecisionMethod method) {
+    std::vector<float> probs = p_choose;
+    switch (method) {
+        case MONOTONIC_DECISION_MEAN:
+            return std::accumulate(probs.begin(), probs.end(), 0.0f) / probs.size();
+        case MONOTONIC_DECISION_MEDIAN:
+            // Same as torch.median: the lower of the two middle values.
+            std::nth_element(probs.begin(), probs.begin() + (probs.size() - 1) / 2, probs.end());
+            return probs[(probs.size() - 1) / 2];
+        default:
+            return *std::min_element(probs.begin(), probs.end());
+    }
+}
+
+std::vector<std::int32_t> monotonic_decoder_push(
+    fairseq2_model& model,
+    MonotonicDecoderState& state,
+    ggml_tensor* encoder_output,
+    bool source_finished,
+    int n_threads
+) {
+    std::vector<std::int32_t> written;
+    std::int64_t source_len = encoder_output->ne[1];
+    if (state.finished) return written;
+    if (source_len == 0 || (source_len < state.opts.min_starting_wait && !source_finished)) return written;
+
+    ggml_detach(encoder_output);
+    ggml_context* original_ctx = model.ctx;
+    ggml_context* original_enc_kv_cache_ctx = model.enc_kv_cache_ctx;
+    std::swap(model.kv_cache, state.kv_cache);
+
+    // The encoder output has changed: the encoder-decoder caches are recomputed at the first step.
+    if (state.source_ctx != nullptr) ggml_free(state.source_ctx);
+    state.source_ctx = ctx_from_buffer(state.bufs[3]);
+    for (auto& kv : model.kv_cache) {
+        if (_is_step_cache(kv.first)) continue;
+        kv.second.full_k = kv.second.full_v = nullptr;
+        kv.second.step_nr = 0;
+    }
+    model.enc_kv_cache_ctx = state.source_ctx;
+    ggml_allocr* fwd_alloc = new_arena_allocr(state.bufs[4]);
+
+    std::int64_t max_len = state.opts.max_len_a * source_len + state.opts.max_len_b;
+    std::int64_t prefix_len = 2;
+    ggml_tensor* embed = model.tensors["text_decoder_frontend.embed.weight"];
+    std::int64_t vocab_size = embed->ne[1];
+    int n_layers = 0;
+    while (has_layer(model, std::string(MONOTONIC_DECODER_PREFIX) + ".layers." + std::to_string(n_layers))) ++n_layers;
+    int num_heads = model.layer_config.at(std::string(MONOTONIC_DECODER_PREFIX) + ".layers.0.p_choose_layer.num_heads");
+
+    while (true) {
+        // The steps which don't write a token are rolled back, so that the next push
+        // only runs the decoder on the last written token, with the new source.
+        std::vector<std::pair<std::string, KeyValueTensor>> step_caches;
+        for (const auto& kv : model.kv_cache) {
+            if (_is_step_cache(kv.first)) step_caches.push_back(kv);
+        }
+        int step_buf = state.kv_buf == 1 ? 2 : 1;
+        ggml_context* step_ctx = ctx_from_buffer(state.bufs[step_buf]);
+        model.ctx = step_ctx;
+
+        std::int64_t n_pending = state.pending.size();
+        FORCE_ALLOC(tokens, step_ctx, ggml_new_tensor_1d(step_ctx, GGML_TYPE_I32, n_pending));
+        std::copy(state.pending.begin(), state.pending.end(), (std::int32_t*)tokens->data);
+        ggml_set_no_alloc(step_ctx, true);
+        ggml_tensor* seqs = TransformerEmbeddingFrontend_forward(model, "text_decoder_frontend", tokens);
+        ggml_tensor* p_choose = nullptr;
+        seqs = MonotonicTransformerDecoder_forward(model, MONOTONIC_DECODER_PREFIX, seqs, nullptr, encoder_output, nullptr, &p_choose);
+        // Only the last position is needed for the decision, keep it out of the arena.
+        ggml_set_no_alloc(step_ctx, false);
+        ggml_tensor* logits = Linear_forward(model, "final_proj", ggml_slice(step_ctx, seqs, 1, n_pending - 1, n_pending));
+        // (L * H, S, S_p) -> (L * H, 1, 1): the last target position against the last pooled source position.
+        ggml_tensor* last_p_choose = ggml_cont(step_ctx, ggml_view_2d(
+            step_ctx, p_choose, 1, p_choose->ne[2], p_choose->nb[2],
+            (p_choose->ne[0] - 1) * p_choose->nb[0] + (n_pending - 1) * p_choose->nb[1]
+        ));
+        ggml_cgraph* gf = ggml_new_graph(step_ctx);
+        ggml_build_forward_expand(gf, logits);
+        ggml_build_forward_expand(gf, last_p_choose);
+        fairseq2_graph_fuse(model, gf);
+        ggml_allocr_alloc_graph(fwd_alloc, gf);
+        fairseq2_graph_compute(model, step_ctx, gf, n_threads);
+        ggml_allocr_reset(fwd_alloc);
+
+        const float* logits_data = ggml_get_data_f32(logits);
+        std::int32_t index = std::max_element(logits_data, logits_data + vocab_size) - logits_data;
+        const float* p_choose_data = ggml_get_data_f32(last_p_choose);
+        std::vector<float> probs(
+            p_choose_data + std::min(state.opts.p_choose_start_layer, n_layers - 1) * num_heads,
+            p_choose_data + n_layers * num_heads
+        );
+        float prob = _monotonic_decision_prob(probs, state.opts.decision_method);
+
+        // Same decisions as MMATextDecoderAgent.policy
+        std::int64_t target_len = state.target.size();
+        bool write = false;
+        if (index == state.eos_idx || target_len > max_len || prefix_len + target_len + 1 >= state.opts.hard_max_seq_len) {
+            state.finished = true;
+        } else if (prob >= state.opts.decision_threshold || source_finished) {
+            write = target_len < max_len && (std::int64_t)written.size() < state.opts.max_consecutive_writes;
+        }
+        if (write) {
+            if (state.kv_ctx != nullptr) ggml_free(state.kv_ctx);
+            state.kv_ctx = step_ctx;
+            state.kv_buf = step_buf;
+            state.target.push_back(index);
+            written.push_back(index);
+            state.pending = {index};
+            continue;
+        }
+        ggml_free(step_ctx);
+        for (const auto& kv : step_caches) model.kv_cache[kv.first] = kv.second;
+        break;
+    }
+
+    ggml_allocr_free(fwd_alloc);
+    std::swap(model.kv_cache, state.kv_cache);
+    model.enc_kv_cache_ctx = original_enc_kv_cache_ctx;
+    model.ctx = original_ctx;
+    return written;
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <atomic>
+#include <climits>
 #include <unordered_map>
 #include <string>
 #include <vector>
@@ -83,6 +85,61 @@ struct KeyValueTensor {
     int step_nr;
 };
 
+/// Timings and counters of a single request, see `fairseq2_model::stats`.
+struct RequestStats {
+    // Wall-clock time of each stage, in microseconds.
+    std::int64_t fbank_us = 0;
+    std::int64_t encoder_us = 0;  // excluding fbank
+    std::int64_t bootstrap_us = 0;
+    std::vector<std::int64_t> decode_step_us;
+    std::int64_t detokenize_us = 0;
+    std::int64_t t2u_us = 0;
+    std::int64_t total_us = 0;
+
+    /// Number of beam search steps run.
+    std::int64_t n_steps = 0;
+    /// Number of beams dropped because none of their continuations made it to the top-k.
+    std::int64_t n_beams_pruned = 0;
+    /// Largest memory usage of the ggml_allocr arenas used by the request.
+    std::size_t peak_arena_bytes = 0;
+    /// Number of nodes in the graphs computed by `fairseq2_graph_compute`.
+    std::int64_t n_graph_nodes = 0;
+    /// Whether the request was stopped by its CancellationToken. The result then holds
+    /// the best partial hypothesis, empty if the decoder didn't start.
+    bool cancelled = false;
+    /// Whether the speech encoder output was found in the `fairseq2_model::encoder_cache`,
+    /// or computed and added to it. Both are false without cache.
+    bool encoder_cache_hit = false;
+    bool encoder_cache_miss = false;
+
+    std::int64_t decode_us() const {
+        std::int64_t total = 0;
+        for (auto step_us : decode_step_us) total += step_us;
+        return total;
+    }
+};
+
+/// Stops a request early, see `fairseq2_model::cancel`. Set from any thread, eg when the
+/// client disconnects, and checked between the nodes of the graphs and between beam search steps.
+struct CancellationToken {
+    std::atomic<bool> cancelled{false};
+    /// In ggml_time_us() time, 0 for no deadline.
+    std::atomic<std::int64_t> deadline_us{0};
+
+    void cancel() { cancelled = true; }
+    void set_timeout_us(std::int64_t timeout_us) { deadline_us = ggml_time_us() + timeout_us; }
+
+    bool is_cancelled() const {
+        if (cancelled.load(std::memory_order_relaxed)) return true;
+        std::int64_t deadline = deadline_us.load(std::memory_order_relaxed);
+        return deadline > 0 && ggml_time_us() >= deadline;
+    }
+};
+
+struct fairseq2_profiler;
+struct fairseq2_fbank;
+class EncoderCache;
+
 struct fairseq2_model {
     // Context containing all tensors memory
     ggml_context* tensors_ctx = nullptr;
@@ -103,6 +160,9 @@ struct fairseq2_model {
     // Optional target vocabulary for bilingual models
     llama_vocab tgt_vocab;
 
+    // Optional character vocabulary of the non-autoregressive T2U model
+    llama_vocab char_vocab;
+
     // KV cache for attention layers
     mutable std::unordered_map<std::string, KeyValueTensor> kv_cache = {};
 
@@ -111,10 +171,61 @@ struct fairseq2_model {
     ggml_context* ctx = nullptr;
 
     ggml_context* enc_kv_cache_ctx = nullptr;
+
+    // Optional per-node profiler, see profiler.h
+    fairseq2_profiler* profiler = nullptr;
+
+    // Fbank feature extractor of the speech encoder, built once by the loader, see fairseq2_fbank_init.
+    fairseq2_fbank* fbank = nullptr;
+
+    // Optional cache of the speech encoder outputs, set by EncoderCache::attach in unity_lib.
+    EncoderCache* encoder_cache = nullptr;
+
+    // Hash of the weights, which keys the encoder_cache entries of this model, see EncoderCache::fingerprint.
+    std::string encoder_fingerprint;
+
+    // Optional timings and counters of the current request, filled when set.
+    RequestStats* stats = nullptr;
+
+    // Optional cancellation of the current request. Once cancelled, the graphs being computed
+    // stop before their next node, and generate_sequence returns the ongoing beams.
+    const CancellationToken* cancel = nullptr;
+
+    // Storage of the decoder KV cache: GGML_TYPE_F32, GGML_TYPE_F16 or GGML_TYPE_Q8_0. The attention
+    // reads F16 and Q8_0 caches in place, which cuts the memory traffic of each decoding step at a
+    // small accuracy cost. With Q8_0 the values, which are read along the sequence, stay in F16.
+    ggml_type kv_cache_type = GGML_TYPE_F32;
+
+    // Fuse chains of ops in the graphs before allocating them, see ggml_graph_fuse.
+    bool fuse_graphs = true;
+
+    // NUMA node holding the weights, set before loading. The graphs are computed by threads
+    // pinned to it. -1 leaves both to the OS, unless numa_interleave spreads the weights
+    // over all nodes. Only effective after ggml_numa_init.
+    int numa_node = -1;
+    bool numa_interleave = false;
+
+    // How long the compute threads spin between nodes before sleeping, see ggml_cplan::spin_count.
+    // Lower it when several processes share the cores. INT_MIN keeps the ggml default.
+    int spin_count = INT_MIN;
 };
 
 double fairseq2_model_layer_config_double(const fairseq2_model& model, std::string name);
 
+/// Sinusoidal encodings of the positions `start` to `start + n - 1`, (n, dim) row major: the sines of
+/// all frequencies then their cosines, as fairseq2 SinusoidalPositionEncoder. Positions up to 2^16.
+void fairseq2_sinusoidal_encodings(float* out, int dim, std::int64_t start, std::int64_t n);
+/// Relative encodings of the positions `start` down to `start - n + 1`, with interleaved sines
+/// and cosines, as fairseq2 RelativePositionalEncoding. Positions up to 2^16 in absolute value.
+void fairseq2_relative_sinusoidal_encodings(float* out, int dim, std::int64_t start, std::int64_t n);
+/// Memory taken in the weights context by the position encodings which aren't stored in the file.
+std::size_t fairseq2_position_encodings_size(const fairseq2_model& model);
+/// Generates the position encodings which aren't stored in the file into `ctx`, see ggml_convert.py.
+void fairseq2_position_encodings_init(fairseq2_model& model, ggml_context* ctx);
+
+/// Whether the model has a tensor or a module with the given name.
+bool has_layer(fairseq2_model& model, const std::string& name);
+
 /// allocate the fairseq2 model and hyperparameters
 extern "C" fairseq2_model* fairseq2_model_alloc();
 // free the models and all its owned tensors
@@ -123,14 +234,37 @@ extern "C" void fairseq2_model_set_inference_ctx(fairseq2_model* model, ggml_con
 extern "C" void fairseq2_kv_cache_reset(const fairseq2_model& model);
 ggml_context* ctx_from_buffer(std::vector<uint8_t>& buffer);
 
+/// Rewrites `gf` with ggml_graph_fuse if enabled for the model. Must be called before allocating it.
+extern "C" void fairseq2_graph_fuse(fairseq2_model& model, ggml_cgraph* gf);
+
+/// Computes the graph, allocating the work buffer in `ctx`.
+/// Per-node timings are recorded if the model profiler is enabled.
+/// The outputs are only partially computed if the request is cancelled, see fairseq2_cancelled.
+extern "C" void fairseq2_graph_compute(fairseq2_model& model, ggml_context* ctx, ggml_cgraph* gf, int n_threads);
+
+/// Whether the current request of the model has been cancelled, or has passed its deadline.
+bool fairseq2_cancelled(const fairseq2_model& model);
+
 extern "C" std::string* std_string_alloc(char* c_str);
 extern "C" void std_string_free(std::string* str);
 
+/// Builds the fbank extractor of the speech encoder `prefix` if the model has one, from the
+/// layer config of `<prefix>_frontend.feature_extractor`: num_fbank_channels (80), stride (2)
+/// and sample_rate (16000). WaveformToFbank_forward builds one per call without it.
+void fairseq2_fbank_init(fairseq2_model& model, const std::string& prefix = "speech_encoder");
+
 extern "C" ggml_tensor* WaveformToFbank_forward(
     fairseq2_model& model,
     const std::string &prefix,
     ggml_tensor* waveform 
 );
+/// Index of the nearest k-means centroid of each frame of `seqs`.
+extern "C" ggml_tensor* KmeansQuantizer_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* seqs
+);
+
 extern "C" ggml_tensor* ggml_slice(
     struct ggml_context* ctx,
     struct ggml_tensor* a,
@@ -150,6 +284,10 @@ extern "C" ggml_tensor* ggml_flatten_1d(ggml_context* ctx, ggml_tensor* x, int d
 /// dim is the position of the output dimension with the given number of element (N).
 extern "C" ggml_tensor* ggml_unflatten_1d(ggml_context* ctx, ggml_tensor* x, int dim, int num_el);
 
+/// Turns a computed tensor into a leaf, so that later graphs read its data instead of
+/// computing it again from sources which may have been freed.
+ggml_tensor* ggml_detach(ggml_tensor* a);
+
 extern "C" ggml_tensor* Linear_forward(
     fairseq2_model& model,
     const std::string &prefix,
@@ -210,6 +348,15 @@ extern "C" ggml_tensor* StandardTransformerEncoder_forward(
     ggml_tensor* padding_mask
 );
 
+extern "C" ggml_tensor* StandardTransformerDecoder_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* seqs,
+    ggml_tensor* padding_mask,
+    ggml_tensor* encoder_output,
+    ggml_tensor* encoder_padding_mask
+);
+
 extern "C" ggml_tensor* RelativePositionMHA_forward(
     fairseq2_model& model,
     const std::string& prefix,
@@ -229,6 +376,16 @@ extern "C" ggml_tensor* StandardConformerEncoderLayer_forward(
     ggml_tensor* padding_mask
 );
 
+/// Output of the conformer layer `out_layer_idx` of the speech encoder, as read by the unit extractor:
+/// the remaining layers, the final layer norm and the adaptor aren't computed. A negative index runs all layers.
+extern "C" ggml_tensor* StandardConformerEncoderLayerOutput_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* seqs,
+    ggml_tensor* padding_mask,
+    int out_layer_idx
+);
+
 extern "C" ggml_tensor* StandardConformerEncoder_forward(
     fairseq2_model& model,
     const std::string& prefix,
@@ -328,6 +485,272 @@ extern "C" Hypothesis* generate_sequence(
     int threads
 );
 
+/// Beam searches of several jobs over the same encoder output, eg one per target language.
+/// The jobs must have the same options and prefix length, they usually only differ by the
+/// language token of their prefix. Each step is one decoder graph over the beams of all the
+/// jobs, and the encoder-decoder attention projects the encoder output once for all of them.
+/// The beams of a job are dropped from the graphs once it has finished.
+/// Returns the `beam_size` hypotheses of each job, the same as with generate_sequence.
+extern "C" Hypothesis** generate_sequences(
+    fairseq2_model& model,
+    const SequenceGeneratorJob* jobs,
+    int n_jobs,
+    ggml_tensor* encoder_output,
+    ggml_tensor* encoder_padding_mask,
+    ggml_context* result_ctx,
+    int threads
+);
+
+extern "C" ggml_tensor* HardUpsampling_forward(
+    fairseq2_model& model,
+    ggml_tensor* seqs,
+    ggml_tensor* durations
+);
+
+extern "C" ggml_tensor* VariancePredictor_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* seqs
+);
+
+extern "C" ggml_tensor* NARDecoderFrontend_character_level_upsampling(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* seqs,
+    ggml_tensor* char_seqs,
+    ggml_tensor* char_lens
+);
+
+extern "C" ggml_tensor* NARDecoderFrontend_forward_unit_pos_embedding(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* seqs
+);
+
+extern "C" ggml_tensor* Conv1dBlock_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* seqs
+);
+
+extern "C" ggml_tensor* FeedForwardTransformerLayer_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* seqs
+);
+
+extern "C" ggml_tensor* FeedForwardTransformer_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* seqs
+);
+
+/// Splits the subwords of `text_seqs` into characters for the T2U model.
+/// Returns the (char_seqs, char_lens) tensors, allocated in `ctx`. char_seqs is null if there are no characters.
+std::pair<ggml_tensor*, ggml_tensor*> fairseq2_t2u_char_seqs(
+    fairseq2_model& model,
+    ggml_context* ctx,
+    ggml_tensor* text_seqs
+);
+
+/// Predicts the speech units of a translation with the non-autoregressive T2U model.
+/// `text_seqs` is the generated sequence without its final EOS, and `text_decoder_output`
+/// the matching output of the text decoder.
+/// The units are written inside `result_ctx`, null is returned if the text is empty.
+extern "C" ggml_tensor* generate_units_nar(
+    fairseq2_model& model,
+    ggml_tensor* text_seqs,
+    ggml_tensor* text_decoder_output,
+    float duration_factor,
+    int mem_mb,
+    ggml_context* result_ctx,
+    int n_threads
+);
+
+// CodeHiFiGAN vocoder. Signals are (T, C), like in torch.
+extern "C" ggml_tensor* Conv1d_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* x
+);
+
+extern "C" ggml_tensor* ConvTranspose1d_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* x
+);
+
+extern "C" ggml_tensor* ResBlock_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* x
+);
+
+extern "C" ggml_tensor* Generator_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* x
+);
+
+/// Waveform of units already upsampled by their durations, for the given `lang` and `spkr` indices.
+extern "C" ggml_tensor* CodeGenerator_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* units,
+    ggml_tensor* lang,
+    ggml_tensor* spkr
+);
+
+/// Number of frames needed on each side of a frame to compute its samples exactly.
+extern "C" std::int64_t fairseq2_vocoder_context_frames(fairseq2_model& model, const std::string& prefix);
+
+/// Incremental synthesis state of the vocoder, see `vocoder_stream_push`.
+/// Frames are units repeated by their predicted durations, and are indexed from the start of the stream.
+struct VocoderStream {
+    std::int32_t lang_idx = 0;
+    std::int32_t spkr_idx = 0;
+    bool dur_prediction = true;
+    /// Receptive field radius of the duration predictor, in units, and of the generator, in frames.
+    std::int64_t context_units = 0;
+    std::int64_t context_frames = 0;
+    /// Units without duration yet, preceded by their left context.
+    std::vector<std::int32_t> units;
+    std::int64_t units_offset = 0;
+    std::int64_t n_units_done = 0;
+    /// Frames not synthesized yet, preceded by their left context.
+    std::vector<std::int32_t> frames;
+    std::int64_t frames_offset = 0;
+    std::int64_t n_frames_emitted = 0;
+    /// Reused between pushes: graph metadata and work buffers, and fwd_alloc arena.
+    std::vector<std::uint8_t> ctx_buf;
+    std::vector<std::uint8_t> fwd_buf;
+};
+
+/// Starts a stream for a language supported by the vocoder.
+/// `spkr` < 0 selects the default speaker of the language.
+VocoderStream vocoder_stream_init(fairseq2_model& model, const std::string& lang, int spkr, bool dur_prediction, int mem_mb);
+
+/// Appends `units` to the stream and returns the new samples which don't depend on units not received yet.
+/// With `flush`, the unit sequence is complete and all the remaining samples are returned.
+/// The concatenated outputs are the same as synthesizing all units at once.
+std::vector<float> vocoder_stream_push(
+    fairseq2_model& model,
+    VocoderStream& stream,
+    const std::int32_t* units,
+    std::size_t n_units,
+    bool flush,
+    int n_threads
+);
+
+/// Synthesizes the waveform of `units` at once.
+std::vector<float> generate_waveform(
+    fairseq2_model& model,
+    const std::vector<std::int32_t>& units,
+    const std::string& lang,
+    int spkr,
+    int mem_mb,
+    int n_threads
+);
+
+extern "C" ggml_tensor* EnergyProjection_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* seqs
+);
+
+/// Probabilities of writing each target position after reading each pooled source position, (H, S, S_p).
+extern "C" ggml_tensor* PChooseLayer_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* seqs,
+    ggml_tensor* keys
+);
+
+extern "C" ggml_tensor* MonotonicTransformerDecoderLayer_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* seqs,
+    ggml_tensor* self_attn_mask,
+    ggml_tensor* encoder_output,
+    ggml_tensor* encoder_padding_mask,
+    ggml_tensor** p_choose
+);
+
+/// Also returns the p_choose of all the layers in `p_choose` if not null, (L * H, S, S_p).
+extern "C" ggml_tensor* MonotonicTransformerDecoder_forward(
+    fairseq2_model& model,
+    const std::string& prefix,
+    ggml_tensor* seqs,
+    ggml_tensor* padding_mask,
+    ggml_tensor* encoder_output,
+    ggml_tensor* encoder_padding_mask,
+    ggml_tensor** p_choose
+);
+
+/// How the p_choose of the attention heads are aggregated into the write probability.
+enum MonotonicDecisionMethod {
+    MONOTONIC_DECISION_MIN = 0,
+    MONOTONIC_DECISION_MEAN = 1,
+    MONOTONIC_DECISION_MEDIAN = 2,
+};
+
+/// Options of the read/write policy of `monotonic_decoder_push`, see MMATextDecoderAgent.
+struct MonotonicDecoderOptions {
+    /// The terms ``a`` and ``b`` of ``ax + b`` where ``x`` is the source
+    /// length, the maximum length of the translation.
+    int max_len_a = 1;
+    int max_len_b = 200;
+    /// Maximum length of the translation including its prefix, which sizes the self attention mask.
+    int hard_max_seq_len = 1024;
+    int max_consecutive_writes = 50;
+    /// Number of encoder frames read before the first write.
+    int min_starting_wait = 1;
+    /// A token is written once its probability reaches the threshold. Small values give low latency.
+    float decision_threshold = 0.5f;
+    MonotonicDecisionMethod decision_method = MONOTONIC_DECISION_MIN;
+    /// Decoder layer from which p_choose is taken into account.
+    int p_choose_start_layer = 0;
+    int mem_mb = 512;
+};
+
+/// Simultaneous translation of a single source stream, see `monotonic_decoder_push`.
+struct MonotonicDecoderState {
+    MonotonicDecoderOptions opts;
+    std::int32_t eos_idx = 0;
+    /// Written tokens, without the (EOS, lang) prefix nor the final EOS.
+    std::vector<std::int32_t> target;
+    /// Tokens not in the self attention caches yet: the prefix, then the last written token.
+    std::vector<std::int32_t> pending;
+    bool finished = false;
+    /// Attention caches, swapped with the model ones during a push.
+    std::unordered_map<std::string, KeyValueTensor> kv_cache;
+    /// Buffers of the self attention mask, of the self attention caches of two consecutive steps,
+    /// of the encoder-decoder caches, and of the forward pass arena.
+    std::vector<std::uint8_t> bufs[5];
+    ggml_context* search_ctx = nullptr;
+    ggml_context* kv_ctx = nullptr;
+    int kv_buf = 0;
+    ggml_context* source_ctx = nullptr;
+};
+
+/// Starts the translation of a source stream. Throws std::invalid_argument for unknown languages.
+MonotonicDecoderState monotonic_decoder_init(fairseq2_model& model, const std::string& tgt_lang, const MonotonicDecoderOptions& opts);
+
+void monotonic_decoder_free(MonotonicDecoderState& state);
+
+/// Runs the read/write policy on the encoder output of all the source received so far,
+/// and returns the tokens written before the policy decided to read more source.
+/// The self attention caches are kept between pushes, so the prefix isn't decoded again:
+/// only the last written token is decoded with the new source.
+/// `state.finished` is set once EOS is predicted or the maximum length is reached.
+std::vector<std::int32_t> monotonic_decoder_push(
+    fairseq2_model& model,
+    MonotonicDecoderState& state,
+    ggml_tensor* encoder_output,
+    bool source_finished,
+    int n_threads
+);
+
 extern "C" void fairseq2_spm_tokenize(fairseq2_model* model, const char* text, ggml_tensor* out);
 extern "C" std::size_t fairseq2_spm_detokenize(fairseq2_model* model, ggml_tensor* tokens, char* out);
 
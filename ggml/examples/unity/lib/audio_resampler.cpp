@@ -0,0 +1,130 @@
+#include "audio_resampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include "ggml.h"
+
+/// Modified Bessel function of the first kind of order 0, for the Kaiser window.
+static double _bessel_i0(double x) {
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 64 && term > 1e-12 * sum; ++k) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+/// Dot product of `n` floats, `n` a multiple of 8. The partial sums are in independent lanes,
+/// so that the loop is vectorized without reassociating float additions.
+static float _dot8(const float* x, const float* h, std::int64_t n) {
+    float acc[8] = {};
+    for (std::int64_t k = 0; k < n; k += 8) {
+        for (int j = 0; j < 8; ++j) acc[j] += x[k + j] * h[k + j];
+    }
+    return ((acc[0] + acc[4]) + (acc[1] + acc[5])) + ((acc[2] + acc[6]) + (acc[3] + acc[7]));
+}
+
+AudioResampler::AudioResampler(int in_rate, int out_rate, int channels, int zero_crossings)
+    : _channels(channels) {
+    GGML_ASSERT(in_rate > 0 && out_rate > 0 && channels > 0 && zero_crossings > 0);
+    std::int64_t g = in_rate, r = out_rate;
+    while (r != 0) {
+        std::int64_t rem = g % r;
+        g = r;
+        r = rem;
+    }
+    _up = out_rate / g;
+    _down = in_rate / g;
+    if (_up == _down) {
+        // Only downmixed.
+        _half_taps = 1;
+        _n_taps = 8;
+        _filters.assign(_n_taps, 0.0f);
+        _filters[0] = 1.0f;
+    } else {
+        // Cut-off below the lower Nyquist frequency, relative to the input one.
+        const double rolloff = 0.95;
+        const double beta = 8.0;
+        const double window_norm = _bessel_i0(beta);
+        double cutoff = rolloff * std::min(1.0, (double)_up / _down);
+        _half_taps = (std::int64_t)std::ceil(zero_crossings / cutoff);
+        _n_taps = (2 * _half_taps + 7) / 8 * 8;
+        // Tap k of phase p weights the input sample k - _half_taps + 1 after the last one at or
+        // before the output, which is p / _up input samples before the output.
+        _filters.assign(_up * _n_taps, 0.0f);
+        for (std::int64_t p = 0; p < _up; ++p) {
+            float* h = _filters.data() + p * _n_taps;
+            double sum = 0.0;
+            for (std::int64_t k = 0; k < 2 * _half_taps; ++k) {
+                double t = (double)(k - _half_taps + 1) - (double)p / _up;
+                double r = t / _half_taps;
+                if (std::abs(r) >= 1.0) continue;
+                double x = M_PI * cutoff * t;
+                double sinc = x == 0.0 ? 1.0 : std::sin(x) / x;
+                double window = _bessel_i0(beta * std::sqrt(1.0 - r * r)) / window_norm;
+                h[k] = (float)(cutoff * sinc * window);
+                sum += h[k];
+            }
+            // Unit DC gain on every phase.
+            for (std::int64_t k = 0; k < _n_taps; ++k) h[k] = (float)(h[k] / sum);
+        }
+    }
+    _history.assign(_half_taps - 1, 0.0f);
+    _history_start = -(_half_taps - 1);
+}
+
+void AudioResampler::_produce(std::int64_t history_end, std::int64_t max_out, std::vector<float>& out) {
+    while (_n_out < max_out) {
+        std::int64_t i = _n_out * _down / _up;
+        std::int64_t first = i - _half_taps + 1;
+        if (first + _n_taps > history_end) break;
+        const float* h = _filters.data() + (_n_out * _down % _up) * _n_taps;
+        out.push_back(_dot8(_history.data() + (first - _history_start), h, _n_taps));
+        _n_out += 1;
+    }
+    // Drops the input no longer needed, once it's worth the move.
+    std::int64_t first = _n_out * _down / _up - _half_taps + 1;
+    if (first - _history_start >= 4096) {
+        _history.erase(_history.begin(), _history.begin() + (first - _history_start));
+        _history_start = first;
+    }
+}
+
+void AudioResampler::process(const float* frames, std::int64_t n_frames, std::vector<float>& out) {
+    std::size_t offset = _history.size();
+    _history.resize(offset + n_frames);
+    float* mono = _history.data() + offset;
+    if (_channels == 1) {
+        std::copy(frames, frames + n_frames, mono);
+    } else {
+        const float scale = 1.0f / _channels;
+        for (std::int64_t i = 0; i < n_frames; ++i) {
+            float sum = 0.0f;
+            for (int c = 0; c < _channels; ++c) sum += frames[i * _channels + c];
+            mono[i] = sum * scale;
+        }
+    }
+    _n_in += n_frames;
+    out.reserve(out.size() + (std::size_t)(n_frames * _up / _down + 1));
+    _produce(_n_in, INT64_MAX, out);
+}
+
+void AudioResampler::flush(std::vector<float>& out) {
+    // The input after the end is zeros.
+    _history.resize(_history.size() + _n_taps, 0.0f);
+    _produce(_n_in + _n_taps, (_n_in * _up + _down - 1) / _down, out);
+    _history.assign(_half_taps - 1, 0.0f);
+    _history_start = -(_half_taps - 1);
+    _n_in = 0;
+    _n_out = 0;
+}
+
+std::vector<float> resample_audio(const float* frames, std::int64_t n_frames, int channels, int in_rate, int out_rate) {
+    AudioResampler resampler(in_rate, out_rate, channels);
+    std::vector<float> out;
+    resampler.process(frames, n_frames, out);
+    resampler.flush(out);
+    return out;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+/// Streaming resampler of interleaved audio to mono at `out_rate`, the channels are averaged.
+/// Polyphase Kaiser-windowed sinc: the filter of each of the `out_rate / gcd` phases is computed
+/// once, and each output sample is a dot product with the input history.
+/// The output is the same however the input is split between `process` calls.
+class AudioResampler {
+public:
+    /// `zero_crossings` of the sinc on each side of the filter, at the lower of the two rates.
+    AudioResampler(int in_rate, int out_rate = 16000, int channels = 1, int zero_crossings = 16);
+
+    /// Appends to `out` the samples resampled from the next `n_frames` frames of `frames`.
+    void process(const float* frames, std::int64_t n_frames, std::vector<float>& out);
+    /// Appends the samples delayed by the filter, up to `ceil(n_in * out_rate / in_rate)` in total,
+    /// and resets the resampler for a new stream.
+    void flush(std::vector<float>& out);
+
+    int channels() const { return _channels; }
+    /// Input frames needed before `process` outputs the first sample.
+    int latency() const { return (int)(_n_taps - _half_taps + 1); }
+
+private:
+    int _channels;
+    std::int64_t _up;
+    std::int64_t _down;
+    std::int64_t _half_taps;
+    std::int64_t _n_taps;
+    std::vector<float> _filters;  // (_up, _n_taps)
+    // Mono input from the absolute index `_history_start`, the samples before 0 are zeros.
+    std::vector<float> _history;
+    std::int64_t _history_start;
+    std::int64_t _n_in = 0;
+    std::int64_t _n_out = 0;
+
+    void _produce(std::int64_t history_end, std::int64_t max_out, std::vector<float>& out);
+};
+
+/// Resamples interleaved `frames` to mono at `out_rate` in one go, see `AudioResampler`.
+std::vector<float> resample_audio(const float* frames, std::int64_t n_frames, int channels, int in_rate, int out_rate = 16000);
@@ -0,0 +1,244 @@
+#include "encoder_cache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+/// 128-bit hash over 64-bit words, in two lanes with different multipliers.
+/// Not cryptographic: the cache trusts its clients.
+struct Hash128 {
+    std::uint64_t a = 0x243f6a8885a308d3ULL;
+    std::uint64_t b = 0x13198a2e03707344ULL;
+
+    static std::uint64_t rotl(std::uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+    void update_word(std::uint64_t w) {
+        a = rotl((a ^ w) * 0x9e3779b97f4a7c15ULL, 31);
+        b = rotl((b + w) * 0xc2b2ae3d27d4eb4fULL, 27) ^ a;
+    }
+
+    void update(const void* data, std::size_t n) {
+        const unsigned char* bytes = (const unsigned char*)data;
+        std::size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            std::uint64_t w;
+            std::memcpy(&w, bytes + i, 8);
+            update_word(w);
+        }
+        std::uint64_t tail = 0;
+        std::memcpy(&tail, bytes + i, n - i);
+        update_word(tail ^ ((std::uint64_t)n << 56));
+    }
+
+    void update(const std::string& s) { update(s.data(), s.size()); }
+
+    static std::uint64_t finalize(std::uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        return h ^ (h >> 33);
+    }
+
+    std::string hex() const {
+        char buf[33];
+        std::snprintf(buf, sizeof(buf), "%016llx%016llx",
+            (unsigned long long)finalize(a), (unsigned long long)finalize(b ^ a));
+        return buf;
+    }
+};
+
+std::string EncoderCache::fingerprint(const fairseq2_model& model) {
+    Hash128 h;
+    // Sorted, as the maps are in no particular order.
+    std::vector<std::pair<std::string, std::int64_t>> hparams(model.hparams.begin(), model.hparams.end());
+    std::sort(hparams.begin(), hparams.end());
+    for (const auto& kv : hparams) {
+        h.update(kv.first);
+        h.update(&kv.second, sizeof(kv.second));
+    }
+    std::vector<std::pair<std::string, ggml_tensor*>> tensors(model.tensors.begin(), model.tensors.end());
+    std::sort(tensors.begin(), tensors.end(), [](const auto& x, const auto& y) { return x.first < y.first; });
+    for (const auto& kv : tensors) {
+        const ggml_tensor* t = kv.second;
+        if (t == nullptr) continue;  // left by lookups of missing tensors with operator[]
+        h.update(kv.first);
+        h.update(&t->type, sizeof(t->type));
+        h.update(t->ne, sizeof(t->ne));
+        if (t->data != nullptr) h.update(t->data, ggml_nbytes(t));
+    }
+    return h.hex();
+}
+
+void EncoderCache::attach(fairseq2_model& model) {
+    if (model.encoder_fingerprint.empty()) model.encoder_fingerprint = fingerprint(model);
+    model.encoder_cache = this;
+}
+
+std::string EncoderCache::key(const fairseq2_model& model, const float* samples, std::size_t n_samples) {
+    GGML_ASSERT(!model.encoder_fingerprint.empty() && "the model was not attached to the encoder cache");
+    Hash128 h;
+    h.update(model.encoder_fingerprint);
+    h.update(&n_samples, sizeof(n_samples));
+    h.update(samples, n_samples * sizeof(float));
+    return h.hex();
+}
+
+struct EncoderCache::Impl {
+    EncoderCacheOptions opts;
+    mutable std::mutex mutex;
+    EncoderCacheStats stats;
+
+    // Most recently used first.
+    std::list<std::string> lru;
+    struct MemoryEntry {
+        EncoderCacheEntry entry;
+        std::list<std::string>::iterator pos;
+    };
+    std::unordered_map<std::string, MemoryEntry> entries;
+
+    std::list<std::string> spill_lru;
+    struct SpillEntry {
+        std::size_t bytes;
+        std::list<std::string>::iterator pos;
+    };
+    std::unordered_map<std::string, SpillEntry> spilled;
+
+    static std::size_t entry_bytes(const EncoderCacheEntry& entry) {
+        return entry.data.size() * sizeof(float);
+    }
+
+    std::string spill_path(const std::string& key) const {
+        return opts.spill_dir + "/" + key + ".enc";
+    }
+
+    void drop_spilled(std::string key) {
+        auto it = spilled.find(key);
+        if (it == spilled.end()) return;
+        std::remove(spill_path(key).c_str());
+        stats.spill_bytes -= it->second.bytes;
+        spill_lru.erase(it->second.pos);
+        spilled.erase(it);
+    }
+
+    void spill(const std::string& key, const EncoderCacheEntry& entry) {
+        std::size_t bytes = entry_bytes(entry);
+        if (bytes > opts.max_spill_bytes) return;
+        FILE* f = std::fopen(spill_path(key).c_str(), "wb");
+        if (f == nullptr) {
+            std::cerr << "Could not spill the encoder output to " << spill_path(key) << "\n";
+            return;
+        }
+        std::int32_t n_dims = entry.n_dims;
+        bool ok = std::fwrite(&n_dims, sizeof(n_dims), 1, f) == 1
+            && std::fwrite(entry.ne, sizeof(entry.ne), 1, f) == 1
+            && std::fwrite(entry.data.data(), sizeof(float), entry.data.size(), f) == entry.data.size();
+        ok = std::fclose(f) == 0 && ok;
+        if (!ok) {
+            std::cerr << "Could not spill the encoder output to " << spill_path(key) << "\n";
+            std::remove(spill_path(key).c_str());
+            return;
+        }
+        spill_lru.push_front(key);
+        spilled[key] = {bytes, spill_lru.begin()};
+        stats.spill_bytes += bytes;
+        stats.spills += 1;
+        while (stats.spill_bytes > opts.max_spill_bytes) drop_spilled(spill_lru.back());
+    }
+
+    bool unspill(const std::string& key, EncoderCacheEntry& entry) {
+        auto it = spilled.find(key);
+        if (it == spilled.end()) return false;
+        FILE* f = std::fopen(spill_path(key).c_str(), "rb");
+        bool ok = f != nullptr;
+        if (ok) {
+            std::int32_t n_dims = 0;
+            entry.data.resize(it->second.bytes / sizeof(float));
+            ok = std::fread(&n_dims, sizeof(n_dims), 1, f) == 1
+                && std::fread(entry.ne, sizeof(entry.ne), 1, f) == 1
+                && std::fread(entry.data.data(), sizeof(float), entry.data.size(), f) == entry.data.size();
+            entry.n_dims = n_dims;
+            std::fclose(f);
+        }
+        // Back in memory, or lost.
+        drop_spilled(key);
+        return ok;
+    }
+
+    void evict() {
+        const std::string& key = lru.back();
+        auto it = entries.find(key);
+        stats.bytes -= entry_bytes(it->second.entry);
+        stats.evictions += 1;
+        if (!opts.spill_dir.empty()) spill(key, it->second.entry);
+        entries.erase(it);
+        lru.pop_back();
+    }
+
+    void insert(const std::string& key, EncoderCacheEntry entry) {
+        std::size_t bytes = entry_bytes(entry);
+        if (bytes > opts.max_bytes) {
+            stats.evictions += 1;
+            if (!opts.spill_dir.empty()) spill(key, entry);
+            return;
+        }
+        lru.push_front(key);
+        entries[key] = {std::move(entry), lru.begin()};
+        stats.bytes += bytes;
+        while (stats.bytes > opts.max_bytes) evict();
+    }
+};
+
+EncoderCache::EncoderCache(EncoderCacheOptions opts) : impl(new Impl) {
+    impl->opts = std::move(opts);
+}
+
+EncoderCache::~EncoderCache() {
+    clear();
+}
+
+bool EncoderCache::get(const std::string& key, EncoderCacheEntry& entry) {
+    std::lock_guard<std::mutex> lock(impl->mutex);
+    auto it = impl->entries.find(key);
+    if (it != impl->entries.end()) {
+        impl->lru.splice(impl->lru.begin(), impl->lru, it->second.pos);
+        entry = it->second.entry;
+        impl->stats.hits += 1;
+        return true;
+    }
+    if (impl->unspill(key, entry)) {
+        impl->insert(key, entry);
+        impl->stats.hits += 1;
+        impl->stats.disk_hits += 1;
+        return true;
+    }
+    impl->stats.misses += 1;
+    return false;
+}
+
+void EncoderCache::put(const std::string& key, EncoderCacheEntry entry) {
+    std::lock_guard<std::mutex> lock(impl->mutex);
+    if (impl->entries.count(key)) return;  // computed concurrently by another request
+    impl->drop_spilled(key);
+    impl->insert(key, std::move(entry));
+}
+
+EncoderCacheStats EncoderCache::stats() const {
+    std::lock_guard<std::mutex> lock(impl->mutex);
+    EncoderCacheStats stats = impl->stats;
+    stats.entries = impl->entries.size();
+    stats.spill_entries = impl->spilled.size();
+    return stats;
+}
+
+void EncoderCache::clear() {
+    std::lock_guard<std::mutex> lock(impl->mutex);
+    while (!impl->spill_lru.empty()) impl->drop_spilled(impl->spill_lru.back());
+    impl->entries.clear();
+    impl->lru.clear();
+    impl->stats.bytes = 0;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "fairseq2.h"
+
+struct EncoderCacheOptions {
+    /// Encoder outputs kept in memory, the least recently used are evicted past it.
+    std::size_t max_bytes = 256 << 20;
+    /// Directory the evicted outputs are written to, empty to drop them.
+    std::string spill_dir;
+    /// Encoder outputs kept in `spill_dir`, the least recently used files are deleted past it.
+    std::size_t max_spill_bytes = std::size_t(1) << 30;
+};
+
+struct EncoderCacheStats {
+    std::uint64_t hits = 0;  // including disk_hits
+    std::uint64_t disk_hits = 0;
+    std::uint64_t misses = 0;
+    std::uint64_t evictions = 0;  // from memory, spilled or dropped
+    std::uint64_t spills = 0;
+    std::size_t entries = 0;
+    std::size_t bytes = 0;
+    std::size_t spill_entries = 0;
+    std::size_t spill_bytes = 0;
+
+    double hit_rate() const { return hits + misses > 0 ? (double)hits / (hits + misses) : 0.0; }
+};
+
+/// Speech encoder output of an audio, as computed by unity_speech_encoder.
+struct EncoderCacheEntry {
+    std::vector<float> data;
+    int n_dims = 0;
+    std::int64_t ne[GGML_MAX_DIMS] = {};
+};
+
+/// LRU cache of speech encoder outputs, so that audio submitted again (retries, other target
+/// languages, other decoding options) is decoded right away. Attach it to a model to use it in
+/// unity_eval_speech and friends. The entries are keyed by the samples and the weights of the
+/// model, so a cache can be shared by several models, eg the NUMA replicas of one.
+/// Thread-safe. The spilled files are deleted with the cache.
+class EncoderCache {
+public:
+    explicit EncoderCache(EncoderCacheOptions opts = {});
+    ~EncoderCache();
+
+    /// Hash of the hparams, tensor names and shapes, and all the weights of `model`.
+    /// Reads the whole model: computed once per model, by attach.
+    static std::string fingerprint(const fairseq2_model& model);
+
+    /// Sets the cache as `model.encoder_cache`, and the `model.encoder_fingerprint` of its entries
+    /// unless already set, eg copied from the model a replica was loaded from. Must be called
+    /// before the model serves requests.
+    void attach(fairseq2_model& model);
+
+    /// Key of the encoder output of `samples` by `model`: a hash of the samples and of the
+    /// fingerprint of the model, which must be attached.
+    static std::string key(const fairseq2_model& model, const float* samples, std::size_t n_samples);
+
+    /// Copies the entry of `key` into `entry`, reading it back from disk if it was spilled.
+    bool get(const std::string& key, EncoderCacheEntry& entry);
+    void put(const std::string& key, EncoderCacheEntry entry);
+
+    EncoderCacheStats stats() const;
+    /// Drops all entries, in memory and on disk. The stats are kept.
+    void clear();
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+};
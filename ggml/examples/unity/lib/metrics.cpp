@@ -0,0 +1,150 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <sstream>
+
+Histogram::Histogram(std::vector<double> bounds) :
+    bounds(std::move(bounds)),
+    counts(this->bounds.size() + 1, 0)
+{}
+
+void Histogram::observe(double value) {
+    std::size_t bucket = std::lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin();
+    counts[bucket] += 1;
+    sum += value;
+    count += 1;
+}
+
+static const std::vector<double> REQUEST_SECONDS = {0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60};
+static const std::vector<double> STEP_SECONDS = {0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1};
+static const std::vector<double> ARENA_BYTES = {1 << 20, 4 << 20, 16 << 20, 64 << 20, 256 << 20, 1024.0 * (1 << 20), 4096.0 * (1 << 20)};
+static const char* STAGES[] = {"fbank", "encoder", "bootstrap", "decode", "detokenize", "t2u", "total"};
+
+struct TaskMetrics {
+    std::uint64_t requests = 0;
+    std::uint64_t errors = 0;
+    std::uint64_t cancelled = 0;
+    std::uint64_t encoder_cache_hits = 0;
+    std::uint64_t encoder_cache_misses = 0;
+    std::uint64_t decode_steps = 0;
+    std::uint64_t beams_pruned = 0;
+    std::uint64_t graph_nodes = 0;
+    std::map<std::string, Histogram> stage_seconds;
+    Histogram step_seconds{STEP_SECONDS};
+    Histogram arena_bytes{ARENA_BYTES};
+
+    TaskMetrics() {
+        for (const char* stage : STAGES) stage_seconds.emplace(stage, Histogram(REQUEST_SECONDS));
+    }
+};
+
+struct MetricsRegistry {
+    std::mutex mutex;
+    std::map<std::string, TaskMetrics> tasks;
+};
+
+static MetricsRegistry& registry() {
+    static MetricsRegistry metrics;
+    return metrics;
+}
+
+void unity_metrics_record(const std::string& task, const RequestStats& stats) {
+    MetricsRegistry& metrics = registry();
+    std::lock_guard<std::mutex> lock(metrics.mutex);
+    TaskMetrics& m = metrics.tasks[task];
+    m.requests += 1;
+    m.cancelled += stats.cancelled;
+    m.encoder_cache_hits += stats.encoder_cache_hit;
+    m.encoder_cache_misses += stats.encoder_cache_miss;
+    m.decode_steps += stats.n_steps;
+    m.beams_pruned += stats.n_beams_pruned;
+    m.graph_nodes += stats.n_graph_nodes;
+    m.stage_seconds.at("fbank").observe(stats.fbank_us * 1e-6);
+    m.stage_seconds.at("encoder").observe(stats.encoder_us * 1e-6);
+    m.stage_seconds.at("bootstrap").observe(stats.bootstrap_us * 1e-6);
+    m.stage_seconds.at("decode").observe(stats.decode_us() * 1e-6);
+    m.stage_seconds.at("detokenize").observe(stats.detokenize_us * 1e-6);
+    if (stats.t2u_us > 0) m.stage_seconds.at("t2u").observe(stats.t2u_us * 1e-6);
+    m.stage_seconds.at("total").observe(stats.total_us * 1e-6);
+    for (auto step_us : stats.decode_step_us) m.step_seconds.observe(step_us * 1e-6);
+    m.arena_bytes.observe(stats.peak_arena_bytes);
+}
+
+void unity_metrics_record_error(const std::string& task) {
+    MetricsRegistry& metrics = registry();
+    std::lock_guard<std::mutex> lock(metrics.mutex);
+    metrics.tasks[task].errors += 1;
+}
+
+static void write_header(std::ostringstream& out, const char* name, const char* type, const char* help) {
+    out << "# HELP " << name << " " << help << "\n";
+    out << "# TYPE " << name << " " << type << "\n";
+}
+
+static void write_histogram(std::ostringstream& out, const char* name, const std::string& labels, const Histogram& h) {
+    std::uint64_t cumulative = 0;
+    for (std::size_t i = 0; i < h.bounds.size(); ++i) {
+        cumulative += h.counts[i];
+        out << name << "_bucket{" << labels << ",le=\"" << h.bounds[i] << "\"} " << cumulative << "\n";
+    }
+    out << name << "_bucket{" << labels << ",le=\"+Inf\"} " << h.count << "\n";
+    out << name << "_sum{" << labels << "} " << h.sum << "\n";
+    out << name << "_count{" << labels << "} " << h.count << "\n";
+}
+
+std::string unity_metrics_prometheus() {
+    MetricsRegistry& metrics = registry();
+    std::lock_guard<std::mutex> lock(metrics.mutex);
+    std::ostringstream out;
+    out.precision(9);
+
+    struct Counter { const char* name; const char* help; std::uint64_t TaskMetrics::* value; };
+    const Counter counters[] = {
+        {"unity_requests_total", "Number of requests processed.", &TaskMetrics::requests},
+        {"unity_request_errors_total", "Number of requests rejected before running the model.", &TaskMetrics::errors},
+        {"unity_requests_cancelled_total", "Number of requests stopped by their deadline or cancellation.", &TaskMetrics::cancelled},
+        {"unity_encoder_cache_hits_total", "Number of speech encoder outputs read from the encoder cache.", &TaskMetrics::encoder_cache_hits},
+        {"unity_encoder_cache_misses_total", "Number of speech encoder outputs computed and added to the encoder cache.", &TaskMetrics::encoder_cache_misses},
+        {"unity_decode_steps_total", "Number of beam search steps.", &TaskMetrics::decode_steps},
+        {"unity_beams_pruned_total", "Number of beams dropped by the beam search top-k.", &TaskMetrics::beams_pruned},
+        {"unity_graph_nodes_total", "Number of ggml graph nodes computed.", &TaskMetrics::graph_nodes},
+    };
+    for (const auto& counter : counters) {
+        write_header(out, counter.name, "counter", counter.help);
+        for (const auto& kv : metrics.tasks) {
+            out << counter.name << "{task=\"" << kv.first << "\"} " << kv.second.*counter.value << "\n";
+        }
+    }
+
+    write_header(out, "unity_request_duration_seconds", "histogram", "Time spent in each stage of a request.");
+    for (const auto& kv : metrics.tasks) {
+        for (const char* stage : STAGES) {
+            std::string labels = "task=\"" + kv.first + "\",stage=\"" + stage + "\"";
+            write_histogram(out, "unity_request_duration_seconds", labels, kv.second.stage_seconds.at(stage));
+        }
+    }
+
+    write_header(out, "unity_decode_step_duration_seconds", "histogram", "Time spent in each beam search step.");
+    for (const auto& kv : metrics.tasks) {
+        write_histogram(out, "unity_decode_step_duration_seconds", "task=\"" + kv.first + "\"", kv.second.step_seconds);
+    }
+
+    write_header(out, "unity_peak_arena_bytes", "histogram", "Peak memory used by the ggml_allocr arenas of a request.");
+    for (const auto& kv : metrics.tasks) {
+        write_histogram(out, "unity_peak_arena_bytes", "task=\"" + kv.first + "\"", kv.second.arena_bytes);
+    }
+    return out.str();
+}
+
+extern "C" void unity_metrics_write(FILE* out) {
+    std::string text = unity_metrics_prometheus();
+    std::fwrite(text.data(), 1, text.size(), out);
+}
+
+extern "C" void unity_metrics_reset() {
+    MetricsRegistry& metrics = registry();
+    std::lock_guard<std::mutex> lock(metrics.mutex);
+    metrics.tasks.clear();
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "fairseq2.h"
+
+/// Cumulative histogram with fixed bucket upper bounds, as exposed by Prometheus.
+struct Histogram {
+    std::vector<double> bounds;
+    std::vector<std::uint64_t> counts;  // one per bound, plus +Inf
+    double sum = 0;
+    std::uint64_t count = 0;
+
+    explicit Histogram(std::vector<double> bounds);
+    void observe(double value);
+};
+
+/// Adds a request to the process-level metrics. `task` is used as label, eg "s2tt".
+void unity_metrics_record(const std::string& task, const RequestStats& stats);
+/// Counts a request which failed before running the model.
+void unity_metrics_record_error(const std::string& task);
+
+/// Returns all metrics in the Prometheus text exposition format.
+std::string unity_metrics_prometheus();
+extern "C" void unity_metrics_write(FILE* out);
+extern "C" void unity_metrics_reset();
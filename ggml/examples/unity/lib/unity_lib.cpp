@@ -1,6 +1,16 @@
 #include "unity_lib.h"
+#include "encoder_cache.h"
+#include "metrics.h"
+#include "profiler.h"
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <stdexcept>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 
 struct ggml_cgraph * unity_text_encoder(
@@ -31,11 +41,11 @@ struct ggml_cgraph * unity_speech_encoder(
     return gf;
 }
 
-Hypothesis* unity_decode(
+/// The beam search of a translation into `tgt_lang_idx`, the prefix is allocated in model.ctx.
+static SequenceGeneratorJob decode_job(
         fairseq2_model& model,
         const SequenceGeneratorOptions& opts,
         int tgt_lang_idx,
-        ggml_tensor* encoder_output,
         int n_threads
 ) {
     SequenceGeneratorJob job = {
@@ -54,54 +64,227 @@ Hypothesis* unity_decode(
         ((int *)prefix_seq->data)[1]  = tgt_lang_idx;
     }
     job.prefix_seq = prefix_seq;
+    return job;
+}
+
+Hypothesis* unity_decode(
+        fairseq2_model& model,
+        const SequenceGeneratorOptions& opts,
+        int tgt_lang_idx,
+        ggml_tensor* encoder_output,
+        int n_threads
+) {
+    SequenceGeneratorJob job = decode_job(model, opts, tgt_lang_idx, n_threads);
     return generate_sequence(model, job, encoder_output, nullptr, model.ctx, n_threads);
 }
 
+Hypothesis** unity_decode_multi(
+        fairseq2_model& model,
+        const SequenceGeneratorOptions& opts,
+        const std::vector<int>& tgt_lang_idx,
+        ggml_tensor* encoder_output,
+        int n_threads
+) {
+    std::vector<SequenceGeneratorJob> jobs;
+    for (int lang_idx : tgt_lang_idx) {
+        jobs.push_back(decode_job(model, opts, lang_idx, n_threads));
+    }
+    return generate_sequences(model, jobs.data(), jobs.size(), encoder_output, nullptr, model.ctx, n_threads);
+}
+
+std::vector<int> unity_text_to_units(
+        fairseq2_model& model,
+        const SequenceGeneratorOptions& opts,
+        ggml_tensor* text_seq,
+        ggml_tensor* encoder_output,
+        ggml_allocr* fwd_alloc,
+        int n_threads
+) {
+    // Manually trim the final EOS token to be consistent with fairseq.
+    ggml_tensor* text_seqs = ggml_slice(model.ctx, text_seq, 0, 0, -1);
+
+    // The T2U model reads the text decoder output of the full hypothesis.
+    ggml_cgraph* gf = ggml_new_graph(model.ctx);
+    ggml_tensor* seqs = TransformerEmbeddingFrontend_forward(model, "text_decoder_frontend", text_seqs);
+    seqs = StandardTransformerDecoder_forward(model, "text_decoder", seqs, nullptr, encoder_output, nullptr);
+    ggml_build_forward_expand(gf, seqs);
+    fairseq2_graph_fuse(model, gf);
+    ggml_allocr_alloc_graph(fwd_alloc, gf);
+    fairseq2_graph_compute(model, model.ctx, gf, n_threads);
+    if (fairseq2_cancelled(model)) return {};
+
+    ggml_tensor* units = generate_units_nar(model, text_seqs, seqs, /*duration_factor*/1.0f, opts.mem_mb, model.ctx, n_threads);
+    if (units == nullptr) return {};
+    const int* units_data = (const int*)units->data;
+    return std::vector<int>(units_data, units_data + units->ne[0]);
+}
+
+std::vector<int> unity_extract_units(
+        fairseq2_model& model,
+        fairseq2_model& kmeans,
+        std::vector<float>& data,
+        int out_layer_idx,
+        int mem_mb,
+        int n_threads
+) {
+    std::int64_t t_start_us = ggml_time_us();
+    RequestStats stats;
+    // Reserved but not zeroed: this runs once per file of the corpus.
+    std::vector<uint8_t> ctx_buf;
+    ctx_buf.reserve(8 * 1024 * 1024);  // this is only for tensor metadata, it can be small
+    std::vector<uint8_t> fwd_buf;
+    fwd_buf.reserve(mem_mb * 1024 * 1024);
+    ggml_allocr* fwd_alloc = ggml_allocr_new(fwd_buf.data(), fwd_buf.capacity(), 8);
+    model.stats = &stats;
+    model.ctx = ctx_from_buffer(ctx_buf);
+    kmeans.ctx = model.ctx;
+    ggml_set_no_alloc(model.ctx, true);
+    ggml_tensor* seqs = ggml_new_tensor_2d(model.ctx, GGML_TYPE_F32, data.size(), 1);
+    seqs->data = data.data();
+
+    // The encoder stops at `out_layer_idx`, and the nearest centroids are found with one matmul.
+    std::int64_t t_encoder_us = ggml_time_us();
+    ggml_cgraph* gf = ggml_new_graph(model.ctx);
+    ggml_tensor* features = StandardConformerEncoderLayerOutput_forward(model, "speech_encoder", seqs, nullptr, out_layer_idx);
+    ggml_tensor* units = KmeansQuantizer_forward(kmeans, "kmeans", features);
+    ggml_build_forward_expand(gf, units);
+    fairseq2_graph_fuse(model, gf);
+    stats.peak_arena_bytes = ggml_allocr_alloc_graph(fwd_alloc, gf);
+    fairseq2_graph_compute(model, model.ctx, gf, n_threads);
+    stats.encoder_us = ggml_time_us() - t_encoder_us - stats.fbank_us;
+
+    const int* units_data = (const int*)units->data;
+    std::vector<int> result(units_data, units_data + units->ne[0]);
+    ggml_free(model.ctx);
+    kmeans.ctx = nullptr;
+    ggml_allocr_free(fwd_alloc);
+    fairseq2_profiler_flush(model);
+    model.stats = nullptr;
+    stats.total_us = ggml_time_us() - t_start_us;
+    unity_metrics_record("units", stats);
+    return result;
+}
+
 extern "C" fairseq2_model unity_init_model(const char* model_path) {
     fairseq2_model model;
     load_fairseq2_ggml_file(model, model_path);
     return model;
 }
 
-//  struct as return - transcription, CE score, LID 
-extern "C" Result unity_eval_speech(fairseq2_model& model, std::vector<float>& data, SequenceGeneratorOptions opts, std::string tgt_lang, int n_threads) {
-    Result result;
-    // The ctx_size_mb mostly depends of input length and model dim.
-    int ctx_size_mb = opts.mem_mb;
-    auto encoder_buf = std::vector<uint8_t>(8 * 1024 * 1024);  // this is only for tensor metadata, it can be small
-    auto encoder_fwd_buf = std::vector<uint8_t>(ctx_size_mb * 1024 * 1024);
-    ggml_allocr* fwd_alloc = ggml_allocr_new(encoder_fwd_buf.data(), encoder_fwd_buf.capacity(), 8);
-    int tgt_lang_idx;
-    if (tgt_lang == "unk") {
-        tgt_lang_idx = model.vocab.token_to_id["<unk>"];
-    } else {
-        auto tgt_lang_ptr = model.vocab.token_to_id.find("__" + tgt_lang + "__"); 
-        if (tgt_lang_ptr == model.vocab.token_to_id.end()) {
-            std::cerr << "Unknown language " << tgt_lang << "\n";
-            result.err = 1;
-            return result;
+NumaMode parse_numa_mode(const std::string& name) {
+    if (name == "none") return NumaMode::none;
+    if (name == "interleave") return NumaMode::interleave;
+    if (name == "replicate") return NumaMode::replicate;
+    throw std::invalid_argument("Unknown NUMA mode " + name + ", expected none, interleave or replicate");
+}
+
+ggml_type parse_kv_cache_type(const std::string& name) {
+    if (name == "f32") return GGML_TYPE_F32;
+    if (name == "f16") return GGML_TYPE_F16;
+    if (name == "q8_0") return GGML_TYPE_Q8_0;
+    throw std::invalid_argument("Unknown KV cache type " + name + ", expected f32, f16 or q8_0");
+}
+
+std::vector<fairseq2_model> unity_load_numa_models(const char* model_path, NumaMode mode) {
+    int n_replicas = mode == NumaMode::replicate ? std::max(1, ggml_numa_n_nodes()) : 1;
+    std::vector<fairseq2_model> models(n_replicas);
+    for (int node = 0; node < n_replicas; ++node) {
+        fairseq2_model& model = models[node];
+        model.numa_node = mode == NumaMode::replicate && ggml_is_numa() ? node : -1;
+        model.numa_interleave = mode == NumaMode::interleave;
+        if (load_fairseq2_ggml_file(model, model_path)) {
+            for (int i = 0; i < node; ++i) fairseq2_model_free(&models[i]);
+            return {};
         }
-        tgt_lang_idx = tgt_lang_ptr->second;
     }
+    return models;
+}
 
+/// Index of the `__lang__` token, or -1 if the model doesn't know the language.
+static int speech_tgt_lang_idx(fairseq2_model& model, const std::string& tgt_lang) {
+    if (tgt_lang == "unk") {
+        return model.vocab.token_to_id["<unk>"];
+    }
+    auto tgt_lang_ptr = model.vocab.token_to_id.find("__" + tgt_lang + "__");
+    if (tgt_lang_ptr == model.vocab.token_to_id.end()) {
+        return -1;
+    }
+    return tgt_lang_ptr->second;
+}
 
-    // Reset the ggml_context
-    model.ctx = ctx_from_buffer(encoder_buf);
-    ggml_set_no_alloc(model.ctx, true);
+/// First half of unity_eval_speech. The output is allocated in `fwd_alloc`, and read from or
+/// added to the `model.encoder_cache` if set. Null if the request is cancelled before or while encoding.
+static ggml_tensor* eval_speech_encoder(fairseq2_model& model, std::vector<float>& data, ggml_allocr* fwd_alloc, RequestStats& stats, int n_threads) {
+    if (fairseq2_cancelled(model)) {
+        stats.cancelled = true;
+        return nullptr;
+    }
+    std::string cache_key;
+    if (model.encoder_cache != nullptr) {
+        std::int64_t t_lookup_us = ggml_time_us();
+        cache_key = EncoderCache::key(model, data.data(), data.size());
+        EncoderCacheEntry cached;
+        if (model.encoder_cache->get(cache_key, cached)) {
+            ggml_tensor* encoder_output = ggml_new_tensor(model.ctx, GGML_TYPE_F32, cached.n_dims, cached.ne);
+            ggml_allocr_alloc(fwd_alloc, encoder_output);
+            std::copy(cached.data.begin(), cached.data.end(), ggml_get_data_f32(encoder_output));
+            stats.encoder_cache_hit = true;
+            stats.encoder_us = ggml_time_us() - t_lookup_us;
+            return encoder_output;
+        }
+        stats.encoder_cache_miss = true;
+    }
     ggml_tensor* seqs = ggml_new_tensor_2d(model.ctx, GGML_TYPE_F32, data.size(), 1);
     seqs->data = data.data();
 
-    // Audio encoder
+    std::int64_t t_encoder_us = ggml_time_us();
     ggml_cgraph* gf = unity_speech_encoder(model, seqs);
-    ggml_allocr_alloc_graph(fwd_alloc, gf);
-    ggml_graph_compute_with_ctx(model.ctx, gf, n_threads);
-    // encoder_output is valid until we call `ggml_allocr_reset(fwd_alloc)`
+    fairseq2_graph_fuse(model, gf);
+    stats.peak_arena_bytes = std::max(stats.peak_arena_bytes, ggml_allocr_alloc_graph(fwd_alloc, gf));
+    fairseq2_graph_compute(model, model.ctx, gf, n_threads);
+    // fbank is computed while building the graph
+    stats.encoder_us = ggml_time_us() - t_encoder_us - stats.fbank_us;
+    if (fairseq2_cancelled(model)) {
+        stats.cancelled = true;
+        return nullptr;
+    }
     ggml_tensor* encoder_output = gf->nodes[gf->n_nodes - 1];
+    if (model.encoder_cache != nullptr) {
+        EncoderCacheEntry entry;
+        const float* encoder_output_data = ggml_get_data_f32(encoder_output);
+        entry.data.assign(encoder_output_data, encoder_output_data + ggml_nelements(encoder_output));
+        entry.n_dims = encoder_output->n_dims;
+        std::copy(encoder_output->ne, encoder_output->ne + GGML_MAX_DIMS, entry.ne);
+        model.encoder_cache->put(cache_key, std::move(entry));
+    }
+    return encoder_output;
+}
 
-    // Beam search decoding
-    const Hypothesis* hypo = unity_decode(model, opts, tgt_lang_idx, encoder_output, n_threads);
+/// The `__lang__` tokens of the model, in the order of Hypothesis::lid_scores.
+static std::vector<int> lang_token_ids(const fairseq2_model& model) {
+    std::vector<int> lang_ids;
+    for (const auto& kv : model.vocab.token_to_id) {
+        if (kv.first.substr(0, 2) == "__" && kv.first.substr(kv.first.size() - 2) == "__") {
+            lang_ids.push_back(kv.second);
+        }
+    }
+    std::sort(lang_ids.begin(), lang_ids.end());
+    return lang_ids;
+}
 
+/// Detokenization and units of the hypotheses of a beam search.
+/// `fwd_alloc` is used by the T2U model.
+static void eval_speech_hypothesis(
+    fairseq2_model& model,
+    const Hypothesis* hypo,
+    ggml_tensor* encoder_output,
+    const SequenceGeneratorOptions& opts,
+    ggml_allocr* fwd_alloc,
+    Result& result,
+    int n_threads
+) {
     // Drop language and bos token.
+    std::int64_t t_detokenize_us = ggml_time_us();
     ggml_tensor* tokens = ggml_slice(model.ctx, hypo[0].seq, 0, 2, 0);
 
     // Collect result string
@@ -111,61 +294,264 @@ extern "C" Result unity_eval_speech(fairseq2_model& model, std::vector<float>& d
     std::vector<float> word_scores = p.second;
 
     std::unordered_map<std::string, float> lid_scores;
-    std::vector<int> lang_ids;
-    for (const auto& kv : model.vocab.token_to_id) {
-        if (kv.first.substr(0, 2) == "__" && kv.first.substr(kv.first.size() - 2) == "__") {
-            lang_ids.push_back(kv.second);
-        }
-    }
-    std::sort(lang_ids.begin(), lang_ids.end());
+    std::vector<int> lang_ids = lang_token_ids(model);
     for (size_t i = 0; i < lang_ids.size(); ++i) {
         lid_scores[model.vocab.id_to_token[lang_ids[i]].text] = ggml_get_f32_1d(hypo[0].lid_scores, i); 
     }
     result.transcription = result_tokens;
     result.word_confidence_scores = word_scores;
     result.lid_scores = lid_scores;
-    result.err = 0;
-    ggml_free(model.ctx);
-    ggml_allocr_reset(fwd_alloc);
-    return result;
+    result.stats.detokenize_us = ggml_time_us() - t_detokenize_us;
+
+    // Speech output, for the models shipping a NAR T2U model. Not worth it for partial hypotheses.
+    if (result.stats.cancelled) return;
+    if (has_layer(model, "t2u_model.decoder_frontend") && !model.char_vocab.id_to_token.empty()) {
+        std::int64_t t_t2u_us = ggml_time_us();
+        result.units = unity_text_to_units(model, opts, hypo[0].seq, encoder_output, fwd_alloc, n_threads);
+        result.stats.t2u_us = ggml_time_us() - t_t2u_us;
+        // no units when cancelled, the transcription is complete
+        result.stats.cancelled = result.units.empty() && fairseq2_cancelled(model);
+    }
 }
 
+/// Second half of unity_eval_speech: beam search, detokenization and units.
+/// `fwd_alloc` is used by the T2U model.
+static void eval_speech_decoder(
+    fairseq2_model& model,
+    ggml_tensor* encoder_output,
+    const SequenceGeneratorOptions& opts,
+    int tgt_lang_idx,
+    ggml_allocr* fwd_alloc,
+    Result& result,
+    int n_threads
+) {
+    result.err = 0;
+    if (fairseq2_cancelled(model)) {
+        result.stats.cancelled = true;
+        return;
+    }
+    // Beam search decoding
+    const Hypothesis* hypo = unity_decode(model, opts, tgt_lang_idx, encoder_output, n_threads);
+    eval_speech_hypothesis(model, hypo, encoder_output, opts, fwd_alloc, result, n_threads);
+}
 
-extern "C" Result unity_eval_text(fairseq2_model& model, const std::string& text, SequenceGeneratorOptions opts, std::string tgt_lang, int n_threads) {
+//  struct as return - transcription, CE score, LID 
+extern "C" Result unity_eval_speech(fairseq2_model& model, std::vector<float>& data, SequenceGeneratorOptions opts, std::string tgt_lang, int n_threads, const CancellationToken* cancel) {
+    std::int64_t t_start_us = ggml_time_us();
     Result result;
+    if (cancel != nullptr && cancel->is_cancelled()) {
+        // Dropped before allocating anything, eg after waiting too long in a queue.
+        result.err = 0;
+        result.stats.cancelled = true;
+        unity_metrics_record("s2tt", result.stats);
+        return result;
+    }
+    int tgt_lang_idx = speech_tgt_lang_idx(model, tgt_lang);
+    if (tgt_lang_idx < 0) {
+        std::cerr << "Unknown language " << tgt_lang << "\n";
+        result.err = 1;
+        unity_metrics_record_error("s2tt");
+        return result;
+    }
     // The ctx_size_mb mostly depends of input length and model dim.
     int ctx_size_mb = opts.mem_mb;
-    auto encoder_buf = std::vector<uint8_t>(ctx_size_mb * 1024 * 1024);
-    auto encoder_fwd_buf = std::vector<uint8_t>(ctx_size_mb * 1024 * 1024);
+    // Reserved but not zeroed: zeroing the arena took longer than short requests.
+    std::vector<uint8_t> encoder_buf;
+    encoder_buf.reserve(8 * 1024 * 1024);  // this is only for tensor metadata, it can be small
+    std::vector<uint8_t> encoder_fwd_buf;
+    encoder_fwd_buf.reserve(ctx_size_mb * 1024 * 1024);
     ggml_allocr* fwd_alloc = ggml_allocr_new(encoder_fwd_buf.data(), encoder_fwd_buf.capacity(), 8);
-    int tgt_lang_idx = 0;
-    if (model.hparams["multilingual"] != 0) {
-        auto tgt_lang_ptr = model.vocab.token_to_id.find("__" + tgt_lang + "__"); 
-        if (tgt_lang_ptr == model.vocab.token_to_id.end()) {
+    model.stats = &result.stats;
+    model.cancel = cancel;
+
+    // Reset the ggml_context
+    model.ctx = ctx_from_buffer(encoder_buf);
+    ggml_set_no_alloc(model.ctx, true);
+
+    // Audio encoder
+    // encoder_output is valid until we call `ggml_allocr_free(fwd_alloc)`
+    ggml_tensor* encoder_output = eval_speech_encoder(model, data, fwd_alloc, result.stats, n_threads);
+    if (encoder_output != nullptr) {
+        eval_speech_decoder(model, encoder_output, opts, tgt_lang_idx, fwd_alloc, result, n_threads);
+    } else {
+        result.err = 0;
+    }
+
+    ggml_free(model.ctx);
+    ggml_allocr_free(fwd_alloc);
+    fairseq2_profiler_flush(model);
+    model.stats = nullptr;
+    model.cancel = nullptr;
+    result.stats.total_us = ggml_time_us() - t_start_us;
+    unity_metrics_record("s2tt", result.stats);
+    return result;
+}
+
+std::vector<Result> unity_eval_speech_multi(
+    fairseq2_model& model,
+    std::vector<float>& data,
+    SequenceGeneratorOptions opts,
+    const std::vector<std::string>& tgt_langs,
+    int n_threads,
+    const CancellationToken* cancel
+) {
+    std::int64_t t_start_us = ggml_time_us();
+    std::vector<Result> results(tgt_langs.size());
+    // Encoder and beam search stats, shared by the results
+    RequestStats stats;
+    for (Result& result : results) result.err = 0;
+    if (tgt_langs.empty()) return results;
+    if (cancel != nullptr && cancel->is_cancelled()) {
+        stats.cancelled = true;
+        for (Result& result : results) result.stats = stats;
+        unity_metrics_record("s2tt", stats);
+        return results;
+    }
+    std::vector<int> tgt_lang_idx;
+    for (const std::string& tgt_lang : tgt_langs) {
+        tgt_lang_idx.push_back(speech_tgt_lang_idx(model, tgt_lang));
+        if (tgt_lang_idx.back() < 0) {
             std::cerr << "Unknown language " << tgt_lang << "\n";
-            result.err = 1;
-            return result;
+            for (Result& result : results) result.err = 1;
+            unity_metrics_record_error("s2tt");
+            return results;
         }
-        tgt_lang_idx = tgt_lang_ptr->second;
     }
-
-    // tokenize the input text
+    // Same buffers as unity_eval_speech, the beam searches size their own from opts.mem_mb.
+    int ctx_size_mb = opts.mem_mb;
+    std::vector<uint8_t> encoder_buf;
+    encoder_buf.reserve(8 * 1024 * 1024);
+    std::vector<uint8_t> encoder_fwd_buf;
+    encoder_fwd_buf.reserve(ctx_size_mb * 1024 * 1024);
+    ggml_allocr* fwd_alloc = ggml_allocr_new(encoder_fwd_buf.data(), encoder_fwd_buf.capacity(), 8);
+    model.stats = &stats;
+    model.cancel = cancel;
     model.ctx = ctx_from_buffer(encoder_buf);
-    ggml_set_no_alloc(model.ctx, false);
-    ggml_tensor* tokens_tensor = ggml_new_tensor_1d(model.ctx, GGML_TYPE_I32, 64);
     ggml_set_no_alloc(model.ctx, true);
-    fairseq2_spm_tokenize(&model, text.c_str(), tokens_tensor);
-    
-    // Text encoder
-    ggml_cgraph* gf = unity_text_encoder(model, tokens_tensor);
-    ggml_allocr_alloc_graph(fwd_alloc, gf);
-    ggml_graph_compute_with_ctx(model.ctx, gf, n_threads);
-    ggml_tensor* encoder_output = gf->nodes[gf->n_nodes - 1];
-    
+
+    ggml_tensor* encoder_output = eval_speech_encoder(model, data, fwd_alloc, stats, n_threads);
+    if (encoder_output != nullptr && !fairseq2_cancelled(model)) {
+        Hypothesis** hypos = unity_decode_multi(model, opts, tgt_lang_idx, encoder_output, n_threads);
+        for (std::size_t i = 0; i < results.size(); ++i) {
+            results[i].stats = stats;
+            model.stats = &results[i].stats;
+            eval_speech_hypothesis(model, hypos[i], encoder_output, opts, fwd_alloc, results[i], n_threads);
+        }
+    } else {
+        stats.cancelled = true;
+        for (Result& result : results) result.stats = stats;
+    }
+
+    ggml_free(model.ctx);
+    ggml_allocr_free(fwd_alloc);
+    fairseq2_profiler_flush(model);
+    model.stats = nullptr;
+    model.cancel = nullptr;
+    for (Result& result : results) result.stats.total_us = ggml_time_us() - t_start_us;
+    // one request, the time of the languages after the first one is in their own stats
+    unity_metrics_record("s2tt", results[0].stats);
+    return results;
+}
+
+LidResult unity_identify_language(
+    fairseq2_model& model,
+    std::vector<float>& data,
+    int mem_mb,
+    float max_audio_s,
+    int n_threads,
+    const CancellationToken* cancel
+) {
+    std::int64_t t_start_us = ggml_time_us();
+    LidResult result;
+    result.err = 0;
+    std::vector<int> lang_ids = lang_token_ids(model);
+    if (lang_ids.empty()) {
+        std::cerr << "The model has no language tokens\n";
+        result.err = 1;
+        unity_metrics_record_error("lid");
+        return result;
+    }
+    if (cancel != nullptr && cancel->is_cancelled()) {
+        result.stats.cancelled = true;
+        unity_metrics_record("lid", result.stats);
+        return result;
+    }
+    // The encoder reads the samples in place, a truncated input is copied.
+    std::vector<float> audio_head;
+    std::vector<float>* audio = &data;
+    if (max_audio_s > 0 && (std::size_t)(max_audio_s * 16000) < data.size()) {
+        audio_head.assign(data.begin(), data.begin() + (std::size_t)(max_audio_s * 16000));
+        audio = &audio_head;
+    }
+    std::vector<uint8_t> ctx_buf;
+    ctx_buf.reserve(8 * 1024 * 1024);  // this is only for tensor metadata, it can be small
+    std::vector<uint8_t> fwd_buf;
+    fwd_buf.reserve(mem_mb * 1024 * 1024);
+    ggml_allocr* fwd_alloc = ggml_allocr_new(fwd_buf.data(), fwd_buf.capacity(), 8);
+    model.stats = &result.stats;
+    model.cancel = cancel;
+    model.ctx = ctx_from_buffer(ctx_buf);
+    ggml_set_no_alloc(model.ctx, true);
+
+    ggml_tensor* encoder_output = eval_speech_encoder(model, *audio, fwd_alloc, result.stats, n_threads);
+    if (encoder_output != nullptr) {
+        // First step of the beam search with an unknown tgt_lang, without KV cache: the
+        // language tokens are scored after the [eos] prefix.
+        std::int64_t t_bootstrap_us = ggml_time_us();
+        // the encoder graph isn't computed again, its intermediate results are already freed
+        encoder_output = ggml_detach(encoder_output);
+        FORCE_ALLOC(prefix_seq, model.ctx, ggml_new_tensor_1d(model.ctx, GGML_TYPE_I32, 1));
+        ggml_set_i32_1d(prefix_seq, 0, model.vocab.token_to_id["</s>"]);
+        ggml_tensor* seqs = TransformerEmbeddingFrontend_forward(model, "text_decoder_frontend", prefix_seq);
+        seqs = StandardTransformerDecoder_forward(model, "text_decoder", seqs, nullptr, encoder_output, nullptr);
+        ggml_tensor* probs = ggml_soft_max(model.ctx, Linear_forward(model, "final_proj", seqs));
+        ggml_cgraph* gf = ggml_new_graph(model.ctx);
+        ggml_build_forward_expand(gf, probs);
+        fairseq2_graph_fuse(model, gf);
+        result.stats.peak_arena_bytes = std::max(result.stats.peak_arena_bytes, ggml_allocr_alloc_graph(fwd_alloc, gf));
+        fairseq2_graph_compute(model, model.ctx, gf, n_threads);
+        result.stats.bootstrap_us = ggml_time_us() - t_bootstrap_us;
+
+        if (fairseq2_cancelled(model)) {
+            result.stats.cancelled = true;
+        } else {
+            float best_prob = -1.0f;
+            for (int lang_id : lang_ids) {
+                const std::string& token = model.vocab.id_to_token[lang_id].text;
+                float prob = ggml_get_f32_1d(probs, lang_id);
+                result.lid_scores[token] = prob;
+                if (prob > best_prob) {
+                    best_prob = prob;
+                    result.language = token.substr(2, token.size() - 4);
+                }
+            }
+        }
+    }
+
+    ggml_free(model.ctx);
+    ggml_allocr_free(fwd_alloc);
+    fairseq2_profiler_flush(model);
+    model.stats = nullptr;
+    model.cancel = nullptr;
+    result.stats.total_us = ggml_time_us() - t_start_us;
+    unity_metrics_record("lid", result.stats);
+    return result;
+}
+
+/// Beam search and detokenization of unity_eval_text.
+static void eval_text_decoder(
+    fairseq2_model& model,
+    ggml_tensor* encoder_output,
+    const SequenceGeneratorOptions& opts,
+    int tgt_lang_idx,
+    Result& result,
+    int n_threads
+) {
     // Beam search decoding
     const Hypothesis* hypo = unity_decode(model, opts, tgt_lang_idx, encoder_output, n_threads);
     
     // Drop language and bos token for multilingual, or only bos token for the bilingual model
+    std::int64_t t_detokenize_us = ggml_time_us();
     int token_offset = (model.hparams["multilingual"] != 0) ? 2 : 1;
     ggml_tensor* tgt_tokens = ggml_slice(model.ctx, hypo[0].seq, 0, token_offset, 0);
 
@@ -192,8 +578,273 @@ extern "C" Result unity_eval_text(fairseq2_model& model, const std::string& text
     }
     result.transcription = result_tokens;
     result.word_confidence_scores = word_scores;
+    result.stats.detokenize_us = ggml_time_us() - t_detokenize_us;
+}
+
+extern "C" Result unity_eval_text(fairseq2_model& model, const std::string& text, SequenceGeneratorOptions opts, std::string tgt_lang, int n_threads, const CancellationToken* cancel) {
+    std::int64_t t_start_us = ggml_time_us();
+    Result result;
+    if (cancel != nullptr && cancel->is_cancelled()) {
+        // Dropped before allocating anything, eg after waiting too long in a queue.
+        result.err = 0;
+        result.stats.cancelled = true;
+        unity_metrics_record("t2tt", result.stats);
+        return result;
+    }
+    int tgt_lang_idx = 0;
+    if (model.hparams["multilingual"] != 0) {
+        auto tgt_lang_ptr = model.vocab.token_to_id.find("__" + tgt_lang + "__"); 
+        if (tgt_lang_ptr == model.vocab.token_to_id.end()) {
+            std::cerr << "Unknown language " << tgt_lang << "\n";
+            result.err = 1;
+            unity_metrics_record_error("t2tt");
+            return result;
+        }
+        tgt_lang_idx = tgt_lang_ptr->second;
+    }
+    // The ctx_size_mb mostly depends of input length and model dim.
+    int ctx_size_mb = opts.mem_mb;
+    std::vector<uint8_t> encoder_buf;
+    encoder_buf.reserve(8 * 1024 * 1024);  // tensor metadata and the input tokens
+    std::vector<uint8_t> encoder_fwd_buf;
+    encoder_fwd_buf.reserve(ctx_size_mb * 1024 * 1024);
+    ggml_allocr* fwd_alloc = ggml_allocr_new(encoder_fwd_buf.data(), encoder_fwd_buf.capacity(), 8);
+    model.stats = &result.stats;
+    model.cancel = cancel;
+
+    // tokenize the input text
+    std::int64_t t_encoder_us = ggml_time_us();
+    model.ctx = ctx_from_buffer(encoder_buf);
+    ggml_set_no_alloc(model.ctx, false);
+    // at most one token per byte, plus the leading space and EOS
+    ggml_tensor* tokens_tensor = ggml_new_tensor_1d(model.ctx, GGML_TYPE_I32, text.size() + 2);
+    ggml_set_no_alloc(model.ctx, true);
+    fairseq2_spm_tokenize(&model, text.c_str(), tokens_tensor);
+    
+    // Text encoder
+    ggml_cgraph* gf = unity_text_encoder(model, tokens_tensor);
+    fairseq2_graph_fuse(model, gf);
+    result.stats.peak_arena_bytes = ggml_allocr_alloc_graph(fwd_alloc, gf);
+    fairseq2_graph_compute(model, model.ctx, gf, n_threads);
+    result.stats.encoder_us = ggml_time_us() - t_encoder_us;
+    ggml_tensor* encoder_output = gf->nodes[gf->n_nodes - 1];
+    if (fairseq2_cancelled(model)) {
+        // the encoder output is incomplete
+        result.stats.cancelled = true;
+    } else {
+        eval_text_decoder(model, encoder_output, opts, tgt_lang_idx, result, n_threads);
+    }
     result.err = 0;
     ggml_free(model.ctx);
-    ggml_allocr_reset(fwd_alloc);
+    ggml_allocr_free(fwd_alloc);
+    fairseq2_profiler_flush(model);
+    model.stats = nullptr;
+    model.cancel = nullptr;
+    result.stats.total_us = ggml_time_us() - t_start_us;
+    unity_metrics_record("t2tt", result.stats);
     return result;
 }
+
+
+namespace {
+
+/// Queue between the pipeline stages, `push` blocks while `capacity` items are waiting.
+template <typename T>
+class BlockingQueue {
+public:
+    /// 0 for an unbounded queue
+    explicit BlockingQueue(std::size_t capacity) : capacity(capacity) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [&]() { return capacity == 0 || items.size() < capacity; });
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+    }
+
+    /// False once the queue is closed and all items have been popped.
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [&]() { return closed || !items.empty(); });
+        if (items.empty()) return false;
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+private:
+    std::size_t capacity;
+    std::deque<T> items;
+    bool closed = false;
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+};
+
+/// The ggml threads of a graph computation are created by the calling thread, and inherit its affinity.
+void pin_current_thread(const std::vector<int>& cpus) {
+#if defined(__linux__)
+    if (cpus.empty()) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) CPU_SET(cpu, &set);
+    int rv = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rv) std::cerr << "warning: pthread_setaffinity_np() failed: " << strerror(rv) << "\n";
+#endif
+}
+
+struct PipelineRequest {
+    std::vector<float> data;
+    int tgt_lang_idx = 0;
+    const CancellationToken* cancel = nullptr;
+    std::int64_t t_start_us = 0;
+    Result result;
+    std::promise<Result> promise;
+    // Copied out of the encoder arena, so that the encoder can move on to the next request.
+    std::vector<float> encoder_output;
+    int encoder_output_dims = 0;
+    std::int64_t encoder_output_ne[GGML_MAX_DIMS] = {};
+};
+
+} // namespace
+
+struct UnityPipeline::Impl {
+    fairseq2_model& model;
+    SequenceGeneratorOptions opts;
+    PipelineOptions pipeline_opts;
+    // The stages compute concurrently, each needs its own ctx, KV cache and stats.
+    fairseq2_model encoder_model;
+    fairseq2_model decoder_model;
+    BlockingQueue<std::unique_ptr<PipelineRequest>> requests;
+    BlockingQueue<std::unique_ptr<PipelineRequest>> encoded;
+    std::thread encoder;
+    std::thread decoder;
+
+    Impl(fairseq2_model& model, SequenceGeneratorOptions opts, PipelineOptions pipeline_opts) :
+        model(model),
+        opts(opts),
+        pipeline_opts(pipeline_opts),
+        encoder_model(model),
+        decoder_model(model),
+        requests(0),
+        encoded(std::max(1, pipeline_opts.queue_size))
+    {
+        // the profiler isn't thread safe, only the decoder records into it
+        encoder_model.profiler = nullptr;
+        encoder = std::thread(&Impl::run_encoder, this);
+        decoder = std::thread(&Impl::run_decoder, this);
+    }
+
+    void run_encoder() {
+        pin_current_thread(pipeline_opts.encoder_cpus);
+        std::vector<uint8_t> ctx_buf;
+        ctx_buf.reserve(8 * 1024 * 1024);  // this is only for tensor metadata, it can be small
+        std::vector<uint8_t> fwd_buf;
+        fwd_buf.reserve(opts.mem_mb * 1024 * 1024);
+        ggml_allocr* fwd_alloc = ggml_allocr_new(fwd_buf.data(), fwd_buf.capacity(), 8);
+        std::unique_ptr<PipelineRequest> request;
+        while (requests.pop(request)) {
+            try {
+                encoder_model.stats = &request->result.stats;
+                encoder_model.cancel = request->cancel;
+                encoder_model.ctx = ctx_from_buffer(ctx_buf);
+                ggml_set_no_alloc(encoder_model.ctx, true);
+                ggml_tensor* encoder_output = eval_speech_encoder(encoder_model, request->data, fwd_alloc, request->result.stats, pipeline_opts.encoder_threads);
+                // cancelled requests are passed on without output, the decoder completes them in order
+                if (encoder_output != nullptr) {
+                    const float* encoder_output_data = ggml_get_data_f32(encoder_output);
+                    request->encoder_output.assign(encoder_output_data, encoder_output_data + ggml_nelements(encoder_output));
+                    request->encoder_output_dims = encoder_output->n_dims;
+                    std::copy(encoder_output->ne, encoder_output->ne + GGML_MAX_DIMS, request->encoder_output_ne);
+                }
+            } catch (...) {
+                request->promise.set_exception(std::current_exception());
+                request = nullptr;
+            }
+            ggml_free(encoder_model.ctx);
+            encoder_model.ctx = nullptr;
+            encoder_model.stats = nullptr;
+            encoder_model.cancel = nullptr;
+            ggml_allocr_reset(fwd_alloc);
+            if (request) encoded.push(std::move(request));
+        }
+        ggml_allocr_free(fwd_alloc);
+        encoded.close();
+    }
+
+    void run_decoder() {
+        pin_current_thread(pipeline_opts.decoder_cpus);
+        std::vector<uint8_t> ctx_buf;
+        ctx_buf.reserve(8 * 1024 * 1024);
+        std::vector<uint8_t> fwd_buf;
+        fwd_buf.reserve(opts.mem_mb * 1024 * 1024);
+        ggml_allocr* fwd_alloc = ggml_allocr_new(fwd_buf.data(), fwd_buf.capacity(), 8);
+        std::unique_ptr<PipelineRequest> request;
+        while (encoded.pop(request)) {
+            Result& result = request->result;
+            try {
+                decoder_model.stats = &result.stats;
+                decoder_model.cancel = request->cancel;
+                decoder_model.ctx = ctx_from_buffer(ctx_buf);
+                ggml_set_no_alloc(decoder_model.ctx, true);
+                if (result.stats.cancelled) {
+                    result.err = 0;
+                } else {
+                    ggml_tensor* encoder_output = ggml_new_tensor(decoder_model.ctx, GGML_TYPE_F32, request->encoder_output_dims, request->encoder_output_ne);
+                    encoder_output->data = request->encoder_output.data();
+                    eval_speech_decoder(decoder_model, encoder_output, opts, request->tgt_lang_idx, fwd_alloc, result, pipeline_opts.decoder_threads);
+                }
+            } catch (...) {
+                request->promise.set_exception(std::current_exception());
+                request = nullptr;
+            }
+            ggml_free(decoder_model.ctx);
+            decoder_model.ctx = nullptr;
+            decoder_model.stats = nullptr;
+            decoder_model.cancel = nullptr;
+            ggml_allocr_reset(fwd_alloc);
+            fairseq2_profiler_flush(decoder_model);
+            if (!request) continue;
+            // includes the time spent waiting between the stages
+            result.stats.total_us = ggml_time_us() - request->t_start_us;
+            unity_metrics_record("s2tt", result.stats);
+            request->promise.set_value(std::move(result));
+        }
+        ggml_allocr_free(fwd_alloc);
+    }
+};
+
+UnityPipeline::UnityPipeline(fairseq2_model& model, SequenceGeneratorOptions opts, PipelineOptions pipeline_opts) :
+    impl(new Impl(model, opts, pipeline_opts))
+{}
+
+UnityPipeline::~UnityPipeline() {
+    impl->requests.close();
+    impl->encoder.join();
+    impl->decoder.join();
+}
+
+std::future<Result> UnityPipeline::submit(std::vector<float> data, std::string tgt_lang, const CancellationToken* cancel) {
+    auto request = std::unique_ptr<PipelineRequest>(new PipelineRequest());
+    request->t_start_us = ggml_time_us();
+    request->cancel = cancel;
+    std::future<Result> future = request->promise.get_future();
+    request->tgt_lang_idx = speech_tgt_lang_idx(impl->model, tgt_lang);
+    if (request->tgt_lang_idx < 0) {
+        std::cerr << "Unknown language " << tgt_lang << "\n";
+        request->result.err = 1;
+        unity_metrics_record_error("s2tt");
+        request->promise.set_value(std::move(request->result));
+        return future;
+    }
+    request->data = std::move(data);
+    impl->requests.push(std::move(request));
+    return future;
+}
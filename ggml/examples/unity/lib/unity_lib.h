@@ -16,12 +16,18 @@
 #include <vector>
 #include <iostream>
 #include <cstdlib>
+#include <future>
+#include <memory>
 
 struct Result {
     std::vector<std::string> transcription;
     std::vector<float> word_confidence_scores;
     std::unordered_map<std::string, float> lid_scores;
+    // Speech units, only predicted by models with a non-autoregressive T2U model
+    std::vector<int> units;
     int err;
+    // Where the time of the request went, also aggregated in metrics.h
+    RequestStats stats;
 };
 
 struct ggml_cgraph * unity_speech_encoder(
@@ -42,14 +48,100 @@ Hypothesis* unity_decode(
     int n_threads
 );
 
+/// Beam searches into each language of `tgt_lang_idx`, computed together, see generate_sequences.
+/// Returns the hypotheses of each language, in order.
+Hypothesis** unity_decode_multi(
+    fairseq2_model& model,
+    const SequenceGeneratorOptions& opts,
+    const std::vector<int>& tgt_lang_idx,
+    ggml_tensor* encoder_output,
+    int n_threads
+);
+
+std::vector<int> unity_text_to_units(
+    fairseq2_model& model,
+    const SequenceGeneratorOptions& opts,
+    ggml_tensor* text_seq,
+    ggml_tensor* encoder_output,
+    ggml_allocr* fwd_alloc,
+    int n_threads
+);
+
+/// Discrete units of `data`, like the Python UnitExtractor: the output of the conformer layer
+/// `out_layer_idx` of the speech encoder, quantized by the `kmeans` model.
+std::vector<int> unity_extract_units(
+    fairseq2_model& model,
+    fairseq2_model& kmeans,
+    std::vector<float>& data,
+    int out_layer_idx,
+    int mem_mb,
+    int n_threads
+);
+
+/// Spoken language of an audio, see unity_identify_language.
+struct LidResult {
+    /// Most likely language, eg "eng", empty if the request was cancelled.
+    std::string language;
+    /// Probability of each language token, eg "__eng__", as in Result::lid_scores.
+    std::unordered_map<std::string, float> lid_scores;
+    int err;
+    RequestStats stats;
+};
+
+/// Identifies the language of `data` from the language token the text decoder predicts after
+/// the [eos] prefix, as the beam search does for tgt_lang "unk". Only the speech encoder and
+/// one decoder step run. With `max_audio_s` > 0 only the start of the audio is encoded, which
+/// is usually enough to route a request, at a fraction of the cost of translating it.
+LidResult unity_identify_language(
+    fairseq2_model& model,
+    std::vector<float>& data,
+    int mem_mb,
+    float max_audio_s,
+    int n_threads,
+    const CancellationToken* cancel = nullptr
+);
+
 extern "C" fairseq2_model unity_init_model(const char* model_path);
 
+/// Where the weights live on multi-socket hosts, see ggml_numa_init.
+enum class NumaMode {
+    none,       // placed by the OS, usually on the node of the loading thread
+    interleave, // pages spread over all nodes
+    replicate,  // one copy per node
+};
+
+NumaMode parse_numa_mode(const std::string& name);
+
+/// "f32", "f16" or "q8_0", see fairseq2_model::kv_cache_type.
+ggml_type parse_kv_cache_type(const std::string& name);
+
+/// Loads the model once, or once per NUMA node with NumaMode::replicate. Replica `n` has its
+/// weights on node `n` and computes its graphs on the CPUs of that node, so requests should
+/// be routed to the replica of the node their thread runs on. Empty if loading failed.
+std::vector<fairseq2_model> unity_load_numa_models(const char* model_path, NumaMode mode);
+
+/// `cancel` stops the request early, when set. The result then has `stats.cancelled` set,
+/// and the best partial hypothesis as transcription, without units.
 extern "C" Result unity_eval_speech(
     fairseq2_model& model, 
     std::vector<float>& data, 
     SequenceGeneratorOptions opts, 
     std::string tgt_lang, 
-    int n_threads
+    int n_threads,
+    const CancellationToken* cancel = nullptr
+);
+
+/// Translates `data` into each of `tgt_langs`, eg to caption a talk in several languages.
+/// The speech encoder runs once, and the beam searches of all the languages are decoded
+/// together. The results are in the order of `tgt_langs` and the same as with unity_eval_speech.
+/// Their stats share the encoder and beam search timings.
+std::vector<Result> unity_eval_speech_multi(
+    fairseq2_model& model,
+    std::vector<float>& data,
+    SequenceGeneratorOptions opts,
+    const std::vector<std::string>& tgt_langs,
+    int n_threads,
+    const CancellationToken* cancel = nullptr
 );
 
 extern "C" Result unity_eval_text(
@@ -57,5 +149,35 @@ extern "C" Result unity_eval_text(
     const std::string& text, 
     SequenceGeneratorOptions opts, 
     std::string tgt_lang, 
-    int n_threads
+    int n_threads,
+    const CancellationToken* cancel = nullptr
 );
+
+struct PipelineOptions {
+    int encoder_threads = 4;
+    int decoder_threads = 2;
+    // Cores the threads of each stage run on, empty to leave it to the OS.
+    std::vector<int> encoder_cpus;
+    std::vector<int> decoder_cpus;
+    // Encoder outputs waiting for the decoder, further requests wait before the encoder.
+    int queue_size = 2;
+};
+
+/// Speech-to-text translation with the speech encoder and the beam search decoder on two
+/// stages, each with its own threads, so that the encoder of a request overlaps the decoding
+/// of the previous one. The encoder scales with cores while the decoder doesn't, this gives
+/// each the cores it can use. Results are the same as unity_eval_speech.
+class UnityPipeline {
+public:
+    UnityPipeline(fairseq2_model& model, SequenceGeneratorOptions opts, PipelineOptions pipeline_opts);
+    /// Waits for the submitted requests to complete.
+    ~UnityPipeline();
+
+    /// Queues a request, the future is ready once it is decoded. Requests complete in order.
+    /// `cancel`, if set, must outlive the request. Requests cancelled while queued are not run.
+    std::future<Result> submit(std::vector<float> data, std::string tgt_lang, const CancellationToken* cancel = nullptr);
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+};
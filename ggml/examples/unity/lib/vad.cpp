@@ -0,0 +1,88 @@
+#include "vad.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include "ggml.h"
+
+std::vector<SpeechSegment> vad_segments(const float* samples, std::int64_t n_samples, const VadOptions& opts) {
+    const std::int64_t window = opts.window_samples;
+    const std::int64_t n_windows = (n_samples + window - 1) / window;
+    if (n_windows == 0) return {};
+
+    // Energy in dBFS and zero-crossing rate of each window, after removing its DC offset.
+    std::vector<float> energy_db(n_windows);
+    std::vector<float> zcr(n_windows);
+    for (std::int64_t w = 0; w < n_windows; ++w) {
+        const float* x = samples + w * window;
+        std::int64_t len = std::min(window, n_samples - w * window);
+        double mean = 0;
+        for (std::int64_t i = 0; i < len; ++i) mean += x[i];
+        mean /= len;
+        double power = 0;
+        std::int64_t crossings = 0;
+        for (std::int64_t i = 0; i < len; ++i) {
+            double y = x[i] - mean;
+            power += y * y;
+            if (i > 0 && (y >= 0) != (x[i - 1] - mean >= 0)) ++crossings;
+        }
+        energy_db[w] = 10.0f * std::log10(power / len + 1e-10);
+        zcr[w] = len > 1 ? (float)crossings / (len - 1) : 0.0f;
+    }
+
+    // The noise floor is a low percentile of the window energies, the input is expected to have some pauses.
+    std::vector<float> sorted_db = energy_db;
+    std::nth_element(sorted_db.begin(), sorted_db.begin() + n_windows / 10, sorted_db.end());
+    float noise_db = std::max(sorted_db[n_windows / 10], opts.min_db);
+    auto is_speech = [&](std::int64_t w) {
+        if (energy_db[w] < opts.min_db) return false;
+        if (energy_db[w] >= std::min(noise_db + opts.snr_db, opts.loud_db)) return true;
+        return energy_db[w] >= noise_db + opts.snr_db / 2 && zcr[w] >= opts.zcr_threshold;
+    };
+
+    // Hysteresis: speech runs are closed after `min_silence_ms` without speech, short runs are dropped.
+    auto ms_to_windows = [&](int ms) { return ((std::int64_t)ms * opts.sample_rate / 1000 + window - 1) / window; };
+    std::int64_t min_speech = ms_to_windows(opts.min_speech_ms);
+    std::int64_t min_silence = ms_to_windows(opts.min_silence_ms);
+    std::int64_t pad = (std::int64_t)opts.speech_pad_ms * opts.sample_rate / 1000;
+    std::vector<SpeechSegment> padded;
+    auto close_run = [&](std::int64_t start, std::int64_t end) {
+        if (end - start < min_speech) return;
+        std::int64_t start_sample = std::max<std::int64_t>(0, start * window - pad);
+        std::int64_t end_sample = std::min(n_samples, end * window + pad);
+        if (!padded.empty() && start_sample <= padded.back().end) {
+            padded.back().end = end_sample;
+        } else {
+            padded.push_back({start_sample, end_sample});
+        }
+    };
+    std::int64_t run_start = -1;
+    std::int64_t last_speech = -1;
+    for (std::int64_t w = 0; w < n_windows; ++w) {
+        if (is_speech(w)) {
+            if (run_start < 0) run_start = w;
+            last_speech = w;
+        } else if (run_start >= 0 && w - last_speech >= min_silence) {
+            close_run(run_start, last_speech + 1);
+            run_start = -1;
+        }
+    }
+    if (run_start >= 0) close_run(run_start, last_speech + 1);
+
+    // Long segments are split at the quietest window of their second half, so the encoder input stays bounded.
+    std::int64_t max_len = (std::int64_t)opts.max_segment_s * opts.sample_rate;
+    GGML_ASSERT(max_len >= 2 * window);
+    std::vector<SpeechSegment> segments;
+    for (SpeechSegment segment : padded) {
+        while (segment.end - segment.start > max_len) {
+            std::int64_t first = (segment.start + max_len / 2) / window;
+            std::int64_t last = (segment.start + max_len) / window;
+            std::int64_t cut = std::min_element(energy_db.begin() + first, energy_db.begin() + last) - energy_db.begin();
+            segments.push_back({segment.start, cut * window});
+            segment.start = cut * window;
+        }
+        segments.push_back(segment);
+    }
+    return segments;
+}
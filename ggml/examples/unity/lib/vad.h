@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+/// Energy and zero-crossing rate voice activity detector, see `vad_segments`.
+/// Defaults follow the Silero VAD agent of the streaming models: 32 ms windows and a 700 ms silence limit.
+struct VadOptions {
+    int sample_rate = 16000;
+    int window_samples = 512;
+    /// Windows louder than the noise floor by `snr_db`, or louder than `loud_db`, are speech (in dBFS).
+    float snr_db = 12.0f;
+    float loud_db = -30.0f;
+    /// Windows quieter than `min_db` are always silence, it's also the lowest noise floor.
+    float min_db = -60.0f;
+    /// Unvoiced speech: windows above the noise floor by `snr_db / 2` with this zero-crossing rate.
+    float zcr_threshold = 0.3f;
+    int min_speech_ms = 250;
+    int min_silence_ms = 700;
+    int speech_pad_ms = 100;
+    /// Longer segments are split at their quietest window.
+    int max_segment_s = 30;
+};
+
+/// Speech region of a waveform, in samples.
+struct SpeechSegment {
+    std::int64_t start;
+    std::int64_t end;
+};
+
+/// Speech segments of a mono waveform, sorted and without overlap, to only encode the speech regions.
+std::vector<SpeechSegment> vad_segments(const float* samples, std::int64_t n_samples, const VadOptions& opts);
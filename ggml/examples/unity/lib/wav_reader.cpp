@@ -0,0 +1,174 @@
+#include "wav_reader.h"
+#include "audio_resampler.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Internal to this file, so that it links with the examples compiling their own dr_wav.
+#define DRWAV_API static
+#define DRWAV_PRIVATE static
+#define DR_WAV_IMPLEMENTATION
+#include "dr_wav.h"
+
+/// Frames converted or decoded at once.
+static const std::int64_t WAV_CHUNK_FRAMES = 16384;
+
+/// 16-bit PCM to float, in [-1, 1) like libsndfile and dr_wav. The loop is vectorized.
+static void _s16_to_f32(const std::int16_t* src, float* dst, std::int64_t n) {
+    const float scale = 1.0f / 32768.0f;
+    for (std::int64_t i = 0; i < n; ++i) dst[i] = (float)src[i] * scale;
+}
+
+struct WavReader::Impl {
+    // The file, mapped or read in `buffer`.
+    const unsigned char* data = nullptr;
+    std::size_t size = 0;
+    bool mapped = false;
+    std::vector<unsigned char> buffer;
+
+    drwav wav;
+    bool wav_ok = false;
+    // Samples of 16-bit PCM files, read from the mapping instead of through dr_wav.
+    const std::int16_t* pcm16 = nullptr;
+    std::int64_t frame = 0;
+
+    std::unique_ptr<AudioResampler> resampler;
+    std::vector<float> chunk;
+
+    bool open(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED) {
+                madvise(addr, st.st_size, MADV_SEQUENTIAL);
+                data = (const unsigned char*)addr;
+                size = st.st_size;
+                mapped = true;
+            }
+        }
+        if (!mapped) {
+            unsigned char block[65536];
+            for (ssize_t n; (n = ::read(fd, block, sizeof(block))) > 0;) buffer.insert(buffer.end(), block, block + n);
+            data = buffer.data();
+            size = buffer.size();
+        }
+        close(fd);
+        return size > 0;
+    }
+
+    ~Impl() {
+        if (wav_ok) drwav_uninit(&wav);
+        if (mapped) munmap((void*)data, size);
+    }
+
+    /// Next `n` frames of the file as float, in `chunk`, interleaved. Returns the frames read.
+    std::int64_t read_chunk(std::int64_t n) {
+        n = std::min<std::int64_t>(n, wav.totalPCMFrameCount - frame);
+        if (n <= 0) return 0;
+        chunk.resize(n * wav.channels);
+        if (pcm16 != nullptr) {
+            _s16_to_f32(pcm16 + frame * wav.channels, chunk.data(), n * wav.channels);
+        } else {
+            n = (std::int64_t)drwav_read_pcm_frames_f32(&wav, n, chunk.data());
+        }
+        frame += n;
+        return n;
+    }
+};
+
+WavReader::WavReader(const std::string& path) : impl(new Impl) {
+    if (!impl->open(path)) return;
+    // dr_wav reads the memory in place, only the headers are copied.
+    impl->wav_ok = drwav_init_memory(&impl->wav, impl->data, impl->size, nullptr);
+    if (!impl->wav_ok) return;
+    const drwav& wav = impl->wav;
+    if (wav.channels == 0 || wav.sampleRate == 0) {
+        drwav_uninit(&impl->wav);
+        impl->wav_ok = false;
+        return;
+    }
+    std::size_t data_end = wav.dataChunkDataPos + wav.totalPCMFrameCount * wav.channels * sizeof(std::int16_t);
+    if (wav.translatedFormatTag == DR_WAVE_FORMAT_PCM && wav.bitsPerSample == 16
+        && wav.dataChunkDataPos % alignof(std::int16_t) == 0 && data_end <= impl->size) {
+        impl->pcm16 = (const std::int16_t*)(impl->data + wav.dataChunkDataPos);
+    }
+    if (wav.sampleRate != 16000 || wav.channels != 1) {
+        impl->resampler.reset(new AudioResampler(wav.sampleRate, 16000, wav.channels));
+    }
+}
+
+WavReader::~WavReader() = default;
+
+bool WavReader::ok() const { return impl->wav_ok; }
+int WavReader::sample_rate() const { return impl->wav.sampleRate; }
+int WavReader::channels() const { return impl->wav.channels; }
+std::int64_t WavReader::n_frames() const { return impl->wav.totalPCMFrameCount; }
+
+std::int64_t WavReader::read(std::int64_t max_frames, std::vector<float>& out) {
+    if (!impl->wav_ok) return 0;
+    std::int64_t n_read = 0;
+    if (impl->resampler == nullptr) {
+        // Already 16kHz mono: converted or decoded into `out` directly.
+        max_frames = std::min<std::int64_t>(max_frames, impl->wav.totalPCMFrameCount - impl->frame);
+        if (max_frames <= 0) return 0;
+        std::size_t offset = out.size();
+        out.resize(offset + max_frames);
+        if (impl->pcm16 != nullptr) {
+            _s16_to_f32(impl->pcm16 + impl->frame, out.data() + offset, max_frames);
+            n_read = max_frames;
+        } else {
+            n_read = (std::int64_t)drwav_read_pcm_frames_f32(&impl->wav, max_frames, out.data() + offset);
+            out.resize(offset + n_read);
+        }
+        impl->frame += n_read;
+        return n_read;
+    }
+    while (n_read < max_frames) {
+        std::int64_t n = impl->read_chunk(std::min(WAV_CHUNK_FRAMES, max_frames - n_read));
+        if (n == 0) break;
+        impl->resampler->process(impl->chunk.data(), n, out);
+        n_read += n;
+    }
+    return n_read;
+}
+
+void WavReader::flush(std::vector<float>& out) {
+    if (impl->resampler != nullptr) impl->resampler->flush(out);
+}
+
+bool read_wav(const std::string& path, int max_s, std::vector<float>& data) {
+    WavReader reader(path);
+    if (!reader.ok()) return false;
+    std::int64_t n_frames = reader.n_frames();
+    if (max_s > 0) n_frames = std::min<std::int64_t>((std::int64_t)reader.sample_rate() * max_s, n_frames);
+    data.clear();
+    data.reserve((std::size_t)(n_frames * 16000 / reader.sample_rate() + 1));
+    reader.read(n_frames, data);
+    reader.flush(data);
+    return true;
+}
+
+bool write_wav(const std::string& path, const std::vector<float>& samples, int sample_rate, int channels) {
+    drwav_data_format format;
+    format.container = drwav_container_riff;
+    format.format = DR_WAVE_FORMAT_PCM;
+    format.channels = channels;
+    format.sampleRate = sample_rate;
+    format.bitsPerSample = 16;
+    drwav wav;
+    if (!drwav_init_file_write(&wav, path.c_str(), &format, nullptr)) return false;
+    std::vector<std::int16_t> pcm(samples.size());
+    for (std::size_t i = 0; i < samples.size(); ++i) {
+        pcm[i] = (std::int16_t)std::lrint(std::min(1.0f, std::max(-1.0f, samples[i])) * 32767.0f);
+    }
+    drwav_uint64 n_frames = pcm.size() / channels;
+    bool ok = drwav_write_pcm_frames(&wav, n_frames, pcm.data()) == n_frames;
+    return drwav_uninit(&wav) == DRWAV_SUCCESS && ok;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/// WAV file read as 16kHz mono, without libsndfile. The file is mapped in memory and parsed by
+/// dr_wav, and its samples are converted chunk by chunk straight into the output: 16-bit PCM
+/// is converted in place of the mapping, other encodings are decoded by dr_wav. Other rates and
+/// channel counts go through an AudioResampler. Pipes, which can't be mapped, are read whole.
+class WavReader {
+public:
+    explicit WavReader(const std::string& path);
+    ~WavReader();
+
+    /// Whether the file could be opened and is a WAV file dr_wav can decode.
+    bool ok() const;
+    int sample_rate() const;
+    int channels() const;
+    /// Frames in the file, at its sample rate.
+    std::int64_t n_frames() const;
+
+    /// Appends to `out` the next `max_frames` frames of the file, as 16kHz mono. Returns the
+    /// number of frames of the file read, 0 at the end.
+    std::int64_t read(std::int64_t max_frames, std::vector<float>& out);
+    /// Appends the last samples, which the resampler delays until the end of the input is known.
+    void flush(std::vector<float>& out);
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+/// Reads the first `max_s` seconds of a WAV file (all of it if `max_s` <= 0) as 16kHz mono.
+/// False if it isn't a WAV file.
+bool read_wav(const std::string& path, int max_s, std::vector<float>& data);
+
+/// Writes interleaved `samples` as a 16-bit PCM WAV file.
+bool write_wav(const std::string& path, const std::vector<float>& samples, int sample_rate = 16000, int channels = 1);
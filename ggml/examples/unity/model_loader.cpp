@@ -1,4 +1,5 @@
 #include "model_loader.h"
+#include "profiler.h"
 #include <string>
 
 #define DEBUG_MODEL_LOAD 0
@@ -47,17 +48,41 @@ model_loader::load_model_weights(fairseq2_model &model, std::ifstream &fin)
     // Note this require changing the on disk format
     bool as_float32 = true;
     struct ggml_init_params params = {
-        /*.mem_size   =*/ static_cast<size_t>(f32_tensor_size + (num_tensor + 1) * (int64_t)ggml_tensor_overhead()),
+        // Each tensor data is padded to GGML_MEM_ALIGN, which matters for models with many small tensors.
+        /*.mem_size   =*/ static_cast<size_t>(f32_tensor_size + (num_tensor + 1) * (int64_t)(ggml_tensor_overhead() + GGML_MEM_ALIGN))
+            + fairseq2_position_encodings_size(model),
         /*.mem_buffer =*/ NULL,
         /*.no_alloc   =*/ false,
     };
     model.tensors_ctx = ggml_init(params);
+    if (model.numa_node >= 0 || model.numa_interleave) {
+        // before the weights are first touched by the reads below
+        ggml_numa_set_memory_node(ggml_get_mem_buffer(model.tensors_ctx), ggml_get_mem_size(model.tensors_ctx), model.numa_node);
+    }
 
     size_t model_size = 0;
+    int num_aliases = 0;
     for (int i = 0; i < num_tensor; ++i) {
         std::string name = get_name(fin);
         if (name.length() == 0)
             break;
+        std::streampos tensor_start = fin.tellg();
+        std::int32_t n_dims = 0;
+        fin.read(reinterpret_cast<char *>(&n_dims), sizeof(n_dims));
+        if (n_dims == TENSOR_ALIAS_N_DIMS) {
+            // Tied weights, eg final_proj and the decoder embeddings: one buffer for both names.
+            std::string target = get_name(fin);
+            auto aliased = model.tensors.find(target);
+            if (aliased == model.tensors.end() || aliased->second == nullptr) {
+                printf("Error while reading tensor %s: alias of unknown tensor %s\n", name.c_str(), target.c_str());
+                throw std::invalid_argument("Error while reading tensor from file.");
+            }
+            register_prefix(model, name);
+            model.tensors[name] = aliased->second;
+            num_aliases += 1;
+            continue;
+        }
+        fin.seekg(tensor_start);
         auto tensor = load_tensor_value(fin, model.tensors_ctx, as_float32);
         if (tensor == nullptr) {
             // Abort in case of error, the input stream is corrupted at this point.
@@ -73,12 +98,17 @@ model_loader::load_model_weights(fairseq2_model &model, std::ifstream &fin)
         model_size += ggml_nbytes(tensor);
     }
 
+    // after the weights: the tables stored by older converters are kept
+    fairseq2_position_encodings_init(model, model.tensors_ctx);
+    fairseq2_fbank_init(model);
+
     double mb = 1024.0 * 1024.0;
-    printf("%s: model size: %8.2f MB, memory used: %8.2f MB, memory reserved: %8.2f MB\n",
+    printf("%s: model size: %8.2f MB, memory used: %8.2f MB, memory reserved: %8.2f MB, tied tensors: %d\n",
         __func__,
         model_size / mb,
         ggml_used_mem(model.tensors_ctx) / mb,
-        ggml_get_mem_size(model.tensors_ctx) / mb
+        ggml_get_mem_size(model.tensors_ctx) / mb,
+        num_aliases
     );
 
     return ggml_get_mem_size(model.tensors_ctx);
@@ -225,5 +255,10 @@ extern "C" int load_fairseq2_ggml_file(fairseq2_model& model, const char* fname)
     
     // load optional target vocabulary in cases of bilingual models
     loader.load_vocab(model.tgt_vocab, fin);
+
+    // load optional character vocabulary of the NAR T2U model
+    loader.load_vocab(model.char_vocab, fin);
+
+    fairseq2_profiler_init_from_env(model);
     return 0;
 }
@@ -16,6 +16,10 @@
 #include "fairseq2.h"
 
 
+// `n_dims` of a tensor record that shares the data of a previous tensor, whose name follows.
+// Written by ggml_convert.py for tied parameters.
+constexpr std::int32_t TENSOR_ALIAS_N_DIMS = -1;
+
 class model_loader {
 public:
     std::int64_t load_model_weights(fairseq2_model &model, std::ifstream &fin);
@@ -0,0 +1,281 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+
+#include "profiler.h"
+
+
+std::string fairseq2_profiler::layer_of(const ggml_tensor* tensor) const {
+    auto addr = reinterpret_cast<std::uintptr_t>(tensor);
+    auto it = segments.upper_bound(addr);
+    if (it == segments.begin()) return "";
+    --it;
+    if (addr >= it->second.end) return "";
+    return it->second.prefix;
+}
+
+void fairseq2_profiler::reset() {
+    events.clear();
+    segments.clear();
+    t_origin_us = ggml_time_us();
+}
+
+fairseq2_profiler_scope::fairseq2_profiler_scope(fairseq2_model& model, const std::string& prefix) :
+    profiler(model.profiler), ctx(model.ctx), begin(0), order(0)
+{
+    if (profiler == nullptr || !profiler->enabled || ctx == nullptr) {
+        profiler = nullptr;
+        return;
+    }
+    begin = reinterpret_cast<std::uintptr_t>(ggml_get_mem_buffer(ctx)) + ggml_used_mem(ctx);
+    order = profiler->n_scopes++;
+    this->prefix = prefix;
+}
+
+fairseq2_profiler_scope::~fairseq2_profiler_scope() {
+    if (profiler == nullptr) return;
+    std::uintptr_t end = reinterpret_cast<std::uintptr_t>(ggml_get_mem_buffer(ctx)) + ggml_used_mem(ctx);
+    if (end <= begin) return;
+
+    auto& segments = profiler->segments;
+    // Segments opened after this scope are inner scopes and are kept.
+    // Older segments in the same range come from a previous use of the buffer.
+    std::uintptr_t cursor = begin;
+    auto it = segments.lower_bound(begin);
+    std::vector<std::pair<std::uintptr_t, std::uintptr_t>> gaps;
+    while (it != segments.end() && it->first < end) {
+        if (it->second.order < order) {
+            it = segments.erase(it);
+            continue;
+        }
+        if (it->first > cursor) gaps.emplace_back(cursor, it->first);
+        cursor = std::max(cursor, it->second.end);
+        ++it;
+    }
+    if (cursor < end) gaps.emplace_back(cursor, end);
+    for (auto& gap : gaps) {
+        segments[gap.first] = {gap.second, prefix, order};
+    }
+}
+
+fairseq2_profiler_region::fairseq2_profiler_region(fairseq2_model& model, const char* name) :
+    profiler(model.profiler), name(name), t_start_us(0)
+{
+    if (profiler == nullptr || !profiler->enabled) {
+        profiler = nullptr;
+        return;
+    }
+    t_start_us = ggml_time_us();
+}
+
+fairseq2_profiler_region::~fairseq2_profiler_region() {
+    if (profiler == nullptr) return;
+    profiler->events.push_back({name, "", "", /*host*/true, t_start_us, ggml_time_us(), 0, 0});
+}
+
+extern "C" void fairseq2_profiler_enable(fairseq2_model* model, bool enabled) {
+    if (model->profiler == nullptr) {
+        if (!enabled) return;
+        model->profiler = new fairseq2_profiler;
+    }
+    model->profiler->enabled = enabled;
+    model->profiler->reset();
+}
+
+extern "C" void fairseq2_profiler_reset(fairseq2_model* model) {
+    if (model->profiler) model->profiler->reset();
+}
+
+void fairseq2_profiler_init_from_env(fairseq2_model& model) {
+    const char* enabled = std::getenv("UNITY_PROFILE");
+    if (enabled == nullptr || enabled[0] == '\0' || std::strcmp(enabled, "0") == 0) return;
+
+    fairseq2_profiler_enable(&model, true);
+    const char* trace_path = std::getenv("UNITY_PROFILE_TRACE");
+    if (trace_path != nullptr) model.profiler->trace_path = trace_path;
+}
+
+static bool is_noop(const ggml_tensor* node) {
+    switch (node->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_VIEW:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/// Same as ggml_op_desc, but also handles the unary ops which don't have a name in ggml.c.
+static const char* op_desc(const ggml_tensor* node) {
+    if (node->op == GGML_OP_UNARY) {
+        ggml_unary_op uop = ggml_get_unary_op(node);
+        if (uop == GGML_UNARY_OP_GLU) return "GLU";
+        if (uop >= GGML_UNARY_OP_COUNT) return "UNARY";
+    }
+    const char* desc = ggml_op_desc(node);
+    return desc ? desc : "UNKNOWN";
+}
+
+std::int64_t fairseq2_node_flops(const ggml_tensor* node) {
+    const ggml_tensor* src0 = node->src[0];
+    switch (node->op) {
+        case GGML_OP_MUL_MAT:
+        case GGML_OP_OUT_PROD:
+            // each output is a dot product of length ne00
+            return 2 * ggml_nelements(node) * src0->ne[0];
+        case GGML_OP_CONV_1D:
+        case GGML_OP_CONV_TRANSPOSE_1D:
+            // (K, Cin, Cout) kernel
+            return 2 * ggml_nelements(node) * src0->ne[0] * src0->ne[1];
+        case GGML_OP_SOFT_MAX:
+        case GGML_OP_NORM:
+        case GGML_OP_BATCH_NORM:
+            // a few passes over the data
+            return 5 * ggml_nelements(node);
+        default:
+            return is_noop(node) ? 0 : ggml_nelements(node);
+    }
+}
+
+std::int64_t fairseq2_node_bytes(const ggml_tensor* node) {
+    if (is_noop(node)) return 0;
+    std::int64_t bytes = ggml_nbytes(node);
+    for (int i = 0; i < GGML_MAX_SRC; ++i) {
+        if (node->src[i] != nullptr) bytes += ggml_nbytes(node->src[i]);
+    }
+    return bytes;
+}
+
+extern "C" void fairseq2_profiler_record_node(ggml_tensor* node, std::int64_t t_start_us, std::int64_t t_end_us, void* data) {
+    auto* profiler = (fairseq2_profiler*)data;
+    if (is_noop(node)) return;
+    profiler->events.push_back({
+        op_desc(node),
+        profiler->layer_of(node),
+        node->name,
+        /*host*/false,
+        t_start_us,
+        t_end_us,
+        fairseq2_node_flops(node),
+        fairseq2_node_bytes(node),
+    });
+}
+
+static void write_json_string(FILE* out, const std::string& str) {
+    std::fputc('"', out);
+    for (char c : str) {
+        if (c == '"' || c == '\\') std::fputc('\\', out);
+        if ((unsigned char)c < 0x20) continue;
+        std::fputc(c, out);
+    }
+    std::fputc('"', out);
+}
+
+extern "C" bool fairseq2_profiler_dump_trace(fairseq2_model* model, const char* path) {
+    fairseq2_profiler* profiler = model->profiler;
+    if (profiler == nullptr) return false;
+    FILE* out = std::fopen(path, "w");
+    if (out == nullptr) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, path);
+        return false;
+    }
+
+    std::fprintf(out, "{\"traceEvents\": [\n");
+    bool first = true;
+    for (const auto& event : profiler->events) {
+        if (!first) std::fprintf(out, ",\n");
+        first = false;
+        std::fprintf(out, "{\"name\": ");
+        write_json_string(out, event.name);
+        std::fprintf(out, ", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": %d, \"ts\": %lld, \"dur\": %lld",
+            event.host ? "host" : "graph",
+            event.host ? 1 : 0,
+            (long long)(event.t_start_us - profiler->t_origin_us),
+            (long long)(event.t_end_us - event.t_start_us)
+        );
+        if (!event.host) {
+            std::fprintf(out, ", \"args\": {\"layer\": ");
+            write_json_string(out, event.layer);
+            std::fprintf(out, ", \"tensor\": ");
+            write_json_string(out, event.tensor);
+            std::fprintf(out, ", \"flops\": %lld, \"bytes\": %lld}", (long long)event.flops, (long long)event.bytes);
+        }
+        std::fprintf(out, "}");
+    }
+    std::fprintf(out, "\n]}\n");
+    std::fclose(out);
+    return true;
+}
+
+struct ProfileStats {
+    std::int64_t calls = 0;
+    std::int64_t time_us = 0;
+    std::int64_t flops = 0;
+    std::int64_t bytes = 0;
+};
+
+static void print_table(FILE* out, const char* title, const std::unordered_map<std::string, ProfileStats>& stats, std::int64_t total_us, std::size_t max_rows) {
+    std::vector<std::pair<std::string, ProfileStats>> rows(stats.begin(), stats.end());
+    std::sort(rows.begin(), rows.end(), [](const auto& a, const auto& b) { return a.second.time_us > b.second.time_us; });
+    if (rows.size() > max_rows) rows.resize(max_rows);
+
+    std::fprintf(out, "-- by %s --\n", title);
+    std::fprintf(out, "%-48s %8s %10s %6s %10s %10s %9s\n", title, "calls", "time(ms)", "%", "GFLOP", "MB", "GFLOP/s");
+    for (const auto& row : rows) {
+        const ProfileStats& s = row.second;
+        std::fprintf(out, "%-48s %8lld %10.3f %5.1f%% %10.3f %10.2f %9.2f\n",
+            row.first.empty() ? "(unscoped)" : row.first.c_str(),
+            (long long)s.calls,
+            s.time_us / 1000.0,
+            total_us > 0 ? 100.0 * s.time_us / total_us : 0.0,
+            s.flops / 1e9,
+            s.bytes / (1024.0 * 1024.0),
+            s.time_us > 0 ? s.flops / (s.time_us * 1e3) : 0.0
+        );
+    }
+}
+
+extern "C" void fairseq2_profiler_print_summary(fairseq2_model* model, FILE* out) {
+    fairseq2_profiler* profiler = model->profiler;
+    if (profiler == nullptr) return;
+
+    std::unordered_map<std::string, ProfileStats> by_op, by_module, by_layer, by_region;
+    std::int64_t graph_us = 0;
+    std::int64_t n_nodes = 0;
+    for (const auto& event : profiler->events) {
+        std::int64_t dur = event.t_end_us - event.t_start_us;
+        if (event.host) {
+            ProfileStats& s = by_region[event.name];
+            s.calls += 1;
+            s.time_us += dur;
+            continue;
+        }
+        graph_us += dur;
+        n_nodes += 1;
+        std::string module = event.layer.substr(0, event.layer.find('.'));
+        for (ProfileStats* s : {&by_op[event.name], &by_module[module], &by_layer[event.layer]}) {
+            s->calls += 1;
+            s->time_us += dur;
+            s->flops += event.flops;
+            s->bytes += event.bytes;
+        }
+    }
+
+    std::fprintf(out, "unity profile: %lld nodes, %.3f ms in graphs\n", (long long)n_nodes, graph_us / 1000.0);
+    print_table(out, "op", by_op, graph_us, 32);
+    print_table(out, "module", by_module, graph_us, 32);
+    print_table(out, "layer", by_layer, graph_us, 32);
+    if (!by_region.empty()) print_table(out, "host region", by_region, 0, 32);
+}
+
+void fairseq2_profiler_flush(fairseq2_model& model) {
+    fairseq2_profiler* profiler = model.profiler;
+    if (profiler == nullptr || !profiler->enabled) return;
+    if (!profiler->trace_path.empty()) fairseq2_profiler_dump_trace(&model, profiler->trace_path.c_str());
+    fairseq2_profiler_print_summary(&model, stderr);
+    profiler->reset();
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ggml.h"
+#include "fairseq2.h"
+
+/// Collects per-node timings of the graphs computed through `fairseq2_graph_compute`.
+///
+/// Each computed node is attributed to the innermost `*_forward` prefix that
+/// created it (e.g. `speech_encoder.inner.layers.7.conv`), so results can be
+/// aggregated by op type and by layer.
+/// Host-side work (fbank, beam search bookkeeping) is recorded with `fairseq2_profiler_region`.
+///
+/// Enable it with `fairseq2_profiler_enable`, or by setting the `UNITY_PROFILE`
+/// env var before loading the model. `UNITY_PROFILE_TRACE=trace.json` additionally
+/// dumps a Chrome trace (chrome://tracing, perfetto) after each request.
+struct fairseq2_profiler {
+    struct Event {
+        std::string name;  // op name, or region name for host events
+        std::string layer;  // layer prefix, empty if unknown
+        std::string tensor;  // tensor name
+        bool host;
+        std::int64_t t_start_us;
+        std::int64_t t_end_us;
+        std::int64_t flops;
+        std::int64_t bytes;
+    };
+
+    /// Range of ggml_context memory allocated while a layer prefix was being built.
+    struct Segment {
+        std::uintptr_t end;
+        std::string prefix;
+        std::uint64_t order;
+    };
+
+    bool enabled = false;
+    std::string trace_path;
+
+    std::int64_t t_origin_us = 0;
+    std::vector<Event> events;
+
+    std::map<std::uintptr_t, Segment> segments;
+    std::uint64_t n_scopes = 0;
+
+    /// Returns the innermost layer prefix which created the given tensor.
+    std::string layer_of(const ggml_tensor* tensor) const;
+
+    void reset();
+};
+
+/// Attributes all tensors created in `model.ctx` during its lifetime to `prefix`.
+/// Inner scopes take precedence over outer ones.
+struct fairseq2_profiler_scope {
+    fairseq2_profiler_scope(fairseq2_model& model, const std::string& prefix);
+    ~fairseq2_profiler_scope();
+
+    fairseq2_profiler* profiler;
+    ggml_context* ctx;
+    std::uintptr_t begin;
+    std::uint64_t order;
+    std::string prefix;
+};
+
+#define FAIRSEQ2_PROFILE_SCOPE(model, prefix) \
+    fairseq2_profiler_scope profile_scope_(model, prefix);
+
+/// Records the time spent on the host between construction and destruction.
+struct fairseq2_profiler_region {
+    fairseq2_profiler_region(fairseq2_model& model, const char* name);
+    ~fairseq2_profiler_region();
+
+    fairseq2_profiler* profiler;
+    const char* name;
+    std::int64_t t_start_us;
+};
+
+extern "C" void fairseq2_profiler_enable(fairseq2_model* model, bool enabled);
+extern "C" void fairseq2_profiler_reset(fairseq2_model* model);
+/// Enables the profiler if `UNITY_PROFILE` is set.
+void fairseq2_profiler_init_from_env(fairseq2_model& model);
+
+/// Writes all events recorded since the last reset in Chrome trace format.
+extern "C" bool fairseq2_profiler_dump_trace(fairseq2_model* model, const char* path);
+/// Prints time / FLOPs / bytes aggregated by op type, by module and by layer.
+extern "C" void fairseq2_profiler_print_summary(fairseq2_model* model, FILE* out);
+/// Writes the trace (if `UNITY_PROFILE_TRACE` is set) and summary of the last request, then resets.
+void fairseq2_profiler_flush(fairseq2_model& model);
+
+/// `ggml_cplan.node_callback` recording computed nodes into the given profiler.
+extern "C" void fairseq2_profiler_record_node(ggml_tensor* node, std::int64_t t_start_us, std::int64_t t_end_us, void* profiler);
+
+/// Estimated number of floating point operations of a node.
+std::int64_t fairseq2_node_flops(const ggml_tensor* node);
+/// Estimated number of bytes read and written by a node.
+std::int64_t fairseq2_node_bytes(const ggml_tensor* node);
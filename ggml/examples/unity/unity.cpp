@@ -4,12 +4,19 @@
 #include "math.h"
 #include "model_loader.h"
 #include "fairseq2.h"
+#include "lib/audio_resampler.h"
+#include "lib/encoder_cache.h"
 #include "lib/unity_lib.h"
+#include "lib/vad.h"
+#include "lib/wav_reader.h"
+#ifdef UNITY_SNDFILE
 #include <sndfile.h>
+#endif
 #include <cstdlib>
 #include "ggml-alloc.h"
 #include <numeric>
 #include <algorithm>
+#include <mutex>
 
 struct unity_params {
     int32_t n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
@@ -28,6 +35,18 @@ struct unity_params {
     };
     int32_t max_audio_s = 30;
     bool verbose = false;
+    std::string vocoder; // vocoder path, speech output is disabled without it
+    std::string speech_output = "speech_output.wav";
+    bool vad = false;
+    std::string kmeans; // k-means quantizer path, extracts units instead of translating
+    int32_t unit_layer = -1; // -1 for the last conformer layer
+    int32_t lid_audio_s = -1; // language identification only, from the first N seconds, 0 for all
+    NumaMode numa = NumaMode::none;
+    int32_t timeout_ms = 0; // deadline of each translation, 0 for none
+    int32_t spin_count = INT_MIN; // INT_MIN for the ggml default
+    int32_t encoder_cache_mb = 0; // encoder outputs of the audio files already translated, 0 for none
+    std::string encoder_cache_dir; // where the evicted encoder outputs are spilled
+    ggml_type kv_cache_type = GGML_TYPE_F32;
 };
 
 
@@ -44,6 +63,24 @@ void unity_print_usage(int /*argc*/, char ** argv, const unity_params & params)
     fprintf(stderr, "  --beam-size           beam size (default: %d)\n", params.opts.beam_size);
     fprintf(stderr, "  -M, --mem             memory buffer, increase for long inputs (default: %d)\n", params.opts.mem_mb);
     fprintf(stderr, " --max-audio max duration of audio in seconds (default: %d)\n", params.max_audio_s);
+    fprintf(stderr, "  --vad                 only translate the speech segments, long audio isn't truncated (default: off)\n");
+    fprintf(stderr, "  --kmeans FNAME        extract the discrete units of the audio files read from stdin, one per line (default: off)\n");
+    fprintf(stderr, "  --unit-layer N        conformer layer quantized by --kmeans (default: last)\n");
+    fprintf(stderr, "  --lid N               print the language of the audio files read from stdin, one per line, identified\n");
+    fprintf(stderr, "                        from their first N seconds, 0 for the whole file (default: off)\n");
+    fprintf(stderr, "  --numa MODE           on multi-socket hosts, interleave the weights over the NUMA nodes, or replicate them\n");
+    fprintf(stderr, "                        on each node with --kmeans files processed by one thread pool per node (default: none)\n");
+    fprintf(stderr, "  --timeout-ms N        stop each translation after N ms and print the best partial one (default: none)\n");
+    fprintf(stderr, "  --spin-count N        iterations the threads spin between graph nodes before sleeping, -1 to never sleep,\n");
+    fprintf(stderr, "                        lower it when other processes share the cores (default: %d)\n", GGML_DEFAULT_SPIN_COUNT);
+    fprintf(stderr, "  --encoder-cache-mb N  keep up to N MB of speech encoder outputs, to translate\n");
+    fprintf(stderr, "                        the same audio again without encoding it (default: off)\n");
+    fprintf(stderr, "  --encoder-cache-dir DIR\n");
+    fprintf(stderr, "                        directory where the encoder outputs evicted from memory are kept (default: none)\n");
+    fprintf(stderr, "  --kv-cache-type TYPE  storage of the decoder KV cache: f32, f16 or q8_0 (default: f32)\n");
+    fprintf(stderr, "  --vocoder FNAME       vocoder path, synthesizes the predicted speech units (default: off)\n");
+    fprintf(stderr, "  --speech-output FNAME\n");
+    fprintf(stderr, "                        wav file written by the vocoder (default: %s)\n", params.speech_output.c_str());
     fprintf(stderr, "\n");
 }
 
@@ -58,6 +95,16 @@ std::string get_next_arg(int& i, int argc, char** argv, const std::string& flag,
 }
 
 
+/// Words separated by spaces. Empty for requests cancelled before decoding.
+std::string join_words(const std::vector<std::string>& words) {
+    if (words.empty()) return "";
+    return std::accumulate(std::next(words.begin()), words.end(), words[0],
+        [](const std::string& a, const std::string& b) {
+            return a + " " + b;
+        }
+    );
+}
+
 bool unity_params_parse(int argc, char ** argv, unity_params & params) {
     for (int i = 1; i < argc; i++) {
         std::string arg = argv[i];
@@ -77,9 +124,62 @@ bool unity_params_parse(int argc, char ** argv, unity_params & params) {
             params.opts.mem_mb = std::stoi(get_next_arg(i, argc, argv, arg, params));
         } else if (arg == "--max-audio") {
             params.max_audio_s = std::stoi(get_next_arg(i, argc, argv, arg, params));
-        } 
+        } else if (arg == "--vad") {
+            params.vad = true;
+        } else if (arg == "--kmeans") {
+            params.kmeans = get_next_arg(i, argc, argv, arg, params);
+        } else if (arg == "--unit-layer") {
+            params.unit_layer = std::stoi(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--lid") {
+            params.lid_audio_s = std::stoi(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--numa") {
+            params.numa = parse_numa_mode(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--timeout-ms") {
+            params.timeout_ms = std::stoi(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--spin-count") {
+            params.spin_count = std::stoi(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--encoder-cache-mb") {
+            params.encoder_cache_mb = std::stoi(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--encoder-cache-dir") {
+            params.encoder_cache_dir = get_next_arg(i, argc, argv, arg, params);
+        } else if (arg == "--kv-cache-type") {
+            params.kv_cache_type = parse_kv_cache_type(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--vocoder") {
+            params.vocoder = get_next_arg(i, argc, argv, arg, params);
+        } else if (arg == "--speech-output") {
+            params.speech_output = get_next_arg(i, argc, argv, arg, params);
+        }
+    }
+    return true;
+}
+
+/// Reads the first `max_s` seconds of an audio file (all of it if `max_s` <= 0) as 16kHz mono.
+/// WAV files are read with read_wav, the other formats need libsndfile. Other rates and
+/// channel counts are resampled and downmixed while reading, block by block.
+bool read_audio(const std::string& path, int max_s, std::vector<float>& data) {
+    if (read_wav(path, max_s, data)) return true;
+#ifdef UNITY_SNDFILE
+    SF_INFO info = {};
+    SNDFILE* sndfile = sf_open(path.c_str(), SFM_READ, &info);
+    if (!sndfile) return false;
+    sf_count_t n_frames = info.frames;
+    if (max_s > 0) n_frames = std::min<sf_count_t>((sf_count_t)info.samplerate * max_s, n_frames);
+    AudioResampler resampler(info.samplerate, 16000, info.channels);
+    data.clear();
+    data.reserve((std::size_t)(n_frames * 16000 / info.samplerate + 1));
+    std::vector<float> block(16384 * info.channels);
+    for (sf_count_t n_read = 0; n_read < n_frames;) {
+        sf_count_t n = sf_readf_float(sndfile, block.data(), std::min<sf_count_t>(16384, n_frames - n_read));
+        if (n <= 0) break;
+        resampler.process(block.data(), n, data);
+        n_read += n;
     }
+    resampler.flush(data);
+    sf_close(sndfile);
     return true;
+#else
+    return false;
+#endif
 }
 
 int main(int argc, char ** argv) {
@@ -90,13 +190,125 @@ int main(int argc, char ** argv) {
         return 1;
     }
 
-    fairseq2_model model;
+    if (params.numa != NumaMode::none) {
+        ggml_numa_init();
+    }
 
-    // load the model
-    if (load_fairseq2_ggml_file(model, params.model.c_str())) {
+    // load the model, once per NUMA node with --numa replicate
+    std::vector<fairseq2_model> models = unity_load_numa_models(params.model.c_str(), params.numa);
+    if (models.empty()) {
         fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
         return 1;
     }
+    for (fairseq2_model& replica : models) {
+        replica.spin_count = params.spin_count;
+        replica.kv_cache_type = params.kv_cache_type;
+    }
+    // interactive requests are served by the first replica, from a thread on its node
+    fairseq2_model& model = models[0];
+    if (model.numa_node >= 0) {
+        ggml_numa_set_thread_node(model.numa_node);
+    }
+
+    std::unique_ptr<EncoderCache> encoder_cache;
+    if (params.encoder_cache_mb > 0) {
+        EncoderCacheOptions cache_opts;
+        cache_opts.max_bytes = (std::size_t)params.encoder_cache_mb * 1024 * 1024;
+        cache_opts.spill_dir = params.encoder_cache_dir;
+        encoder_cache.reset(new EncoderCache(cache_opts));
+        // the replicas hold copies of the same weights, hashed once
+        encoder_cache->attach(model);
+        for (fairseq2_model& replica : models) {
+            replica.encoder_fingerprint = model.encoder_fingerprint;
+            encoder_cache->attach(replica);
+        }
+    }
+
+    fairseq2_model vocoder;
+    vocoder.numa_node = model.numa_node;
+    vocoder.numa_interleave = model.numa_interleave;
+    vocoder.spin_count = params.spin_count;
+    if (!params.vocoder.empty() && load_fairseq2_ggml_file(vocoder, params.vocoder.c_str())) {
+        fprintf(stderr, "%s: failed to load vocoder from '%s'\n", __func__, params.vocoder.c_str());
+        return 1;
+    }
+
+    // Unit extraction: the units of each file are written as soon as it's processed,
+    // so arbitrarily large corpora can be piped through.
+    // With --numa replicate, each replica pulls files from stdin on its own node.
+    if (!params.kmeans.empty()) {
+        std::vector<fairseq2_model> kmeans = unity_load_numa_models(params.kmeans.c_str(), params.numa);
+        if (kmeans.empty()) {
+            fprintf(stderr, "%s: failed to load k-means quantizer from '%s'\n", __func__, params.kmeans.c_str());
+            return 1;
+        }
+        for (fairseq2_model& replica : kmeans) {
+            replica.spin_count = params.spin_count;
+        }
+        if (params.unit_layer >= 0 && !has_layer(model, "speech_encoder.inner.layers." + std::to_string(params.unit_layer))) {
+            fprintf(stderr, "%s: the speech encoder has no layer %d\n", __func__, params.unit_layer);
+            return 1;
+        }
+        std::mutex io_mutex;
+        auto extract_units = [&](std::size_t replica) {
+            if (models[replica].numa_node >= 0) {
+                ggml_numa_set_thread_node(models[replica].numa_node);
+            }
+            std::string audio_path;
+            while (true) {
+                {
+                    std::lock_guard<std::mutex> lock(io_mutex);
+                    if (!std::getline(std::cin, audio_path)) break;
+                }
+                if (audio_path.empty()) continue;
+                std::vector<float> data;
+                if (!read_audio(audio_path, 0, data)) {
+                    std::lock_guard<std::mutex> lock(io_mutex);
+                    std::cerr << "Could not open " << audio_path << "\n";
+                    continue;
+                }
+                std::vector<int> units = unity_extract_units(models[replica], kmeans[replica], data, params.unit_layer, params.opts.mem_mb, params.n_threads);
+                std::lock_guard<std::mutex> lock(io_mutex);
+                std::cout << audio_path << "\t";
+                for (std::size_t i = 0; i < units.size(); ++i) std::cout << (i ? " " : "") << units[i];
+                std::cout << std::endl;
+            }
+        };
+        std::vector<std::thread> workers;
+        for (std::size_t replica = 1; replica < models.size(); ++replica) {
+            workers.emplace_back(extract_units, replica);
+        }
+        extract_units(0);
+        for (auto& worker : workers) worker.join();
+        for (auto& replica : kmeans) fairseq2_model_free(&replica);
+        return 0;
+    }
+
+    // Language identification: the language of each file is written as soon as it's
+    // identified, without translating it, eg to route the requests to per-language models.
+    if (params.lid_audio_s >= 0) {
+        std::string audio_path;
+        while (std::getline(std::cin, audio_path)) {
+            if (audio_path.empty()) continue;
+            // Only the identified part of the audio is read.
+            std::vector<float> data;
+            if (!read_audio(audio_path, params.lid_audio_s, data)) {
+                std::cerr << "Could not open " << audio_path << "\n";
+                continue;
+            }
+            CancellationToken cancel;
+            if (params.timeout_ms > 0) cancel.set_timeout_us(params.timeout_ms * 1000LL);
+            LidResult lid = unity_identify_language(model, data, params.opts.mem_mb, 0, params.n_threads, &cancel);
+            if (lid.err) continue;
+            if (lid.stats.cancelled) std::cerr << "Timed out after " << params.timeout_ms << " ms\n";
+            std::cout << audio_path << "\t" << lid.language;
+            if (params.verbose) {
+                for (const auto& score : lid.lid_scores) std::cout << "\t" << score.first << " " << score.second;
+            }
+            std::cout << std::endl;
+        }
+        return 0;
+    }
 
     // The ctx_size_mb mostly depends of input length and model dim.
     int ctx_size_mb = params.opts.mem_mb;
@@ -107,7 +319,7 @@ int main(int argc, char ** argv) {
         // S2ST
         if (!params.text) {
             std::string input;
-            std::cout << "\nEnter audio_path and tgt_lang, separated by space (or 'exit' to quit):\n";
+            std::cout << "\nEnter audio_path and tgt_lang (or several, comma separated), separated by space (or 'exit' to quit):\n";
             std::getline(std::cin, input);
             if (input == "exit") {
                 break;
@@ -120,39 +332,90 @@ int main(int argc, char ** argv) {
                 audio_path = "/proc/self/fd/0";
             }
             std::cerr << "Translating (Transcribing) " << audio_path << " to " << tgt_lang << "\n";
-            SF_INFO info;
-            SNDFILE* sndfile = sf_open(audio_path.c_str(), SFM_READ, &info);
-            if (!sndfile) {
+            std::vector<std::string> tgt_langs;
+            std::istringstream langs_ss(tgt_lang);
+            for (std::string lang; std::getline(langs_ss, lang, ',');) tgt_langs.push_back(lang);
+            // Load audio input, as 16kHz mono.
+            // Without VAD, truncate audio input. This will prevent most obvious OOM.
+            // With VAD, the speech segments are translated one by one, and are at most max_audio_s long.
+            std::vector<float> data;
+            if (!read_audio(audio_path, params.vad ? 0 : params.max_audio_s, data)) {
                 std::cerr << "Could not open file\n";
                 continue;
             }
-            // Load audio input
-            GGML_ASSERT(info.samplerate == 16000);
-            GGML_ASSERT(info.channels == 1);
-            // Truncate audio input. Ideally we should chunk it, but this will prevent most obvious OOM.
-            int n_frames = std::min(info.samplerate * params.max_audio_s, (int)info.frames);
-            std::vector<float> data(n_frames * info.channels);
-            sf_readf_float(sndfile, data.data(), n_frames);
-            Result result = unity_eval_speech(model, data, params.opts, tgt_lang, params.n_threads);
-            std::string concat_transcription = std::accumulate(std::next(result.transcription.begin()), result.transcription.end(), result.transcription[0],
-                [](const std::string& a, const std::string& b) {
-                    return a + " " + b;
+            std::vector<SpeechSegment> segments = {{0, (std::int64_t)data.size()}};
+            if (params.vad) {
+                VadOptions vad_opts;
+                vad_opts.max_segment_s = params.max_audio_s;
+                segments = vad_segments(data.data(), data.size(), vad_opts);
+                if (segments.empty()) {
+                    std::cerr << "No speech detected\n";
+                    continue;
                 }
-            );
-            if (params.verbose) {
-                std::cout << "Final transcription: " << concat_transcription << std::endl;
-                std::cout << std::endl;
-                std::cout << "Word level confidence score:" << std::endl;
-                for (size_t i = 0; i < result.transcription.size(); ++i) {
-                    std::cout << "Word: " << result.transcription[i] << " | Score: " << result.word_confidence_scores[i] << std::endl;
+            }
+            std::vector<int> units;
+            for (const SpeechSegment& segment : segments) {
+                std::vector<float> segment_data(data.begin() + segment.start, data.begin() + segment.end);
+                CancellationToken cancel;
+                if (params.timeout_ms > 0) cancel.set_timeout_us(params.timeout_ms * 1000LL);
+                if (tgt_langs.size() > 1) {
+                    // The audio is encoded once for all the languages, text output only.
+                    std::vector<Result> results = unity_eval_speech_multi(model, segment_data, params.opts, tgt_langs, params.n_threads, &cancel);
+                    for (size_t i = 0; i < results.size(); ++i) {
+                        std::cout << tgt_langs[i] << ": " << join_words(results[i].transcription) << std::endl;
+                    }
+                    continue;
                 }
-                std::cout << std::endl;
-                std::cout << "LID scores: " << std::endl;
-                for (const auto& kv : result.lid_scores) {
-                    std::cout << "Language: " << kv.first << "| Score: " << kv.second << std::endl;
+                Result result = unity_eval_speech(model, segment_data, params.opts, tgt_lang, params.n_threads, &cancel);
+                if (result.stats.cancelled) std::cerr << "Timed out after " << params.timeout_ms << " ms\n";
+                if (params.vad) {
+                    std::cout << "[" << (float)segment.start / 16000 << "s - " << (float)segment.end / 16000 << "s] ";
                 }
-            } else {
-                std::cout << concat_transcription << std::endl;
+                std::string concat_transcription = join_words(result.transcription);
+                if (params.verbose) {
+                    std::cout << "Final transcription: " << concat_transcription << std::endl;
+                    std::cout << std::endl;
+                    std::cout << "Word level confidence score:" << std::endl;
+                    for (size_t i = 0; i < result.transcription.size(); ++i) {
+                        std::cout << "Word: " << result.transcription[i] << " | Score: " << result.word_confidence_scores[i] << std::endl;
+                    }
+                    std::cout << std::endl;
+                    std::cout << "LID scores: " << std::endl;
+                    for (const auto& kv : result.lid_scores) {
+                        std::cout << "Language: " << kv.first << "| Score: " << kv.second << std::endl;
+                    }
+                    std::cout << std::endl;
+                    if (!result.units.empty()) {
+                        std::cout << "Units:";
+                        for (int unit : result.units) std::cout << " " << unit;
+                        std::cout << std::endl << std::endl;
+                    }
+                    const RequestStats& stats = result.stats;
+                    std::cout << "Latency (ms): fbank " << stats.fbank_us / 1000.0
+                        << " | encoder " << stats.encoder_us / 1000.0
+                        << " | bootstrap " << stats.bootstrap_us / 1000.0
+                        << " | decode " << stats.decode_us() / 1000.0 << " (" << stats.n_steps << " steps)"
+                        << " | detokenize " << stats.detokenize_us / 1000.0
+                        << " | t2u " << stats.t2u_us / 1000.0
+                        << " | total " << stats.total_us / 1000.0 << std::endl;
+                } else {
+                    std::cout << concat_transcription << std::endl;
+                }
+                units.insert(units.end(), result.units.begin(), result.units.end());
+            }
+            if (!params.vocoder.empty() && !units.empty()) {
+                std::vector<float> waveform;
+                try {
+                    waveform = generate_waveform(vocoder, units, tgt_lang, -1, params.opts.mem_mb, params.n_threads);
+                } catch (const std::invalid_argument& e) {
+                    std::cerr << "Speech output skipped: " << e.what() << "\n";
+                    continue;
+                }
+                if (!write_wav(params.speech_output, waveform)) {
+                    std::cerr << "Could not write " << params.speech_output << "\n";
+                    continue;
+                }
+                std::cerr << "Speech output written to " << params.speech_output << "\n";
             }
         // T2TT
         } else {
@@ -171,12 +434,11 @@ int main(int argc, char ** argv) {
                 }
             }
             // tokenize the input text
-            Result result = unity_eval_text(model, input_text, params.opts, tgt_lang, params.n_threads);
-            std::string concat_translation = std::accumulate(std::next(result.transcription.begin()), result.transcription.end(), result.transcription[0],
-                [](const std::string& a, const std::string& b) {
-                    return a + " " + b;
-                }
-            );
+            CancellationToken cancel;
+            if (params.timeout_ms > 0) cancel.set_timeout_us(params.timeout_ms * 1000LL);
+            Result result = unity_eval_text(model, input_text, params.opts, tgt_lang, params.n_threads, &cancel);
+            if (result.stats.cancelled) std::cerr << "Timed out after " << params.timeout_ms << " ms\n";
+            std::string concat_translation = join_words(result.transcription);
             std::cout << "Translation: " << concat_translation << std::endl;
         }
     }
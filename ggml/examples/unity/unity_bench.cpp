@@ -0,0 +1,2542 @@
+#include "ggml/ggml.h"
+#include "ggml/ggml-alloc.h"
+
+#include "model_loader.h"
+#include "fairseq2.h"
+#include "lib/audio_resampler.h"
+#include "lib/encoder_cache.h"
+#include "lib/metrics.h"
+#include "lib/unity_lib.h"
+#include "lib/vad.h"
+#include "lib/wav_reader.h"
+#include "profiler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+/// Benchmarks S2TT and T2TT inference end-to-end, without needing a real checkpoint.
+///
+/// A model with random weights is generated in the same file format as `ggml_convert.py`,
+/// then loaded with `load_fairseq2_ggml_file`, so the loader and every `*_forward` function
+/// used by `unity_eval_speech` and `unity_eval_text` are exercised.
+/// The CodeHiFiGAN vocoder, the monotonic decoder and the unit extractor k-means are generated in their own files, next to the model.
+/// Each benchmark sweeps over audio length, text length, beam size and thread count,
+/// and writes one JSON object per configuration.
+
+struct synthetic_model_params {
+    std::int64_t model_dim = 1024;
+    std::int64_t ffn_dim = 4096;
+    // RelativePositionMHA_forward hardcodes 16 heads for the speech encoder.
+    std::int64_t num_heads = 16;
+    std::int64_t conformer_layers = 4;
+    std::int64_t adaptor_layers = 1;
+    std::int64_t text_encoder_layers = 4;
+    std::int64_t text_decoder_layers = 4;
+    std::int64_t vocab_size = 16000;
+    std::int64_t max_seq_len = 1024;
+    std::int64_t depthwise_kernel_size = 31;
+    // final_proj shares the weights of the text decoder embeddings, as in SeamlessM4T.
+    bool tied_embeddings = true;
+    // Non-autoregressive T2U model, 0 for a text only model.
+    std::int64_t t2u_layers = 0;
+    std::int64_t unit_vocab_size = 10000;
+    std::int64_t t2u_kernel_size = 9;
+    std::int64_t duration_kernel_size = 3;
+    // CodeHiFiGAN vocoder, written in its own file like the real one. 0 channels for none.
+    std::int64_t vocoder_channels = 512;
+    std::int64_t vocoder_embed_dim = 1280;
+    // Monotonic decoder of the streaming models, written in its own file like the real one.
+    std::int64_t monotonic_energy_layers = 4;
+    // K-means quantizer of the unit extractor, written in its own file. 0 clusters for none.
+    std::int64_t kmeans_clusters = 10000;
+    std::uint32_t seed = 42;
+};
+
+enum synthetic_init {
+    INIT_UNIFORM,
+    INIT_ZEROS,
+    INIT_ONES,
+};
+
+struct synthetic_tensor {
+    std::string name;
+    std::vector<std::int64_t> ne;  // ggml order, ie reversed torch shape
+    synthetic_init init;
+    std::string alias;  // tensor whose data it shares, written as an alias record
+};
+
+/// Description of a random UnitY model, with the same tensor names and shapes as
+/// the ones produced by `ggml_convert.py` for SeamlessM4T checkpoints.
+struct synthetic_model {
+    std::map<std::string, std::int64_t> hparams;
+    std::map<std::string, std::int64_t> layer_config;
+    std::vector<synthetic_tensor> tensors;
+    std::vector<std::string> vocab;
+    std::vector<std::string> char_vocab;
+
+    void add_tensor(const std::string& name, std::vector<std::int64_t> ne, synthetic_init init = INIT_UNIFORM) {
+        tensors.push_back({name, std::move(ne), init});
+    }
+
+    void add_alias(const std::string& name, const std::string& target) {
+        auto it = std::find_if(tensors.begin(), tensors.end(), [&](const synthetic_tensor& t) { return t.name == target; });
+        GGML_ASSERT(it != tensors.end());
+        tensors.push_back({name, it->ne, it->init, target});
+    }
+
+    void set_double(const std::string& name, double value) {
+        std::int64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        layer_config[name] = bits;
+    }
+
+    void add_linear(const std::string& prefix, std::int64_t d_in, std::int64_t d_out) {
+        add_tensor(prefix + ".weight", {d_in, d_out});
+        // ggml_convert.py reshapes biases to (1, D) for broadcasting.
+        add_tensor(prefix + ".bias", {d_out, 1});
+    }
+
+    void add_layer_norm(const std::string& prefix, std::int64_t dim) {
+        add_tensor(prefix + ".weight", {dim}, INIT_ONES);
+        add_tensor(prefix + ".bias", {dim, 1}, INIT_ZEROS);
+        set_double(prefix + ".eps", 1e-5);
+    }
+
+    void add_mha(const std::string& prefix, std::int64_t dim, std::int64_t num_heads) {
+        add_linear(prefix + ".q_proj", dim, dim);
+        add_linear(prefix + ".k_proj", dim, dim);
+        add_linear(prefix + ".v_proj", dim, dim);
+        add_linear(prefix + ".output_proj", dim, dim);
+        layer_config[prefix + ".num_heads"] = num_heads;
+    }
+
+    void add_ffn(const std::string& prefix, std::int64_t dim, std::int64_t ffn_dim) {
+        add_linear(prefix + ".inner_proj", dim, ffn_dim);
+        add_linear(prefix + ".output_proj", ffn_dim, dim);
+    }
+
+    /// SinusoidalPositionEncoder, generated by the loader like the ones converted by ggml_convert.py.
+    void add_sinusoidal(const std::string& prefix, std::int64_t dim, std::int64_t max_seq_len) {
+        layer_config[prefix + ".encoding_dim"] = dim;
+        layer_config[prefix + ".max_seq_len"] = max_seq_len;
+        layer_config[prefix + ".sin_offset"] = 1;
+    }
+
+    void add_conv1d(const std::string& prefix, std::int64_t kernel_size, std::int64_t c_in, std::int64_t c_out) {
+        add_tensor(prefix + ".weight", {kernel_size, c_in, c_out});
+        add_tensor(prefix + ".bias", {c_out, 1});
+    }
+};
+
+/// Special tokens, a few languages, one token per letter (with and without leading space)
+/// so that a string of N letters is tokenized into N tokens, and filler tokens.
+std::vector<std::string> synthetic_text_vocab(std::int64_t vocab_size) {
+    std::vector<std::string> vocab = {"<pad>", "<unk>", "<s>", "</s>", "__eng__", "__fra__", "__deu__", "__spa__", "__cmn__"};
+    for (char c = 'a'; c <= 'z'; ++c) {
+        vocab.push_back(std::string(" ") + c);
+        vocab.push_back(std::string(1, c));
+    }
+    GGML_ASSERT((std::int64_t)vocab.size() <= vocab_size);
+    for (std::int64_t i = vocab.size(); i < vocab_size; ++i) {
+        vocab.push_back(" w" + std::to_string(i));
+    }
+    return vocab;
+}
+
+synthetic_model synthetic_unity_model(const synthetic_model_params& p) {
+    GGML_ASSERT(p.model_dim % 16 == 0);
+    GGML_ASSERT(p.model_dim % p.num_heads == 0);
+    synthetic_model m;
+    std::int64_t D = p.model_dim;
+    std::int64_t F = p.ffn_dim;
+    std::int64_t V = p.vocab_size;
+
+    m.hparams["model_dim"] = D;
+    m.hparams["vocab_size"] = V;
+    m.hparams["multilingual"] = 1;
+
+    // Speech encoder: conformer layers + adaptor
+    m.add_layer_norm("speech_encoder_frontend.post_extract_layer_norm", 160);
+    m.add_linear("speech_encoder_frontend.model_dim_proj", 160, D);
+    // RelativePositionalEncoding, generated by the loader
+    m.layer_config["speech_encoder.pos_enc.encoding_dim"] = D;
+    m.layer_config["speech_encoder.pos_enc.max_seq_len"] = 4096;
+    for (int i = 0; i < p.conformer_layers; ++i) {
+        std::string layer = "speech_encoder.inner.layers." + std::to_string(i);
+        m.add_layer_norm(layer + ".ffn1_layer_norm", D);
+        m.add_ffn(layer + ".ffn1", D, F);
+        m.add_layer_norm(layer + ".self_attn_layer_norm", D);
+        m.add_linear(layer + ".self_attn.q_proj", D, D);
+        m.add_linear(layer + ".self_attn.k_proj", D, D);
+        m.add_linear(layer + ".self_attn.v_proj", D, D);
+        m.add_linear(layer + ".self_attn.output_proj", D, D);
+        m.add_tensor(layer + ".self_attn.sdpa.r_proj.weight", {D, D});
+        m.add_tensor(layer + ".self_attn.sdpa.u_bias", {D / 16, 16});
+        m.add_tensor(layer + ".self_attn.sdpa.v_bias", {D / 16, 16});
+        m.add_layer_norm(layer + ".conv_layer_norm", D);
+        m.add_tensor(layer + ".conv.pointwise_conv1.weight", {D, 2 * D});
+        m.add_tensor(layer + ".conv.depthwise_conv.weight", {p.depthwise_kernel_size, D});
+        m.add_tensor(layer + ".conv.batch_norm.weight", {D}, INIT_ONES);
+        m.add_tensor(layer + ".conv.batch_norm.bias", {D, 1}, INIT_ZEROS);
+        m.add_tensor(layer + ".conv.batch_norm.running_mean", {D}, INIT_ZEROS);
+        m.add_tensor(layer + ".conv.batch_norm.running_var", {D}, INIT_ONES);
+        m.add_tensor(layer + ".conv.pointwise_conv2.weight", {D, D});
+        m.add_layer_norm(layer + ".ffn2_layer_norm", D);
+        m.add_ffn(layer + ".ffn2", D, F);
+        m.add_layer_norm(layer + ".layer_norm", D);
+    }
+    m.add_layer_norm("speech_encoder.inner_layer_norm", D);
+    m.add_linear("speech_encoder.proj1", D, F);
+    m.add_linear("speech_encoder.proj2", F, D);
+    for (int i = 0; i < p.adaptor_layers; ++i) {
+        std::string layer = "speech_encoder.adaptor_layers." + std::to_string(i);
+        m.add_layer_norm(layer + ".residual_layer_norm", D);
+        // adaptor biases aren't reshaped by ggml_convert.py
+        m.add_tensor(layer + ".residual_conv.weight", {8, D, 2 * D});
+        m.add_tensor(layer + ".residual_conv.bias", {2 * D});
+        m.add_layer_norm(layer + ".self_attn_layer_norm", D);
+        m.add_tensor(layer + ".self_attn_conv.weight", {8, D, 2 * D});
+        m.add_tensor(layer + ".self_attn_conv.bias", {2 * D});
+        m.add_mha(layer + ".self_attn", D, p.num_heads);
+        m.add_layer_norm(layer + ".ffn_layer_norm", D);
+        m.add_ffn(layer + ".ffn", D, F);
+    }
+    m.add_layer_norm("speech_encoder.layer_norm", D);
+
+    // Text encoder
+    m.add_tensor("text_encoder_frontend.embed.weight", {D, V});
+    m.add_sinusoidal("text_encoder_frontend.pos_encoder", D, p.max_seq_len);
+    for (int i = 0; i < p.text_encoder_layers; ++i) {
+        std::string layer = "text_encoder.layers." + std::to_string(i);
+        m.layer_config[layer + ".norm_order"] = TRANSFORMER_NORM_ORDER_PRE;
+        m.add_layer_norm(layer + ".self_attn_layer_norm", D);
+        m.add_mha(layer + ".self_attn", D, p.num_heads);
+        m.add_layer_norm(layer + ".ffn_layer_norm", D);
+        m.add_ffn(layer + ".ffn", D, F);
+    }
+    m.add_layer_norm("text_encoder.layer_norm", D);
+
+    // Text decoder
+    m.add_tensor("text_decoder_frontend.embed.weight", {D, V});
+    m.add_sinusoidal("text_decoder_frontend.pos_encoder", D, p.max_seq_len);
+    for (int i = 0; i < p.text_decoder_layers; ++i) {
+        std::string layer = "text_decoder.layers." + std::to_string(i);
+        m.layer_config[layer + ".norm_order"] = TRANSFORMER_NORM_ORDER_PRE;
+        m.add_layer_norm(layer + ".self_attn_layer_norm", D);
+        m.add_mha(layer + ".self_attn", D, p.num_heads);
+        m.add_layer_norm(layer + ".encoder_decoder_attn_layer_norm", D);
+        m.add_mha(layer + ".encoder_decoder_attn", D, p.num_heads);
+        m.add_layer_norm(layer + ".ffn_layer_norm", D);
+        m.add_ffn(layer + ".ffn", D, F);
+    }
+    m.add_layer_norm("text_decoder.layer_norm", D);
+    if (p.tied_embeddings) {
+        // ggml_convert.py keeps tied embeddings unscaled
+        m.add_alias("final_proj.weight", "text_decoder_frontend.embed.weight");
+        m.set_double("text_decoder_frontend.embed_scale", std::sqrt((double)D));
+    } else {
+        m.add_tensor("final_proj.weight", {D, V});
+    }
+
+    // NAR T2U: characters, durations, then units.
+    m.char_vocab = {"<pad>", "<unk>", "<s>", "</s>", " "};
+    for (char c = 'a'; c <= 'z'; ++c) m.char_vocab.push_back(std::string(1, c));
+    for (char c = '0'; c <= '9'; ++c) m.char_vocab.push_back(std::string(1, c));
+    if (p.t2u_layers > 0) {
+        std::int64_t C = m.char_vocab.size();
+        // Tokens are at most 8 chars, and each char is upsampled to a few units.
+        std::int64_t max_char_len = 8 * p.max_seq_len;
+        std::int64_t max_unit_len = 4 * max_char_len;
+        for (int i = 0; i < p.t2u_layers; ++i) {
+            std::string layer = "t2u_model.encoder.layers." + std::to_string(i);
+            m.layer_config[layer + ".norm_order"] = TRANSFORMER_NORM_ORDER_PRE;
+            m.add_layer_norm(layer + ".self_attn_layer_norm", D);
+            m.add_mha(layer + ".self_attn", D, p.num_heads);
+            m.add_layer_norm(layer + ".ffn_layer_norm", D);
+            m.add_ffn(layer + ".ffn", D, F);
+        }
+        m.add_layer_norm("t2u_model.encoder.layer_norm", D);
+        std::string frontend = "t2u_model.decoder_frontend";
+        m.set_double(frontend + ".scale", std::sqrt((double)D));
+        m.add_tensor(frontend + ".embed_char.weight", {D, C});
+        m.add_sinusoidal(frontend + ".char_pos_encoder", D, max_char_len);
+        m.add_tensor(frontend + ".pos_emb_alpha_char", {1}, INIT_ONES);
+        m.add_sinusoidal(frontend + ".unit_pos_encoder", D, max_unit_len);
+        m.add_tensor(frontend + ".pos_emb_alpha", {1}, INIT_ONES);
+        std::string predictor = frontend + ".variance_adaptor.duration_predictor";
+        m.add_conv1d(predictor + ".conv1.0", p.duration_kernel_size, D, D);
+        m.add_layer_norm(predictor + ".ln1", D);
+        m.add_conv1d(predictor + ".conv2.0", p.duration_kernel_size, D, D);
+        m.add_layer_norm(predictor + ".ln2", D);
+        m.add_linear(predictor + ".proj", D, 1);
+        for (int i = 0; i < p.t2u_layers; ++i) {
+            std::string layer = "t2u_model.decoder.layers." + std::to_string(i);
+            m.add_mha(layer + ".self_attn", D, p.num_heads);
+            m.add_layer_norm(layer + ".self_attn_layer_norm", D);
+            m.add_conv1d(layer + ".conv1d.conv1", p.t2u_kernel_size, D, F);
+            m.add_conv1d(layer + ".conv1d.conv2", p.t2u_kernel_size, F, D);
+            m.add_layer_norm(layer + ".conv1d_layer_norm", D);
+        }
+        m.add_layer_norm("t2u_model.decoder.layer_norm", D);
+        m.add_tensor("t2u_model.final_proj.weight", {D, p.unit_vocab_size});
+    }
+
+    m.vocab = synthetic_text_vocab(V);
+    return m;
+}
+
+/// Description of a random monotonic decoder, with the architecture of seamless_streaming_monotonic_decoder
+/// and the text dims of the UnitY model, whose speech encoder it decodes.
+synthetic_model synthetic_monotonic_decoder_model(const synthetic_model_params& p) {
+    synthetic_model m;
+    std::int64_t D = p.model_dim;
+    std::int64_t V = p.vocab_size;
+    m.hparams["model_dim"] = D;
+    m.hparams["vocab_size"] = V;
+    m.add_tensor("text_decoder_frontend.embed.weight", {D, V});
+    m.add_sinusoidal("text_decoder_frontend.pos_encoder", D, p.max_seq_len);
+    for (int i = 0; i < p.text_decoder_layers; ++i) {
+        std::string layer = "text_decoder.layers." + std::to_string(i);
+        m.add_layer_norm(layer + ".self_attn_layer_norm", D);
+        m.add_mha(layer + ".self_attn", D, p.num_heads);
+        m.add_layer_norm(layer + ".encoder_decoder_attn_layer_norm", D);
+        m.add_mha(layer + ".encoder_decoder_attn", D, p.num_heads);
+        std::string p_choose = layer + ".p_choose_layer";
+        for (int j = 0; j < p.monotonic_energy_layers; ++j) {
+            m.add_linear(p_choose + ".q_energy_proj.layers." + std::to_string(2 * j), D, D);
+            m.add_linear(p_choose + ".k_energy_proj.layers." + std::to_string(2 * j), D, D);
+        }
+        m.add_tensor(p_choose + ".energy_bias", {1});
+        m.layer_config[p_choose + ".num_heads"] = p.num_heads;
+        m.layer_config[p_choose + ".keys_pooling.kernel_size"] = 2;
+        m.set_double(p_choose + ".monotonic_temperature", 0.2);
+        m.add_layer_norm(layer + ".ffn_layer_norm", D);
+        m.add_ffn(layer + ".ffn", D, p.ffn_dim);
+    }
+    m.add_layer_norm("text_decoder.layer_norm", D);
+    m.add_tensor("final_proj.weight", {D, V});
+    m.vocab = synthetic_text_vocab(V);
+    return m;
+}
+
+/// Languages of the synthetic models.
+static const std::vector<std::string> SYNTHETIC_LANGS = {"eng", "fra", "deu", "spa", "cmn"};
+
+/// Description of a random CodeHiFiGAN vocoder, with the base architecture of vocoder_36langs.
+synthetic_model synthetic_vocoder_model(const synthetic_model_params& p) {
+    synthetic_model m;
+    const std::string prefix = "code_generator";
+    const std::vector<std::int64_t> upsample_rates = {5, 4, 4, 2, 2};
+    const std::vector<std::int64_t> upsample_kernel_sizes = {11, 8, 8, 4, 4};
+    const std::vector<std::int64_t> resblock_kernel_sizes = {3, 7, 11};
+    const std::vector<std::int64_t> resblock_dilations = {1, 3, 5};
+    const std::int64_t E = p.vocoder_embed_dim;
+    const std::int64_t lang_dim = 256, spkr_dim = 256, num_spkrs = 2 * SYNTHETIC_LANGS.size();
+
+    m.add_tensor(prefix + ".dict.weight", {E, p.unit_vocab_size});
+    m.add_tensor(prefix + ".lang.weight", {lang_dim, (std::int64_t)SYNTHETIC_LANGS.size()});
+    m.add_tensor(prefix + ".spkr.weight", {spkr_dim, num_spkrs});
+    for (std::size_t i = 0; i < SYNTHETIC_LANGS.size(); ++i) {
+        m.layer_config["lang_spkr_idx_map.multilingual." + SYNTHETIC_LANGS[i]] = i;
+        m.layer_config["lang_spkr_idx_map.multispkr." + SYNTHETIC_LANGS[i]] = 2 * i;
+    }
+    std::string predictor = prefix + ".dur_predictor";
+    m.add_conv1d(predictor + ".conv1.0", p.duration_kernel_size, E, E);
+    m.add_layer_norm(predictor + ".ln1", E);
+    m.add_conv1d(predictor + ".conv2.0", p.duration_kernel_size, E, E);
+    m.add_layer_norm(predictor + ".ln2", E);
+    m.add_linear(predictor + ".proj", E, 1);
+
+    auto add_conv = [&](const std::string& conv, std::int64_t k, std::int64_t c_in, std::int64_t c_out, std::int64_t dilation) {
+        m.add_conv1d(conv, k, c_in, c_out);
+        m.layer_config[conv + ".stride"] = 1;
+        m.layer_config[conv + ".padding"] = dilation * (k - 1) / 2;
+        m.layer_config[conv + ".dilation"] = dilation;
+    };
+    std::int64_t C = p.vocoder_channels;
+    add_conv(prefix + ".conv_pre", 7, lang_dim + E + spkr_dim, C, 1);
+    for (std::size_t i = 0; i < upsample_rates.size(); ++i) {
+        std::string up = prefix + ".ups." + std::to_string(i);
+        std::int64_t u = upsample_rates[i], k = upsample_kernel_sizes[i];
+        // torch ConvTranspose1d weights are (C_in, C_out, K)
+        m.add_tensor(up + ".weight", {k, C / 2, C});
+        m.add_tensor(up + ".bias", {C / 2, 1});
+        m.layer_config[up + ".stride"] = u;
+        m.layer_config[up + ".padding"] = (k - u) / 2;
+        m.layer_config[up + ".output_padding"] = 0;
+        C /= 2;
+        for (std::size_t j = 0; j < resblock_kernel_sizes.size(); ++j) {
+            std::string resblock = prefix + ".resblocks." + std::to_string(i * resblock_kernel_sizes.size() + j);
+            for (std::size_t c = 0; c < resblock_dilations.size(); ++c) {
+                add_conv(resblock + ".convs1." + std::to_string(c), resblock_kernel_sizes[j], C, C, resblock_dilations[c]);
+                add_conv(resblock + ".convs2." + std::to_string(c), resblock_kernel_sizes[j], C, C, 1);
+            }
+        }
+    }
+    GGML_ASSERT(C > 0);
+    add_conv(prefix + ".conv_post", 7, C, 1, 1);
+    return m;
+}
+
+synthetic_model synthetic_kmeans_model(const synthetic_model_params& p) {
+    synthetic_model m;
+    m.add_tensor("kmeans.centroids", {p.model_dim, p.kmeans_clusters});
+    return m;
+}
+
+static void write_name(std::ofstream& out, const std::string& name) {
+    std::uint32_t length = name.size();
+    out.write((const char*)&length, sizeof(length));
+    out.write(name.data(), length);
+}
+
+static void write_hparams(std::ofstream& out, const std::map<std::string, std::int64_t>& hparams) {
+    std::int64_t num_params = hparams.size();
+    out.write((const char*)&num_params, sizeof(num_params));
+    for (const auto& kv : hparams) {
+        write_name(out, kv.first);
+        out.write((const char*)&kv.second, sizeof(kv.second));
+    }
+}
+
+static void write_tensor_header(std::ofstream& out, ggml_type type, const std::vector<std::int64_t>& ne) {
+    std::int32_t n_dims = ne.size();
+    std::int32_t raw_type = type;
+    out.write((const char*)&n_dims, sizeof(n_dims));
+    out.write((const char*)&raw_type, sizeof(raw_type));
+    out.write((const char*)ne.data(), ne.size() * sizeof(std::int64_t));
+}
+
+static std::int64_t num_elements(const std::vector<std::int64_t>& ne) {
+    std::int64_t n = 1;
+    for (auto d : ne) n *= d;
+    return n;
+}
+
+static void fill_tensor(const synthetic_tensor& t, std::vector<float>& data, std::mt19937& rng) {
+    std::int64_t n = num_elements(t.ne);
+    data.resize(n);
+    switch (t.init) {
+        case INIT_ZEROS:
+            std::fill(data.begin(), data.end(), 0.0f);
+            break;
+        case INIT_ONES:
+            std::fill(data.begin(), data.end(), 1.0f);
+            break;
+        case INIT_UNIFORM: {
+            float bound = 1.0f / std::sqrt((float)t.ne[0]);
+            std::uniform_real_distribution<float> uniform(-bound, bound);
+            for (auto& x : data) x = uniform(rng);
+            break;
+        }
+    }
+}
+
+/// Packed words, then lengths and scores tensors.
+static void write_vocab(std::ofstream& out, const std::vector<std::string>& vocab) {
+    std::int64_t vocab_size = vocab.size();
+    out.write((const char*)&vocab_size, sizeof(vocab_size));
+    if (vocab_size == 0) return;
+    std::string packed;
+    std::vector<std::int8_t> lengths;
+    std::vector<float> scores;
+    for (std::size_t i = 0; i < vocab.size(); ++i) {
+        if (i > 0) packed.push_back('\0');
+        packed += vocab[i];
+        lengths.push_back(vocab[i].size());
+        scores.push_back(-(float)i);
+    }
+    write_name(out, packed);
+    write_tensor_header(out, GGML_TYPE_I8, {vocab_size});
+    out.write((const char*)lengths.data(), lengths.size());
+    write_tensor_header(out, GGML_TYPE_F32, {vocab_size});
+    out.write((const char*)scores.data(), scores.size() * sizeof(float));
+}
+
+/// Writes the model in the format expected by `load_fairseq2_ggml_file`.
+bool write_synthetic_model(const synthetic_model& m, const char* fname, std::uint32_t seed) {
+    std::ofstream out(fname, std::ios::binary);
+    if (!out) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname);
+        return false;
+    }
+    std::uint32_t magic = GGML_FILE_MAGIC;
+    out.write((const char*)&magic, sizeof(magic));
+    write_hparams(out, m.hparams);
+    write_hparams(out, m.layer_config);
+
+    write_vocab(out, m.vocab);
+
+    // state dict
+    std::int64_t num_tensors = m.tensors.size();
+    std::int64_t f32_size = 0;
+    for (const auto& t : m.tensors) {
+        if (t.alias.empty()) f32_size += num_elements(t.ne) * sizeof(float);
+    }
+    out.write((const char*)&num_tensors, sizeof(num_tensors));
+    out.write((const char*)&f32_size, sizeof(f32_size));
+    std::mt19937 rng(seed);
+    std::vector<float> data;
+    for (const auto& t : m.tensors) {
+        write_name(out, t.name);
+        if (!t.alias.empty()) {
+            std::int32_t n_dims = TENSOR_ALIAS_N_DIMS;
+            out.write((const char*)&n_dims, sizeof(n_dims));
+            write_name(out, t.alias);
+            continue;
+        }
+        write_tensor_header(out, GGML_TYPE_F32, t.ne);
+        fill_tensor(t, data, rng);
+        out.write((const char*)data.data(), data.size() * sizeof(float));
+    }
+
+    // no target vocab
+    write_vocab(out, {});
+    // char vocab, only with a T2U model
+    bool has_t2u = std::any_of(m.tensors.begin(), m.tensors.end(), [](const synthetic_tensor& t) {
+        return t.name.rfind("t2u_model.", 0) == 0;
+    });
+    write_vocab(out, has_t2u ? m.char_vocab : std::vector<std::string>());
+    return out.good();
+}
+
+struct bench_params {
+    std::string model;  // real model to benchmark instead of the synthetic one
+    std::string vocoder;  // real vocoder to benchmark instead of the synthetic one
+    std::string monotonic_decoder;  // real monotonic decoder to benchmark instead of the synthetic one
+    std::string kmeans;  // real k-means quantizer to benchmark instead of the synthetic one
+    std::string write_model;  // where to keep the synthetic model
+    std::string output = "-";
+    std::string metrics;  // where to write the Prometheus metrics
+    synthetic_model_params synthetic;
+    std::vector<std::string> benches = {"speech_encoder", "text_encoder", "decoder", "s2tt", "t2tt", "t2u", "vocoder", "monotonic", "vad", "units", "sessions", "numa", "pipeline", "deadline", "contention", "multilang", "lid", "encoder_cache", "kv_cache", "layer_norm", "pos_enc", "resample", "wav", "fbank"};
+    std::vector<int> audio_s = {1, 5, 10};
+    std::vector<int> text_len = {16, 64};
+    std::vector<int> beam_size = {1, 5};
+    std::vector<int> n_threads = {std::min(4, (int) std::thread::hardware_concurrency())};
+    std::vector<int> chunk_units = {10, 50};
+    std::vector<int> chunk_frames = {2, 8};
+    std::vector<int> sessions = {1, 8, 32};
+    int session_mem_mb = 64;
+    int pipeline_requests = 8;
+    int pipeline_decoder_threads = 2;
+    std::vector<int> processes = {1, 2, 4, 8};
+    std::vector<int> langs = {1, 2, 5};
+    std::string tgt_lang = "eng";
+    int warmup = 1;
+    int repeat = 3;
+    int mem_mb = 256;
+    bool fuse = true;
+    int unit_layer = -1;  // conformer layer read by the unit extractor, -1 for the middle one
+};
+
+void bench_print_usage(int /*argc*/, char ** argv, const bench_params & params) {
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Benchmarks unity inference on a synthetic model with random weights.\n");
+    fprintf(stderr, "Results are written as one JSON object per line.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help            show this help message and exit\n");
+    fprintf(stderr, "  -m FNAME, --model FNAME\n");
+    fprintf(stderr, "                        benchmark an existing model instead of a synthetic one\n");
+    fprintf(stderr, "  --vocoder FNAME       benchmark an existing vocoder instead of a synthetic one\n");
+    fprintf(stderr, "  --monotonic-decoder FNAME\n");
+    fprintf(stderr, "                        benchmark an existing monotonic decoder instead of a synthetic one\n");
+    fprintf(stderr, "  --kmeans FNAME        benchmark an existing k-means quantizer instead of a synthetic one\n");
+    fprintf(stderr, "  --unit-layer N        conformer layer read by the unit extractor (default: middle layer)\n");
+    fprintf(stderr, "  --write-model FNAME   keep the synthetic model at the given path\n");
+    fprintf(stderr, "  -o FNAME, --output FNAME\n");
+    fprintf(stderr, "                        where to write the results (default: stdout)\n");
+    fprintf(stderr, "  --metrics FNAME       write the Prometheus metrics of the s2tt and t2tt runs\n");
+    fprintf(stderr, "  --bench LIST          benchmarks to run among speech_encoder,text_encoder,decoder,s2tt,t2tt,t2u,vocoder,monotonic,vad,units,sessions,numa,pipeline,deadline,contention,multilang,lid,encoder_cache,kv_cache,layer_norm,pos_enc,resample,wav,fbank (default: all)\n");
+    fprintf(stderr, "  --audio LIST          audio lengths in seconds, also of the vocoder output (default: 1,5,10)\n");
+    fprintf(stderr, "  --text-len LIST       input and output text lengths in tokens (default: 16,64)\n");
+    fprintf(stderr, "  --beam-size LIST      beam sizes (default: 1,5)\n");
+    fprintf(stderr, "  --chunk-units LIST    units per push of the streaming vocoder (default: 10,50)\n");
+    fprintf(stderr, "  --chunk-frames LIST   encoder frames per push of the monotonic decoder (default: 2,8)\n");
+    fprintf(stderr, "  --sessions LIST       concurrent decoding sessions, one thread each (default: 1,8,32)\n");
+    fprintf(stderr, "  --session-mem N       decoding memory of each session in MB (default: %d)\n", params.session_mem_mb);
+    fprintf(stderr, "  --pipeline-requests N requests translated back to back by the pipeline bench (default: %d)\n", params.pipeline_requests);
+    fprintf(stderr, "  --pipeline-decoder-threads N\n");
+    fprintf(stderr, "                        threads of the pipeline decoder stage, the encoder gets the others (default: %d)\n", params.pipeline_decoder_threads);
+    fprintf(stderr, "  --processes LIST      co-located processes translating at once in the contention bench (default: 1,2,4,8)\n");
+    fprintf(stderr, "  --langs LIST          target languages of each request in the multilang bench, at most 5 (default: 1,2,5)\n");
+    fprintf(stderr, "  -t LIST, --threads LIST\n");
+    fprintf(stderr, "                        thread counts (default: %d)\n", params.n_threads[0]);
+    fprintf(stderr, "  --warmup N            untimed runs per configuration (default: %d)\n", params.warmup);
+    fprintf(stderr, "  --repeat N            timed runs per configuration (default: %d)\n", params.repeat);
+    fprintf(stderr, "  -M, --mem             memory buffer, increase for long inputs (default: %d)\n", params.mem_mb);
+    fprintf(stderr, "  --no-fuse             compute the graphs without ggml_graph_fuse\n");
+    fprintf(stderr, "  --quick               tiny model and sweeps, to check everything runs\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "synthetic model options:\n");
+    fprintf(stderr, "  --dim N               model dim (default: %lld)\n", (long long)params.synthetic.model_dim);
+    fprintf(stderr, "  --ffn-dim N           feed forward dim (default: %lld)\n", (long long)params.synthetic.ffn_dim);
+    fprintf(stderr, "  --heads N             attention heads of the text layers (default: %lld)\n", (long long)params.synthetic.num_heads);
+    fprintf(stderr, "  --conformer-layers N  (default: %lld)\n", (long long)params.synthetic.conformer_layers);
+    fprintf(stderr, "  --adaptor-layers N    (default: %lld)\n", (long long)params.synthetic.adaptor_layers);
+    fprintf(stderr, "  --encoder-layers N    text encoder layers (default: %lld)\n", (long long)params.synthetic.text_encoder_layers);
+    fprintf(stderr, "  --decoder-layers N    text decoder layers (default: %lld)\n", (long long)params.synthetic.text_decoder_layers);
+    fprintf(stderr, "  --vocab N             vocabulary size (default: %lld)\n", (long long)params.synthetic.vocab_size);
+    fprintf(stderr, "  --untied-embeddings   store final_proj apart from the text decoder embeddings\n");
+    fprintf(stderr, "  --t2u-layers N        layers of the NAR T2U encoder and decoder, 0 for none (default: %lld)\n", (long long)params.synthetic.t2u_layers);
+    fprintf(stderr, "  --vocoder-channels N  initial channels of the vocoder upsampling, 0 for none (default: %lld)\n", (long long)params.synthetic.vocoder_channels);
+    fprintf(stderr, "  --kmeans-clusters N   centroids of the unit extractor k-means, 0 for none (default: %lld)\n", (long long)params.synthetic.kmeans_clusters);
+    fprintf(stderr, "  --seed N              (default: %u)\n", params.synthetic.seed);
+    fprintf(stderr, "\n");
+}
+
+std::string get_next_arg(int& i, int argc, char** argv, const std::string& flag, bench_params& params) {
+    if (i + 1 < argc && argv[i + 1][0] != '-') {
+        return argv[++i];
+    } else {
+        fprintf(stderr, "error: %s requires one argument.\n", flag.c_str());
+        bench_print_usage(argc, argv, params);
+        exit(1);
+    }
+}
+
+std::vector<std::string> split_list(const std::string& list) {
+    std::vector<std::string> items;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) items.push_back(item);
+    }
+    return items;
+}
+
+std::vector<int> parse_int_list(const std::string& list) {
+    std::vector<int> values;
+    for (const auto& item : split_list(list)) values.push_back(std::stoi(item));
+    return values;
+}
+
+bool bench_params_parse(int argc, char ** argv, bench_params & params) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            bench_print_usage(argc, argv, params);
+            exit(0);
+        } else if (arg == "-m" || arg == "--model") {
+            params.model = get_next_arg(i, argc, argv, arg, params);
+        } else if (arg == "--vocoder") {
+            params.vocoder = get_next_arg(i, argc, argv, arg, params);
+        } else if (arg == "--monotonic-decoder") {
+            params.monotonic_decoder = get_next_arg(i, argc, argv, arg, params);
+        } else if (arg == "--kmeans") {
+            params.kmeans = get_next_arg(i, argc, argv, arg, params);
+        } else if (arg == "--unit-layer") {
+            params.unit_layer = std::stoi(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--write-model") {
+            params.write_model = get_next_arg(i, argc, argv, arg, params);
+        } else if (arg == "-o" || arg == "--output") {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "error: %s requires one argument.\n", arg.c_str());
+                return false;
+            }
+            params.output = argv[++i];
+        } else if (arg == "--metrics") {
+            params.metrics = get_next_arg(i, argc, argv, arg, params);
+        } else if (arg == "--bench") {
+            params.benches = split_list(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--audio") {
+            params.audio_s = parse_int_list(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--text-len") {
+            params.text_len = parse_int_list(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "-b" || arg == "--beam-size") {
+            params.beam_size = parse_int_list(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--chunk-units") {
+            params.chunk_units = parse_int_list(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--chunk-frames") {
+            params.chunk_frames = parse_int_list(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--sessions") {
+            params.sessions = parse_int_list(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--session-mem") {
+            params.session_mem_mb = std::stoi(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--pipeline-requests") {
+            params.pipeline_requests = std::stoi(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--pipeline-decoder-threads") {
+            params.pipeline_decoder_threads = std::stoi(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--langs") {
+            params.langs = parse_int_list(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--processes") {
+            params.processes = parse_int_list(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "-t" || arg == "--threads") {
+            params.n_threads = parse_int_list(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--warmup") {
+            params.warmup = std::stoi(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--repeat") {
+            params.repeat = std::stoi(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "-M" || arg == "--mem") {
+            params.mem_mb = std::stoi(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--quick") {
+            params.synthetic.model_dim = 64;
+            params.synthetic.ffn_dim = 128;
+            // 32-dim heads, so that the keys of the Q8_0 KV cache are quantized
+            params.synthetic.num_heads = 2;
+            params.synthetic.conformer_layers = 1;
+            params.synthetic.adaptor_layers = 1;
+            params.synthetic.text_encoder_layers = 1;
+            params.synthetic.text_decoder_layers = 1;
+            params.synthetic.vocab_size = 256;
+            params.synthetic.max_seq_len = 64;
+            params.synthetic.t2u_layers = 1;
+            params.synthetic.unit_vocab_size = 64;
+            params.synthetic.vocoder_channels = 32;
+            params.synthetic.vocoder_embed_dim = 64;
+            params.synthetic.monotonic_energy_layers = 1;
+            params.synthetic.kmeans_clusters = 64;
+            params.audio_s = {1};
+            params.chunk_units = {10};
+            params.chunk_frames = {4};
+            params.sessions = {1, 32};
+            params.session_mem_mb = 16;
+            params.pipeline_requests = 3;
+            params.pipeline_decoder_threads = 1;
+            params.processes = {1, 2};
+            params.langs = {1, 3};
+            params.text_len = {8};
+            params.beam_size = {2};
+            params.n_threads = {1};
+            params.warmup = 0;
+            params.repeat = 1;
+        } else if (arg == "--no-fuse") {
+            params.fuse = false;
+        } else if (arg == "--dim") {
+            params.synthetic.model_dim = std::stoi(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--ffn-dim") {
+            params.synthetic.ffn_dim = std::stoi(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--heads") {
+            params.synthetic.num_heads = std::stoi(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--conformer-layers") {
+            params.synthetic.conformer_layers = std::stoi(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--adaptor-layers") {
+            params.synthetic.adaptor_layers = std::stoi(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--encoder-layers") {
+            params.synthetic.text_encoder_layers = std::stoi(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--decoder-layers") {
+            params.synthetic.text_decoder_layers = std::stoi(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--vocab") {
+            params.synthetic.vocab_size = std::stoi(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--untied-embeddings") {
+            params.synthetic.tied_embeddings = false;
+        } else if (arg == "--t2u-layers") {
+            params.synthetic.t2u_layers = std::stoi(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--vocoder-channels") {
+            params.synthetic.vocoder_channels = std::stoi(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--kmeans-clusters") {
+            params.synthetic.kmeans_clusters = std::stoi(get_next_arg(i, argc, argv, arg, params));
+        } else if (arg == "--seed") {
+            params.synthetic.seed = std::stoi(get_next_arg(i, argc, argv, arg, params));
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            bench_print_usage(argc, argv, params);
+            return false;
+        }
+    }
+    return true;
+}
+
+/// One line of JSON output.
+struct json_line {
+    std::ostringstream ss;
+    bool first = true;
+
+    json_line& key(const char* name) {
+        ss << (first ? "{" : ", ") << "\"" << name << "\": ";
+        first = false;
+        return *this;
+    }
+    json_line& add(const char* name, const std::string& value) {
+        key(name).ss << "\"" << value << "\"";
+        return *this;
+    }
+    json_line& add(const char* name, std::int64_t value) {
+        key(name).ss << value;
+        return *this;
+    }
+    json_line& add(const char* name, double value) {
+        key(name).ss << value;
+        return *this;
+    }
+    void write(FILE* out) {
+        std::fprintf(out, "%s}\n", ss.str().c_str());
+        std::fflush(out);
+    }
+};
+
+/// Timings of the repeated runs of one configuration, in milliseconds.
+struct bench_stats {
+    double mean, min, p50, max;
+};
+
+bench_stats compute_stats(std::vector<double> ms) {
+    std::sort(ms.begin(), ms.end());
+    double sum = 0;
+    for (double x : ms) sum += x;
+    return {sum / ms.size(), ms.front(), ms[ms.size() / 2], ms.back()};
+}
+
+void add_stats(json_line& line, const bench_stats& stats) {
+    line.add("mean_ms", stats.mean).add("min_ms", stats.min).add("p50_ms", stats.p50).add("max_ms", stats.max);
+}
+
+/// Average of the stats returned by unity_lib over the last `repeat` runs, ie without warmup.
+void add_request_stats(json_line& line, const std::vector<RequestStats>& runs, int repeat) {
+    double fbank = 0, encoder = 0, bootstrap = 0, decode = 0, detokenize = 0, t2u = 0, beams_pruned = 0, graph_nodes = 0;
+    std::size_t peak_arena_bytes = 0;
+    for (auto it = runs.end() - repeat; it != runs.end(); ++it) {
+        fbank += it->fbank_us / 1000.0 / repeat;
+        encoder += it->encoder_us / 1000.0 / repeat;
+        bootstrap += it->bootstrap_us / 1000.0 / repeat;
+        decode += it->decode_us() / 1000.0 / repeat;
+        detokenize += it->detokenize_us / 1000.0 / repeat;
+        t2u += it->t2u_us / 1000.0 / repeat;
+        beams_pruned += it->n_beams_pruned / (double)repeat;
+        graph_nodes += it->n_graph_nodes / (double)repeat;
+        peak_arena_bytes = std::max(peak_arena_bytes, it->peak_arena_bytes);
+    }
+    line.add("fbank_ms", fbank)
+        .add("encoder_ms", encoder)
+        .add("bootstrap_ms", bootstrap)
+        .add("decode_ms", decode)
+        .add("detokenize_ms", detokenize)
+        .add("t2u_ms", t2u)
+        .add("beams_pruned", beams_pruned)
+        .add("graph_nodes", graph_nodes)
+        .add("peak_arena_mb", peak_arena_bytes / (1024.0 * 1024.0));
+}
+
+/// Buffers reused between the runs, same layout as in `unity_eval_speech`.
+struct bench_state {
+    fairseq2_model& model;
+    std::vector<std::uint8_t> ctx_buf;
+    std::vector<std::uint8_t> fwd_buf;
+    ggml_allocr* fwd_alloc;
+    std::mt19937 rng;
+
+    bench_state(fairseq2_model& model, int mem_mb) :
+        model(model),
+        ctx_buf(16 * 1024 * 1024),
+        fwd_buf((std::size_t)mem_mb * 1024 * 1024),
+        rng(0)
+    {
+        fwd_alloc = ggml_allocr_new(fwd_buf.data(), fwd_buf.capacity(), 8);
+    }
+
+    ~bench_state() {
+        ggml_allocr_free(fwd_alloc);
+    }
+
+    void begin() {
+        model.ctx = ctx_from_buffer(ctx_buf);
+        ggml_set_no_alloc(model.ctx, true);
+        ggml_allocr_reset(fwd_alloc);
+    }
+
+    void end() {
+        ggml_free(model.ctx);
+        model.ctx = nullptr;
+        fairseq2_profiler_flush(model);
+    }
+
+    std::vector<float> random_audio(int seconds) {
+        std::normal_distribution<float> noise(0.0f, 0.1f);
+        std::vector<float> audio(16000 * seconds);
+        for (auto& x : audio) x = noise(rng);
+        return audio;
+    }
+
+    /// Random lowercase letters: tokenized as `len` tokens by the synthetic vocab.
+    std::string random_text(int len) {
+        std::uniform_int_distribution<int> letter('a', 'z');
+        std::string text;
+        for (int i = 0; i < len; ++i) text.push_back((char)letter(rng));
+        return text;
+    }
+
+    ggml_tensor* encode_speech(std::vector<float>& audio, int n_threads) {
+        ggml_tensor* seqs = ggml_new_tensor_2d(model.ctx, GGML_TYPE_F32, audio.size(), 1);
+        seqs->data = audio.data();
+        ggml_cgraph* gf = unity_speech_encoder(model, seqs);
+        fairseq2_graph_fuse(model, gf);
+        ggml_allocr_alloc_graph(fwd_alloc, gf);
+        fairseq2_graph_compute(model, model.ctx, gf, n_threads);
+        return gf->nodes[gf->n_nodes - 1];
+    }
+
+    ggml_tensor* encode_text(const std::string& text, int n_threads) {
+        FORCE_ALLOC(tokens, model.ctx, ggml_new_tensor_1d(model.ctx, GGML_TYPE_I32, text.size() + 2));
+        fairseq2_spm_tokenize(&model, text.c_str(), tokens);
+        ggml_cgraph* gf = unity_text_encoder(model, tokens);
+        fairseq2_graph_fuse(model, gf);
+        ggml_allocr_alloc_graph(fwd_alloc, gf);
+        fairseq2_graph_compute(model, model.ctx, gf, n_threads);
+        return gf->nodes[gf->n_nodes - 1];
+    }
+};
+
+/// Forces the decoder to generate exactly `text_len` tokens (+ EOS),
+/// so that the decoding cost doesn't depend on what the model outputs.
+SequenceGeneratorOptions fixed_length_opts(int text_len, int beam_size, int mem_mb) {
+    SequenceGeneratorOptions opts;
+    opts.beam_size = beam_size;
+    // prefix is (EOS, lang), then text_len tokens, then EOS
+    opts.hard_max_seq_len = text_len + 3;
+    // EOS is forbidden until step `min_seq_len`, and forced at step `max_seq_len - 2`.
+    opts.min_seq_len = opts.hard_max_seq_len - 2;
+    opts.soft_max_seq_len_a = 0;
+    opts.mem_mb = mem_mb;
+    return opts;
+}
+
+/// Number of decoder forward passes done by `generate_sequence` with `fixed_length_opts`.
+int fixed_length_steps(int text_len) {
+    return text_len + 1;
+}
+
+template<typename F>
+std::vector<double> run_timed(const bench_params& params, F run) {
+    for (int i = 0; i < params.warmup; ++i) run();
+    std::vector<double> ms;
+    for (int i = 0; i < params.repeat; ++i) ms.push_back(run());
+    return ms;
+}
+
+double elapsed_ms(std::int64_t t_start_us) {
+    return (ggml_time_us() - t_start_us) / 1000.0;
+}
+
+void bench_speech_encoder(bench_state& state, const bench_params& params, FILE* out) {
+    for (int audio_s : params.audio_s) {
+        std::vector<float> audio = state.random_audio(audio_s);
+        for (int n_threads : params.n_threads) {
+            std::int64_t frames = 0;
+            auto ms = run_timed(params, [&]() {
+                state.begin();
+                std::int64_t t_start_us = ggml_time_us();
+                ggml_tensor* encoder_output = state.encode_speech(audio, n_threads);
+                double elapsed = elapsed_ms(t_start_us);
+                frames = encoder_output->ne[1];
+                state.end();
+                return elapsed;
+            });
+            bench_stats stats = compute_stats(ms);
+            json_line line;
+            line.add("bench", std::string("speech_encoder"))
+                .add("audio_s", (std::int64_t)audio_s)
+                .add("threads", (std::int64_t)n_threads)
+                .add("encoder_frames", frames);
+            add_stats(line, stats);
+            line.add("rtf", stats.mean / 1000.0 / audio_s);
+            line.write(out);
+        }
+    }
+}
+
+/// Speech encoder on audio with pauses, with and without the VAD front end.
+/// The audio alternates 700 ms of amplitude modulated noise and 800 ms of near silence.
+void bench_vad(bench_state& state, const bench_params& params, FILE* out) {
+    const int sample_rate = 16000;
+    const std::int64_t speech_len = sample_rate * 7 / 10;
+    const std::int64_t period = sample_rate * 3 / 2;
+    VadOptions vad_opts;
+    for (int audio_s : params.audio_s) {
+        std::vector<float> audio = state.random_audio(audio_s);
+        std::int64_t speech_samples = 0;
+        for (std::size_t i = 0; i < audio.size(); ++i) {
+            bool speech = (std::int64_t)i % period < speech_len;
+            float syllables = 0.3f + 0.7f * std::abs(std::sin(2.0f * 3.14159265f * 4.0f * i / sample_rate));
+            audio[i] *= speech ? syllables : 0.01f;
+            speech_samples += speech;
+        }
+        std::vector<SpeechSegment> segments = vad_segments(audio.data(), audio.size(), vad_opts);
+        // Every speech sample must be kept, and the pauses mostly dropped.
+        std::int64_t kept_samples = 0;
+        for (const SpeechSegment& segment : segments) kept_samples += segment.end - segment.start;
+        for (std::size_t i = 0; i < audio.size(); ++i) {
+            if ((std::int64_t)i % period >= speech_len) continue;
+            GGML_ASSERT(std::any_of(segments.begin(), segments.end(), [&](const SpeechSegment& segment) {
+                return segment.start <= (std::int64_t)i && (std::int64_t)i < segment.end;
+            }));
+        }
+        GGML_ASSERT(kept_samples < (std::int64_t)audio.size());
+
+        auto vad_ms = run_timed(params, [&]() {
+            std::int64_t t_start_us = ggml_time_us();
+            vad_segments(audio.data(), audio.size(), vad_opts);
+            return elapsed_ms(t_start_us);
+        });
+        for (int n_threads : params.n_threads) {
+            auto full_ms = run_timed(params, [&]() {
+                state.begin();
+                std::int64_t t_start_us = ggml_time_us();
+                state.encode_speech(audio, n_threads);
+                double elapsed = elapsed_ms(t_start_us);
+                state.end();
+                return elapsed;
+            });
+            auto segments_ms = run_timed(params, [&]() {
+                double elapsed = 0;
+                for (const SpeechSegment& segment : segments) {
+                    std::vector<float> segment_audio(audio.begin() + segment.start, audio.begin() + segment.end);
+                    state.begin();
+                    std::int64_t t_start_us = ggml_time_us();
+                    state.encode_speech(segment_audio, n_threads);
+                    elapsed += elapsed_ms(t_start_us);
+                    state.end();
+                }
+                return elapsed;
+            });
+            bench_stats stats = compute_stats(segments_ms);
+            json_line line;
+            line.add("bench", std::string("vad"))
+                .add("audio_s", (std::int64_t)audio_s)
+                .add("threads", (std::int64_t)n_threads)
+                .add("segments", (std::int64_t)segments.size())
+                .add("speech_s", (double)speech_samples / sample_rate)
+                .add("kept_s", (double)kept_samples / sample_rate);
+            add_stats(line, stats);
+            line.add("vad_ms", compute_stats(vad_ms).mean)
+                .add("full_encoder_ms", compute_stats(full_ms).mean);
+            line.write(out);
+        }
+    }
+}
+
+/// Unit extraction: speech encoder up to a conformer layer and k-means quantization.
+/// The units are checked against the nearest centroids of the layer output computed on the host.
+void bench_units(bench_state& state, fairseq2_model& kmeans, const bench_params& params, FILE* out) {
+    int n_layers = 0;
+    while (has_layer(state.model, "speech_encoder.inner.layers." + std::to_string(n_layers))) ++n_layers;
+    int out_layer_idx = params.unit_layer >= 0 ? params.unit_layer : (n_layers - 1) / 2;
+    GGML_ASSERT(out_layer_idx < n_layers);
+    ggml_tensor* centroids = kmeans.tensors["kmeans.centroids"];
+    const std::int64_t dim = centroids->ne[0];
+    const std::int64_t n_clusters = centroids->ne[1];
+    const float* centroids_data = ggml_get_data_f32(centroids);
+    for (int audio_s : params.audio_s) {
+        std::vector<float> audio = state.random_audio(audio_s);
+        state.begin();
+        ggml_tensor* seqs = ggml_new_tensor_2d(state.model.ctx, GGML_TYPE_F32, audio.size(), 1);
+        seqs->data = audio.data();
+        ggml_cgraph* gf = ggml_new_graph(state.model.ctx);
+        ggml_tensor* features = StandardConformerEncoderLayerOutput_forward(state.model, "speech_encoder", seqs, nullptr, out_layer_idx);
+        ggml_build_forward_expand(gf, features);
+        fairseq2_graph_fuse(state.model, gf);
+        ggml_allocr_alloc_graph(state.fwd_alloc, gf);
+        fairseq2_graph_compute(state.model, state.model.ctx, gf, params.n_threads[0]);
+        GGML_ASSERT(features->ne[0] == dim);
+        const std::int64_t n_frames = features->ne[1];
+        std::vector<double> distances(n_frames * n_clusters);
+        for (std::int64_t t = 0; t < n_frames; ++t) {
+            const float* x = ggml_get_data_f32(features) + t * dim;
+            for (std::int64_t k = 0; k < n_clusters; ++k) {
+                double d = 0;
+                for (std::int64_t i = 0; i < dim; ++i) {
+                    double diff = x[i] - centroids_data[k * dim + i];
+                    d += diff * diff;
+                }
+                distances[t * n_clusters + k] = d;
+            }
+        }
+        state.end();
+
+        for (int n_threads : params.n_threads) {
+            std::vector<int> units;
+            auto ms = run_timed(params, [&]() {
+                std::int64_t t_start_us = ggml_time_us();
+                units = unity_extract_units(state.model, kmeans, audio, out_layer_idx, params.mem_mb, n_threads);
+                return elapsed_ms(t_start_us);
+            });
+            // Centroids at the same distance up to rounding can be swapped.
+            GGML_ASSERT((std::int64_t)units.size() == n_frames);
+            std::int64_t n_exact = 0;
+            for (std::int64_t t = 0; t < n_frames; ++t) {
+                const double* d = distances.data() + t * n_clusters;
+                std::int64_t nearest = std::min_element(d, d + n_clusters) - d;
+                GGML_ASSERT(d[units[t]] <= d[nearest] * (1 + 1e-4) + 1e-4);
+                n_exact += units[t] == nearest;
+            }
+            bench_stats stats = compute_stats(ms);
+            json_line line;
+            line.add("bench", std::string("units"))
+                .add("audio_s", (std::int64_t)audio_s)
+                .add("threads", (std::int64_t)n_threads)
+                .add("layer", (std::int64_t)out_layer_idx)
+                .add("clusters", n_clusters)
+                .add("units", n_frames);
+            add_stats(line, stats);
+            line.add("rtf", stats.mean / 1000.0 / audio_s)
+                .add("exact_units", (double)n_exact / n_frames);
+            line.write(out);
+        }
+    }
+}
+
+void bench_text_encoder(bench_state& state, const bench_params& params, FILE* out) {
+    for (int text_len : params.text_len) {
+        std::string text = state.random_text(text_len);
+        for (int n_threads : params.n_threads) {
+            auto ms = run_timed(params, [&]() {
+                state.begin();
+                std::int64_t t_start_us = ggml_time_us();
+                state.encode_text(text, n_threads);
+                double elapsed = elapsed_ms(t_start_us);
+                state.end();
+                return elapsed;
+            });
+            bench_stats stats = compute_stats(ms);
+            json_line line;
+            line.add("bench", std::string("text_encoder"))
+                .add("text_len", (std::int64_t)text_len)
+                .add("threads", (std::int64_t)n_threads);
+            add_stats(line, stats);
+            line.add("tokens_per_s", text_len * 1000.0 / stats.mean);
+            line.write(out);
+        }
+    }
+}
+
+void bench_decoder(bench_state& state, const bench_params& params, FILE* out) {
+    int tgt_lang_idx = state.model.vocab.token_to_id.at("__" + params.tgt_lang + "__");
+    for (int audio_s : params.audio_s) {
+        std::vector<float> audio = state.random_audio(audio_s);
+        for (int text_len : params.text_len) {
+            for (int beam_size : params.beam_size) {
+                for (int n_threads : params.n_threads) {
+                    SequenceGeneratorOptions opts = fixed_length_opts(text_len, beam_size, params.mem_mb);
+                    auto ms = run_timed(params, [&]() {
+                        state.begin();
+                        ggml_tensor* encoder_output = state.encode_speech(audio, n_threads);
+                        std::int64_t t_start_us = ggml_time_us();
+                        unity_decode(state.model, opts, tgt_lang_idx, encoder_output, n_threads);
+                        double elapsed = elapsed_ms(t_start_us);
+                        state.end();
+                        return elapsed;
+                    });
+                    bench_stats stats = compute_stats(ms);
+                    int steps = fixed_length_steps(text_len);
+                    json_line line;
+                    line.add("bench", std::string("decoder"))
+                        .add("audio_s", (std::int64_t)audio_s)
+                        .add("text_len", (std::int64_t)text_len)
+                        .add("beam_size", (std::int64_t)beam_size)
+                        .add("threads", (std::int64_t)n_threads)
+                        .add("steps", (std::int64_t)steps);
+                    add_stats(line, stats);
+                    line.add("ms_per_step", stats.mean / steps);
+                    line.add("tokens_per_s", text_len * 1000.0 / stats.mean);
+                    line.write(out);
+                }
+            }
+        }
+    }
+}
+
+/// Concurrent decoding sessions, one thread each, like a server with many streams.
+/// Each session copies the model, so only the weights are shared, and creates its own contexts at every step.
+void bench_sessions(bench_state& state, const bench_params& params, FILE* out) {
+    int tgt_lang_idx = state.model.vocab.token_to_id.at("__" + params.tgt_lang + "__");
+    int text_len = params.text_len[0];
+    int beam_size = params.beam_size[0];
+    std::vector<float> audio = state.random_audio(params.audio_s[0]);
+    state.begin();
+    ggml_tensor* encoder_output = state.encode_speech(audio, params.n_threads[0]);
+    std::int64_t model_dim = encoder_output->ne[0];
+    std::int64_t n_frames = encoder_output->ne[1];
+    std::vector<float> frames(ggml_get_data_f32(encoder_output), ggml_get_data_f32(encoder_output) + model_dim * n_frames);
+    state.end();
+
+    SequenceGeneratorOptions opts = fixed_length_opts(text_len, beam_size, params.session_mem_mb);
+    for (int n_sessions : params.sessions) {
+        auto ms = run_timed(params, [&]() {
+            std::int64_t t_start_us = ggml_time_us();
+            std::vector<std::thread> threads;
+            for (int i = 0; i < n_sessions; ++i) {
+                threads.emplace_back([&]() {
+                    fairseq2_model session = state.model;
+                    session.profiler = nullptr;
+                    std::vector<std::uint8_t> ctx_buf;
+                    ctx_buf.reserve(4 * 1024 * 1024);
+                    session.ctx = ctx_from_buffer(ctx_buf);
+                    ggml_set_no_alloc(session.ctx, true);
+                    ggml_tensor* session_encoder_output = ggml_new_tensor_2d(session.ctx, GGML_TYPE_F32, model_dim, n_frames);
+                    session_encoder_output->data = frames.data();
+                    Hypothesis* hypo = unity_decode(session, opts, tgt_lang_idx, session_encoder_output, 1);
+                    GGML_ASSERT(hypo != nullptr);
+                    ggml_free(session.ctx);
+                });
+            }
+            for (auto& thread : threads) thread.join();
+            return elapsed_ms(t_start_us);
+        });
+        bench_stats stats = compute_stats(ms);
+        json_line line;
+        line.add("bench", std::string("sessions"))
+            .add("sessions", (std::int64_t)n_sessions)
+            .add("audio_s", (std::int64_t)params.audio_s[0])
+            .add("text_len", (std::int64_t)text_len)
+            .add("beam_size", (std::int64_t)beam_size);
+        add_stats(line, stats);
+        line.add("tokens_per_s", (double)n_sessions * text_len * 1000.0 / stats.mean);
+        line.write(out);
+    }
+}
+
+/// Speech encoder throughput on multi-socket hosts: one thread pool per NUMA node, all encoding at once.
+/// The weights are where the loading thread first touched them ("none"), interleaved over the nodes,
+/// or replicated on each node with each pool using the replica of its node.
+void bench_numa(fairseq2_model& model, std::vector<fairseq2_model>& interleaved, std::vector<fairseq2_model>& replicas, const bench_params& params, FILE* out) {
+    int n_pools = std::max(1, ggml_numa_n_nodes());
+    int audio_s = params.audio_s[0];
+    std::vector<float> audio(16000 * audio_s);
+    std::mt19937 rng(0);
+    std::normal_distribution<float> noise(0.0f, 0.1f);
+    for (auto& x : audio) x = noise(rng);
+
+    for (NumaMode mode : {NumaMode::none, NumaMode::interleave, NumaMode::replicate}) {
+        for (int n_threads : params.n_threads) {
+            std::vector<std::vector<double>> pool_ms(n_pools);
+            std::vector<std::thread> pools;
+            for (int node = 0; node < n_pools; ++node) {
+                pools.emplace_back([&, node]() {
+                    fairseq2_model pool_model = mode == NumaMode::none ? model
+                        : mode == NumaMode::interleave ? interleaved[0] : replicas[node];
+                    pool_model.profiler = nullptr;
+                    if (mode != NumaMode::none && ggml_is_numa()) {
+                        // the buffers of the pool are first touched on its node too
+                        pool_model.numa_node = node;
+                        ggml_numa_set_thread_node(node);
+                    }
+                    bench_state state(pool_model, params.mem_mb);
+                    std::vector<float> pool_audio = audio;
+                    pool_ms[node] = run_timed(params, [&]() {
+                        state.begin();
+                        std::int64_t t_start_us = ggml_time_us();
+                        state.encode_speech(pool_audio, n_threads);
+                        double elapsed = elapsed_ms(t_start_us);
+                        state.end();
+                        return elapsed;
+                    });
+                });
+            }
+            for (auto& pool : pools) pool.join();
+            std::vector<double> ms;
+            for (const auto& runs : pool_ms) ms.insert(ms.end(), runs.begin(), runs.end());
+            bench_stats stats = compute_stats(ms);
+            json_line line;
+            line.add("bench", std::string("numa"))
+                .add("mode", std::string(mode == NumaMode::none ? "none" : mode == NumaMode::interleave ? "interleave" : "replicate"))
+                .add("nodes", (std::int64_t)ggml_numa_n_nodes())
+                .add("pools", (std::int64_t)n_pools)
+                .add("audio_s", (std::int64_t)audio_s)
+                .add("threads", (std::int64_t)n_threads);
+            add_stats(line, stats);
+            line.add("audio_s_per_s", n_pools * audio_s * 1000.0 / stats.mean);
+            line.write(out);
+        }
+    }
+}
+
+/// Back to back speech translation requests, run one after the other by unity_eval_speech, or by
+/// UnityPipeline with the encoder of a request overlapping the decoding of the previous one.
+/// `threads` is split between the stages, pinned to separate cores when the machine has enough.
+void bench_pipeline(bench_state& state, const bench_params& params, FILE* out) {
+    int audio_s = params.audio_s[0];
+    std::vector<std::vector<float>> audios;
+    for (int i = 0; i < params.pipeline_requests; ++i) audios.push_back(state.random_audio(audio_s));
+    SequenceGeneratorOptions opts = fixed_length_opts(params.text_len[0], params.beam_size[0], params.mem_mb);
+    for (int n_threads : params.n_threads) {
+        std::vector<std::vector<std::string>> sequential_text(audios.size());
+        double sequential_latency_ms = 0;
+        auto sequential_ms = run_timed(params, [&]() {
+            std::int64_t t_start_us = ggml_time_us();
+            sequential_latency_ms = 0;
+            for (std::size_t i = 0; i < audios.size(); ++i) {
+                Result result = unity_eval_speech(state.model, audios[i], opts, params.tgt_lang, n_threads);
+                GGML_ASSERT(result.err == 0);
+                sequential_text[i] = result.transcription;
+                // measured from the start of the batch, like the pipeline
+                sequential_latency_ms += elapsed_ms(t_start_us) / audios.size();
+            }
+            return elapsed_ms(t_start_us);
+        });
+
+        PipelineOptions pipeline_opts;
+        pipeline_opts.decoder_threads = std::max(1, std::min(params.pipeline_decoder_threads, n_threads - 1));
+        pipeline_opts.encoder_threads = std::max(1, n_threads - pipeline_opts.decoder_threads);
+        int n_cpus = (int)std::thread::hardware_concurrency();
+        if (pipeline_opts.encoder_threads + pipeline_opts.decoder_threads <= n_cpus) {
+            for (int cpu = 0; cpu < pipeline_opts.encoder_threads; ++cpu) pipeline_opts.encoder_cpus.push_back(cpu);
+            for (int cpu = 0; cpu < pipeline_opts.decoder_threads; ++cpu) pipeline_opts.decoder_cpus.push_back(pipeline_opts.encoder_threads + cpu);
+        }
+        bool exact = true;
+        double pipeline_latency_ms = 0;
+        auto pipeline_ms = run_timed(params, [&]() {
+            std::int64_t t_start_us = ggml_time_us();
+            UnityPipeline pipeline(state.model, opts, pipeline_opts);
+            std::vector<std::future<Result>> results;
+            for (auto& audio : audios) results.push_back(pipeline.submit(audio, params.tgt_lang));
+            pipeline_latency_ms = 0;
+            for (std::size_t i = 0; i < results.size(); ++i) {
+                Result result = results[i].get();
+                GGML_ASSERT(result.err == 0);
+                exact = exact && result.transcription == sequential_text[i];
+                pipeline_latency_ms += elapsed_ms(t_start_us) / audios.size();
+            }
+            return elapsed_ms(t_start_us);
+        });
+
+        bench_stats stats = compute_stats(pipeline_ms);
+        double sequential_mean = compute_stats(sequential_ms).mean;
+        json_line line;
+        line.add("bench", std::string("pipeline"))
+            .add("requests", (std::int64_t)audios.size())
+            .add("audio_s", (std::int64_t)audio_s)
+            .add("text_len", (std::int64_t)params.text_len[0])
+            .add("beam_size", (std::int64_t)params.beam_size[0])
+            .add("threads", (std::int64_t)n_threads)
+            .add("encoder_threads", (std::int64_t)pipeline_opts.encoder_threads)
+            .add("decoder_threads", (std::int64_t)pipeline_opts.decoder_threads)
+            .add("pinned", std::string(pipeline_opts.encoder_cpus.empty() ? "false" : "true"));
+        add_stats(line, stats);
+        line.add("sequential_mean_ms", sequential_mean)
+            .add("speedup", sequential_mean / stats.mean)
+            .add("requests_per_s", audios.size() * 1000.0 / stats.mean)
+            .add("mean_latency_ms", pipeline_latency_ms)
+            .add("sequential_mean_latency_ms", sequential_latency_ms)
+            .add("exact", (std::int64_t)exact);
+        line.write(out);
+    }
+}
+
+/// Speech translation requests with a deadline at a fraction of the time they take without one,
+/// 0 for requests cancelled before they start. Reports how long the requests run past their
+/// deadline, and how many of the decoding steps make it into the partial translation.
+void bench_deadline(bench_state& state, const bench_params& params, FILE* out) {
+    int audio_s = params.audio_s[0];
+    std::vector<float> audio = state.random_audio(audio_s);
+    for (int text_len : params.text_len) {
+        for (int beam_size : params.beam_size) {
+            for (int n_threads : params.n_threads) {
+                SequenceGeneratorOptions opts = fixed_length_opts(text_len, beam_size, params.mem_mb);
+                auto full_ms = run_timed(params, [&]() {
+                    std::int64_t t_start_us = ggml_time_us();
+                    Result result = unity_eval_speech(state.model, audio, opts, params.tgt_lang, n_threads);
+                    GGML_ASSERT(result.err == 0 && !result.stats.cancelled);
+                    return elapsed_ms(t_start_us);
+                });
+                double full_mean = compute_stats(full_ms).mean;
+
+                for (double fraction : {0.0, 0.25, 0.5, 0.75}) {
+                    std::int64_t deadline_us = (std::int64_t)(full_mean * fraction * 1000);
+                    std::vector<double> overshoot_ms;
+                    std::vector<RequestStats> runs;
+                    auto ms = run_timed(params, [&]() {
+                        CancellationToken cancel;
+                        std::int64_t t_start_us = ggml_time_us();
+                        if (deadline_us == 0) {
+                            cancel.cancel();
+                        } else {
+                            cancel.deadline_us = t_start_us + deadline_us;
+                        }
+                        Result result = unity_eval_speech(state.model, audio, opts, params.tgt_lang, n_threads, &cancel);
+                        GGML_ASSERT(result.err == 0);
+                        double run_ms = elapsed_ms(t_start_us);
+                        overshoot_ms.push_back(run_ms - deadline_us / 1000.0);
+                        runs.push_back(result.stats);
+                        return run_ms;
+                    });
+                    double cancelled = 0, steps = 0;
+                    for (auto it = runs.end() - params.repeat; it != runs.end(); ++it) {
+                        cancelled += it->cancelled / (double)params.repeat;
+                        steps += it->n_steps / (double)params.repeat;
+                    }
+                    bench_stats stats = compute_stats(ms);
+                    json_line line;
+                    line.add("bench", std::string("deadline"))
+                        .add("audio_s", (std::int64_t)audio_s)
+                        .add("text_len", (std::int64_t)text_len)
+                        .add("beam_size", (std::int64_t)beam_size)
+                        .add("threads", (std::int64_t)n_threads)
+                        .add("deadline_fraction", fraction)
+                        .add("deadline_ms", deadline_us / 1000.0);
+                    add_stats(line, stats);
+                    line.add("full_mean_ms", full_mean)
+                        .add("overshoot_ms", compute_stats({overshoot_ms.end() - params.repeat, overshoot_ms.end()}).mean)
+                        .add("cancelled", cancelled)
+                        .add("steps", steps)
+                        .add("full_steps", (std::int64_t)fixed_length_steps(text_len));
+                    line.write(out);
+                }
+            }
+        }
+    }
+}
+
+/// Translation of the same audio into several languages: one unity_eval_speech per language,
+/// against unity_eval_speech_multi encoding once and decoding the languages together.
+/// With fixed length outputs all the languages finish together, otherwise they stop at
+/// their own EOS and the finished ones are dropped from the decoder graphs.
+void bench_multilang(bench_state& state, const bench_params& params, FILE* out) {
+    int audio_s = params.audio_s[0];
+    std::vector<float> audio = state.random_audio(audio_s);
+    for (int n_langs : params.langs) {
+        GGML_ASSERT(n_langs >= 1 && n_langs <= (int)SYNTHETIC_LANGS.size());
+        std::vector<std::string> langs(SYNTHETIC_LANGS.begin(), SYNTHETIC_LANGS.begin() + n_langs);
+        for (int text_len : params.text_len) {
+            for (int beam_size : params.beam_size) {
+                for (bool fixed_length : {true, false}) {
+                    SequenceGeneratorOptions opts = fixed_length_opts(text_len, beam_size, params.mem_mb);
+                    if (!fixed_length) opts.min_seq_len = 1;
+                    for (int n_threads : params.n_threads) {
+                        std::vector<Result> sequential(n_langs);
+                        auto sequential_ms = run_timed(params, [&]() {
+                            std::int64_t t_start_us = ggml_time_us();
+                            for (int i = 0; i < n_langs; ++i) {
+                                sequential[i] = unity_eval_speech(state.model, audio, opts, langs[i], n_threads);
+                                GGML_ASSERT(sequential[i].err == 0);
+                            }
+                            return elapsed_ms(t_start_us);
+                        });
+
+                        bool exact = true;
+                        double steps = 0;
+                        auto ms = run_timed(params, [&]() {
+                            std::int64_t t_start_us = ggml_time_us();
+                            std::vector<Result> results = unity_eval_speech_multi(state.model, audio, opts, langs, n_threads);
+                            double elapsed = elapsed_ms(t_start_us);
+                            for (int i = 0; i < n_langs; ++i) {
+                                GGML_ASSERT(results[i].err == 0);
+                                exact = exact && results[i].transcription == sequential[i].transcription;
+                                exact = exact && results[i].units == sequential[i].units;
+                            }
+                            steps = results[0].stats.n_steps;
+                            return elapsed;
+                        });
+
+                        double sequential_steps = 0;
+                        for (const Result& result : sequential) sequential_steps += result.stats.n_steps;
+                        bench_stats stats = compute_stats(ms);
+                        double sequential_mean = compute_stats(sequential_ms).mean;
+                        json_line line;
+                        line.add("bench", std::string("multilang"))
+                            .add("langs", (std::int64_t)n_langs)
+                            .add("audio_s", (std::int64_t)audio_s)
+                            .add("text_len", (std::int64_t)text_len)
+                            .add("beam_size", (std::int64_t)beam_size)
+                            .add("fixed_length", std::string(fixed_length ? "true" : "false"))
+                            .add("threads", (std::int64_t)n_threads);
+                        add_stats(line, stats);
+                        line.add("sequential_mean_ms", sequential_mean)
+                            .add("speedup", sequential_mean / stats.mean)
+                            .add("steps", steps)
+                            .add("sequential_steps", sequential_steps)
+                            .add("exact", (std::int64_t)exact);
+                        line.write(out);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/// Language identification alone against a speech translation with tgt_lang "unk", which
+/// scores the languages at its first step. The LID runs on the whole audio and on its first
+/// second; `max_diff` compares the scores with those of the translation. Decoding to <unk>
+/// must produce the tokens and scores of decoding to the most probable language.
+void bench_lid(bench_state& state, const bench_params& params, FILE* out) {
+    for (int audio_s : params.audio_s) {
+        std::vector<float> audio = state.random_audio(audio_s);
+        SequenceGeneratorOptions opts = fixed_length_opts(params.text_len[0], 1, params.mem_mb);
+        for (int n_threads : params.n_threads) {
+            Result translation;
+            auto translation_ms = run_timed(params, [&]() {
+                std::int64_t t_start_us = ggml_time_us();
+                translation = unity_eval_speech(state.model, audio, opts, "unk", n_threads);
+                GGML_ASSERT(translation.err == 0);
+                return elapsed_ms(t_start_us);
+            });
+            double translation_mean = compute_stats(translation_ms).mean;
+            // The <unk> target is replaced by the most probable language, as if it had been given.
+            std::string best_language;
+            float best_score = -INFINITY;
+            for (const auto& kv : translation.lid_scores) {
+                if (kv.second > best_score) {
+                    best_score = kv.second;
+                    best_language = kv.first.substr(2, kv.first.size() - 4);
+                }
+            }
+            // Compared on the hypotheses, the translations hide the scores of the prefix.
+            auto decode = [&](int tgt_lang_idx) {
+                state.begin();
+                Hypothesis* hypo = unity_decode(state.model, opts, tgt_lang_idx, state.encode_speech(audio, n_threads), n_threads);
+                const std::int32_t* seq = (const std::int32_t*)hypo->seq->data;
+                const float* step_scores = ggml_get_data_f32(hypo->step_scores);
+                std::pair<std::vector<std::int32_t>, std::vector<float>> decoded(
+                    std::vector<std::int32_t>(seq, seq + hypo->seq->ne[0]),
+                    std::vector<float>(step_scores, step_scores + hypo->step_scores->ne[0])
+                );
+                state.end();
+                return decoded;
+            };
+            auto unk_decoded = decode(state.model.vocab.token_to_id.at("<unk>"));
+            auto explicit_decoded = decode(state.model.vocab.token_to_id.at("__" + best_language + "__"));
+            GGML_ASSERT(unk_decoded == explicit_decoded);
+            std::string full_language;
+            for (float max_audio_s : {0.0f, 1.0f}) {
+                LidResult lid;
+                auto ms = run_timed(params, [&]() {
+                    std::int64_t t_start_us = ggml_time_us();
+                    lid = unity_identify_language(state.model, audio, params.mem_mb, max_audio_s, n_threads);
+                    GGML_ASSERT(lid.err == 0);
+                    return elapsed_ms(t_start_us);
+                });
+                if (max_audio_s == 0.0f) full_language = lid.language;
+                double max_diff = 0;
+                for (const auto& kv : translation.lid_scores) {
+                    max_diff = std::max(max_diff, (double)std::fabs(kv.second - lid.lid_scores[kv.first]));
+                }
+
+                bench_stats stats = compute_stats(ms);
+                json_line line;
+                line.add("bench", std::string("lid"))
+                    .add("audio_s", (std::int64_t)audio_s)
+                    .add("max_audio_s", (double)max_audio_s)
+                    .add("threads", (std::int64_t)n_threads);
+                add_stats(line, stats);
+                line.add("translation_mean_ms", translation_mean)
+                    .add("speedup", translation_mean / stats.mean)
+                    .add("language", lid.language)
+                    .add("agrees", (std::int64_t)(lid.language == full_language));
+                if (max_audio_s == 0.0f) line.add("max_diff", max_diff);
+                line.write(out);
+            }
+        }
+    }
+}
+
+/// Speech translation of audio submitted again, with its encoder output read from an
+/// EncoderCache in memory, or from disk after being spilled, against no cache.
+void bench_encoder_cache(bench_state& state, const bench_params& params, FILE* out) {
+    char spill_dir[] = "/tmp/unity_bench_cache_XXXXXX";
+    GGML_ASSERT(mkdtemp(spill_dir) != nullptr);
+    for (int audio_s : params.audio_s) {
+        std::vector<float> audio = state.random_audio(audio_s);
+        SequenceGeneratorOptions opts = fixed_length_opts(params.text_len[0], params.beam_size[0], params.mem_mb);
+        for (int n_threads : params.n_threads) {
+            Result uncached;
+            auto uncached_ms = run_timed(params, [&]() {
+                std::int64_t t_start_us = ggml_time_us();
+                uncached = unity_eval_speech(state.model, audio, opts, params.tgt_lang, n_threads);
+                GGML_ASSERT(uncached.err == 0);
+                return elapsed_ms(t_start_us);
+            });
+            double uncached_mean = compute_stats(uncached_ms).mean;
+
+            for (std::string storage : {"memory", "disk"}) {
+                EncoderCacheOptions cache_opts;
+                if (storage == "disk") {
+                    // every entry is spilled right away, and read back from disk
+                    cache_opts.max_bytes = 0;
+                    cache_opts.spill_dir = spill_dir;
+                }
+                EncoderCache cache(cache_opts);
+                cache.attach(state.model);
+                Result first = unity_eval_speech(state.model, audio, opts, params.tgt_lang, n_threads);
+                GGML_ASSERT(first.stats.encoder_cache_miss);
+                bool exact = first.transcription == uncached.transcription;
+                auto ms = run_timed(params, [&]() {
+                    std::int64_t t_start_us = ggml_time_us();
+                    Result result = unity_eval_speech(state.model, audio, opts, params.tgt_lang, n_threads);
+                    GGML_ASSERT(result.err == 0 && result.stats.encoder_cache_hit);
+                    exact = exact && result.transcription == uncached.transcription && result.units == uncached.units;
+                    return elapsed_ms(t_start_us);
+                });
+                state.model.encoder_cache = nullptr;
+
+                EncoderCacheStats cache_stats = cache.stats();
+                bench_stats stats = compute_stats(ms);
+                json_line line;
+                line.add("bench", std::string("encoder_cache"))
+                    .add("storage", storage)
+                    .add("audio_s", (std::int64_t)audio_s)
+                    .add("threads", (std::int64_t)n_threads);
+                add_stats(line, stats);
+                line.add("uncached_mean_ms", uncached_mean)
+                    .add("speedup", uncached_mean / stats.mean)
+                    .add("hit_rate", cache_stats.hit_rate())
+                    .add("entry_bytes", (std::int64_t)(cache_stats.bytes + cache_stats.spill_bytes))
+                    .add("exact", (std::int64_t)exact);
+                line.write(out);
+            }
+        }
+    }
+    rmdir(spill_dir);
+}
+
+/// Speech translation with the decoder KV cache stored in F32, F16 and Q8_0. `decode_speedup`
+/// compares the beam search steps to F32, and `word_match` is the fraction of the F32
+/// transcription found at the same position.
+void bench_kv_cache(bench_state& state, const bench_params& params, FILE* out) {
+    int audio_s = params.audio_s[0];
+    std::vector<float> audio = state.random_audio(audio_s);
+    for (int text_len : params.text_len) {
+        for (int beam_size : params.beam_size) {
+            for (int n_threads : params.n_threads) {
+                SequenceGeneratorOptions opts = fixed_length_opts(text_len, beam_size, params.mem_mb);
+                Result reference;
+                double reference_decode_ms = 0;
+                for (ggml_type type : {GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_Q8_0}) {
+                    state.model.kv_cache_type = type;
+                    Result result;
+                    std::vector<RequestStats> runs;
+                    auto ms = run_timed(params, [&]() {
+                        std::int64_t t_start_us = ggml_time_us();
+                        result = unity_eval_speech(state.model, audio, opts, params.tgt_lang, n_threads);
+                        GGML_ASSERT(result.err == 0);
+                        runs.push_back(result.stats);
+                        return elapsed_ms(t_start_us);
+                    });
+                    state.model.kv_cache_type = GGML_TYPE_F32;
+
+                    double decode_ms = 0;
+                    for (const RequestStats& run : runs) decode_ms += (run.bootstrap_us + run.decode_us()) / 1000.0;
+                    decode_ms /= runs.size();
+                    if (type == GGML_TYPE_F32) {
+                        reference = result;
+                        reference_decode_ms = decode_ms;
+                    }
+                    std::size_t n_match = 0;
+                    for (std::size_t i = 0; i < std::min(result.transcription.size(), reference.transcription.size()); ++i) {
+                        n_match += result.transcription[i] == reference.transcription[i];
+                    }
+
+                    bench_stats stats = compute_stats(ms);
+                    json_line line;
+                    line.add("bench", std::string("kv_cache"))
+                        .add("type", std::string(ggml_type_name(type)))
+                        .add("audio_s", (std::int64_t)audio_s)
+                        .add("text_len", (std::int64_t)text_len)
+                        .add("beam_size", (std::int64_t)beam_size)
+                        .add("threads", (std::int64_t)n_threads);
+                    add_stats(line, stats);
+                    line.add("decode_ms", decode_ms)
+                        .add("decode_speedup", reference_decode_ms / decode_ms)
+                        .add("word_match", reference.transcription.empty() ? 1.0 : (double)n_match / reference.transcription.size());
+                    line.write(out);
+                }
+            }
+        }
+    }
+}
+
+/// Speech translation by several processes sharing the cores, as when a host runs many small
+/// services, with the compute threads always spinning between nodes, spinning a while then
+/// sleeping (the default), or sleeping right away. Each process is forked after loading, so
+/// that they share the weights, and translates the same requests back to back.
+void bench_contention(bench_state& state, const bench_params& params, FILE* out) {
+#if defined(_WIN32)
+    fprintf(stderr, "%s: needs fork, skipping\n", __func__);
+#else
+    int audio_s = params.audio_s[0];
+    int text_len = params.text_len[0];
+    int beam_size = params.beam_size[0];
+    std::vector<float> audio = state.random_audio(audio_s);
+    SequenceGeneratorOptions opts = fixed_length_opts(text_len, beam_size, params.mem_mb);
+    int model_spin_count = state.model.spin_count;
+
+    for (int n_processes : params.processes) {
+        for (int n_threads : params.n_threads) {
+            for (int spin_count : {-1, GGML_DEFAULT_SPIN_COUNT, 0}) {
+                state.model.spin_count = spin_count;
+                int fds[2];
+                GGML_ASSERT(pipe(fds) == 0);
+                rusage usage_before;
+                getrusage(RUSAGE_CHILDREN, &usage_before);
+
+                std::int64_t t_start_us = ggml_time_us();
+                std::vector<pid_t> children;
+                for (int i = 0; i < n_processes; ++i) {
+                    pid_t pid = fork();
+                    GGML_ASSERT(pid >= 0);
+                    if (pid == 0) {
+                        close(fds[0]);
+                        // the mean time of the timed requests of this process
+                        auto ms = run_timed(params, [&]() {
+                            std::int64_t t_run_us = ggml_time_us();
+                            Result result = unity_eval_speech(state.model, audio, opts, params.tgt_lang, n_threads);
+                            GGML_ASSERT(result.err == 0);
+                            return elapsed_ms(t_run_us);
+                        });
+                        double mean_ms = compute_stats(ms).mean;
+                        bool ok = write(fds[1], &mean_ms, sizeof(mean_ms)) == sizeof(mean_ms);
+                        _exit(ok ? 0 : 1);
+                    }
+                    children.push_back(pid);
+                }
+                close(fds[1]);
+
+                std::vector<double> process_ms;
+                double mean_ms;
+                while (read(fds[0], &mean_ms, sizeof(mean_ms)) == sizeof(mean_ms)) {
+                    process_ms.push_back(mean_ms);
+                }
+                close(fds[0]);
+                for (pid_t pid : children) {
+                    int status;
+                    waitpid(pid, &status, 0);
+                    GGML_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+                }
+                double wall_ms = elapsed_ms(t_start_us);
+                GGML_ASSERT((int)process_ms.size() == n_processes);
+
+                rusage usage_after;
+                getrusage(RUSAGE_CHILDREN, &usage_after);
+                auto cpu_s = [](const rusage& usage) {
+                    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+                };
+                int n_requests = n_processes * (params.warmup + params.repeat);
+
+                bench_stats stats = compute_stats(process_ms);
+                json_line line;
+                line.add("bench", std::string("contention"))
+                    .add("processes", (std::int64_t)n_processes)
+                    .add("threads", (std::int64_t)n_threads)
+                    .add("spin_count", (std::int64_t)spin_count)
+                    .add("audio_s", (std::int64_t)audio_s)
+                    .add("text_len", (std::int64_t)text_len)
+                    .add("beam_size", (std::int64_t)beam_size);
+                add_stats(line, stats);
+                line.add("wall_ms", wall_ms)
+                    .add("requests_per_s", n_requests * 1000.0 / wall_ms)
+                    .add("cpu_s_per_request", (cpu_s(usage_after) - cpu_s(usage_before)) / n_requests);
+                line.write(out);
+            }
+        }
+    }
+    state.model.spin_count = model_spin_count;
+#endif
+}
+
+void bench_s2tt(bench_state& state, const bench_params& params, FILE* out) {
+    for (int audio_s : params.audio_s) {
+        std::vector<float> audio = state.random_audio(audio_s);
+        for (int text_len : params.text_len) {
+            for (int beam_size : params.beam_size) {
+                for (int n_threads : params.n_threads) {
+                    SequenceGeneratorOptions opts = fixed_length_opts(text_len, beam_size, params.mem_mb);
+                    std::vector<RequestStats> runs;
+                    auto ms = run_timed(params, [&]() {
+                        std::int64_t t_start_us = ggml_time_us();
+                        Result result = unity_eval_speech(state.model, audio, opts, params.tgt_lang, n_threads);
+                        GGML_ASSERT(result.err == 0);
+                        runs.push_back(result.stats);
+                        return elapsed_ms(t_start_us);
+                    });
+                    bench_stats stats = compute_stats(ms);
+                    json_line line;
+                    line.add("bench", std::string("s2tt"))
+                        .add("audio_s", (std::int64_t)audio_s)
+                        .add("text_len", (std::int64_t)text_len)
+                        .add("beam_size", (std::int64_t)beam_size)
+                        .add("threads", (std::int64_t)n_threads);
+                    add_stats(line, stats);
+                    line.add("rtf", stats.mean / 1000.0 / audio_s);
+                    add_request_stats(line, runs, params.repeat);
+                    line.write(out);
+                }
+            }
+        }
+    }
+}
+
+void bench_t2tt(bench_state& state, const bench_params& params, FILE* out) {
+    for (int text_len : params.text_len) {
+        std::string text = state.random_text(text_len);
+        for (int beam_size : params.beam_size) {
+            for (int n_threads : params.n_threads) {
+                SequenceGeneratorOptions opts = fixed_length_opts(text_len, beam_size, params.mem_mb);
+                std::vector<RequestStats> runs;
+                auto ms = run_timed(params, [&]() {
+                    std::int64_t t_start_us = ggml_time_us();
+                    Result result = unity_eval_text(state.model, text, opts, params.tgt_lang, n_threads);
+                    GGML_ASSERT(result.err == 0);
+                    runs.push_back(result.stats);
+                    return elapsed_ms(t_start_us);
+                });
+                bench_stats stats = compute_stats(ms);
+                json_line line;
+                line.add("bench", std::string("t2tt"))
+                    .add("text_len", (std::int64_t)text_len)
+                    .add("beam_size", (std::int64_t)beam_size)
+                    .add("threads", (std::int64_t)n_threads);
+                add_stats(line, stats);
+                line.add("tokens_per_s", text_len * 1000.0 / stats.mean);
+                add_request_stats(line, runs, params.repeat);
+                line.write(out);
+            }
+        }
+    }
+}
+
+/// Units of random text, from a random text decoder output.
+void bench_t2u(bench_state& state, const bench_params& params, FILE* out) {
+    if (!has_layer(state.model, "t2u_model.decoder_frontend") || state.model.char_vocab.id_to_token.empty()) {
+        fprintf(stderr, "%s: the model has no NAR T2U model, skipping\n", __func__);
+        return;
+    }
+    std::int64_t model_dim = state.model.tensors["text_decoder_frontend.embed.weight"]->ne[0];
+    int eos_idx = state.model.vocab.token_to_id.at("</s>");
+    int tgt_lang_idx = state.model.vocab.token_to_id.at("__" + params.tgt_lang + "__");
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+    for (int text_len : params.text_len) {
+        std::string text = state.random_text(text_len);
+        for (int n_threads : params.n_threads) {
+            std::int64_t n_chars = 0;
+            std::int64_t n_units = 0;
+            auto ms = run_timed(params, [&]() {
+                state.begin();
+                ggml_context* ctx = state.model.ctx;
+                // (EOS, lang) prefix, then the text without its EOS.
+                FORCE_ALLOC(tokens, ctx, ggml_new_tensor_1d(ctx, GGML_TYPE_I32, text.size() + 2));
+                fairseq2_spm_tokenize(&state.model, text.c_str(), tokens);
+                std::int64_t n_tokens = 0;
+                while (ggml_get_i32_1d(tokens, n_tokens) != eos_idx) ++n_tokens;
+                FORCE_ALLOC(text_seqs, ctx, ggml_new_tensor_1d(ctx, GGML_TYPE_I32, n_tokens + 2));
+                ggml_set_i32_1d(text_seqs, 0, eos_idx);
+                ggml_set_i32_1d(text_seqs, 1, tgt_lang_idx);
+                for (std::int64_t i = 0; i < n_tokens; ++i) ggml_set_i32_1d(text_seqs, i + 2, ggml_get_i32_1d(tokens, i));
+                FORCE_ALLOC(decoder_output, ctx, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, model_dim, n_tokens + 2));
+                for (std::int64_t i = 0; i < ggml_nelements(decoder_output); ++i) ggml_set_f32_1d(decoder_output, i, normal(state.rng));
+
+                std::int64_t t_start_us = ggml_time_us();
+                ggml_tensor* units = generate_units_nar(state.model, text_seqs, decoder_output, 1.0f, params.mem_mb, ctx, n_threads);
+                double elapsed = elapsed_ms(t_start_us);
+                GGML_ASSERT(units != nullptr);
+                n_units = units->ne[0];
+                n_chars = fairseq2_t2u_char_seqs(state.model, ctx, text_seqs).first->ne[0];
+                state.end();
+                return elapsed;
+            });
+            bench_stats stats = compute_stats(ms);
+            json_line line;
+            line.add("bench", std::string("t2u"))
+                .add("text_len", (std::int64_t)text_len)
+                .add("threads", (std::int64_t)n_threads)
+                .add("chars", n_chars)
+                .add("units", n_units);
+            add_stats(line, stats);
+            line.add("units_per_s", n_units * 1000.0 / stats.mean);
+            line.write(out);
+        }
+    }
+}
+
+/// Synthesizes `audio_s` seconds of random units, at once and streamed by chunks of units.
+/// The real-time factors are relative to the duration of the generated audio.
+void bench_vocoder(fairseq2_model& vocoder, const bench_params& params, FILE* out) {
+    const int sample_rate = 16000;
+    const int units_per_s = 50;
+    std::int64_t unit_vocab_size = vocoder.tensors["code_generator.dict.weight"]->ne[1];
+    std::mt19937 rng(0);
+    std::uniform_int_distribution<std::int32_t> random_unit(0, unit_vocab_size - 1);
+    for (int audio_s : params.audio_s) {
+        std::vector<std::int32_t> units(audio_s * units_per_s);
+        for (auto& unit : units) unit = random_unit(rng);
+        for (int n_threads : params.n_threads) {
+            std::vector<float> wav;
+            auto ms = run_timed(params, [&]() {
+                std::int64_t t_start_us = ggml_time_us();
+                wav = generate_waveform(vocoder, units, params.tgt_lang, -1, params.mem_mb, n_threads);
+                return elapsed_ms(t_start_us);
+            });
+            bench_stats stats = compute_stats(ms);
+            double wav_s = wav.size() / (double)sample_rate;
+            for (int chunk_units : params.chunk_units) {
+                std::vector<float> streamed;
+                double first_audio_ms = 0;
+                auto stream_ms = run_timed(params, [&]() {
+                    std::int64_t t_start_us = ggml_time_us();
+                    VocoderStream stream = vocoder_stream_init(vocoder, params.tgt_lang, -1, true, params.mem_mb);
+                    streamed.clear();
+                    first_audio_ms = 0;
+                    for (std::size_t i = 0; i < units.size(); i += chunk_units) {
+                        std::size_t n = std::min<std::size_t>(chunk_units, units.size() - i);
+                        bool flush = i + n == units.size();
+                        std::vector<float> samples = vocoder_stream_push(vocoder, stream, units.data() + i, n, flush, n_threads);
+                        if (!samples.empty() && streamed.empty()) first_audio_ms = elapsed_ms(t_start_us);
+                        streamed.insert(streamed.end(), samples.begin(), samples.end());
+                    }
+                    return elapsed_ms(t_start_us);
+                });
+                // Streaming is exact: it only differs from the offline waveform by rounding errors.
+                GGML_ASSERT(streamed.size() == wav.size());
+                double max_abs_diff = 0;
+                for (std::size_t i = 0; i < wav.size(); ++i) {
+                    max_abs_diff = std::max(max_abs_diff, (double)std::abs(streamed[i] - wav[i]));
+                }
+                GGML_ASSERT(max_abs_diff < 1e-3);
+                double stream_mean = compute_stats(stream_ms).mean;
+                json_line line;
+                line.add("bench", std::string("vocoder"))
+                    .add("units", (std::int64_t)units.size())
+                    .add("threads", (std::int64_t)n_threads)
+                    .add("samples", (std::int64_t)wav.size())
+                    .add("context_frames", fairseq2_vocoder_context_frames(vocoder, "code_generator"));
+                add_stats(line, stats);
+                line.add("rtf", stats.mean / 1000.0 / wav_s)
+                    .add("chunk_units", (std::int64_t)chunk_units)
+                    .add("stream_mean_ms", stream_mean)
+                    .add("stream_rtf", stream_mean / 1000.0 / wav_s)
+                    .add("first_audio_ms", first_audio_ms)
+                    .add("stream_max_abs_diff", max_abs_diff);
+                line.write(out);
+            }
+        }
+    }
+}
+
+/// Next token predicted by the monotonic decoder after `tokens`, without any cache:
+/// the decoder runs on the full prefix, like the streaming agents do at each policy call.
+std::int32_t monotonic_next_token(bench_state& state, const std::vector<std::int32_t>& tokens, ggml_tensor* encoder_output, int n_threads) {
+    fairseq2_model& model = state.model;
+    ggml_context* ctx = model.ctx;
+    FORCE_ALLOC(seqs, ctx, ggml_new_tensor_1d(ctx, GGML_TYPE_I32, tokens.size()));
+    std::copy(tokens.begin(), tokens.end(), (std::int32_t*)seqs->data);
+    ggml_tensor* x = TransformerEmbeddingFrontend_forward(model, "text_decoder_frontend", seqs);
+    x = MonotonicTransformerDecoder_forward(model, "text_decoder", x, nullptr, encoder_output, nullptr, nullptr);
+    ggml_tensor* logits = Linear_forward(model, "final_proj", ggml_slice(ctx, x, 1, tokens.size() - 1, tokens.size()));
+    ggml_cgraph* gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, logits);
+    fairseq2_graph_fuse(model, gf);
+    ggml_allocr_alloc_graph(state.fwd_alloc, gf);
+    fairseq2_graph_compute(model, ctx, gf, n_threads);
+    const float* logits_data = ggml_get_data_f32(logits);
+    std::int32_t token = std::max_element(logits_data, logits_data + logits->ne[0]) - logits_data;
+    ggml_allocr_reset(state.fwd_alloc);
+    return token;
+}
+
+/// Simultaneous translation of `audio_s` seconds of random audio: the encoder output
+/// is pushed to the monotonic decoder by chunks of frames, like the streaming agents do.
+/// The encoder isn't timed, the streaming encoder of the real pipeline isn't ported yet.
+void bench_monotonic(bench_state& state, fairseq2_model& decoder, const bench_params& params, FILE* out) {
+    bench_state decoder_state(decoder, params.mem_mb);
+    MonotonicDecoderOptions opts;
+    opts.max_len_a = 0;
+    opts.max_len_b = *std::max_element(params.text_len.begin(), params.text_len.end());
+    opts.mem_mb = params.mem_mb;
+    std::int32_t eos_idx = decoder.vocab.token_to_id.at("</s>");
+    std::int32_t tgt_lang_idx = decoder.vocab.token_to_id.at("__" + params.tgt_lang + "__");
+    for (int audio_s : params.audio_s) {
+        std::vector<float> audio = state.random_audio(audio_s);
+        state.begin();
+        ggml_tensor* encoder_output = state.encode_speech(audio, params.n_threads[0]);
+        std::int64_t model_dim = encoder_output->ne[0];
+        std::int64_t n_frames = encoder_output->ne[1];
+        std::vector<float> frames(ggml_get_data_f32(encoder_output), ggml_get_data_f32(encoder_output) + model_dim * n_frames);
+        state.end();
+        auto source_prefix = [&](std::int64_t n) {
+            ggml_tensor* source = ggml_new_tensor_2d(decoder.ctx, GGML_TYPE_F32, model_dim, n);
+            source->data = frames.data();
+            return source;
+        };
+
+        for (int n_threads : params.n_threads) {
+            // With the whole source, every token is written: the cached decoding must match
+            // the one running the decoder on the full prefix at each step.
+            decoder_state.begin();
+            MonotonicDecoderState full = monotonic_decoder_init(decoder, params.tgt_lang, opts);
+            monotonic_decoder_push(decoder, full, source_prefix(n_frames), /*source_finished*/true, n_threads);
+            std::vector<std::int32_t> prefix = {eos_idx, tgt_lang_idx};
+            bool incremental_match = true;
+            for (std::int32_t token : full.target) {
+                incremental_match &= monotonic_next_token(decoder_state, prefix, source_prefix(n_frames), n_threads) == token;
+                prefix.push_back(token);
+            }
+            GGML_ASSERT(incremental_match);
+            monotonic_decoder_free(full);
+            decoder_state.end();
+
+            for (int chunk_frames : params.chunk_frames) {
+                std::vector<double> push_ms;
+                std::int64_t n_tokens = 0, n_pushes = 0, first_write_frames = 0;
+                auto ms = run_timed(params, [&]() {
+                    decoder_state.begin();
+                    MonotonicDecoderState stream = monotonic_decoder_init(decoder, params.tgt_lang, opts);
+                    push_ms.clear();
+                    first_write_frames = 0;
+                    double elapsed = 0;
+                    for (std::int64_t n = 0; n < n_frames && !stream.finished;) {
+                        n = std::min<std::int64_t>(n + chunk_frames, n_frames);
+                        std::int64_t t_start_us = ggml_time_us();
+                        auto written = monotonic_decoder_push(decoder, stream, source_prefix(n), n == n_frames, n_threads);
+                        push_ms.push_back(elapsed_ms(t_start_us));
+                        elapsed += push_ms.back();
+                        if (!written.empty() && first_write_frames == 0) first_write_frames = n;
+                    }
+                    n_tokens = stream.target.size();
+                    n_pushes = push_ms.size();
+                    monotonic_decoder_free(stream);
+                    decoder_state.end();
+                    return elapsed;
+                });
+                bench_stats stats = compute_stats(ms);
+                bench_stats push_stats = compute_stats(push_ms);
+                json_line line;
+                line.add("bench", std::string("monotonic"))
+                    .add("audio_s", (std::int64_t)audio_s)
+                    .add("threads", (std::int64_t)n_threads)
+                    .add("encoder_frames", n_frames)
+                    .add("chunk_frames", (std::int64_t)chunk_frames)
+                    .add("pushes", n_pushes)
+                    .add("tokens", n_tokens);
+                add_stats(line, stats);
+                line.add("push_mean_ms", push_stats.mean)
+                    .add("push_max_ms", push_stats.max)
+                    .add("first_write_frames", first_write_frames)
+                    .add("incremental_match", (std::int64_t)incremental_match);
+                line.write(out);
+            }
+        }
+    }
+}
+
+/// Computes `gf` `iters` times, and returns the mean time per iteration.
+double graph_compute_ms(ggml_cgraph* gf, int n_threads, int iters) {
+    ggml_cplan cplan = ggml_graph_plan(gf, n_threads);
+    GGML_ASSERT(cplan.work_size == 0);
+    std::int64_t t_start_us = ggml_time_us();
+    for (int i = 0; i < iters; ++i) ggml_graph_compute(gf, &cplan);
+    return elapsed_ms(t_start_us) / iters;
+}
+
+/// Compares `ggml_layer_norm` with the norm -> mul(weight) -> add(bias) chain
+/// it replaces in `LayerNorm_forward`, on `text_len` rows of the model dim.
+void bench_layer_norm(bench_state& state, const bench_params& params, FILE* out) {
+    const std::string prefix = "speech_encoder.inner_layer_norm";
+    ggml_tensor* weight = state.model.tensors[prefix + ".weight"];
+    ggml_tensor* bias = state.model.tensors[prefix + ".bias"];
+    GGML_ASSERT(weight != nullptr && bias != nullptr);
+    const std::int64_t dim = weight->ne[0];
+    const int iters = 100;
+
+    for (int text_len : params.text_len) {
+        for (int n_threads : params.n_threads) {
+            std::vector<std::uint8_t> buf(8 * (dim * text_len * sizeof(float) + ggml_tensor_overhead()) + 2 * ggml_graph_overhead());
+            ggml_context* ctx = ctx_from_buffer(buf);
+            ggml_tensor* x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, dim, text_len);
+            std::normal_distribution<float> dist(0.0f, 1.0f);
+            for (std::int64_t i = 0; i < ggml_nelements(x); ++i) ggml_get_data_f32(x)[i] = dist(state.rng);
+
+            ggml_tensor* chain = ggml_norm(ctx, x, 1e-5f);
+            chain = ggml_add_inplace(
+                ctx,
+                ggml_mul_inplace(ctx, ggml_repeat(ctx, weight, chain), chain),
+                ggml_repeat(ctx, bias, chain)
+            );
+            ggml_tensor* fused = ggml_layer_norm(ctx, x, weight, bias, 1e-5f);
+            ggml_cgraph* chain_gf = ggml_new_graph(ctx);
+            ggml_build_forward_expand(chain_gf, chain);
+            ggml_cgraph* fused_gf = ggml_new_graph(ctx);
+            ggml_build_forward_expand(fused_gf, fused);
+
+            auto chain_ms = run_timed(params, [&]() { return graph_compute_ms(chain_gf, n_threads, iters); });
+            auto fused_ms = run_timed(params, [&]() { return graph_compute_ms(fused_gf, n_threads, iters); });
+            ggml_free(ctx);
+
+            bench_stats stats = compute_stats(fused_ms);
+            double chain_mean = compute_stats(chain_ms).mean;
+            json_line line;
+            line.add("bench", std::string("layer_norm"))
+                .add("rows", (std::int64_t)text_len)
+                .add("dim", dim)
+                .add("threads", (std::int64_t)n_threads);
+            add_stats(line, stats);
+            line.add("unfused_mean_ms", chain_mean)
+                .add("speedup", chain_mean / stats.mean);
+            line.write(out);
+        }
+    }
+}
+
+/// Sinusoidal position tables generated by the loader, against scalar std::sin and std::cos
+/// of the same float32 angles: the table of the text decoder and the relative one of the speech encoder.
+void bench_pos_enc(bench_state& state, const bench_params& params, FILE* out) {
+    for (bool relative : {false, true}) {
+        std::string prefix = relative ? "speech_encoder.pos_enc" : "text_decoder_frontend.pos_encoder";
+        ggml_tensor* table = state.model.tensors[prefix];
+        GGML_ASSERT(table != nullptr);
+        int dim = table->ne[0];
+        std::int64_t rows = table->ne[1];
+        std::int64_t start = relative ? (rows - 1) / 2 : 1;
+        std::vector<float> data(dim * rows), expected(dim * rows);
+
+        auto ms = run_timed(params, [&]() {
+            std::int64_t t_start_us = ggml_time_us();
+            if (relative) {
+                fairseq2_relative_sinusoidal_encodings(data.data(), dim, start, rows);
+            } else {
+                fairseq2_sinusoidal_encodings(data.data(), dim, start, rows);
+            }
+            return elapsed_ms(t_start_us);
+        });
+        auto reference_ms = run_timed(params, [&]() {
+            std::int64_t t_start_us = ggml_time_us();
+            int half = dim / 2;
+            float coef = relative ? (float)(-std::log(10000.0) / dim) : (float)(-std::log(10000.0) / (half - 1));
+            for (std::int64_t row = 0; row < rows; ++row) {
+                std::int64_t pos = relative ? start - row : start + row;
+                for (int i = 0; i < half; ++i) {
+                    float freq = std::exp((float)(relative ? 2 * i : i) * coef);
+                    double angle = (pos < 0 ? -1.0f : 1.0f) * ((float)std::abs(pos) * freq);
+                    float* dst = expected.data() + row * dim;
+                    dst[relative ? 2 * i : i] = std::sin(angle);
+                    dst[relative ? 2 * i + 1 : half + i] = std::cos(angle);
+                }
+            }
+            return elapsed_ms(t_start_us);
+        });
+        double max_abs_err = 0;
+        for (std::size_t i = 0; i < data.size(); ++i) max_abs_err = std::max<double>(max_abs_err, std::abs(data[i] - expected[i]));
+
+        bench_stats stats = compute_stats(ms);
+        double reference_mean = compute_stats(reference_ms).mean;
+        json_line line;
+        line.add("bench", std::string("pos_enc"))
+            .add("table", std::string(relative ? "relative" : "absolute"))
+            .add("rows", rows)
+            .add("dim", (std::int64_t)dim);
+        add_stats(line, stats);
+        line.add("reference_mean_ms", reference_mean)
+            .add("speedup", reference_mean / stats.mean)
+            .add("max_abs_err", max_abs_err);
+        line.write(out);
+    }
+}
+
+void bench_resample(bench_state& /*state*/, const bench_params& params, FILE* out) {
+    const int out_rate = 16000;
+    const double pi = 3.14159265358979323846;
+    for (auto rate_channels : std::vector<std::pair<int, int>>{{44100, 2}, {48000, 2}, {22050, 1}, {8000, 1}}) {
+        int in_rate = rate_channels.first;
+        int channels = rate_channels.second;
+        for (int audio_s : params.audio_s) {
+            // A 1kHz tone, plus a 10kHz one which must be filtered out when it's above the input
+            // Nyquist frequency, plus a 3kHz one which cancels out in the downmix.
+            std::int64_t n_frames = (std::int64_t)in_rate * audio_s;
+            std::vector<float> audio(n_frames * channels);
+            double alias_amp = in_rate > 20000 ? 0.05 : 0.0;
+            for (std::int64_t i = 0; i < n_frames; ++i) {
+                double t = (double)i / in_rate;
+                for (int c = 0; c < channels; ++c) {
+                    double cancelled_amp = channels == 1 ? 0.0 : c == 0 ? 0.25 * (channels - 1) : -0.25;
+                    audio[i * channels + c] = (float)(0.5 * std::sin(2 * pi * 1000.0 * t)
+                        + alias_amp * std::sin(2 * pi * 10000.0 * t)
+                        + cancelled_amp * std::sin(2 * pi * 3000.0 * t));
+                }
+            }
+
+            std::vector<float> resampled = resample_audio(audio.data(), n_frames, channels, in_rate, out_rate);
+            GGML_ASSERT((std::int64_t)resampled.size() == (n_frames * out_rate + in_rate - 1) / in_rate);
+            // Only the 1kHz tone is left, away from the edges where the input is padded with zeros.
+            double max_abs_err = 0;
+            for (std::size_t i = 64; i + 64 < resampled.size(); ++i) {
+                double expected = 0.5 * std::sin(2 * pi * 1000.0 * i / out_rate);
+                max_abs_err = std::max(max_abs_err, std::abs(resampled[i] - expected));
+            }
+            GGML_ASSERT(max_abs_err < 1e-3);
+
+            // Streaming in blocks of any size gives the same samples.
+            AudioResampler resampler(in_rate, out_rate, channels);
+            std::vector<float> streamed;
+            std::mt19937 rng(audio_s);
+            for (std::int64_t i = 0; i < n_frames;) {
+                std::int64_t n = std::min<std::int64_t>(n_frames - i, 1 + rng() % 4000);
+                resampler.process(audio.data() + i * channels, n, streamed);
+                i += n;
+            }
+            resampler.flush(streamed);
+            GGML_ASSERT(streamed == resampled);
+
+            auto ms = run_timed(params, [&]() {
+                std::int64_t t_start_us = ggml_time_us();
+                resample_audio(audio.data(), n_frames, channels, in_rate, out_rate);
+                return elapsed_ms(t_start_us);
+            });
+            bench_stats stats = compute_stats(ms);
+            json_line line;
+            line.add("bench", std::string("resample"))
+                .add("in_rate", (std::int64_t)in_rate)
+                .add("channels", (std::int64_t)channels)
+                .add("audio_s", (std::int64_t)audio_s);
+            add_stats(line, stats);
+            line.add("msamples_per_s", n_frames / stats.mean / 1000.0)
+                .add("realtime_factor", audio_s * 1000.0 / stats.mean)
+                .add("latency_frames", (std::int64_t)resampler.latency())
+                .add("max_abs_err", max_abs_err);
+            line.write(out);
+        }
+    }
+}
+
+void bench_wav(bench_state& /*state*/, const bench_params& params, FILE* out) {
+    const double pi = 3.14159265358979323846;
+    std::string path = "unity_bench_audio.wav";
+    for (auto rate_channels : std::vector<std::pair<int, int>>{{16000, 1}, {44100, 2}}) {
+        int rate = rate_channels.first;
+        int channels = rate_channels.second;
+        for (int audio_s : params.audio_s) {
+            std::int64_t n_frames = (std::int64_t)rate * audio_s;
+            std::vector<float> audio(n_frames * channels);
+            for (std::int64_t i = 0; i < (std::int64_t)audio.size(); ++i) {
+                audio[i] = (float)(0.5 * std::sin(2 * pi * 440.0 * (i / channels) / rate + (i % channels)));
+            }
+            GGML_ASSERT(write_wav(path, audio, rate, channels));
+            // The samples as written, 16-bit.
+            std::vector<float> pcm(audio.size());
+            for (std::size_t i = 0; i < audio.size(); ++i) pcm[i] = std::lrint(audio[i] * 32767.0f) / 32768.0f;
+            std::vector<float> expected = channels == 1 && rate == 16000 ? pcm : resample_audio(pcm.data(), n_frames, channels, rate);
+
+            std::vector<float> data;
+            GGML_ASSERT(read_wav(path, 0, data));
+            GGML_ASSERT(data == expected);
+            // Reading in chunks of any size gives the same samples.
+            std::vector<float> streamed;
+            WavReader reader(path);
+            GGML_ASSERT(reader.ok() && reader.n_frames() == n_frames && reader.channels() == channels);
+            std::mt19937 rng(audio_s);
+            while (reader.read(1 + rng() % 8000, streamed) > 0) {}
+            reader.flush(streamed);
+            GGML_ASSERT(streamed == expected);
+
+            auto ms = run_timed(params, [&]() {
+                std::int64_t t_start_us = ggml_time_us();
+                read_wav(path, 0, data);
+                return elapsed_ms(t_start_us);
+            });
+            // Reference: the whole file read in a buffer, then converted, without resampling.
+            auto reference_ms = run_timed(params, [&]() {
+                std::int64_t t_start_us = ggml_time_us();
+                std::ifstream file(path, std::ios::binary);
+                std::vector<char> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+                std::vector<float> samples((bytes.size() - 44) / 2);
+                for (std::size_t i = 0; i < samples.size(); ++i) {
+                    std::int16_t sample;
+                    std::memcpy(&sample, bytes.data() + 44 + 2 * i, 2);
+                    samples[i] = sample / 32768.0f;
+                }
+                return elapsed_ms(t_start_us);
+            });
+            bench_stats stats = compute_stats(ms);
+            double reference_mean = compute_stats(reference_ms).mean;
+            json_line line;
+            line.add("bench", std::string("wav"))
+                .add("rate", (std::int64_t)rate)
+                .add("channels", (std::int64_t)channels)
+                .add("audio_s", (std::int64_t)audio_s);
+            add_stats(line, stats);
+            line.add("msamples_per_s", n_frames / stats.mean / 1000.0)
+                .add("reference_mean_ms", reference_mean);
+            line.write(out);
+        }
+    }
+    std::remove(path.c_str());
+}
+
+void bench_fbank(bench_state& state, const bench_params& params, FILE* out) {
+    GGML_ASSERT(state.model.fbank != nullptr);
+    fairseq2_fbank* fbank = state.model.fbank;
+    // Short utterances, where building the extractor was a visible part of the fbank time.
+    for (int audio_ms : {250, 1000, 5000}) {
+        std::vector<float> audio(16 * audio_ms);
+        std::normal_distribution<float> noise(0.0f, 0.1f);
+        for (float& x : audio) x = noise(state.rng);
+        auto features = [&]() {
+            state.begin();
+            ggml_tensor* waveform = ggml_new_tensor_2d(state.model.ctx, GGML_TYPE_F32, audio.size(), 1);
+            waveform->data = audio.data();
+            ggml_tensor* seqs = WaveformToFbank_forward(state.model, "speech_encoder", waveform);
+            ggml_cgraph* gf = ggml_new_graph(state.model.ctx);
+            ggml_build_forward_expand(gf, seqs);
+            ggml_allocr_alloc_graph(state.fwd_alloc, gf);
+            fairseq2_graph_compute(state.model, state.model.ctx, gf, 1);
+            std::vector<float> data(ggml_get_data_f32(seqs), ggml_get_data_f32(seqs) + ggml_nelements(seqs));
+            state.end();
+            return data;
+        };
+        // Same features with the extractor of the model and with one built for the call.
+        std::vector<float> cached = features();
+        state.model.fbank = nullptr;
+        std::vector<float> uncached = features();
+        state.model.fbank = fbank;
+        GGML_ASSERT(cached == uncached);
+
+        std::map<std::string, std::vector<double>> ms;
+        for (bool use_cache : {true, false}) {
+            state.model.fbank = use_cache ? fbank : nullptr;
+            ms[use_cache ? "cached" : "uncached"] = run_timed(params, [&]() {
+                std::int64_t t_start_us = ggml_time_us();
+                state.begin();
+                ggml_tensor* waveform = ggml_new_tensor_2d(state.model.ctx, GGML_TYPE_F32, audio.size(), 1);
+                waveform->data = audio.data();
+                WaveformToFbank_forward(state.model, "speech_encoder", waveform);
+                state.end();
+                return elapsed_ms(t_start_us);
+            });
+        }
+        state.model.fbank = fbank;
+        bench_stats stats = compute_stats(ms["cached"]);
+        double uncached_mean = compute_stats(ms["uncached"]).mean;
+        json_line line;
+        line.add("bench", std::string("fbank"))
+            .add("audio_ms", (std::int64_t)audio_ms);
+        add_stats(line, stats);
+        line.add("uncached_mean_ms", uncached_mean)
+            .add("speedup", uncached_mean / stats.mean);
+        line.write(out);
+    }
+}
+
+int main(int argc, char ** argv) {
+    bench_params params;
+    if (bench_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+    if (params.repeat < 1) {
+        fprintf(stderr, "error: --repeat must be at least 1\n");
+        return 1;
+    }
+    ggml_time_init();
+
+    std::string model_path = params.model;
+    if (model_path.empty()) {
+        model_path = params.write_model.empty() ? "unity_bench_synthetic.ggml" : params.write_model;
+        int max_text_len = *std::max_element(params.text_len.begin(), params.text_len.end());
+        params.synthetic.max_seq_len = std::max<std::int64_t>(params.synthetic.max_seq_len, max_text_len + 3);
+        synthetic_model synthetic = synthetic_unity_model(params.synthetic);
+        if (!write_synthetic_model(synthetic, model_path.c_str(), params.synthetic.seed)) {
+            fprintf(stderr, "%s: failed to write synthetic model to '%s'\n", __func__, model_path.c_str());
+            return 1;
+        }
+    }
+
+    fairseq2_model model;
+    if (load_fairseq2_ggml_file(model, model_path.c_str())) {
+        fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, model_path.c_str());
+        return 1;
+    }
+    bool bench_numa_enabled = std::find(params.benches.begin(), params.benches.end(), "numa") != params.benches.end();
+    std::vector<fairseq2_model> numa_interleaved;
+    std::vector<fairseq2_model> numa_replicas;
+    if (bench_numa_enabled) {
+        ggml_numa_init();
+        numa_interleaved = unity_load_numa_models(model_path.c_str(), NumaMode::interleave);
+        numa_replicas = unity_load_numa_models(model_path.c_str(), NumaMode::replicate);
+        if (numa_interleaved.empty() || numa_replicas.empty()) {
+            fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, model_path.c_str());
+            return 1;
+        }
+        for (auto& replica : numa_interleaved) replica.fuse_graphs = params.fuse;
+        for (auto& replica : numa_replicas) replica.fuse_graphs = params.fuse;
+    }
+    if (params.model.empty() && params.write_model.empty()) {
+        std::remove(model_path.c_str());
+    }
+
+    bool bench_vocoder_enabled = std::find(params.benches.begin(), params.benches.end(), "vocoder") != params.benches.end();
+    std::string vocoder_path = params.vocoder;
+    if (vocoder_path.empty() && bench_vocoder_enabled && params.synthetic.vocoder_channels > 0) {
+        vocoder_path = model_path + ".vocoder";
+        synthetic_model synthetic = synthetic_vocoder_model(params.synthetic);
+        if (!write_synthetic_model(synthetic, vocoder_path.c_str(), params.synthetic.seed)) {
+            fprintf(stderr, "%s: failed to write synthetic vocoder to '%s'\n", __func__, vocoder_path.c_str());
+            return 1;
+        }
+    }
+    bool bench_monotonic_enabled = std::find(params.benches.begin(), params.benches.end(), "monotonic") != params.benches.end();
+    std::string monotonic_path = params.monotonic_decoder;
+    if (monotonic_path.empty() && bench_monotonic_enabled && params.model.empty()) {
+        monotonic_path = model_path + ".monotonic";
+        synthetic_model synthetic = synthetic_monotonic_decoder_model(params.synthetic);
+        if (!write_synthetic_model(synthetic, monotonic_path.c_str(), params.synthetic.seed)) {
+            fprintf(stderr, "%s: failed to write synthetic monotonic decoder to '%s'\n", __func__, monotonic_path.c_str());
+            return 1;
+        }
+    }
+    fairseq2_model monotonic_decoder;
+    if (!monotonic_path.empty()) {
+        if (load_fairseq2_ggml_file(monotonic_decoder, monotonic_path.c_str())) {
+            fprintf(stderr, "%s: failed to load monotonic decoder from '%s'\n", __func__, monotonic_path.c_str());
+            return 1;
+        }
+        if (params.monotonic_decoder.empty() && params.write_model.empty()) {
+            std::remove(monotonic_path.c_str());
+        }
+        monotonic_decoder.fuse_graphs = params.fuse;
+    }
+    bool bench_units_enabled = std::find(params.benches.begin(), params.benches.end(), "units") != params.benches.end();
+    std::string kmeans_path = params.kmeans;
+    if (kmeans_path.empty() && bench_units_enabled && params.synthetic.kmeans_clusters > 0) {
+        kmeans_path = model_path + ".kmeans";
+        synthetic_model synthetic = synthetic_kmeans_model(params.synthetic);
+        if (!write_synthetic_model(synthetic, kmeans_path.c_str(), params.synthetic.seed)) {
+            fprintf(stderr, "%s: failed to write synthetic k-means quantizer to '%s'\n", __func__, kmeans_path.c_str());
+            return 1;
+        }
+    }
+    fairseq2_model kmeans;
+    if (!kmeans_path.empty()) {
+        if (load_fairseq2_ggml_file(kmeans, kmeans_path.c_str())) {
+            fprintf(stderr, "%s: failed to load k-means quantizer from '%s'\n", __func__, kmeans_path.c_str());
+            return 1;
+        }
+        if (params.kmeans.empty() && params.write_model.empty()) {
+            std::remove(kmeans_path.c_str());
+        }
+    }
+    fairseq2_model vocoder;
+    if (!vocoder_path.empty()) {
+        if (load_fairseq2_ggml_file(vocoder, vocoder_path.c_str())) {
+            fprintf(stderr, "%s: failed to load vocoder from '%s'\n", __func__, vocoder_path.c_str());
+            return 1;
+        }
+        if (params.vocoder.empty() && params.write_model.empty()) {
+            std::remove(vocoder_path.c_str());
+        }
+        vocoder.fuse_graphs = params.fuse;
+    }
+    model.fuse_graphs = params.fuse;
+
+    FILE* out = stdout;
+    if (params.output != "-") {
+        out = std::fopen(params.output.c_str(), "w");
+        if (out == nullptr) {
+            fprintf(stderr, "%s: failed to open '%s'\n", __func__, params.output.c_str());
+            return 1;
+        }
+    }
+
+    // tied tensors are counted once
+    std::int64_t n_params = 0;
+    std::set<const ggml_tensor*> params_seen;
+    for (const auto& kv : model.tensors) {
+        if (kv.second != nullptr && params_seen.insert(kv.second).second) n_params += ggml_nelements(kv.second);
+    }
+    json_line header;
+    header.add("bench", std::string("model"))
+        .add("model", params.model.empty() ? std::string("synthetic") : params.model)
+        .add("n_params", n_params)
+        .add("model_dim", model.tensors["text_decoder_frontend.embed.weight"]->ne[0])
+        .add("vocab_size", model.tensors["text_decoder_frontend.embed.weight"]->ne[1])
+        .add("warmup", (std::int64_t)params.warmup)
+        .add("repeat", (std::int64_t)params.repeat)
+        .add("fuse", std::string(params.fuse ? "true" : "false"));
+    header.write(out);
+
+    bench_state state(model, params.mem_mb);
+    for (const auto& bench : params.benches) {
+        if (bench == "speech_encoder") {
+            bench_speech_encoder(state, params, out);
+        } else if (bench == "text_encoder") {
+            bench_text_encoder(state, params, out);
+        } else if (bench == "decoder") {
+            bench_decoder(state, params, out);
+        } else if (bench == "s2tt") {
+            bench_s2tt(state, params, out);
+        } else if (bench == "t2tt") {
+            bench_t2tt(state, params, out);
+        } else if (bench == "t2u") {
+            bench_t2u(state, params, out);
+        } else if (bench == "vocoder") {
+            if (vocoder.tensors_ctx == nullptr) {
+                fprintf(stderr, "%s: no vocoder, skipping\n", __func__);
+                continue;
+            }
+            bench_vocoder(vocoder, params, out);
+        } else if (bench == "monotonic") {
+            if (monotonic_decoder.tensors_ctx == nullptr) {
+                fprintf(stderr, "%s: no monotonic decoder, skipping\n", __func__);
+                continue;
+            }
+            bench_monotonic(state, monotonic_decoder, params, out);
+        } else if (bench == "vad") {
+            bench_vad(state, params, out);
+        } else if (bench == "units") {
+            if (kmeans.tensors_ctx == nullptr) {
+                fprintf(stderr, "%s: no k-means quantizer, skipping\n", __func__);
+                continue;
+            }
+            bench_units(state, kmeans, params, out);
+        } else if (bench == "sessions") {
+            bench_sessions(state, params, out);
+        } else if (bench == "pipeline") {
+            bench_pipeline(state, params, out);
+        } else if (bench == "deadline") {
+            bench_deadline(state, params, out);
+        } else if (bench == "multilang") {
+            bench_multilang(state, params, out);
+        } else if (bench == "lid") {
+            bench_lid(state, params, out);
+        } else if (bench == "encoder_cache") {
+            bench_encoder_cache(state, params, out);
+        } else if (bench == "kv_cache") {
+            bench_kv_cache(state, params, out);
+        } else if (bench == "contention") {
+            bench_contention(state, params, out);
+        } else if (bench == "numa") {
+            bench_numa(model, numa_interleaved, numa_replicas, params, out);
+        } else if (bench == "layer_norm") {
+            bench_layer_norm(state, params, out);
+        } else if (bench == "pos_enc") {
+            bench_pos_enc(state, params, out);
+        } else if (bench == "resample") {
+            bench_resample(state, params, out);
+        } else if (bench == "wav") {
+            bench_wav(state, params, out);
+        } else if (bench == "fbank") {
+            bench_fbank(state, params, out);
+        } else {
+            fprintf(stderr, "%s: unknown benchmark '%s'\n", __func__, bench.c_str());
+            return 1;
+        }
+    }
+
+    if (out != stdout) std::fclose(out);
+    if (!params.metrics.empty()) {
+        FILE* metrics_out = std::fopen(params.metrics.c_str(), "w");
+        if (metrics_out == nullptr) {
+            fprintf(stderr, "%s: failed to open '%s'\n", __func__, params.metrics.c_str());
+            return 1;
+        }
+        unity_metrics_write(metrics_out);
+        std::fclose(metrics_out);
+    }
+    for (auto& replica : numa_interleaved) fairseq2_model_free(&replica);
+    for (auto& replica : numa_replicas) fairseq2_model_free(&replica);
+    fairseq2_model_free(&monotonic_decoder);
+    fairseq2_model_free(&kmeans);
+    fairseq2_model_free(&vocoder);
+    fairseq2_model_free(&model);
+    return 0;
+}
@@ -404,6 +404,8 @@ def build_and_compute(
     gf = ggml_build_forward(tensor)
     need_alloc = tensor.contents.data == NULLPTR
     if need_alloc:
+        # same rewrites as the C++ inference code, only possible before allocating
+        ggml_graph_fuse(ctypes.pointer(gf))
         alloc = FixedSizeArena(1024 * 1024 * 1024 * 2)
         ggml_allocr_alloc_graph(alloc.ptr, ctypes.pointer(gf))
         setattr(tensor, "__data", alloc)
@@ -416,6 +418,11 @@ def build_and_compute(
     return gf
 
 
+@c_fn(lib)
+def ggml_graph_fuse(cgraph: Ptr[ggml_cgraph]) -> int:
+    ...
+
+
 @c_fn(lib)
 def causal_attention_mask(
     ctx: ggml_context_p, seqs: Ptr[ggml_tensor]
@@ -37,6 +37,9 @@ class ModelType(str, Enum):
     NLLB = "nllb"
     MT = "bitext"
     MTS = "bitext_scripted"
+    VOCODER = "vocoder"
+    MONOTONIC_DECODER = "monotonic_decoder"
+    KMEANS = "kmeans"
 
 
 UNITY_SMALLER_MODELS = [
@@ -230,7 +233,13 @@ def convert_unity_model(
 
     vocab = read_vocab(tokenizer)
 
-    return model, hparams, vocab
+    # The NAR T2U model splits the text tokens in characters.
+    char_vocab: List[Tuple[str, float]] = []
+    char_tokenizer = getattr(getattr(model.t2u_model, "decoder_frontend", None), "char_tokenizer", None)
+    if char_tokenizer is not None:
+        char_vocab = read_vocab(char_tokenizer)
+
+    return model, hparams, vocab, char_vocab
 
 
 def convert_nllb_model(
@@ -252,6 +261,57 @@ def convert_nllb_model(
     return model, hparams, vocab
 
 
+def convert_vocoder_model(
+    model_name: str,
+    hparams: Optional[Dict[str, Any]] = None,
+):
+    from seamless_communication.models.vocoder import load_vocoder_model
+
+    hparams = hparams or {}
+    model = load_vocoder_model(model_name)
+
+    return model, hparams
+
+
+def convert_monotonic_decoder_model(
+    model_name: str,
+    hparams: Optional[Dict[str, Any]] = None,
+    text_tokenizer_name: str = "seamless_streaming_unity",
+):
+    from seamless_communication.models.monotonic_decoder import (
+        load_monotonic_decoder_config,
+        load_monotonic_decoder_model,
+    )
+    from seamless_communication.models.unity import load_unity_text_tokenizer
+
+    model_config = load_monotonic_decoder_config(model_name)
+    hparams = flatten_config(
+        dataclasses.asdict(model_config), separator="__", overrides=hparams,
+    )
+    model = load_monotonic_decoder_model(model_name)
+    # The monotonic decoder checkpoint doesn't have a tokenizer, it uses the one of the streaming UnitY model.
+    tokenizer = load_unity_text_tokenizer(text_tokenizer_name)
+    vocab = read_vocab(tokenizer)
+
+    return model, hparams, vocab
+
+
+def convert_kmeans_model(
+    kmeans_uri: str,
+    hparams: Optional[Dict[str, Any]] = None,
+):
+    import numpy as np
+
+    hparams = hparams or {}
+    km_path = download_manager.download_checkpoint(kmeans_uri, kmeans_uri)
+    # (K, D) centroids, the C++ KmeansQuantizer computes their norms
+    kmeans = torch.nn.Module()
+    kmeans.register_buffer("centroids", torch.from_numpy(np.load(km_path)).float())
+    model = torch.nn.ModuleDict({"kmeans": kmeans})
+
+    return model, hparams
+
+
 def convert_bitext_model(
     model_name: str,
     hparams: Optional[Dict[str, Any]] = None,
@@ -281,6 +341,9 @@ def convert_model(
     Entry function for converting different kinds of model into GGML file. Supported model checkpoints:
         - unity models
         - nllb models
+        - CodeHiFiGAN vocoders
+        - monotonic decoders of the streaming models
+        - k-means quantizers of the unit extractor (.npy centroids)
         - Bilingual encoder-decoder model (Pytorch) with separate vocabulary for src and tgt languages
         - Bilingual encoder-decoder model (torchscript)
     Args:
@@ -297,7 +360,9 @@ def convert_model(
     """
 
     key_map: Optional[Dict[str, str]] = None
+    vocab: Optional[List[Tuple[str, float]]] = None
     tgt_vocab: Optional[List[Tuple[str, float]]] = None
+    char_vocab: Optional[List[Tuple[str, float]]] = None
     if isinstance(model_name, str):
         # Load the corresponding fairseq2 model
         if out is None:
@@ -310,16 +375,28 @@ def convert_model(
                     model_type = ModelType.UNITY
                 elif "nllb" in model_name:
                     model_type = ModelType.NLLB
+                elif "vocoder" in model_name:
+                    model_type = ModelType.VOCODER
+                elif "monotonic_decoder" in model_name:
+                    model_type = ModelType.MONOTONIC_DECODER
+                elif "kmeans" in model_name or model_name.endswith(".npy"):
+                    model_type = ModelType.KMEANS
 
             assert (
                 model_type != ModelType.AUTO
             ), "Cannot infer model type from the `model_name`. Please specify `model_type`"
 
             if model_type == ModelType.UNITY:
-                model, hparams, vocab = convert_unity_model(model_name, hparams=hparams)
+                model, hparams, vocab, char_vocab = convert_unity_model(model_name, hparams=hparams)
             elif model_type == ModelType.NLLB:
                 model, hparams, vocab = convert_nllb_model(model_name, hparams=hparams)
                 key_map = NLLB_2_UNITY_KEYMAP
+            elif model_type == ModelType.VOCODER:
+                model, hparams = convert_vocoder_model(model_name, hparams=hparams)
+            elif model_type == ModelType.MONOTONIC_DECODER:
+                model, hparams, vocab = convert_monotonic_decoder_model(model_name, hparams=hparams)
+            elif model_type == ModelType.KMEANS:
+                model, hparams = convert_kmeans_model(model_name, hparams=hparams)
             elif model_type == ModelType.MTS:
                 # TODO: implement the EdgeML model conversion here
                 raise NotImplementedError("Scripted model conversion not implemented yet")
@@ -341,13 +418,18 @@ def convert_model(
     state_dict = model.state_dict()
     if layers:
         state_dict = {k: v for k, v in state_dict.items() if re.match(layers, k)}
-    fixup_model(model, state_dict, layer_filter=layers)
+    fixup_config = fixup_model(model, state_dict, layer_filter=layers)
     state_dict = convert_state_dict(state_dict, key_map=key_map)
     layer_config = read_layer_config(model, layer_filter=layers, key_map=key_map)
+    layer_config.update(rename_keys(fixup_config, key_map))
+    lang_spkr_idx_map = getattr(model, "lang_spkr_idx_map", None)
+    if lang_spkr_idx_map:
+        layer_config.update(read_lang_spkr_idx_map(lang_spkr_idx_map))
 
     vocab = vocab or []
     tgt_vocab = tgt_vocab or []
-    write_ggml_file(out, hparams, layer_config, state_dict=state_dict, vocab=vocab, tgt_vocab=tgt_vocab, fp16=fp16)
+    char_vocab = char_vocab or []
+    write_ggml_file(out, hparams, layer_config, state_dict=state_dict, vocab=vocab, tgt_vocab=tgt_vocab, char_vocab=char_vocab, fp16=fp16)
 
 
 def find_children(model: torch.nn.Module, t: type, layer_filter: str = "") -> List[Tuple[str, torch.nn.Module]]:
@@ -367,8 +449,16 @@ def find_children(model: torch.nn.Module, t: type, layer_filter: str = "") -> Li
     return modules
 
 
-def fixup_model(model: torch.nn.Module, state_dict: Dict[str, torch.Tensor], layer_filter: str) -> None:
-    # Bake the embedding scaling into the weights
+def fixup_model(model: torch.nn.Module, state_dict: Dict[str, torch.Tensor], layer_filter: str) -> Dict[str, Any]:
+    """Rewrite the state dict in the form expected by the GGML code.
+
+    :returns:
+        layer config entries describing the rewrite
+    """
+    config: Dict[str, Any] = {}
+
+    # Bake the embedding scaling into the weights, unless they are tied to another
+    # parameter (eg final_proj), which they would no longer share storage with.
     frontends = find_children(model, TransformerEmbeddingFrontend, layer_filter)
     if frontends:
         log.info(
@@ -377,10 +467,19 @@ def fixup_model(model: torch.nn.Module, state_dict: Dict[str, torch.Tensor], lay
         )
     for name, frontend in frontends:
         embed_weights = state_dict[name + ".embed.weight"]
-        state_dict[name + ".embed.weight"] = embed_weights * frontend.scale
+        if frontend.scale == 1.0:
+            continue
+        if any(
+            key != name + ".embed.weight"
+            and storage_key(value) == storage_key(embed_weights)
+            for key, value in state_dict.items()
+        ):
+            config[name + ".embed_scale"] = frontend.scale
+        else:
+            state_dict[name + ".embed.weight"] = embed_weights * frontend.scale
 
-    # Sinusoidal embeddings are typically not saved since they are easily recomputed,
-    # but this allows to avoid porting the sinusoidal logic to GGML
+    # Sinusoidal embeddings aren't saved: the GGML loader generates the same tables,
+    # and extends them for longer sequences. See fairseq2_position_encodings_init.
     pos_encoders = find_children(model, SinusoidalPositionEncoder, layer_filter)
     if pos_encoders:
         log.info(
@@ -390,7 +489,9 @@ def fixup_model(model: torch.nn.Module, state_dict: Dict[str, torch.Tensor], lay
     for name, pos_encoder in pos_encoders:
         assert isinstance(pos_encoder.freqs, torch.Tensor)
         assert name not in state_dict
-        state_dict[name] = pos_encoder.freqs
+        config[name + ".encoding_dim"] = pos_encoder.encoding_dim
+        config[name + ".max_seq_len"] = pos_encoder.max_seq_len
+        config[name + ".sin_offset"] = pos_encoder._sin_offset
 
     relative_pos_encs = find_children(model, RelativePositionalEncoding, layer_filter)
     # speech_encoder has several copies of the relative_pos_enc module.
@@ -398,8 +499,27 @@ def fixup_model(model: torch.nn.Module, state_dict: Dict[str, torch.Tensor], lay
     if relative_pos_encs:
         log.info("Merging all speech_encoder RelativePositionalEncoding into one.")
         _, rel_pos_enc = relative_pos_encs[0]
-        assert isinstance(rel_pos_enc.freqs, torch.Tensor)
-        state_dict["speech_encoder.pos_enc"] = rel_pos_enc.freqs
+        config["speech_encoder.pos_enc.encoding_dim"] = rel_pos_enc.encoding_dim
+        config["speech_encoder.pos_enc.max_seq_len"] = rel_pos_enc.max_seq_len
+
+    # Vocoder convolutions are weight normalized: bake the normalization into the weights.
+    for key in [k for k in state_dict if k.endswith(".weight_g")]:
+        name = key[: -len(".weight_g")]
+        g = state_dict.pop(key)
+        v = state_dict.pop(name + ".weight_v")
+        state_dict[name + ".weight"] = torch._weight_norm(v, g, dim=0)
+
+    return config
+
+
+def read_lang_spkr_idx_map(lang_spkr_idx_map: Dict[str, Any]) -> Dict[str, int]:
+    """Language indices of the vocoder, and the default speaker of each language."""
+    config = {}
+    for lang, idx in lang_spkr_idx_map.get("multilingual", {}).items():
+        config[f"lang_spkr_idx_map.multilingual.{lang}"] = idx
+    for lang, spkrs in lang_spkr_idx_map.get("multispkr", {}).items():
+        config[f"lang_spkr_idx_map.multispkr.{lang}"] = spkrs[0]
+    return config
 
 
 def read_vocab(tokenizer: Any) -> List[Tuple[str, float]]:
@@ -418,6 +538,7 @@ def write_ggml_file(
     state_dict: Dict[str, torch.Tensor],
     vocab: List[Tuple[str, float]],
     tgt_vocab: Optional[List[Tuple[str, float]]] = None,  # tgt_vocab for bilingual models
+    char_vocab: Optional[List[Tuple[str, float]]] = None,  # char_vocab for NAR T2U models
     fp16: bool = False,
 ) -> None:
     with out.open("wb") as o:
@@ -427,6 +548,7 @@ def write_ggml_file(
         write_vocab(o, vocab)
         write_state_dict(o, state_dict, fp16)
         write_vocab(o, tgt_vocab)
+        write_vocab(o, char_vocab or [])
 
 
 def write_ggml_header(out: BufferedWriter) -> None:
@@ -490,9 +612,25 @@ def write_state_dict(
     :params fp16:
         convert float32 tensors to float16 on disk
     """
+    # Tied parameters are written once, then as aliases of the first name.
+    aliases: Dict[str, str] = {}
+    first_names: Dict[Tuple[Any, ...], str] = {}
+    for key, value in state_dict.items():
+        storage = storage_key(value)
+        if storage is None:
+            continue
+        storage += (ggml_layout(key, value).shape,)
+        if storage in first_names:
+            aliases[key] = first_names[storage]
+        else:
+            first_names[storage] = key
+    if aliases:
+        log.info(f"Writing {len(aliases)} tied tensors as aliases: {aliases}")
+    tensors = [x for key, x in state_dict.items() if key not in aliases]
+
     out.write(struct.pack("<q", len(state_dict)))
     # True size of each tensor (before downcasting to float16)
-    true_byte_size = sum(x.numel() * x.element_size() for x in state_dict.values())
+    true_byte_size = sum(x.numel() * x.element_size() for x in tensors)
     out.write(struct.pack("<q", true_byte_size))
 
     GB = 1024**3
@@ -509,7 +647,7 @@ def write_state_dict(
             return full_byte_size
 
         # Compressed size
-        compressed_byte_size = sum(_fp16_byte_size(x) for x in state_dict.values())
+        compressed_byte_size = sum(_fp16_byte_size(x) for x in tensors)
         log.warning(
             f"Saving a ggml file with {len(state_dict)} tensors, totalling {true_byte_size / GB:.3f}Gb"
             f". Compressed to {compressed_byte_size / GB:.3f}Gb"
@@ -518,18 +656,50 @@ def write_state_dict(
     for key, value in state_dict.items():
         # Rename the layers to make it look like "unity-arch"
         write_string(out, key)
-        if key.endswith(".bias") and value.ndim == 1 and "adaptor" not in key:
-            # GGML broadcasting isn't as strong as numpy
-            value = value.reshape(1, -1)
-        if "pointwise_conv" in key:  # pointwise_conv / depthwise_conv
-            value = value.squeeze(-1)
-        if "depthwise_conv" in key:
-            value = value.squeeze(1)
+        if key in aliases:
+            write_alias(out, aliases[key])
+            continue
+        value = ggml_layout(key, value)
         if fp16 and value.dtype == torch.float32:
             value = value.to(torch.float16)
         write_tensor(out, value.contiguous())
 
 
+def ggml_layout(key: str, value: torch.Tensor) -> torch.Tensor:
+    """View of the parameter `key` in the shape expected by the GGML code."""
+    if key.endswith(".bias") and value.ndim == 1 and "adaptor" not in key:
+        # GGML broadcasting isn't as strong as numpy
+        value = value.reshape(1, -1)
+    if "pointwise_conv" in key:  # pointwise_conv / depthwise_conv
+        value = value.squeeze(-1)
+    if "depthwise_conv" in key:
+        value = value.squeeze(1)
+    return value
+
+
+def storage_key(x: torch.Tensor) -> Optional[Tuple[Any, ...]]:
+    """Identifies the elements viewed by `x`: tied parameters have the same key."""
+    if x.numel() == 0 or x.device.type == "meta":
+        return None
+    return (
+        x.untyped_storage().data_ptr(),
+        x.storage_offset(),
+        tuple(x.shape),
+        x.stride(),
+        x.dtype,
+    )
+
+
+# `n_dims` of a tensor record aliasing a previous tensor, whose name follows.
+ALIAS_N_DIMS = -1
+
+
+def write_alias(out: BufferedWriter, target: str) -> None:
+    """Write a tensor record sharing the data of the previously written `target`."""
+    out.write(struct.pack("<i", ALIAS_N_DIMS))
+    write_string(out, target)
+
+
 def write_string(out: BufferedWriter, value: str) -> None:
     """Write string in utf-8 format.
 
@@ -655,15 +825,22 @@ def read_layer_config(
     for name, node in find_children(model, torch.nn.Module, layer_filter):
         _append_node_config(node, name + ".")
 
+    return rename_keys(layer_config, key_map)
+
+
+def rename_keys(
+    config: Dict[str, Any], key_map: Optional[Dict[str, str]] = None
+) -> Dict[str, Any]:
+    """Rename the keys of a flat config with the regex patterns of `key_map`, in place."""
     key_map = key_map or {}
     keys_to_replace = []
-    for k, v in layer_config.items():
+    for k, v in config.items():
         for old_pattern, replacement in key_map.items():
             if (new_key := re.sub(old_pattern, replacement, k)) != k:
                 keys_to_replace.append((k, new_key))
     for old_key, new_key in keys_to_replace:
-        layer_config[new_key] = layer_config.pop(old_key)
-    return layer_config
+        config[new_key] = config.pop(old_key)
+    return config
 
 
 def to_ctype(value: Any) -> Tuple[str, Any]:
@@ -216,18 +216,21 @@
 
 #define GGML_MAX_DIMS           4
 #define GGML_MAX_PARAMS         4096
-#define GGML_MAX_CONTEXTS       64
 #define GGML_MAX_SRC            10
 #define GGML_MAX_NAME           64
 #define GGML_MAX_OP_PARAMS      64
 #define GGML_DEFAULT_N_THREADS  4
 #define GGML_DEFAULT_GRAPH_SIZE 4096
+#define GGML_DEFAULT_SPIN_COUNT 4096
 #if UINTPTR_MAX == 0xFFFFFFFF
     #define GGML_MEM_ALIGN 4
 #else
     #define GGML_MEM_ALIGN 16
 #endif
 
+// bytes taken by the context at the start of a ggml_init_params.mem_buffer given by the caller
+#define GGML_CONTEXT_HEADER_SIZE 128
+
 #define GGML_EXIT_SUCCESS 0
 #define GGML_EXIT_ABORTED 1
 
@@ -557,9 +560,22 @@ extern "C" {
 
         int n_threads;
 
-        // abort ggml_graph_compute when true
+        // NUMA node the threads are pinned to, -1 to spread them over all nodes (default)
+        int numa_node;
+
+        // how long the threads waiting for the next node spin before sleeping until it is ready,
+        // in pause instructions: -1 to never sleep, 0 to sleep right away when other processes
+        // need the cores (default: GGML_DEFAULT_SPIN_COUNT, 0 with BLAS)
+        int spin_count;
+
+        // abort ggml_graph_compute when true, checked before each node. The nodes left are not
+        // computed and ggml_graph_compute returns GGML_EXIT_ABORTED
         bool (*abort_callback)(void * data);
         void * abort_callback_data;
+
+        // called once each node has been computed, with the wall-clock start/end of the node in us
+        void (*node_callback)(struct ggml_tensor * node, int64_t t_start_us, int64_t t_end_us, void * data);
+        void * node_callback_data;
     };
 
     enum ggml_cgraph_eval_order {
@@ -604,6 +620,10 @@ extern "C" {
         // memory pool
         size_t mem_size;   // bytes
         void * mem_buffer; // if NULL, memory will be allocated internally
+                           // otherwise it must be aligned to GGML_MEM_ALIGN and also holds the context itself:
+                           // its first GGML_CONTEXT_HEADER_SIZE bytes are not available to the tensors, so
+                           // mem_size must be GGML_CONTEXT_HEADER_SIZE plus what the tensors need.
+                           // the buffer is not freed by ggml_free, and can be reused once the context is freed
         bool   no_alloc;   // don't allocate memory for the tensor data
     };
 
@@ -641,6 +661,10 @@ extern "C" {
 
     GGML_API void    ggml_numa_init(void); // call once for better performance on NUMA systems
     GGML_API bool    ggml_is_numa(void); // true if init detected that system has >1 NUMA node
+    GGML_API int     ggml_numa_n_nodes(void); // NUMA nodes found by ggml_numa_init, 0 before
+    GGML_API void    ggml_numa_set_thread_node(int node); // pin the calling thread to the CPUs of a node, -1 to unpin it
+    // place the pages of a buffer that are not touched yet on a node, or interleave them over all nodes if node < 0
+    GGML_API void    ggml_numa_set_memory_node(void * data, size_t size, int node);
 
     GGML_API void    ggml_print_object (const struct ggml_object * obj);
     GGML_API void    ggml_print_objects(const struct ggml_context * ctx);
@@ -919,6 +943,12 @@ extern "C" {
             struct ggml_tensor  * a,
             struct ggml_tensor  * b);
 
+    // concat a and b on dim 0, eg to append a step to a transposed KV cache
+    GGML_API struct ggml_tensor * ggml_concat_0(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b);
+
     GGML_API struct ggml_tensor * ggml_abs(
             struct ggml_context * ctx,
             struct ggml_tensor  * a);
@@ -1024,6 +1054,22 @@ extern "C" {
             struct ggml_context * ctx,
             struct ggml_tensor  * a,
             float                 eps);
+
+    // normalize along rows, then scale by gamma and shift by beta, in a single pass
+    // gamma and beta are F32 vectors of a->ne[0] elements
+    GGML_API struct ggml_tensor * ggml_layer_norm(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * gamma,
+            struct ggml_tensor  * beta,
+            float                 eps);
+
+    GGML_API struct ggml_tensor * ggml_layer_norm_inplace(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * gamma,
+            struct ggml_tensor  * beta,
+            float                 eps);
     
      GGML_API struct ggml_tensor * ggml_batch_norm(
             struct ggml_context * ctx,
@@ -1845,6 +1891,12 @@ extern "C" {
     GGML_API void                 ggml_graph_reset       (struct ggml_cgraph * cgraph);  // zero grads
     GGML_API void                 ggml_graph_clear       (struct ggml_cgraph * cgraph);
 
+    // rewrites chains of ops (mul_mat + bias + activation, norm + affine, scale + mask + soft_max)
+    // into fused nodes and removes the intermediate nodes from the graph. returns the number of fusions
+    // must be called before allocating the graph, nodes that already have data are left untouched
+    // intermediate results are not computed anymore, so they should not be read after compute
+    GGML_API int                  ggml_graph_fuse        (struct ggml_cgraph * cgraph);
+
     GGML_API size_t ggml_graph_overhead(void);
     GGML_API size_t ggml_graph_overhead_custom(size_t size, bool grads);
 
@@ -94,6 +94,11 @@ typedef void * thread_ret_t;
 #include <sys/stat.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
 #endif
 
 #ifdef GGML_USE_CPU_HBM
@@ -1385,6 +1390,95 @@ inline static void ggml_vec_scale_f32(const int n, float * y, const float   v) {
 #endif
 }
 
+// sums of x[i] - shift and of their squares. shifting by a value close to the mean
+// keeps the variance from cancelling out in float when the mean is large
+inline static void ggml_vec_shifted_sums_f32(const int n, ggml_float * s, ggml_float * s2, const float * x, const float shift) {
+    ggml_float sum  = 0.0;
+    ggml_float sum2 = 0.0;
+#if defined(GGML_SIMD)
+    const int np = (n & ~(GGML_F32_STEP - 1));
+
+    GGML_F32_VEC vshift = GGML_F32_VEC_SET1(-shift);
+
+    GGML_F32_VEC asum [GGML_F32_ARR] = { GGML_F32_VEC_ZERO };
+    GGML_F32_VEC asum2[GGML_F32_ARR] = { GGML_F32_VEC_ZERO };
+
+    GGML_F32_VEC ax[GGML_F32_ARR];
+
+    for (int i = 0; i < np; i += GGML_F32_STEP) {
+        for (int j = 0; j < GGML_F32_ARR; j++) {
+            ax[j] = GGML_F32_VEC_ADD(GGML_F32_VEC_LOAD(x + i + j*GGML_F32_EPR), vshift);
+
+            asum [j] = GGML_F32_VEC_ADD(asum[j], ax[j]);
+            asum2[j] = GGML_F32_VEC_FMA(asum2[j], ax[j], ax[j]);
+        }
+    }
+
+    // each lane holds n/GGML_F32_STEP values, few enough for float
+    float sumf  = 0.0f;
+    float sum2f = 0.0f;
+    GGML_F32_VEC_REDUCE(sumf,  asum);
+    GGML_F32_VEC_REDUCE(sum2f, asum2);
+    sum  = sumf;
+    sum2 = sum2f;
+
+    // leftovers
+    for (int i = np; i < n; ++i) {
+        const ggml_float v = (ggml_float)(x[i] - shift);
+        sum  += v;
+        sum2 += v*v;
+    }
+#else
+    // scalar
+    for (int i = 0; i < n; ++i) {
+        const ggml_float v = (ggml_float)(x[i] - shift);
+        sum  += v;
+        sum2 += v*v;
+    }
+#endif
+
+    *s  = sum;
+    *s2 = sum2;
+}
+
+// y = (x - mean)*scale, times gamma and plus beta when they are given. y can be x
+inline static void ggml_vec_norm_affine_f32(const int n, float * y, const float * x,
+        const float mean, const float scale, const float * gamma, const float * beta) {
+#if defined(GGML_SIMD)
+    const int np = (n & ~(GGML_F32_STEP - 1));
+
+    GGML_F32_VEC vmean  = GGML_F32_VEC_SET1(-mean);
+    GGML_F32_VEC vscale = GGML_F32_VEC_SET1(scale);
+
+    GGML_F32_VEC ay[GGML_F32_ARR];
+
+    for (int i = 0; i < np; i += GGML_F32_STEP) {
+        for (int j = 0; j < GGML_F32_ARR; j++) {
+            ay[j] = GGML_F32_VEC_ADD(GGML_F32_VEC_LOAD(x + i + j*GGML_F32_EPR), vmean);
+            ay[j] = GGML_F32_VEC_MUL(ay[j], vscale);
+            if (gamma) {
+                ay[j] = GGML_F32_VEC_MUL(ay[j], GGML_F32_VEC_LOAD(gamma + i + j*GGML_F32_EPR));
+            }
+            if (beta) {
+                ay[j] = GGML_F32_VEC_ADD(ay[j], GGML_F32_VEC_LOAD(beta + i + j*GGML_F32_EPR));
+            }
+
+            GGML_F32_VEC_STORE(y + i + j*GGML_F32_EPR, ay[j]);
+        }
+    }
+
+    // leftovers
+    for (int i = np; i < n; ++i) {
+        y[i] = (x[i] - mean)*scale*(gamma ? gamma[i] : 1.0f) + (beta ? beta[i] : 0.0f);
+    }
+#else
+    // scalar
+    for (int i = 0; i < n; ++i) {
+        y[i] = (x[i] - mean)*scale*(gamma ? gamma[i] : 1.0f) + (beta ? beta[i] : 0.0f);
+    }
+#endif
+}
+
 inline static void ggml_vec_norm_f32 (const int n, float * s, const float * x) { ggml_vec_dot_f32(n, s, x, x); *s = sqrtf(*s);   }
 inline static void ggml_vec_sqr_f32  (const int n, float * y, const float * x) { for (int i = 0; i < n; ++i) y[i] = x[i]*x[i];   }
 inline static void ggml_vec_sqrt_f32 (const int n, float * y, const float * x) { for (int i = 0; i < n; ++i) y[i] = sqrtf(x[i]); }
@@ -1848,11 +1942,9 @@ struct ggml_context {
     struct ggml_scratch scratch_save;
 };
 
-struct ggml_context_container {
-    bool used;
-
-    struct ggml_context context;
-};
+// contexts are stored at the start of their memory buffer, there is no global registry
+static_assert(sizeof(struct ggml_context) <= GGML_CONTEXT_HEADER_SIZE, "ggml_context does not fit in GGML_CONTEXT_HEADER_SIZE");
+static_assert(GGML_CONTEXT_HEADER_SIZE%GGML_MEM_ALIGN == 0, "GGML_CONTEXT_HEADER_SIZE must be a multiple of GGML_MEM_ALIGN");
 
 //
 // NUMA support
@@ -1877,13 +1969,13 @@ struct ggml_numa_nodes {
 //
 
 struct ggml_state {
-    struct ggml_context_container contexts[GGML_MAX_CONTEXTS];
     struct ggml_numa_nodes numa;
 };
 
 // global state
 static struct ggml_state g_state;
 static atomic_int g_state_barrier = 0;
+static atomic_bool g_state_initialized = false;
 
 // barrier via spin lock
 inline static void ggml_critical_section_start(void) {
@@ -1972,6 +2064,46 @@ bool ggml_is_numa(void) {
     return g_state.numa.n_nodes > 1;
 }
 
+int ggml_numa_n_nodes(void) {
+    return (int) g_state.numa.n_nodes;
+}
+
+void ggml_numa_set_memory_node(void * data, size_t size, int node) {
+    if (!ggml_is_numa() || size == 0) {
+        return;
+    }
+    GGML_ASSERT(node < (int) g_state.numa.n_nodes);
+
+#if defined(__linux__) && defined(SYS_mbind)
+    // values of MPOL_PREFERRED and MPOL_INTERLEAVE in <numaif.h>, which needs libnuma
+    const int mpol_preferred  = 1;
+    const int mpol_interleave = 3;
+
+    unsigned long nodemask = 0;
+    if (node >= 0) {
+        nodemask = 1UL << node;
+    } else {
+        for (uint32_t n = 0; n < g_state.numa.n_nodes; ++n) {
+            nodemask |= 1UL << n;
+        }
+    }
+
+    // mbind works on whole pages, the policy of the pages shared with neighbouring
+    // allocations changes too, which is harmless
+    const uintptr_t page  = (uintptr_t) sysconf(_SC_PAGESIZE);
+    const uintptr_t begin = (uintptr_t) data & ~(page - 1);
+    const uintptr_t end   = ((uintptr_t) data + size + page - 1) & ~(page - 1);
+
+    const long rv = syscall(SYS_mbind, (void *) begin, end - begin, node >= 0 ? mpol_preferred : mpol_interleave,
+            &nodemask, (unsigned long) GGML_NUMA_MAX_NODES + 1, 0);
+    if (rv != 0) {
+        fprintf(stderr, "warning: mbind() failed: %s\n", strerror(errno));
+    }
+#else
+    UNUSED(data);
+#endif
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void ggml_print_object(const struct ggml_object * obj) {
@@ -2228,86 +2360,62 @@ static inline int ggml_up(int n, int m) {
 ////////////////////////////////////////////////////////////////////////////////
 
 struct ggml_context * ggml_init(struct ggml_init_params params) {
-    // make this function thread safe
-    ggml_critical_section_start();
-
-    static bool is_first_call = true;
+    // the one-time initialization is the only part which needs to be thread safe
+    if (!atomic_load(&g_state_initialized)) {
+        ggml_critical_section_start();
+
+        if (!atomic_load(&g_state_initialized)) {
+            // initialize time system (required on Windows)
+            ggml_time_init();
+
+            // initialize GELU, Quick GELU, SILU and EXP F32 tables
+            {
+                const uint64_t t_start = ggml_time_us(); UNUSED(t_start);
+
+                ggml_fp16_t ii;
+                for (int i = 0; i < (1 << 16); ++i) {
+                    uint16_t ui = i;
+                    memcpy(&ii, &ui, sizeof(ii));
+                    const float f = ggml_table_f32_f16[i] = GGML_COMPUTE_FP16_TO_FP32(ii);
+                    ggml_table_gelu_f16[i] = GGML_FP32_TO_FP16(ggml_gelu_f32(f));
+                    ggml_table_gelu_quick_f16[i] = GGML_FP32_TO_FP16(ggml_gelu_quick_f32(f));
+                    ggml_table_silu_f16[i] = GGML_FP32_TO_FP16(ggml_silu_f32(f));
+                    ggml_table_exp_f16[i]  = GGML_FP32_TO_FP16(expf(f));
+                }
 
-    if (is_first_call) {
-        // initialize time system (required on Windows)
-        ggml_time_init();
+                const uint64_t t_end = ggml_time_us(); UNUSED(t_end);
 
-        // initialize GELU, Quick GELU, SILU and EXP F32 tables
-        {
-            const uint64_t t_start = ggml_time_us(); UNUSED(t_start);
-
-            ggml_fp16_t ii;
-            for (int i = 0; i < (1 << 16); ++i) {
-                uint16_t ui = i;
-                memcpy(&ii, &ui, sizeof(ii));
-                const float f = ggml_table_f32_f16[i] = GGML_COMPUTE_FP16_TO_FP32(ii);
-                ggml_table_gelu_f16[i] = GGML_FP32_TO_FP16(ggml_gelu_f32(f));
-                ggml_table_gelu_quick_f16[i] = GGML_FP32_TO_FP16(ggml_gelu_quick_f32(f));
-                ggml_table_silu_f16[i] = GGML_FP32_TO_FP16(ggml_silu_f32(f));
-                ggml_table_exp_f16[i]  = GGML_FP32_TO_FP16(expf(f));
+                GGML_PRINT_DEBUG("%s: GELU, Quick GELU, SILU and EXP tables initialized in %f ms\n", __func__, (t_end - t_start)/1000.0f);
             }
 
-            const uint64_t t_end = ggml_time_us(); UNUSED(t_end);
+            // initialize g_state
+            {
+                const uint64_t t_start = ggml_time_us(); UNUSED(t_start);
 
-            GGML_PRINT_DEBUG("%s: GELU, Quick GELU, SILU and EXP tables initialized in %f ms\n", __func__, (t_end - t_start)/1000.0f);
-        }
+                g_state = (struct ggml_state) {
+                    /*.numa =*/ {
+                        .n_nodes = 0,
+                        .total_cpus = 0,
+                    },
+                };
 
-        // initialize g_state
-        {
-            const uint64_t t_start = ggml_time_us(); UNUSED(t_start);
-
-            g_state = (struct ggml_state) {
-                /*.contexts =*/ { { 0 } },
-                /*.numa =*/ {
-                    .n_nodes = 0,
-                    .total_cpus = 0,
-                },
-            };
+                const uint64_t t_end = ggml_time_us(); UNUSED(t_end);
 
-            for (int i = 0; i < GGML_MAX_CONTEXTS; ++i) {
-                g_state.contexts[i].used = false;
+                GGML_PRINT_DEBUG("%s: g_state initialized in %f ms\n", __func__, (t_end - t_start)/1000.0f);
             }
 
-            const uint64_t t_end = ggml_time_us(); UNUSED(t_end);
-
-            GGML_PRINT_DEBUG("%s: g_state initialized in %f ms\n", __func__, (t_end - t_start)/1000.0f);
-        }
-
 #if defined(GGML_USE_CUBLAS)
-        ggml_init_cublas();
+            ggml_init_cublas();
 #elif defined(GGML_USE_CLBLAST)
-        ggml_cl_init();
+            ggml_cl_init();
 #endif
 
-        ggml_setup_op_has_task_pass();
-
-        is_first_call = false;
-    }
-
-    // find non-used context in g_state
-    struct ggml_context * ctx = NULL;
-
-    for (int i = 0; i < GGML_MAX_CONTEXTS; i++) {
-        if (!g_state.contexts[i].used) {
-            g_state.contexts[i].used = true;
-            ctx = &g_state.contexts[i].context;
+            ggml_setup_op_has_task_pass();
 
-            GGML_PRINT_DEBUG("%s: found unused context %d\n", __func__, i);
-            break;
+            atomic_store(&g_state_initialized, true);
         }
-    }
-
-    if (ctx == NULL) {
-        GGML_PRINT_DEBUG("%s: no unused context found\n", __func__);
 
         ggml_critical_section_end();
-
-        return NULL;
     }
 
     // allow to call ggml_init with 0 size
@@ -2315,11 +2423,24 @@ struct ggml_context * ggml_init(struct ggml_init_params params) {
         params.mem_size = GGML_MEM_ALIGN;
     }
 
-    const size_t mem_size = params.mem_buffer ? params.mem_size : GGML_PAD(params.mem_size, GGML_MEM_ALIGN);
+    // the context itself is stored at the start of the memory buffer,
+    // which is allocated here with room for it when not given by the caller
+    struct ggml_context * ctx;
+    size_t mem_size;
+    if (params.mem_buffer) {
+        ggml_assert_aligned(params.mem_buffer);
+        GGML_ASSERT(params.mem_size > GGML_CONTEXT_HEADER_SIZE && "mem_buffer is too small to hold the context");
+        ctx = (struct ggml_context *) params.mem_buffer;
+        mem_size = params.mem_size - GGML_CONTEXT_HEADER_SIZE;
+    } else {
+        mem_size = GGML_PAD(params.mem_size, GGML_MEM_ALIGN);
+        ctx = (struct ggml_context *) GGML_ALIGNED_MALLOC(GGML_CONTEXT_HEADER_SIZE + mem_size);
+        GGML_ASSERT(ctx != NULL);
+    }
 
     *ctx = (struct ggml_context) {
         /*.mem_size           =*/ mem_size,
-        /*.mem_buffer         =*/ params.mem_buffer ? params.mem_buffer : GGML_ALIGNED_MALLOC(mem_size),
+        /*.mem_buffer         =*/ (char *) ctx + GGML_CONTEXT_HEADER_SIZE,
         /*.mem_buffer_owned   =*/ params.mem_buffer ? false : true,
         /*.no_alloc           =*/ params.no_alloc,
         /*.no_alloc_save      =*/ params.no_alloc,
@@ -2330,44 +2451,24 @@ struct ggml_context * ggml_init(struct ggml_init_params params) {
         /*.scratch_save       =*/ { 0, 0, NULL, },
     };
 
-    GGML_ASSERT(ctx->mem_buffer != NULL);
-
     ggml_assert_aligned(ctx->mem_buffer);
 
     GGML_PRINT_DEBUG("%s: context initialized\n", __func__);
 
-    ggml_critical_section_end();
-
     return ctx;
 }
 
 void ggml_free(struct ggml_context * ctx) {
-    // make this function thread safe
-    ggml_critical_section_start();
-
-    bool found = false;
-
-    for (int i = 0; i < GGML_MAX_CONTEXTS; i++) {
-        if (&g_state.contexts[i].context == ctx) {
-            g_state.contexts[i].used = false;
-
-            GGML_PRINT_DEBUG("%s: context %d has been freed. memory used = %zu\n",
-                    __func__, i, ggml_used_mem(ctx));
-
-            if (ctx->mem_buffer_owned) {
-                GGML_ALIGNED_FREE(ctx->mem_buffer);
-            }
-
-            found = true;
-            break;
-        }
+    if (ctx == NULL) {
+        return;
     }
 
-    if (!found) {
-        GGML_PRINT_DEBUG("%s: context not found\n", __func__);
-    }
+    GGML_PRINT_DEBUG("%s: context has been freed. memory used = %zu\n", __func__, ggml_used_mem(ctx));
 
-    ggml_critical_section_end();
+    // the context lives in its own buffer: nothing to do when the buffer belongs to the caller
+    if (ctx->mem_buffer_owned) {
+        GGML_ALIGNED_FREE(ctx);
+    }
 }
 
 size_t ggml_used_mem(const struct ggml_context * ctx) {
@@ -3743,11 +3844,14 @@ struct ggml_tensor * ggml_repeat_back(
 
 // ggml_concat
 
-struct ggml_tensor * ggml_concat(
+static struct ggml_tensor * ggml_concat_impl(
     struct ggml_context* ctx,
     struct ggml_tensor* a,
-    struct ggml_tensor* b) {
-    GGML_ASSERT(a->ne[0] == b->ne[0] && a->ne[1] == b->ne[1] && a->ne[3] == b->ne[3]);
+    struct ggml_tensor* b,
+    int dim) {
+    for (int d = 0; d < GGML_MAX_DIMS; ++d) {
+        GGML_ASSERT(d == dim || a->ne[d] == b->ne[d]);
+    }
 
     bool is_node = false;
 
@@ -3755,7 +3859,11 @@ struct ggml_tensor * ggml_concat(
         is_node = true;
     }
 
-    struct ggml_tensor * result = ggml_new_tensor_4d(ctx, a->type, a->ne[0], a->ne[1], a->ne[2] + b->ne[2], a->ne[3]);
+    int64_t ne[GGML_MAX_DIMS] = { a->ne[0], a->ne[1], a->ne[2], a->ne[3] };
+    ne[dim] += b->ne[dim];
+    struct ggml_tensor * result = ggml_new_tensor_4d(ctx, a->type, ne[0], ne[1], ne[2], ne[3]);
+
+    ggml_set_op_params_i32(result, 0, dim);
 
     result->op = GGML_OP_CONCAT;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -3765,6 +3873,20 @@ struct ggml_tensor * ggml_concat(
     return result;
 }
 
+struct ggml_tensor * ggml_concat(
+    struct ggml_context* ctx,
+    struct ggml_tensor* a,
+    struct ggml_tensor* b) {
+    return ggml_concat_impl(ctx, a, b, 2);
+}
+
+struct ggml_tensor * ggml_concat_0(
+    struct ggml_context* ctx,
+    struct ggml_tensor* a,
+    struct ggml_tensor* b) {
+    return ggml_concat_impl(ctx, a, b, 0);
+}
+
 // ggml_abs
 
 struct ggml_tensor * ggml_abs(
@@ -3963,11 +4085,20 @@ struct ggml_tensor * ggml_glu(
 static struct ggml_tensor * ggml_norm_impl(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
+        struct ggml_tensor  * gamma,
+        struct ggml_tensor  * beta,
         float eps,
         bool inplace) {
     bool is_node = false;
 
-    if (!inplace && (a->grad)) {
+    if (gamma) {
+        GGML_ASSERT(gamma->type == GGML_TYPE_F32 && ggml_is_contiguous(gamma) && ggml_nelements(gamma) == a->ne[0]);
+    }
+    if (beta) {
+        GGML_ASSERT(beta->type == GGML_TYPE_F32 && ggml_is_contiguous(beta) && ggml_nelements(beta) == a->ne[0]);
+    }
+
+    if (!inplace && (a->grad || (gamma && gamma->grad) || (beta && beta->grad))) {
         GGML_ASSERT(false); // TODO: implement backward
         is_node = true;
     }
@@ -3979,6 +4110,8 @@ static struct ggml_tensor * ggml_norm_impl(
     result->op   = GGML_OP_NORM;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
     result->src[0] = a;
+    result->src[1] = gamma;
+    result->src[2] = beta;
 
     return result;
 }
@@ -3987,7 +4120,7 @@ struct ggml_tensor * ggml_norm(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
         float eps) {
-    return ggml_norm_impl(ctx, a, eps, false);
+    return ggml_norm_impl(ctx, a, NULL, NULL, eps, false);
 }
 
 // ggml_batch_norm
@@ -4025,7 +4158,27 @@ struct ggml_tensor * ggml_norm_inplace(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
         float eps) {
-    return ggml_norm_impl(ctx, a, eps, true);
+    return ggml_norm_impl(ctx, a, NULL, NULL, eps, true);
+}
+
+// ggml_layer_norm
+
+struct ggml_tensor * ggml_layer_norm(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * gamma,
+        struct ggml_tensor  * beta,
+        float eps) {
+    return ggml_norm_impl(ctx, a, gamma, beta, eps, false);
+}
+
+struct ggml_tensor * ggml_layer_norm_inplace(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * gamma,
+        struct ggml_tensor  * beta,
+        float eps) {
+    return ggml_norm_impl(ctx, a, gamma, beta, eps, true);
 }
 
 // ggml_rms_norm
@@ -8764,6 +8917,20 @@ static void ggml_compute_forward_concat_f32(
     GGML_ASSERT(nb00 == sizeof(float));
     GGML_ASSERT(nb10 == sizeof(float));
 
+    if (ggml_get_op_params_i32(dst, 0) == 0) {
+        // each row of dst is a row of src0 followed by a row of src1
+        for (int i3 = 0; i3 < ne3; i3++) {
+            for (int i2 = ith; i2 < ne2; i2 += nth) {
+                for (int i1 = 0; i1 < ne1; i1++) {
+                    float * y = (float *)((char *)dst->data + i1 * nb1 + i2 * nb2 + i3 * nb3);
+                    memcpy(y,        (char *) src0->data + i1 * nb01 + i2 * nb02 + i3 * nb03, ne00 * sizeof(float));
+                    memcpy(y + ne00, (char *) src1->data + i1 * nb11 + i2 * nb12 + i3 * nb13, ne10 * sizeof(float));
+                }
+            }
+        }
+        return;
+    }
+
     for (int i3 = 0; i3 < ne3; i3++) {
         for (int i2 = ith; i2 < ne2; i2 += nth) {
             if (i2 < ne02) { // src0
@@ -8790,6 +8957,61 @@ static void ggml_compute_forward_concat_f32(
     }
 }
 
+// other types, eg F16 or quantized KV caches, are copied by rows
+static void ggml_compute_forward_concat_rows(
+    const struct ggml_compute_params * params,
+    const struct ggml_tensor * src0,
+    const struct ggml_tensor * src1,
+    struct ggml_tensor * dst) {
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    GGML_ASSERT(src0->type == dst->type && src1->type == dst->type);
+    GGML_ASSERT(nb0  == ggml_type_size(dst->type));
+    GGML_ASSERT(nb00 == ggml_type_size(dst->type));
+    GGML_ASSERT(nb10 == ggml_type_size(dst->type));
+
+    const size_t ts = ggml_type_size(dst->type);
+    const int64_t bs = ggml_blck_size(dst->type);
+
+    if (ggml_get_op_params_i32(dst, 0) == 0) {
+        // each row of dst is a row of src0 followed by a row of src1
+        GGML_ASSERT(ne00 % bs == 0);
+        const size_t rs0 = ne00*ts/bs;
+        const size_t rs1 = ne10*ts/bs;
+        for (int i3 = 0; i3 < ne3; i3++) {
+            for (int i2 = ith; i2 < ne2; i2 += nth) {
+                for (int i1 = 0; i1 < ne1; i1++) {
+                    char * y = (char *) dst->data + i1*nb1 + i2*nb2 + i3*nb3;
+                    memcpy(y,       (char *) src0->data + i1*nb01 + i2*nb02 + i3*nb03, rs0);
+                    memcpy(y + rs0, (char *) src1->data + i1*nb11 + i2*nb12 + i3*nb13, rs1);
+                }
+            }
+        }
+        return;
+    }
+
+    const size_t rs = ne0*ts/bs;
+
+    for (int i3 = 0; i3 < ne3; i3++) {
+        for (int i2 = ith; i2 < ne2; i2 += nth) {
+            for (int i1 = 0; i1 < ne1; i1++) {
+                const char * x = i2 < ne02
+                    ? (char *) src0->data + i1*nb01 + i2*nb02 + i3*nb03
+                    : (char *) src1->data + i1*nb11 + (i2 - ne02)*nb12 + i3*nb13;
+                memcpy((char *) dst->data + i1*nb1 + i2*nb2 + i3*nb3, x, rs);
+            }
+        }
+    }
+}
+
 static void ggml_compute_forward_concat(
     const struct ggml_compute_params* params,
     const struct ggml_tensor* src0,
@@ -8802,7 +9024,7 @@ static void ggml_compute_forward_concat(
             } break;
         default:
             {
-                GGML_ASSERT(false);
+                ggml_compute_forward_concat_rows(params, src0, src1, dst);
             } break;
     }
 }
@@ -9450,34 +9672,33 @@ static void ggml_compute_forward_norm_f32(
     float eps;
     memcpy(&eps, dst->op_params, sizeof(float));
 
-    // TODO: optimize
-    for (int64_t i03 = 0; i03 < ne03; i03++) {
-        for (int64_t i02 = 0; i02 < ne02; i02++) {
-            for (int64_t i01 = ith; i01 < ne01; i01 += nth) {
-                const float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+    // optional affine transform, set by ggml_layer_norm or ggml_graph_fuse
+    const float * gamma = dst->src[1] ? (const float *) dst->src[1]->data : NULL;
+    const float * beta  = dst->src[2] ? (const float *) dst->src[2]->data : NULL;
 
-                ggml_float sum = 0.0;
-                for (int64_t i00 = 0; i00 < ne00; i00++) {
-                    sum += (ggml_float)x[i00];
-                }
+    // rows are split across all the threads, not only along ne01 which is 1 when decoding
+    const int64_t nr = ne01*ne02*ne03;
 
-                float mean = sum/ne00;
+    for (int64_t ir = ith; ir < nr; ir += nth) {
+        const int64_t i03 = ir/(ne02*ne01);
+        const int64_t i02 = (ir - i03*ne02*ne01)/ne01;
+        const int64_t i01 = (ir - i03*ne02*ne01 - i02*ne01);
 
-                float * y = (float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3);
+        const float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+        float       * y = (float *) ((char *) dst->data  + i01*nb1  + i02*nb2  + i03*nb3);
 
-                ggml_float sum2 = 0.0;
-                for (int64_t i00 = 0; i00 < ne00; i00++) {
-                    float v = x[i00] - mean;
-                    y[i00] = v;
-                    sum2 += (ggml_float)(v*v);
-                }
+        // mean and variance in a single pass, shifted by the first value of the row
+        const float shift = x[0];
+        ggml_float sum;
+        ggml_float sum2;
+        ggml_vec_shifted_sums_f32(ne00, &sum, &sum2, x, shift);
 
-                float variance = sum2/ne00;
-                const float scale = 1.0f/sqrtf(variance + eps);
+        const float mean     = (float)(sum/ne00) + shift;
+        const float variance = (float)(sum2/ne00 - (sum/ne00)*(sum/ne00));
+        const float scale    = 1.0f/sqrtf(MAX(variance, 0.0f) + eps);
 
-                ggml_vec_scale_f32(ne00, y, scale);
-            }
-        }
+        // normalize and apply the affine transform in the same sweep
+        ggml_vec_norm_affine_f32(ne00, y, x, mean, scale, gamma, beta);
     }
 }
 
@@ -9918,6 +10139,26 @@ static bool ggml_compute_forward_mul_mat_use_blas(
 }
 #endif
 
+// bias + activation applied to the output of a GGML_OP_MUL_MAT node rewritten by ggml_graph_fuse
+//   src[2]        - optional bias, one value per dst row element
+//   op_params[0]  - 1 if an activation follows
+//   op_params[1]  - the activation (enum ggml_unary_op)
+static void ggml_mul_mat_epilogue(const struct ggml_tensor * dst, const int n, float * y, const int64_t i0) {
+    const struct ggml_tensor * bias = dst->src[2];
+    if (bias) {
+        ggml_vec_acc_f32(n, y, (const float *) bias->data + i0);
+    }
+    if (ggml_get_op_params_i32(dst, 0) == 0) {
+        return;
+    }
+    switch ((enum ggml_unary_op) ggml_get_op_params_i32(dst, 1)) {
+        case GGML_UNARY_OP_RELU: ggml_vec_relu_f32(n, y, y); break;
+        case GGML_UNARY_OP_GELU: ggml_vec_gelu_f32(n, y, y); break;
+        case GGML_UNARY_OP_SILU: ggml_vec_silu_f32(n, y, y); break;
+        default: GGML_ASSERT(false);
+    }
+}
+
 // off1 = offset in i11 and i1
 // cne1 = ne11 and ne1
 // in a normal matrix multiplication, off1 = 0 and cne1 = ne1
@@ -9963,6 +10204,10 @@ static void ggml_compute_forward_mul_mat(
     const int64_t r2 = ne12/ne02;
     const int64_t r3 = ne13/ne03;
 
+    // GGML_OP_MUL_MAT_ID also goes through here, and uses src[2] for something else
+    const bool fused = dst->op == GGML_OP_MUL_MAT &&
+        (dst->src[2] != NULL || ggml_get_op_params_i32(dst, 0) != 0);
+
     // nb01 >= nb00 - src0 is not transposed
     //   compute by src0 rows
 
@@ -10018,6 +10263,12 @@ static void ggml_compute_forward_mul_mat(
                          1.0f,    y, ne10,
                                   x, ne00,
                          0.0f,    d, ne01);
+
+                if (fused) {
+                    for (int64_t i11 = 0; i11 < cne1; i11++) {
+                        ggml_mul_mat_epilogue(dst, ne01, (float *) ((char *) d + i11*nb1), 0);
+                    }
+                }
             }
         }
 
@@ -10130,6 +10381,9 @@ static void ggml_compute_forward_mul_mat(
                 for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
                     vec_dot(ne00, &tmp[ir0 - iir0], src0_row + ir0*nb01, src1_col);
                 }
+                if (fused) {
+                    ggml_mul_mat_epilogue(dst, MIN(iir0 + blck_0, ir011) - iir0, tmp, iir0);
+                }
                 memcpy(&dst_col[iir0], tmp, (MIN(iir0 + blck_0, ir011) - iir0)*sizeof(float));
             }
         }
@@ -10834,11 +11088,47 @@ static void ggml_compute_forward_get_rows_f32(
     }
 }
 
+// rows gathered without conversion, when the result keeps the type of src0
+static void ggml_compute_forward_get_rows_same_type(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+              struct ggml_tensor * dst) {
+    assert(params->ith == 0);
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    const size_t rs = ne00*ggml_type_size(src0->type)/ggml_blck_size(src0->type);
+
+    assert(ne0  == ne00);
+    assert(ne02 == ne11);
+    assert(nb00 == ggml_type_size(src0->type));
+
+    for (int64_t i12 = 0; i12 < ne12; ++i12) {
+        for (int64_t i11 = 0; i11 < ne11; ++i11) {
+            for (int64_t i10 = 0; i10 < ne10; ++i10) {
+                const int64_t i01 = *(int32_t *) ((char *) src1->data + i10*nb10 + i11*nb11 + i12*nb12);
+
+                memcpy((char *)  dst->data + i10*nb1  + i11*nb2  + i12*nb3,
+                       (char *) src0->data + i01*nb01 + i11*nb02 + i12*nb03, rs);
+            }
+        }
+    }
+}
+
 static void ggml_compute_forward_get_rows(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
+    if (dst->type == src0->type && src0->type != GGML_TYPE_F32 && src0->type != GGML_TYPE_I32) {
+        ggml_compute_forward_get_rows_same_type(params, src0, src1, dst);
+        return;
+    }
     switch (src0->type) {
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
@@ -16882,31 +17172,358 @@ void ggml_graph_clear(struct ggml_cgraph * cgraph) {
 }
 
 //
-// thread data
-//
-// synchronization is done via busy loops
-// I tried using spin locks, but not sure how to use them correctly - the things I tried were slower than busy loops
+// graph fusion
 //
-
-#ifdef __APPLE__
-
-//#include <os/lock.h>
+// rewrites chains of nodes into a single node, so the intermediate results are
+// never written to memory:
 //
-//typedef os_unfair_lock ggml_lock_t;
+//   mul_mat -> add(bias) -> relu/gelu/silu    mul_mat with a bias + activation epilogue
+//   norm -> mul(gamma) -> add(beta)           norm with an affine transform
+//   scale -> add(mask) -> soft_max            soft_max(x*scale + mask)
 //
-//#define ggml_lock_init(x)    UNUSED(x)
-//#define ggml_lock_destroy(x) UNUSED(x)
-//#define ggml_lock_lock       os_unfair_lock_lock
-//#define ggml_lock_unlock     os_unfair_lock_unlock
+// the last node of a chain keeps its identity, the intermediate nodes are removed
+// from the graph. when reshapes sit in the middle of a chain, the epilogue is moved
+// to the producer instead, and the last node becomes a view of it.
 //
-//#define GGML_LOCK_INITIALIZER OS_UNFAIR_LOCK_INIT
-
-typedef int ggml_lock_t;
 
-#define ggml_lock_init(x)    UNUSED(x)
-#define ggml_lock_destroy(x) UNUSED(x)
-#define ggml_lock_lock(x)    UNUSED(x)
-#define ggml_lock_unlock(x)  UNUSED(x)
+struct ggml_fuse_state {
+    struct ggml_hash_set uses;
+    int  * n_uses;
+    bool * removed;
+    struct ggml_tensor ** owner; // the node now holding the memory of a removed node
+};
+
+static int ggml_fuse_n_uses(const struct ggml_fuse_state * st, struct ggml_tensor * t) {
+    const size_t i = ggml_hash_find(st->uses, t);
+    if (i == GGML_HASHTABLE_FULL || st->uses.keys[i] != t) {
+        return 0;
+    }
+    return st->n_uses[i];
+}
+
+static void ggml_fuse_remove(struct ggml_fuse_state * st, struct ggml_tensor * t) {
+    const size_t i = ggml_hash_find(st->uses, t);
+    GGML_ASSERT(i != GGML_HASHTABLE_FULL && st->uses.keys[i] == t);
+    st->removed[i] = true;
+}
+
+static bool ggml_fuse_is_removed(const struct ggml_fuse_state * st, struct ggml_tensor * t) {
+    const size_t i = ggml_hash_find(st->uses, t);
+    return i != GGML_HASHTABLE_FULL && st->uses.keys[i] == t && st->removed[i];
+}
+
+// in-place nodes are views of the tensor holding their memory, and so are the views built on
+// top of them. if that tensor was removed, the fused node takes over its memory.
+static void ggml_fuse_take_memory(struct ggml_fuse_state * st, struct ggml_tensor * node) {
+    struct ggml_tensor * root = node->view_src;
+    if (root == NULL || !ggml_fuse_is_removed(st, root)) {
+        return;
+    }
+    st->owner[ggml_hash_find(st->uses, root)] = node;
+    node->view_src  = NULL;
+    node->view_offs = 0;
+}
+
+// t is only used by the node being fused, so it can be absorbed into it
+static bool ggml_fuse_is_private(const struct ggml_fuse_state * st, struct ggml_tensor * t) {
+    return t->op != GGML_OP_NONE && ggml_fuse_n_uses(st, t) == 1;
+}
+
+// the node will be (re)allocated after fusion
+static bool ggml_fuse_can_rewrite(const struct ggml_tensor * node) {
+    return node->data == NULL && node->type == GGML_TYPE_F32 && ggml_is_contiguous(node);
+}
+
+// returns the F32 vector of n elements used by t, either directly or through a private repeat
+static struct ggml_tensor * ggml_fuse_vector(const struct ggml_fuse_state * st, struct ggml_tensor * t, int64_t n) {
+    if (t->op == GGML_OP_REPEAT && ggml_fuse_is_private(st, t)) {
+        t = t->src[0];
+    }
+    if (t->type != GGML_TYPE_F32 || !ggml_is_contiguous(t) || t->ne[0] != n || ggml_nelements(t) != n) {
+        return NULL;
+    }
+    return t;
+}
+
+// follows private reshapes down to a mul_mat node which can take an epilogue
+static struct ggml_tensor * ggml_fuse_mul_mat_src(const struct ggml_fuse_state * st, struct ggml_tensor * t) {
+    while (t->op == GGML_OP_RESHAPE && ggml_fuse_is_private(st, t)) {
+        t = t->src[0];
+    }
+    if (t->op != GGML_OP_MUL_MAT || !ggml_fuse_is_private(st, t) || !ggml_fuse_can_rewrite(t)) {
+        return NULL;
+    }
+    return t;
+}
+
+// node computes what src computed, src is removed from the graph
+static void ggml_fuse_replace(struct ggml_fuse_state * st, struct ggml_tensor * node, struct ggml_tensor * src) {
+    node->op = src->op;
+    memcpy(node->op_params, src->op_params, sizeof(node->op_params));
+    memcpy(node->src, src->src, sizeof(node->src));
+    ggml_fuse_remove(st, src);
+    ggml_fuse_take_memory(st, node);
+}
+
+// node becomes a view of owner, which now computes its result
+static void ggml_fuse_make_view(struct ggml_tensor * node, struct ggml_tensor * src, struct ggml_tensor * owner) {
+    node->op = GGML_OP_RESHAPE;
+    memset(node->op_params, 0, sizeof(node->op_params));
+    memset(node->src, 0, sizeof(node->src));
+    node->src[0]    = src;
+    node->view_src  = owner;
+    node->view_offs = 0;
+}
+
+static bool ggml_fuse_mul_mat_bias(struct ggml_fuse_state * st, struct ggml_tensor * node) {
+    if (node->op != GGML_OP_ADD || !ggml_fuse_can_rewrite(node)) {
+        return false;
+    }
+    struct ggml_tensor * a  = node->src[0];
+    struct ggml_tensor * mm = ggml_fuse_mul_mat_src(st, a);
+    if (mm == NULL || mm->src[2] != NULL || ggml_get_op_params_i32(mm, 0) != 0) {
+        return false;
+    }
+    if (node->ne[0] != mm->ne[0] || ggml_nelements(node) != ggml_nelements(mm)) {
+        return false;
+    }
+    struct ggml_tensor * bias = ggml_fuse_vector(st, node->src[1], mm->ne[0]);
+    if (bias == NULL) {
+        return false;
+    }
+
+    if (node->src[1] != bias) {
+        ggml_fuse_remove(st, node->src[1]);
+    }
+    if (a == mm) {
+        ggml_fuse_replace(st, node, mm);
+        node->src[2] = bias;
+    } else {
+        mm->src[2] = bias;
+        ggml_fuse_make_view(node, a, mm);
+    }
+    return true;
+}
+
+static bool ggml_fuse_mul_mat_act(struct ggml_fuse_state * st, struct ggml_tensor * node) {
+    if (node->op != GGML_OP_UNARY || !ggml_fuse_can_rewrite(node)) {
+        return false;
+    }
+    const enum ggml_unary_op act = ggml_get_unary_op(node);
+    if (act != GGML_UNARY_OP_RELU && act != GGML_UNARY_OP_GELU && act != GGML_UNARY_OP_SILU) {
+        return false;
+    }
+    struct ggml_tensor * a  = node->src[0];
+    struct ggml_tensor * mm = ggml_fuse_mul_mat_src(st, a);
+    if (mm == NULL || ggml_get_op_params_i32(mm, 0) != 0 || ggml_nelements(node) != ggml_nelements(mm)) {
+        return false;
+    }
+
+    struct ggml_tensor * owner = mm;
+    if (a == mm) {
+        ggml_fuse_replace(st, node, mm);
+        owner = node;
+    } else {
+        ggml_fuse_make_view(node, a, mm);
+    }
+    ggml_set_op_params_i32(owner, 0, 1);
+    ggml_set_op_params_i32(owner, 1, act);
+    return true;
+}
+
+static bool ggml_fuse_norm_affine(struct ggml_fuse_state * st, struct ggml_tensor * node) {
+    if (node->op != GGML_OP_ADD || !ggml_fuse_can_rewrite(node)) {
+        return false;
+    }
+    struct ggml_tensor * mul = node->src[0];
+    if (mul->op != GGML_OP_MUL || !ggml_fuse_is_private(st, mul)) {
+        return false;
+    }
+    const int i_norm = mul->src[0]->op == GGML_OP_NORM ? 0 : 1;
+    struct ggml_tensor * norm = mul->src[i_norm];
+    if (norm->op != GGML_OP_NORM || norm->src[1] != NULL || !ggml_fuse_is_private(st, norm)) {
+        return false;
+    }
+    if (!ggml_are_same_shape(node, norm)) {
+        return false;
+    }
+    struct ggml_tensor * gamma = ggml_fuse_vector(st, mul->src[1 - i_norm], norm->ne[0]);
+    struct ggml_tensor * beta  = ggml_fuse_vector(st, node->src[1], norm->ne[0]);
+    if (gamma == NULL || beta == NULL) {
+        return false;
+    }
+
+    if (mul->src[1 - i_norm] != gamma) {
+        ggml_fuse_remove(st, mul->src[1 - i_norm]);
+    }
+    if (node->src[1] != beta) {
+        ggml_fuse_remove(st, node->src[1]);
+    }
+    ggml_fuse_remove(st, mul);
+    ggml_fuse_replace(st, node, norm);
+    node->src[1] = gamma;
+    node->src[2] = beta;
+    return true;
+}
+
+// returns the scale applied by a private scale node, or by a mul with a private repeated scalar
+static bool ggml_fuse_scale_value(const struct ggml_fuse_state * st, struct ggml_tensor * t, float * scale, struct ggml_tensor ** repeat) {
+    if (!ggml_fuse_is_private(st, t) || (t->op != GGML_OP_SCALE && t->op != GGML_OP_MUL)) {
+        return false;
+    }
+    struct ggml_tensor * s = t->src[1];
+    *repeat = NULL;
+    if (t->op == GGML_OP_MUL && s->op == GGML_OP_REPEAT && ggml_fuse_is_private(st, s)) {
+        *repeat = s;
+        s = s->src[0];
+    }
+    // the value is read now, so it has to be set before fusing
+    if (s->op != GGML_OP_NONE || s->data == NULL || s->type != GGML_TYPE_F32 || ggml_nelements(s) != 1) {
+        return false;
+    }
+    *scale = *(const float *) s->data;
+    return true;
+}
+
+static bool ggml_fuse_soft_max(struct ggml_fuse_state * st, struct ggml_tensor * node) {
+    if (node->op != GGML_OP_SOFT_MAX || node->src[1] != NULL || !ggml_fuse_can_rewrite(node)) {
+        return false;
+    }
+    float scale;
+    memcpy(&scale, node->op_params, sizeof(float));
+    if (scale != 1.0f) {
+        return false;
+    }
+
+    struct ggml_tensor * t    = node->src[0];
+    struct ggml_tensor * add  = NULL;
+    struct ggml_tensor * mask = NULL;
+    if (t->op == GGML_OP_ADD && ggml_fuse_is_private(st, t)) {
+        mask = t->src[1];
+        const bool ok = mask->type == GGML_TYPE_F32 && mask->nb[0] == sizeof(float) &&
+            mask->ne[0] == t->ne[0] && mask->ne[2] == 1 && mask->ne[3] == 1 && t->ne[1] % mask->ne[1] == 0;
+        if (ok) {
+            add = t;
+            t = t->src[0];
+        } else {
+            mask = NULL;
+        }
+    }
+    struct ggml_tensor * repeat = NULL;
+    const bool scaled = ggml_fuse_scale_value(st, t, &scale, &repeat);
+    if (scaled) {
+        t = t->src[0];
+    }
+    if ((!scaled && add == NULL) || t->type != GGML_TYPE_F32 || !ggml_is_contiguous(t) || !ggml_are_same_shape(t, node)) {
+        return false;
+    }
+
+    if (add) {
+        ggml_fuse_remove(st, add);
+    }
+    if (scaled) {
+        ggml_fuse_remove(st, add ? add->src[0] : node->src[0]);
+    }
+    if (repeat) {
+        ggml_fuse_remove(st, repeat);
+    }
+    node->src[0] = t;
+    node->src[1] = mask;
+    memcpy(node->op_params, &scale, sizeof(float));
+    ggml_fuse_take_memory(st, node);
+    return true;
+}
+
+int ggml_graph_fuse(struct ggml_cgraph * cgraph) {
+#if defined(GGML_USE_CUBLAS) || defined(GGML_USE_CLBLAST) || defined(GGML_USE_METAL)
+    // the fused kernels only exist on the CPU
+    UNUSED(cgraph);
+    return 0;
+#else
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        if (cgraph->nodes[i]->grad) {
+            return 0;
+        }
+    }
+
+    struct ggml_fuse_state st;
+    st.uses    = ggml_hash_set_new(2*(cgraph->n_nodes + cgraph->n_leafs));
+    st.n_uses  = calloc(st.uses.size, sizeof(int));
+    st.removed = calloc(st.uses.size, sizeof(bool));
+    st.owner   = calloc(st.uses.size, sizeof(struct ggml_tensor *));
+
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            if (node->src[j]) {
+                st.n_uses[ggml_hash_find_or_insert(st.uses, node->src[j])] += 1;
+            }
+        }
+    }
+
+    int n_fused = 0;
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+        if (node->backend != GGML_BACKEND_CPU) {
+            continue;
+        }
+        if (ggml_fuse_mul_mat_bias(&st, node) ||
+            ggml_fuse_mul_mat_act (&st, node) ||
+            ggml_fuse_norm_affine (&st, node) ||
+            ggml_fuse_soft_max    (&st, node)) {
+            n_fused++;
+        }
+    }
+
+    int n_nodes = 0;
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+        if (ggml_fuse_is_removed(&st, node)) {
+            continue;
+        }
+        while (node->view_src && ggml_fuse_is_removed(&st, node->view_src)) {
+            node->view_src = st.owner[ggml_hash_find(st.uses, node->view_src)];
+            GGML_ASSERT(node->view_src != NULL);
+        }
+        cgraph->nodes[n_nodes++] = node;
+    }
+    cgraph->n_nodes = n_nodes;
+
+    ggml_hash_set_free(st.uses);
+    free(st.n_uses);
+    free(st.removed);
+    free(st.owner);
+
+    return n_fused;
+#endif
+}
+
+//
+// thread data
+//
+// synchronization is done via busy loops
+// I tried using spin locks, but not sure how to use them correctly - the things I tried were slower than busy loops
+//
+
+#ifdef __APPLE__
+
+//#include <os/lock.h>
+//
+//typedef os_unfair_lock ggml_lock_t;
+//
+//#define ggml_lock_init(x)    UNUSED(x)
+//#define ggml_lock_destroy(x) UNUSED(x)
+//#define ggml_lock_lock       os_unfair_lock_lock
+//#define ggml_lock_unlock     os_unfair_lock_unlock
+//
+//#define GGML_LOCK_INITIALIZER OS_UNFAIR_LOCK_INIT
+
+typedef int ggml_lock_t;
+
+#define ggml_lock_init(x)    UNUSED(x)
+#define ggml_lock_destroy(x) UNUSED(x)
+#define ggml_lock_lock(x)    UNUSED(x)
+#define ggml_lock_unlock(x)  UNUSED(x)
 
 #define GGML_LOCK_INITIALIZER 0
 
@@ -16946,20 +17563,24 @@ typedef pthread_t ggml_thread_t;
 
 // Android's libc implementation "bionic" does not support setting affinity
 #if defined(__linux__) && !defined(__BIONIC__)
-static void set_numa_thread_affinity(int thread_n, int n_threads) {
+static void set_thread_affinity_node(int node_num) {
     if (!ggml_is_numa()) {
         return;
     }
 
-    // run thread on node_num thread_n / (threads per node)
-    const int node_num = thread_n / ((n_threads + g_state.numa.n_nodes - 1) / g_state.numa.n_nodes);
-    struct ggml_numa_node * node = &g_state.numa.nodes[node_num];
     size_t setsize = CPU_ALLOC_SIZE(g_state.numa.total_cpus);
 
     cpu_set_t * cpus = CPU_ALLOC(g_state.numa.total_cpus);
     CPU_ZERO_S(setsize, cpus);
-    for (size_t i = 0; i < node->n_cpus; ++i) {
-        CPU_SET_S(node->cpus[i], setsize, cpus);
+    if (node_num >= 0) {
+        struct ggml_numa_node * node = &g_state.numa.nodes[node_num];
+        for (size_t i = 0; i < node->n_cpus; ++i) {
+            CPU_SET_S(node->cpus[i], setsize, cpus);
+        }
+    } else {
+        for (unsigned i = 0; i < g_state.numa.total_cpus; ++i) {
+            CPU_SET_S(i, setsize, cpus);
+        }
     }
 
     int rv = pthread_setaffinity_np(pthread_self(), setsize, cpus);
@@ -16971,34 +17592,33 @@ static void set_numa_thread_affinity(int thread_n, int n_threads) {
     CPU_FREE(cpus);
 }
 
-static void clear_numa_thread_affinity(void) {
+static void set_numa_thread_affinity(int thread_n, int n_threads, int numa_node) {
     if (!ggml_is_numa()) {
         return;
     }
 
-    size_t setsize = CPU_ALLOC_SIZE(g_state.numa.total_cpus);
-
-    cpu_set_t * cpus = CPU_ALLOC(g_state.numa.total_cpus);
-    CPU_ZERO_S(setsize, cpus);
-    for (unsigned i = 0; i < g_state.numa.total_cpus; ++i) {
-        CPU_SET_S(i, setsize, cpus);
-    }
-
-    int rv = pthread_setaffinity_np(pthread_self(), setsize, cpus);
-    if (rv) {
-        fprintf(stderr, "warning: pthread_setaffinity_np() failed: %s\n",
-            strerror(rv));
-    }
+    // run thread on numa_node if given, else on node_num thread_n / (threads per node)
+    const int n_nodes = (int) g_state.numa.n_nodes;
+    const int node_num = numa_node >= 0 ? numa_node : thread_n / ((n_threads + n_nodes - 1) / n_nodes);
+    set_thread_affinity_node(node_num);
+}
 
-    CPU_FREE(cpus);
+static void clear_numa_thread_affinity(void) {
+    set_thread_affinity_node(-1);
 }
 #else
 // TODO: Windows etc.
 // (the linux implementation may also work on BSD, someone should test)
-static void set_numa_thread_affinity(int thread_n, int n_threads) { UNUSED(thread_n); UNUSED(n_threads);  }
+static void set_thread_affinity_node(int node_num) { UNUSED(node_num); }
+static void set_numa_thread_affinity(int thread_n, int n_threads, int numa_node) { UNUSED(thread_n); UNUSED(n_threads); UNUSED(numa_node); }
 static void clear_numa_thread_affinity(void) {}
 #endif
 
+void ggml_numa_set_thread_node(int node) {
+    GGML_ASSERT(node < (int) g_state.numa.n_nodes);
+    set_thread_affinity_node(node);
+}
+
 struct ggml_compute_state_shared {
     const struct ggml_cgraph * cgraph;
     const struct ggml_cplan  * cplan;
@@ -17006,14 +17626,34 @@ struct ggml_compute_state_shared {
     int64_t perf_node_start_cycles;
     int64_t perf_node_start_time_us;
 
+    // only measured when cplan->node_callback is set
+    int64_t node_start_time_us;
+
     const int n_threads;
 
     // synchronization primitives
+    // each node ends with a barrier: the last thread to decrement n_active moves node_n to the
+    // next node, which releases the others; node_n is the sense of the barrier
     atomic_int n_active; // num active threads
     atomic_int node_n;   // active graph node
+    atomic_int n_parked; // threads sleeping until node_n changes, see ggml_graph_wait_node
+
+    // execution order of the nodes and the waves in it, see ggml_graph_schedule_waves
+    // NULL when the nodes are computed in graph order, one at a time
+    const int * order;
+    const int * wave_ends;
+
+    // when wave_end > node_n, nodes [node_n, wave_end) are independent single-task
+    // nodes; each thread claims the next one from wave_next until none are left
+    int        wave_end;
+    atomic_int wave_next;
 
     bool (*abort_callback)(void * data); // abort ggml_graph_compute when true
     void * abort_callback_data;
+
+    // set to GGML_EXIT_ABORTED by the thread distributing the work when cplan->abort_callback
+    // returns true; it then moves node_n past the last node, which stops all the threads
+    int ec;
 };
 
 struct ggml_compute_state {
@@ -17029,6 +17669,10 @@ static void ggml_graph_compute_perf_stats_node(struct ggml_tensor * node, const
     node->perf_runs++;
     node->perf_cycles  += cycles_cur;
     node->perf_time_us += time_us_cur;
+
+    if (st->cplan->node_callback) {
+        st->cplan->node_callback(node, st->node_start_time_us, ggml_time_us(), st->cplan->node_callback_data);
+    }
 }
 
 static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
@@ -17297,6 +17941,395 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
     return n_tasks;
 }
 
+// scratch memory a node needs in cplan->work_data when computed with n_tasks threads
+static size_t ggml_graph_node_work_size(const struct ggml_tensor * node, int n_tasks) {
+    size_t cur = 0;
+
+    switch (node->op) {
+        case GGML_OP_CPY:
+        case GGML_OP_DUP:
+            {
+                if (ggml_is_quantized(node->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_ADD:
+        case GGML_OP_ADD1:
+            {
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_ACC:
+            {
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[1]->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_MUL_MAT:
+            {
+                const enum ggml_type vec_dot_type = type_traits[node->src[0]->type].vec_dot_type;
+
+#if defined(GGML_USE_CLBLAST)
+                if (ggml_cl_can_mul_mat(node->src[0], node->src[1], node)) {
+                    cur = ggml_cl_mul_mat_get_wsize(node->src[0], node->src[1], node);
+                } else
+#endif
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+                if (ggml_compute_forward_mul_mat_use_blas(node->src[0], node->src[1], node)) {
+                    if (node->src[0]->type != GGML_TYPE_F32) {
+                        // here we need memory just for single 2D matrix from src0
+                        cur = ggml_type_size(GGML_TYPE_F32)*(node->src[0]->ne[0]*node->src[0]->ne[1]);
+                    }
+                } else
+#endif
+                if (node->src[1]->type != vec_dot_type) {
+                    cur = ggml_type_size(vec_dot_type)*ggml_nelements(node->src[1])/ggml_blck_size(vec_dot_type);
+                }
+            } break;
+        case GGML_OP_MUL_MAT_ID:
+            {
+                const struct ggml_tensor * a = node->src[2];
+                const struct ggml_tensor * b = node->src[1];
+                const enum ggml_type vec_dot_type = type_traits[a->type].vec_dot_type;
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+                if (ggml_compute_forward_mul_mat_use_blas(a, b, node)) {
+                    if (a->type != GGML_TYPE_F32) {
+                        // here we need memory just for single 2D matrix from src0
+                        cur = ggml_type_size(GGML_TYPE_F32)*(a->ne[0]*a->ne[1]);
+                    }
+                } else
+#endif
+                if (b->type != vec_dot_type) {
+                    cur = ggml_type_size(vec_dot_type)*ggml_nelements(b)/ggml_blck_size(vec_dot_type);
+                }
+            } break;
+        case GGML_OP_OUT_PROD:
+            {
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_SOFT_MAX:
+            {
+                cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
+            } break;
+        case GGML_OP_CONV_TRANSPOSE_1D:
+            {
+                GGML_ASSERT(node->src[0]->ne[3] == 1);
+                GGML_ASSERT(node->src[1]->ne[2] == 1);
+                GGML_ASSERT(node->src[1]->ne[3] == 1);
+
+                const int64_t ne00 = node->src[0]->ne[0];  // K
+                const int64_t ne01 = node->src[0]->ne[1];  // Cout
+                const int64_t ne02 = node->src[0]->ne[2];  // Cin
+
+                const int64_t ne10 = node->src[1]->ne[0];  // L
+                const int64_t ne11 = node->src[1]->ne[1];  // Cin
+
+                if (node->src[0]->type == GGML_TYPE_F16 &&
+                    node->src[1]->type == GGML_TYPE_F32) {
+                    cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02;
+                    cur += sizeof(ggml_fp16_t)*ne10*ne11;
+                } else if (node->src[0]->type == GGML_TYPE_F32 &&
+                           node->src[1]->type == GGML_TYPE_F32) {
+                    cur += sizeof(float)*ne00*ne01*ne02;
+                    cur += sizeof(float)*ne10*ne11;
+                } else {
+                    GGML_ASSERT(false);
+                }
+            } break;
+        case GGML_OP_CONV_TRANSPOSE_2D:
+            {
+                const int64_t ne00 = node->src[0]->ne[0]; // W
+                const int64_t ne01 = node->src[0]->ne[1]; // H
+                const int64_t ne02 = node->src[0]->ne[2]; // Channels Out
+                const int64_t ne03 = node->src[0]->ne[3]; // Channels In
+
+                const int64_t ne10 = node->src[1]->ne[0]; // W
+                const int64_t ne11 = node->src[1]->ne[1]; // H
+                const int64_t ne12 = node->src[1]->ne[2]; // Channels In
+
+                cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02*ne03;
+                cur += sizeof(ggml_fp16_t)*ne10*ne11*ne12;
+            } break;
+        case GGML_OP_FLASH_ATTN:
+            {
+                const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
+
+                if (node->src[1]->type == GGML_TYPE_F32) {
+                    cur  = sizeof(float)*ne11*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
+                } else if (node->src[1]->type == GGML_TYPE_F16) {
+                    cur  = sizeof(float)*ne11*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
+                }
+            } break;
+        case GGML_OP_FLASH_FF:
+            {
+                if (node->src[1]->type == GGML_TYPE_F32) {
+                    cur  = sizeof(float)*node->src[1]->ne[1]*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*node->src[1]->ne[1]*n_tasks; // this is overestimated by x2
+                } else if (node->src[1]->type == GGML_TYPE_F16) {
+                    cur  = sizeof(float)*node->src[1]->ne[1]*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*node->src[1]->ne[1]*n_tasks; // this is overestimated by x2
+                }
+            } break;
+        case GGML_OP_FLASH_ATTN_BACK:
+            {
+                const int64_t    D = node->src[0]->ne[0];
+                const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
+                const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
+                if (node->src[1]->type == GGML_TYPE_F32) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                } else if (node->src[1]->type == GGML_TYPE_F16) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                }
+            } break;
+
+        case GGML_OP_CROSS_ENTROPY_LOSS:
+            {
+                cur = ggml_type_size(node->type)*(n_tasks + node->src[0]->ne[0]*n_tasks);
+            } break;
+        case GGML_OP_COUNT:
+            {
+                GGML_ASSERT(false);
+            } break;
+        default:
+            break;
+    }
+
+    return cur;
+}
+
+// max number of consecutive nodes the scheduler looks at when building a wave
+#define GGML_GRAPH_WAVE_MAX_NODES 32
+
+static bool ggml_graph_node_is_noop(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_VIEW:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// a node may run concurrently with other nodes if a single thread computes it
+// without touching the shared work buffer or calling back into user code
+static bool ggml_graph_node_can_overlap(struct ggml_tensor * node, int n_threads) {
+    if (ggml_graph_node_is_noop(node)) {
+        return true;
+    }
+
+    switch (node->op) {
+        case GGML_OP_MAP_UNARY:
+        case GGML_OP_MAP_BINARY:
+        case GGML_OP_MAP_CUSTOM1_F32:
+        case GGML_OP_MAP_CUSTOM2_F32:
+        case GGML_OP_MAP_CUSTOM3_F32:
+        case GGML_OP_MAP_CUSTOM1:
+        case GGML_OP_MAP_CUSTOM2:
+        case GGML_OP_MAP_CUSTOM3:
+            return false;
+        default:
+            break;
+    }
+
+    return ggml_get_n_tasks(node, n_threads) == 1 && ggml_graph_node_work_size(node, 1) == 0;
+}
+
+static bool ggml_tensors_overlap(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (a->data == NULL || b->data == NULL) {
+        return false;
+    }
+
+    const char * a0 = (const char *) a->data;
+    const char * b0 = (const char *) b->data;
+
+    return a0 < b0 + ggml_nbytes(b) && b0 < a0 + ggml_nbytes(a);
+}
+
+// nodes are compared by the memory they read and write rather than by graph edges,
+// so that views and buffers reused by ggml-alloc are accounted for
+static bool ggml_graph_nodes_independent(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (ggml_tensors_overlap(a, b)) {
+        return false;
+    }
+
+    for (int i = 0; i < GGML_MAX_SRC; ++i) {
+        if (a->src[i] && ggml_tensors_overlap(a->src[i], b)) {
+            return false;
+        }
+        if (b->src[i] && ggml_tensors_overlap(b->src[i], a)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// computes the execution order of the graph nodes: single-task nodes that may overlap
+// are held back until a later node conflicts with one of them, so that independent
+// branches (e.g. the q/k/v head splits) end up next to each other and form a wave.
+// wave_ends[i] > i when positions [i, wave_ends[i]) can be computed concurrently.
+// returns the number of waves
+static int ggml_graph_schedule_waves(const struct ggml_cgraph * cgraph, int n_threads, int * order, int * wave_ends) {
+    int held[GGML_GRAPH_WAVE_MAX_NODES];
+    int n_held  = 0;
+    int n_order = 0;
+    int n_waves = 0;
+
+    for (int i = 0; i <= cgraph->n_nodes; ++i) {
+        struct ggml_tensor * node = i < cgraph->n_nodes ? cgraph->nodes[i] : NULL;
+
+        // views do not read or write anything, they can run at any point
+        if (node && ggml_graph_node_is_noop(node)) {
+            wave_ends[n_order] = n_order;
+            order[n_order++] = i;
+            continue;
+        }
+
+        bool flush = node == NULL || n_held == GGML_GRAPH_WAVE_MAX_NODES;
+        for (int j = 0; j < n_held && !flush; ++j) {
+            flush = !ggml_graph_nodes_independent(cgraph->nodes[held[j]], node);
+        }
+
+        if (flush && n_held > 0) {
+            const int begin = n_order;
+            for (int j = 0; j < n_held; ++j) {
+                wave_ends[n_order] = n_order;
+                order[n_order++] = held[j];
+            }
+            if (n_held > 1) {
+                wave_ends[begin] = n_order;
+                n_waves++;
+            }
+            n_held = 0;
+        }
+
+        if (node == NULL) {
+            break;
+        }
+
+        if (ggml_graph_node_can_overlap(node, n_threads)) {
+            held[n_held++] = i;
+        } else {
+            wave_ends[n_order] = n_order;
+            order[n_order++] = i;
+        }
+    }
+
+    GGML_ASSERT(n_order == cgraph->n_nodes);
+
+    return n_waves;
+}
+
+static inline void ggml_spin_pause(void) {
+#if defined(_MSC_VER) && (defined(_M_AMD64) || defined(_M_IX86))
+    _mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// sleeps while *word == val, spurious wakeups are possible
+static void ggml_futex_wait(atomic_int * word, int val) {
+#if defined(__linux__)
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#else
+    UNUSED(word);
+    UNUSED(val);
+    sched_yield();
+#endif
+}
+
+static void ggml_futex_wake_all(atomic_int * word) {
+#if defined(__linux__)
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+    UNUSED(word);
+#endif
+}
+
+// waits for node_n to move past `last`: spins up to cplan->spin_count times, then sleeps
+// until ggml_graph_release_node wakes the thread, so that waiting threads don't take the
+// cores of other processes during long single-task nodes
+static int ggml_graph_wait_node(struct ggml_compute_state_shared * shared, int last) {
+    const int spin_count = shared->cplan->spin_count;
+
+    for (int i = 0; spin_count < 0 || i < spin_count; ++i) {
+        const int node_n = atomic_load(&shared->node_n);
+        if (node_n != last) {
+            return node_n;
+        }
+        ggml_spin_pause();
+    }
+
+    // n_parked is incremented before node_n is checked again, and ggml_graph_release_node
+    // stores node_n before reading n_parked: either the wakeup is sent, or node_n is seen
+    atomic_fetch_add(&shared->n_parked, 1);
+    int node_n;
+    while ((node_n = atomic_load(&shared->node_n)) == last) {
+        ggml_futex_wait(&shared->node_n, last);
+    }
+    atomic_fetch_sub(&shared->n_parked, 1);
+
+    return node_n;
+}
+
+static void ggml_graph_release_node(struct ggml_compute_state_shared * shared, int node_n) {
+    atomic_store(&shared->node_n, node_n);
+    if (atomic_load(&shared->n_parked) > 0) {
+        ggml_futex_wake_all(&shared->node_n);
+    }
+}
+
+static void ggml_graph_compute_wave(struct ggml_compute_state * state, int wave_end) {
+    const struct ggml_cgraph * cgraph = state->shared->cgraph;
+    const struct ggml_cplan  * cplan  = state->shared->cplan;
+
+    struct ggml_compute_params params = {
+        /*.type  =*/ GGML_TASK_COMPUTE,
+        /*.ith   =*/ 0,
+        /*.nth   =*/ 1,
+        /*.wsize =*/ cplan->work_size,
+        /*.wdata =*/ cplan->work_data,
+    };
+
+    int node_n;
+    while ((node_n = atomic_fetch_add(&state->shared->wave_next, 1)) < wave_end) {
+        struct ggml_tensor * node = cgraph->nodes[state->shared->order[node_n]];
+
+        const int64_t perf_cycles  = ggml_perf_cycles();
+        const int64_t perf_time_us = ggml_perf_time_us();
+
+        if (GGML_OP_HAS_INIT[node->op]) {
+            params.type = GGML_TASK_INIT;
+            ggml_compute_forward(&params, node);
+        }
+
+        params.type = GGML_TASK_COMPUTE;
+        ggml_compute_forward(&params, node);
+
+        if (GGML_OP_HAS_FINALIZE[node->op]) {
+            params.type = GGML_TASK_FINALIZE;
+            ggml_compute_forward(&params, node);
+        }
+
+        node->perf_runs++;
+        node->perf_cycles  += ggml_perf_cycles()  - perf_cycles;
+        node->perf_time_us += ggml_perf_time_us() - perf_time_us;
+    }
+}
+
 static thread_ret_t ggml_graph_compute_thread(void * data) {
     struct ggml_compute_state * state = (struct ggml_compute_state *) data;
 
@@ -17305,15 +18338,15 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
 
     const int   n_threads   = state->shared->n_threads;
 
-    set_numa_thread_affinity(state->ith, n_threads);
+    set_numa_thread_affinity(state->ith, n_threads, cplan->numa_node);
+
+    const int * order     = state->shared->order;
+    const int * wave_ends = state->shared->wave_ends;
 
-    int node_n = -1;
+    int  node_n  = -1;
+    bool in_wave = false;
 
     while (true) {
-        if (cplan->abort_callback && cplan->abort_callback(cplan->abort_callback_data)) {
-            state->shared->node_n += 1;
-            return (thread_ret_t) GGML_EXIT_ABORTED;
-        }
         if (atomic_fetch_sub(&state->shared->n_active, 1) == 1) {
             // all other threads are finished and spinning
             // do finalize and init here so we don't have synchronize again
@@ -17325,9 +18358,9 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
                 /*.wdata =*/ cplan->work_data,
             };
 
-            if (node_n != -1) {
+            if (node_n != -1 && !in_wave) {
                 /* FINALIZE */
-                struct ggml_tensor * node = cgraph->nodes[node_n];
+                struct ggml_tensor * node = cgraph->nodes[order ? order[node_n] : node_n];
                 if (GGML_OP_HAS_FINALIZE[node->op]) {
                     params.nth = ggml_get_n_tasks(node, n_threads);
                     ggml_compute_forward(&params, node);
@@ -17335,15 +18368,35 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
                 ggml_graph_compute_perf_stats_node(node, state->shared);
             }
 
+            if (in_wave) {
+                // continue after the wave
+                node_n = state->shared->wave_end - 1;
+            }
+            state->shared->wave_end = 0;
+
             // distribute new work or execute it direct if 1T
             while (++node_n < cgraph->n_nodes) {
                 GGML_PRINT_DEBUG_5("%s: %d/%d\n", __func__, node_n, cgraph->n_nodes);
 
-                struct ggml_tensor * node = cgraph->nodes[node_n];
+                if (cplan->abort_callback && cplan->abort_callback(cplan->abort_callback_data)) {
+                    state->shared->ec = GGML_EXIT_ABORTED;
+                    node_n = cgraph->n_nodes;
+                    break;
+                }
+
+                struct ggml_tensor * node = cgraph->nodes[order ? order[node_n] : node_n];
                 const int n_tasks = ggml_get_n_tasks(node, n_threads);
 
+                if (wave_ends && wave_ends[node_n] > node_n) {
+                    // hand independent single-task nodes to all threads instead of running them here
+                    state->shared->wave_end = wave_ends[node_n];
+                    atomic_store(&state->shared->wave_next, node_n);
+                    break;
+                }
+
                 state->shared->perf_node_start_cycles  = ggml_perf_cycles();
                 state->shared->perf_node_start_time_us = ggml_perf_time_us();
+                state->shared->node_start_time_us      = cplan->node_callback ? ggml_time_us() : 0;
 
                 params.nth = n_tasks;
 
@@ -17368,36 +18421,28 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
                 } else {
                     break;
                 }
-
-                if (cplan->abort_callback && cplan->abort_callback(cplan->abort_callback_data)) {
-                    break;
-                }
             }
 
             atomic_store(&state->shared->n_active, n_threads);
-            atomic_store(&state->shared->node_n,   node_n);
+            ggml_graph_release_node(state->shared, node_n);
         } else {
             // wait for other threads to finish
-            const int last = node_n;
-            while (true) {
-                // TODO: this sched_yield can have significant impact on the performance - either positive or negative
-                //       depending on the workload and the operating system.
-                //       since it is not clear what is the best approach, it should potentially become user-configurable
-                //       ref: https://github.com/ggerganov/ggml/issues/291
-#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
-                sched_yield();
-#endif
-
-                node_n = atomic_load(&state->shared->node_n);
-                if (node_n != last) break;
-            };
+            node_n = ggml_graph_wait_node(state->shared, node_n);
         }
 
         // check if we should stop
         if (node_n >= cgraph->n_nodes) break;
 
+        in_wave = node_n < state->shared->wave_end;
+        if (in_wave) {
+            const int wave_end = state->shared->wave_end;
+            ggml_graph_compute_wave(state, wave_end);
+            // node_n stays at the start of the wave, which is what the other threads wait on
+            continue;
+        }
+
         /* COMPUTE */
-        struct ggml_tensor * node = cgraph->nodes[node_n];
+        struct ggml_tensor * node = cgraph->nodes[order ? order[node_n] : node_n];
         const int n_tasks = ggml_get_n_tasks(node, n_threads);
 
         struct ggml_compute_params params = {
@@ -17432,163 +18477,7 @@ struct ggml_cplan ggml_graph_plan(struct ggml_cgraph * cgraph, int n_threads) {
 
         const int n_tasks = ggml_get_n_tasks(node, n_threads);
 
-        size_t cur = 0;
-
-        switch (node->op) {
-            case GGML_OP_CPY:
-            case GGML_OP_DUP:
-                {
-                    if (ggml_is_quantized(node->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_ADD:
-            case GGML_OP_ADD1:
-                {
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_ACC:
-                {
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[1]->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_MUL_MAT:
-                {
-                    const enum ggml_type vec_dot_type = type_traits[node->src[0]->type].vec_dot_type;
-
-#if defined(GGML_USE_CLBLAST)
-                    if (ggml_cl_can_mul_mat(node->src[0], node->src[1], node)) {
-                        cur = ggml_cl_mul_mat_get_wsize(node->src[0], node->src[1], node);
-                    } else
-#endif
-#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
-                    if (ggml_compute_forward_mul_mat_use_blas(node->src[0], node->src[1], node)) {
-                        if (node->src[0]->type != GGML_TYPE_F32) {
-                            // here we need memory just for single 2D matrix from src0
-                            cur = ggml_type_size(GGML_TYPE_F32)*(node->src[0]->ne[0]*node->src[0]->ne[1]);
-                        }
-                    } else
-#endif
-                    if (node->src[1]->type != vec_dot_type) {
-                        cur = ggml_type_size(vec_dot_type)*ggml_nelements(node->src[1])/ggml_blck_size(vec_dot_type);
-                    }
-                } break;
-            case GGML_OP_MUL_MAT_ID:
-                {
-                    const struct ggml_tensor * a = node->src[2];
-                    const struct ggml_tensor * b = node->src[1];
-                    const enum ggml_type vec_dot_type = type_traits[a->type].vec_dot_type;
-#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
-                    if (ggml_compute_forward_mul_mat_use_blas(a, b, node)) {
-                        if (a->type != GGML_TYPE_F32) {
-                            // here we need memory just for single 2D matrix from src0
-                            cur = ggml_type_size(GGML_TYPE_F32)*(a->ne[0]*a->ne[1]);
-                        }
-                    } else
-#endif
-                    if (b->type != vec_dot_type) {
-                        cur = ggml_type_size(vec_dot_type)*ggml_nelements(b)/ggml_blck_size(vec_dot_type);
-                    }
-                } break;
-            case GGML_OP_OUT_PROD:
-                {
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_SOFT_MAX:
-                {
-                    cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
-                } break;
-            case GGML_OP_CONV_TRANSPOSE_1D:
-                {
-                    GGML_ASSERT(node->src[0]->ne[3] == 1);
-                    GGML_ASSERT(node->src[1]->ne[2] == 1);
-                    GGML_ASSERT(node->src[1]->ne[3] == 1);
-
-                    const int64_t ne00 = node->src[0]->ne[0];  // K
-                    const int64_t ne01 = node->src[0]->ne[1];  // Cout
-                    const int64_t ne02 = node->src[0]->ne[2];  // Cin
-
-                    const int64_t ne10 = node->src[1]->ne[0];  // L
-                    const int64_t ne11 = node->src[1]->ne[1];  // Cin
-
-                    if (node->src[0]->type == GGML_TYPE_F16 &&
-                        node->src[1]->type == GGML_TYPE_F32) {
-                        cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02;
-                        cur += sizeof(ggml_fp16_t)*ne10*ne11;
-                    } else if (node->src[0]->type == GGML_TYPE_F32 &&
-                               node->src[1]->type == GGML_TYPE_F32) {
-                        cur += sizeof(float)*ne00*ne01*ne02;
-                        cur += sizeof(float)*ne10*ne11;
-                    } else {
-                        GGML_ASSERT(false);
-                    }
-                } break;
-            case GGML_OP_CONV_TRANSPOSE_2D:
-                {
-                    const int64_t ne00 = node->src[0]->ne[0]; // W
-                    const int64_t ne01 = node->src[0]->ne[1]; // H
-                    const int64_t ne02 = node->src[0]->ne[2]; // Channels Out
-                    const int64_t ne03 = node->src[0]->ne[3]; // Channels In
-
-                    const int64_t ne10 = node->src[1]->ne[0]; // W
-                    const int64_t ne11 = node->src[1]->ne[1]; // H
-                    const int64_t ne12 = node->src[1]->ne[2]; // Channels In
-
-                    cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02*ne03;
-                    cur += sizeof(ggml_fp16_t)*ne10*ne11*ne12;
-                } break;
-            case GGML_OP_FLASH_ATTN:
-                {
-                    const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
-
-                    if (node->src[1]->type == GGML_TYPE_F32) {
-                        cur  = sizeof(float)*ne11*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
-                    } else if (node->src[1]->type == GGML_TYPE_F16) {
-                        cur  = sizeof(float)*ne11*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
-                    }
-                } break;
-            case GGML_OP_FLASH_FF:
-                {
-                    if (node->src[1]->type == GGML_TYPE_F32) {
-                        cur  = sizeof(float)*node->src[1]->ne[1]*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*node->src[1]->ne[1]*n_tasks; // this is overestimated by x2
-                    } else if (node->src[1]->type == GGML_TYPE_F16) {
-                        cur  = sizeof(float)*node->src[1]->ne[1]*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*node->src[1]->ne[1]*n_tasks; // this is overestimated by x2
-                    }
-                } break;
-            case GGML_OP_FLASH_ATTN_BACK:
-                {
-                    const int64_t    D = node->src[0]->ne[0];
-                    const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
-                    const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
-                    if (node->src[1]->type == GGML_TYPE_F32) {
-                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                    } else if (node->src[1]->type == GGML_TYPE_F16) {
-                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                    }
-                } break;
-
-            case GGML_OP_CROSS_ENTROPY_LOSS:
-                {
-                    cur = ggml_type_size(node->type)*(n_tasks + node->src[0]->ne[0]*n_tasks);
-                } break;
-            case GGML_OP_COUNT:
-                {
-                    GGML_ASSERT(false);
-                } break;
-            default:
-                break;
-        }
+        const size_t cur = ggml_graph_node_work_size(node, n_tasks);
 
         work_size = MAX(work_size, cur);
     }
@@ -17598,6 +18487,13 @@ struct ggml_cplan ggml_graph_plan(struct ggml_cgraph * cgraph, int n_threads) {
     }
 
     cplan.n_threads = n_threads;
+    cplan.numa_node = -1;
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+    // the BLAS threads need the cores while the ggml threads wait for the matrix multiplication
+    cplan.spin_count = 0;
+#else
+    cplan.spin_count = GGML_DEFAULT_SPIN_COUNT;
+#endif
     cplan.work_size = work_size;
     cplan.work_data = NULL;
 
@@ -17621,14 +18517,33 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
         /*.cgraph_plan             =*/ cplan,
         /*.perf_node_start_cycles  =*/ 0,
         /*.perf_node_start_time_us =*/ 0,
+        /*.node_start_time_us      =*/ 0,
         /*.n_threads               =*/ n_threads,
         /*.n_active                =*/ n_threads,
         /*.node_n                  =*/ -1,
+        /*.n_parked                =*/ 0,
+        /*.order                   =*/ NULL,
+        /*.wave_ends               =*/ NULL,
+        /*.wave_end                =*/ 0,
+        /*.wave_next               =*/ 0,
         /*.abort_callback          =*/ NULL,
         /*.abort_callback_data     =*/ NULL,
+        /*.ec                      =*/ GGML_EXIT_SUCCESS,
     };
     struct ggml_compute_state * workers = alloca(sizeof(struct ggml_compute_state)*n_threads);
 
+    // run independent single-task nodes concurrently, unless per-node callbacks
+    // expect the nodes to complete one at a time in graph order
+    int * schedule = NULL;
+    if (n_threads > 1 && cplan->node_callback == NULL && cgraph->n_nodes > 0) {
+        schedule = malloc(2*cgraph->n_nodes*sizeof(int));
+        GGML_ASSERT(schedule);
+        if (ggml_graph_schedule_waves(cgraph, n_threads, schedule, schedule + cgraph->n_nodes) > 0) {
+            state_shared.order     = schedule;
+            state_shared.wave_ends = schedule + cgraph->n_nodes;
+        }
+    }
+
     // create thread pool
     if (n_threads > 1) {
         for (int j = 1; j < n_threads; ++j) {
@@ -17651,10 +18566,12 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
     const int64_t perf_start_time_us = ggml_perf_time_us();
 
     // this is a work thread too
-    int compute_status = (size_t) ggml_graph_compute_thread(&workers[0]);
+    ggml_graph_compute_thread(&workers[0]);
 
-    // don't leave affinity set on the main thread
-    clear_numa_thread_affinity();
+    // don't leave affinity set on the main thread, unless the caller asked for a node
+    if (cplan->numa_node < 0) {
+        clear_numa_thread_affinity();
+    }
 
     // join or kill thread pool
     if (n_threads > 1) {
@@ -17664,6 +18581,10 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
         }
     }
 
+    free(schedule);
+
+    const int compute_status = state_shared.ec;
+
     // performance stats (graph)
     {
         int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_start_cycles;
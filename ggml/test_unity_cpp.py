@@ -138,6 +138,30 @@ def test_convert_linear_fp16(tmp_path: Path, ctx: Ctx) -> None:
     assert np.allclose(y_exp, y, atol=1e-3)
 
 
+def test_convert_tied_weights(tmp_path: Path, ctx: Ctx) -> None:
+    linear = fairseq2.nn.Linear(16, 24, True)
+    tied = fairseq2.nn.Linear(16, 24, False)
+    tied.weight = linear.weight
+    pt_model = torch.nn.ModuleDict({"linear": linear, "tied": tied})
+
+    ggml_file = tmp_path / "tied.ggml"
+    convert_model(pt_model, ggml_file)
+    # The weight is written once
+    assert ggml_file.stat().st_size < 2 * 16 * 24 * 4
+    g_model = ggml.load_fairseq2_ggml_file(ggml_file)
+    ggml.lib.fairseq2_model_set_inference_ctx(g_model.ptr, ctx)
+
+    x = torch.empty((2, 5, 16))
+    torch.nn.init.uniform_(x, -1, 1)
+    y_exp = pt_model.tied(x).numpy()
+    gx = ggml.from_numpy(ctx, x)
+    gy = ggml.forward("Linear", g_model.ptr, "tied", gx)
+    ggml.build_and_compute(ctx, gy)
+    y = ggml.to_numpy(gy)
+
+    assert np.allclose(y_exp, y, atol=1e-6)
+
+
 def test_causal_attention_mask(ctx: Ctx):
     x = torch.zeros((1, 10, 32))
     generator = fairseq2.nn.transformer.CausalAttentionMaskFactory()
@@ -399,6 +423,42 @@ def test_MultiheadAttention_forward_cross_attn_with_cache(
             assert np.allclose(y, y_exp, atol=1e-2)
 
 
+def test_MultiheadAttention_forward_cross_attn_shared_kv(
+    ctx: Ctx, g_model: c_void_p
+) -> None:
+    pt_model = load_pt_model()
+    attn = pt_model.text_decoder.layers[0].encoder_decoder_attn
+
+    x = torch.empty((3, 21, 1024))
+    torch.random.manual_seed(0)
+    torch.nn.init.uniform_(x, -1, 1)
+
+    with ggml.fairseq2_kv_cache_alloc(g_model, 16 * MB, 3, 21):
+        # A single encoder output is attended by all the beams
+        xk = x[:1, :11]
+        gxk = ggml.from_numpy(ctx, xk.contiguous(), name=b"xk")
+
+        for t in range(2):
+            xq = x[:, t : t + 1]
+            gxq = ggml.from_numpy(ctx, xq.contiguous(), name=b"xq")
+            gy = ggml.forward(
+                "MultiheadAttention",
+                g_model,
+                "text_decoder.layers.0.encoder_decoder_attn",
+                gxq,
+                gxk,
+                gxk,
+                None,  # type: ignore
+            )
+            ggml.build_and_compute(ctx, gy)
+            y = ggml.to_numpy(gy)
+
+            xk_expanded = xk.expand(3, -1, -1)
+            y_exp = attn(xq, None, xk_expanded, None, xk_expanded).numpy()
+            assert y.shape == (3, 1, 1024)
+            assert np.allclose(y, y_exp, atol=1e-2)
+
+
 def test_StandardTransformerEncoderLayer_forward(ctx: Ctx, g_model: c_void_p) -> None:
     x = torch.empty((2, 21, 1024))
     torch.random.manual_seed(0)
@@ -717,6 +777,197 @@ def test_StandardTransformerDecoder_forward(ctx: Ctx, g_model: c_void_p) -> None
     assert np.allclose(y_exp, y, atol=1e-3)  # TODO: those tests are failing now
 
 
+def test_VariancePredictor_forward(tmp_path: Path, ctx: Ctx) -> None:
+    from seamless_communication.models.unity.length_regulator import VariancePredictor
+
+    pt_model = torch.nn.ModuleDict(
+        {"duration_predictor": VariancePredictor(32, 48, 3, var_pred_dropout=0.0)}
+    ).eval()
+    ggml_file = tmp_path / "duration_predictor.ggml"
+    convert_model(pt_model, ggml_file)
+    g_model = ggml.load_fairseq2_ggml_file(ggml_file)
+    ggml.lib.fairseq2_model_set_inference_ctx(g_model.ptr, ctx)
+
+    x = torch.empty((11, 32))
+    torch.random.manual_seed(0)
+    torch.nn.init.uniform_(x, -1, 1)
+    gx = ggml.from_numpy(ctx, x)
+    gy = ggml.forward("VariancePredictor", g_model.ptr, "duration_predictor", gx)
+    ggml.build_and_compute(ctx, gy)
+    y = ggml.to_numpy(gy)
+
+    y_exp = pt_model.duration_predictor(x.unsqueeze(0))[0].numpy()
+
+    assert y.shape == y_exp.shape
+    assert np.allclose(y_exp, y, atol=1e-4)
+
+
+def test_FeedForwardTransformerLayer_forward(tmp_path: Path, ctx: Ctx) -> None:
+    from seamless_communication.models.unity.fft_decoder_layer import (
+        Conv1dBlock,
+        FeedForwardTransformerLayer,
+    )
+
+    self_attn = fairseq2.nn.transformer.StandardMultiheadAttention(32, 4)
+    layer = FeedForwardTransformerLayer(
+        self_attn, Conv1dBlock(32, 64, 9), dropout_p=0.0, conv1d_dropout_p=0.0
+    )
+    pt_model = torch.nn.ModuleDict({"layer": layer}).eval()
+    ggml_file = tmp_path / "fft_layer.ggml"
+    convert_model(pt_model, ggml_file)
+    g_model = ggml.load_fairseq2_ggml_file(ggml_file)
+    ggml.lib.fairseq2_model_set_inference_ctx(g_model.ptr, ctx)
+
+    x = torch.empty((23, 32))
+    torch.random.manual_seed(0)
+    torch.nn.init.uniform_(x, -1, 1)
+    gx = ggml.from_numpy(ctx, x)
+    gy = ggml.forward("FeedForwardTransformerLayer", g_model.ptr, "layer", gx)
+    ggml.build_and_compute(ctx, gy)
+    y = ggml.to_numpy(gy)
+
+    y_exp, _ = layer(x.unsqueeze(0), None)
+    y_exp = y_exp[0].numpy()
+
+    assert y.shape == y_exp.shape
+    assert np.allclose(y_exp, y, atol=1e-4 if UNITY_FLASH_ATTN else 1e-3)
+
+
+def test_ResBlock_forward(tmp_path: Path, ctx: Ctx) -> None:
+    from seamless_communication.models.vocoder.hifigan import ResBlock
+
+    pt_model = torch.nn.ModuleDict({"resblock": ResBlock(16, 3, [1, 3, 5])}).eval()
+    ggml_file = tmp_path / "resblock.ggml"
+    convert_model(pt_model, ggml_file)
+    g_model = ggml.load_fairseq2_ggml_file(ggml_file)
+    ggml.lib.fairseq2_model_set_inference_ctx(g_model.ptr, ctx)
+
+    x = torch.empty((16, 37))
+    torch.random.manual_seed(0)
+    torch.nn.init.uniform_(x, -1, 1)
+    gx = ggml.from_numpy(ctx, x)
+    gy = ggml.forward("ResBlock", g_model.ptr, "resblock", gx)
+    ggml.build_and_compute(ctx, gy)
+    y = ggml.to_numpy(gy)
+
+    with torch.inference_mode():
+        y_exp = pt_model.resblock(x.unsqueeze(0))[0].numpy()
+
+    assert y.shape == y_exp.shape
+    assert np.allclose(y_exp, y, atol=1e-4)
+
+
+def test_CodeGenerator_forward(tmp_path: Path, ctx: Ctx) -> None:
+    from seamless_communication.models.vocoder.codehifigan import CodeGenerator
+
+    generator = CodeGenerator(
+        upsample_rates=[5, 4],
+        upsample_kernel_sizes=[11, 8],
+        upsample_initial_channel=32,
+        resblock_kernel_sizes=[3, 7],
+        resblock_dilation_sizes=[[1, 3, 5], [1, 3, 5]],
+        model_in_dim=48,
+        num_embeddings=20,
+        embedding_dim=16,
+        dur_predictor_params=None,
+        lang_embedding_dim=16,
+        num_langs=3,
+        spkr_embedding_dim=16,
+        num_spkrs=4,
+    )
+    pt_model = torch.nn.ModuleDict({"code_generator": generator}).eval()
+    ggml_file = tmp_path / "code_generator.ggml"
+    convert_model(pt_model, ggml_file)
+    g_model = ggml.load_fairseq2_ggml_file(ggml_file)
+    ggml.lib.fairseq2_model_set_inference_ctx(g_model.ptr, ctx)
+
+    torch.random.manual_seed(0)
+    units = torch.randint(0, 20, (13,), dtype=torch.int32)
+    lang = torch.tensor([1], dtype=torch.int32)
+    spkr = torch.tensor([2], dtype=torch.int32)
+    gy = ggml.forward(
+        "CodeGenerator",
+        g_model.ptr,
+        "code_generator",
+        ggml.from_numpy(ctx, units),
+        ggml.from_numpy(ctx, lang),
+        ggml.from_numpy(ctx, spkr),
+    )
+    ggml.build_and_compute(ctx, gy)
+    y = ggml.to_numpy(gy)
+
+    with torch.inference_mode():
+        sample = {
+            "code": units.long().unsqueeze(0),
+            "lang": lang.long().view(1, 1),
+            "spkr": spkr.long().view(1, 1),
+        }
+        y_exp = generator(sample, dur_prediction=False)[0].reshape(-1).numpy()
+
+    assert y.shape == y_exp.shape
+    assert np.allclose(y_exp, y, atol=1e-4)
+
+
+def test_PChooseLayer_forward(tmp_path: Path, ctx: Ctx) -> None:
+    from seamless_communication.models.monotonic_decoder.p_choose import PChooseLayer
+
+    pt_model = torch.nn.ModuleDict(
+        {"p_choose_layer": PChooseLayer(32, 4, -0.5, 0.2, 2, 2)}
+    ).eval()
+    ggml_file = tmp_path / "p_choose.ggml"
+    convert_model(pt_model, ggml_file)
+    g_model = ggml.load_fairseq2_ggml_file(ggml_file)
+    ggml.lib.fairseq2_model_set_inference_ctx(g_model.ptr, ctx)
+
+    x = torch.empty((5, 32))
+    keys = torch.empty((13, 32))
+    torch.random.manual_seed(0)
+    torch.nn.init.uniform_(x, -1, 1)
+    torch.nn.init.uniform_(keys, -1, 1)
+    gy = ggml.forward(
+        "PChooseLayer",
+        g_model.ptr,
+        "p_choose_layer",
+        ggml.from_numpy(ctx, x),
+        ggml.from_numpy(ctx, keys),
+    )
+    ggml.build_and_compute(ctx, gy)
+    y = ggml.to_numpy(gy)
+
+    with torch.inference_mode():
+        y_exp = pt_model.p_choose_layer(x.unsqueeze(0), keys.unsqueeze(0))[0].numpy()
+
+    assert y.shape == y_exp.shape
+    assert np.allclose(y_exp, y, atol=1e-4)
+
+
+def test_KmeansQuantizer_forward(tmp_path: Path, ctx: Ctx) -> None:
+    torch.random.manual_seed(0)
+    centroids = torch.empty((100, 32))
+    torch.nn.init.uniform_(centroids, -1, 1)
+    kmeans = torch.nn.Module()
+    kmeans.register_buffer("centroids", centroids)
+    pt_model = torch.nn.ModuleDict({"kmeans": kmeans})
+    ggml_file = tmp_path / "kmeans.ggml"
+    convert_model(pt_model, ggml_file)
+    g_model = ggml.load_fairseq2_ggml_file(ggml_file)
+    ggml.lib.fairseq2_model_set_inference_ctx(g_model.ptr, ctx)
+
+    x = torch.empty((37, 32))
+    torch.nn.init.uniform_(x, -1, 1)
+    gy = ggml.forward("KmeansQuantizer", g_model.ptr, "kmeans", ggml.from_numpy(ctx, x))
+    ggml.build_and_compute(ctx, gy)
+    y = ggml.to_numpy(gy)
+
+    # Same formula as seamless_communication.models.unit_extractor.kmeans.KmeansModel
+    c = centroids.transpose(0, 1)
+    dist = x.pow(2).sum(1, keepdim=True) - 2 * torch.matmul(x, c) + (c**2).sum(0, keepdim=True)
+    y_exp = dist.argmin(dim=-1).numpy()
+
+    assert y.shape == y_exp.shape
+    assert np.all(y == y_exp)
+
+
 def test_s2tt(ctx: Ctx, g_model: c_void_p):
     if not LOCAL_AUDIO_SAMPLE_PATH.exists():
         download_sample_audio()
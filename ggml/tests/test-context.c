@@ -0,0 +1,102 @@
+#include "ggml/ggml.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// checks the contexts stored at the start of their own memory buffer: a caller buffer loses
+// GGML_CONTEXT_HEADER_SIZE bytes to the context and the rest can be allocated to the last byte,
+// and contexts can be created and freed from several threads at once, more of them alive at a
+// time than any fixed number of slots
+
+#define N_THREADS 8
+#define N_LIVE    32
+#define N_ROUNDS  200
+
+void check_caller_buffer(void) {
+    const int64_t n = 1000;
+    const size_t tensors_size = ggml_tensor_overhead() + GGML_PAD(n*sizeof(float), GGML_MEM_ALIGN);
+    const size_t mem_size = GGML_CONTEXT_HEADER_SIZE + tensors_size;
+
+    void * buffer = malloc(mem_size);
+    GGML_ASSERT(buffer != NULL && (uintptr_t) buffer % GGML_MEM_ALIGN == 0);
+
+    // the buffer is reused once its context is freed
+    for (int i = 0; i < 2; ++i) {
+        struct ggml_init_params params = {
+            .mem_size   = mem_size,
+            .mem_buffer = buffer,
+            .no_alloc   = false,
+        };
+        struct ggml_context * ctx = ggml_init(params);
+        GGML_ASSERT(ctx != NULL);
+        GGML_ASSERT(ggml_get_mem_size(ctx) == tensors_size);
+        GGML_ASSERT(ggml_get_mem_buffer(ctx) == (char *) buffer + GGML_CONTEXT_HEADER_SIZE);
+
+        struct ggml_tensor * t = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n);
+        GGML_ASSERT(t != NULL);
+        GGML_ASSERT(ggml_used_mem(ctx) == tensors_size);
+        GGML_ASSERT(ggml_get_max_tensor_size(ctx) == n*sizeof(float));
+
+        // the tensor data ends at the end of the caller buffer
+        memset(t->data, 0x55, ggml_nbytes(t));
+        GGML_ASSERT((char *) t->data + ggml_nbytes(t) <= (char *) buffer + mem_size);
+
+        ggml_free(ctx);
+    }
+
+    free(buffer);
+    printf("caller buffer: ok\n");
+}
+
+void * init_free_loop(void * arg) {
+    const int id = (int) (intptr_t) arg;
+    struct ggml_context * ctxs[N_LIVE];
+
+    for (int round = 0; round < N_ROUNDS; ++round) {
+        for (int i = 0; i < N_LIVE; ++i) {
+            struct ggml_init_params params = {
+                .mem_size   = 4096,
+                .mem_buffer = NULL,
+                .no_alloc   = false,
+            };
+            ctxs[i] = ggml_init(params);
+            GGML_ASSERT(ctxs[i] != NULL);
+
+            struct ggml_tensor * t = ggml_new_i32(ctxs[i], id*N_LIVE + i);
+            GGML_ASSERT(t != NULL);
+        }
+
+        // every context still holds its own tensor while the other threads create theirs
+        for (int i = 0; i < N_LIVE; ++i) {
+            struct ggml_tensor * t = ggml_get_first_tensor(ctxs[i]);
+            if (t == NULL || ggml_get_i32_1d(t, 0) != id*N_LIVE + i) {
+                fprintf(stderr, "thread %d, round %d: context %d lost its tensor\n", id, round, i);
+                GGML_ASSERT(false);
+            }
+            ggml_free(ctxs[i]);
+        }
+    }
+
+    return NULL;
+}
+
+void check_concurrent_init_free(void) {
+    pthread_t threads[N_THREADS];
+    for (int i = 0; i < N_THREADS; ++i) {
+        GGML_ASSERT(pthread_create(&threads[i], NULL, init_free_loop, (void *) (intptr_t) i) == 0);
+    }
+    for (int i = 0; i < N_THREADS; ++i) {
+        GGML_ASSERT(pthread_join(threads[i], NULL) == 0);
+    }
+
+    printf("concurrent init/free, %d live contexts: ok\n", N_THREADS*N_LIVE);
+}
+
+int main(int argc, const char ** argv) {
+    check_caller_buffer();
+    check_concurrent_init_free();
+
+    return 0;
+}
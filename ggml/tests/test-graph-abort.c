@@ -0,0 +1,87 @@
+#include "ggml/ggml.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// checks that the abort callback stops ggml_graph_compute before the next node,
+// with all the threads, and that the nodes left are not computed
+
+struct ggml_context * make_ctx(void) {
+    struct ggml_init_params params = {
+        .mem_size = 16 * 1024 * 1024,
+        .no_alloc = false,
+    };
+
+    return ggml_init(params);
+}
+
+struct abort_after {
+    int n_calls;
+    int limit;
+};
+
+// aborts once called `limit` times, and keeps aborting after that
+bool abort_after_callback(void * data) {
+    struct abort_after * state = (struct abort_after *) data;
+    return ++state->n_calls > state->limit;
+}
+
+// chain of `n` nodes, mixing single-task and multi-task ops
+struct ggml_tensor * build_chain(struct ggml_context * ctx, struct ggml_tensor * x, struct ggml_tensor * w, int n) {
+    for (int i = 0; i < n; ++i) {
+        x = i % 2 == 0 ? ggml_mul_mat(ctx, w, x) : ggml_scale(ctx, x, ggml_new_f32(ctx, 0.5f));
+    }
+    return x;
+}
+
+int main(int argc, const char ** argv) {
+    struct ggml_context * ctx = make_ctx();
+
+    struct ggml_tensor * x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 64, 8);
+    struct ggml_tensor * w = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 64, 64);
+    ggml_set_f32(x, 1.0f);
+    ggml_set_f32(w, 1.0f / 64);
+
+    const int n_nodes = 16;
+    struct ggml_tensor * out = build_chain(ctx, x, w, n_nodes);
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+    GGML_ASSERT(gf->n_nodes == n_nodes);
+
+    for (int n_threads = 1; n_threads <= 4; ++n_threads) {
+        struct ggml_cplan plan = ggml_graph_plan(gf, n_threads);
+        void * work = malloc(plan.work_size > 0 ? plan.work_size : 1);
+        plan.work_data = work;
+
+        // never aborting
+        struct abort_after never = { 0, n_nodes };
+        plan.abort_callback = abort_after_callback;
+        plan.abort_callback_data = &never;
+        ggml_set_f32(out, -1.0f);
+        GGML_ASSERT(ggml_graph_compute(gf, &plan) == GGML_EXIT_SUCCESS);
+        GGML_ASSERT(ggml_get_f32_1d(out, 0) != -1.0f);
+
+        for (int limit = 0; limit < n_nodes; limit += 5) {
+            // the first `limit` nodes are computed
+            struct abort_after state = { 0, limit };
+            plan.abort_callback_data = &state;
+            for (int i = 0; i < n_nodes; ++i) {
+                ggml_set_f32(gf->nodes[i], -1.0f);
+            }
+            GGML_ASSERT(ggml_graph_compute(gf, &plan) == GGML_EXIT_ABORTED);
+            for (int i = 0; i < n_nodes; ++i) {
+                const bool computed = ggml_get_f32_1d(gf->nodes[i], 0) != -1.0f;
+                if (computed != (i < limit)) {
+                    fprintf(stderr, "node %d with %d threads, abort after %d nodes: computed = %d\n", i, n_threads, limit, computed);
+                    GGML_ASSERT(false);
+                }
+            }
+        }
+
+        free(work);
+    }
+    printf("abort: ok\n");
+
+    ggml_free(ctx);
+    return 0;
+}
@@ -0,0 +1,199 @@
+#include "ggml/ggml.h"
+#include "ggml/ggml-alloc.h"
+
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// checks that ggml_graph_fuse rewrites each supported chain, and that the fused
+// graph computes the same values as the original one, up to rounding
+
+struct ggml_context * make_ctx(bool no_alloc) {
+    struct ggml_init_params params = {
+        .mem_size = 16 * 1024 * 1024,
+        .no_alloc = no_alloc,
+    };
+
+    return ggml_init(params);
+}
+
+struct inputs {
+    struct ggml_tensor * x;       // (32, 5)
+    struct ggml_tensor * x_batch; // (32, 1, 3)
+    struct ggml_tensor * w;       // (32, 24)
+    struct ggml_tensor * b;       // (24)
+    struct ggml_tensor * gamma;   // (32)
+    struct ggml_tensor * beta;    // (32)
+    struct ggml_tensor * qk;      // (7, 4, 2)
+    struct ggml_tensor * bd;      // (7, 4, 2)
+    struct ggml_tensor * mask;    // (7, 4)
+    struct ggml_tensor * scale;   // (1)
+    struct ggml_tensor * scale_2d; // (1, 1)
+};
+
+void fill_random(struct ggml_tensor * t) {
+    float * data = ggml_get_data_f32(t);
+    for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+        data[i] = (float)rand() / (float)RAND_MAX * 2.0f - 1.0f;
+    }
+}
+
+struct inputs make_inputs(struct ggml_context * ctx) {
+    struct inputs in;
+    in.x        = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 32, 5);
+    in.x_batch  = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, 32, 1, 3);
+    in.w        = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 32, 24);
+    in.b        = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 24);
+    in.gamma    = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 32);
+    in.beta     = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 32);
+    in.qk       = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, 7, 4, 2);
+    in.bd       = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, 7, 4, 2);
+    in.mask     = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 7, 4);
+    in.scale    = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 1);
+    in.scale_2d = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 1, 1);
+
+    fill_random(in.x);
+    fill_random(in.x_batch);
+    fill_random(in.w);
+    fill_random(in.b);
+    fill_random(in.gamma);
+    fill_random(in.beta);
+    fill_random(in.qk);
+    fill_random(in.bd);
+    for (int i1 = 0; i1 < 4; ++i1) {
+        for (int i0 = 0; i0 < 7; ++i0) {
+            ggml_get_data_f32(in.mask)[i1*7 + i0] = i0 > i1 + 3 ? -INFINITY : 0.0f;
+        }
+    }
+    ggml_set_f32(in.scale, 0.125f);
+    ggml_set_f32(in.scale_2d, 0.25f);
+    return in;
+}
+
+// linear + bias + relu, as in StandardFeedForwardNetwork_forward
+struct ggml_tensor * build_linear_relu(struct ggml_context * ctx, struct inputs * in) {
+    struct ggml_tensor * out = ggml_add(ctx, ggml_mul_mat(ctx, in->w, in->x), in->b);
+    return ggml_relu_inplace(ctx, out);
+}
+
+// batched linear going through reshapes, as done by `mul_mat` in fairseq2.cpp
+struct ggml_tensor * build_batched_linear_gelu(struct ggml_context * ctx, struct inputs * in) {
+    struct ggml_tensor * x = ggml_reshape_2d(ctx, in->x_batch, 32, 3);
+    struct ggml_tensor * out = ggml_reshape_3d(ctx, ggml_mul_mat(ctx, in->w, x), 24, 1, 3);
+    out = ggml_add(ctx, out, in->b);
+    return ggml_gelu(ctx, out);
+}
+
+// LayerNorm_forward, followed by a view of the result
+struct ggml_tensor * build_layer_norm(struct ggml_context * ctx, struct inputs * in) {
+    struct ggml_tensor * x = ggml_norm(ctx, in->x, 1e-5f);
+    x = ggml_add_inplace(ctx,
+        ggml_mul_inplace(ctx, ggml_repeat(ctx, in->gamma, x), x),
+        ggml_repeat(ctx, in->beta, x)
+    );
+    return ggml_cont(ctx, ggml_transpose(ctx, x));
+}
+
+// attention weights with a causal mask, as in MultiheadAttention_forward
+struct ggml_tensor * build_masked_soft_max(struct ggml_context * ctx, struct inputs * in) {
+    struct ggml_tensor * qk = ggml_scale(ctx, ggml_cont(ctx, in->qk), in->scale);
+    qk = ggml_add_inplace(ctx, qk, in->mask);
+    return ggml_soft_max(ctx, qk);
+}
+
+// attention weights scaled by a repeated scalar, as in RelativePositionMHA_forward
+struct ggml_tensor * build_rel_pos_soft_max(struct ggml_context * ctx, struct inputs * in) {
+    struct ggml_tensor * w = ggml_add(ctx, in->qk, in->bd);
+    w = ggml_mul_inplace(ctx, w, ggml_repeat(ctx, in->scale_2d, w));
+    return ggml_soft_max(ctx, w);
+}
+
+// views do not make a pass over memory, only count the nodes doing work
+int n_compute_nodes(struct ggml_cgraph * gf) {
+    int n = 0;
+    for (int i = 0; i < gf->n_nodes; ++i) {
+        switch (gf->nodes[i]->op) {
+            case GGML_OP_RESHAPE:
+            case GGML_OP_VIEW:
+            case GGML_OP_PERMUTE:
+            case GGML_OP_TRANSPOSE:
+                break;
+            default:
+                n++;
+        }
+    }
+    return n;
+}
+
+typedef struct ggml_tensor * (*build_fn)(struct ggml_context * ctx, struct inputs * in);
+
+struct ggml_tensor * compute(struct inputs * in, build_fn build, bool fuse, int expected_fusions, int * n_nodes, void * buffer, size_t buffer_size) {
+    struct ggml_context * ctx = make_ctx(true);
+    struct ggml_tensor * out = build(ctx, in);
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+
+    if (fuse) {
+        const int n_fused = ggml_graph_fuse(gf);
+        if (n_fused != expected_fusions) {
+            fprintf(stderr, "expected %d fusions, got %d\n", expected_fusions, n_fused);
+            GGML_ASSERT(false);
+        }
+    }
+    *n_nodes = n_compute_nodes(gf);
+
+    ggml_allocr_t alloc = ggml_allocr_new(buffer, buffer_size, 32);
+    ggml_allocr_alloc_graph(alloc, gf);
+    ggml_allocr_free(alloc);
+
+    struct ggml_cplan plan = ggml_graph_plan(gf, 2);
+    void * work = malloc(plan.work_size > 0 ? plan.work_size : 1);
+    plan.work_data = work;
+    ggml_graph_compute(gf, &plan);
+    free(work);
+
+    // the graph context only holds tensor headers, the data lives in `buffer`
+    return out;
+}
+
+void check(struct inputs * in, const char * name, build_fn build, int expected_fusions) {
+    const size_t buffer_size = 1024 * 1024;
+    void * ref_buffer = malloc(buffer_size);
+    void * fused_buffer = malloc(buffer_size);
+
+    int ref_nodes, fused_nodes;
+    struct ggml_tensor * ref = compute(in, build, false, 0, &ref_nodes, ref_buffer, buffer_size);
+    struct ggml_tensor * fused = compute(in, build, true, expected_fusions, &fused_nodes, fused_buffer, buffer_size);
+
+    GGML_ASSERT(ggml_are_same_shape(ref, fused));
+    GGML_ASSERT(fused_nodes < ref_nodes);
+    for (int64_t i = 0; i < ggml_nelements(ref); ++i) {
+        const float expected = ggml_get_data_f32(ref)[i];
+        const float actual = ggml_get_data_f32(fused)[i];
+        // the fused kernels may contract multiply-adds into fma
+        if (fabsf(expected - actual) > 1e-5f*fmaxf(1.0f, fabsf(expected))) {
+            fprintf(stderr, "%s: mismatch at %d: %f != %f\n", name, (int) i, actual, expected);
+            GGML_ASSERT(false);
+        }
+    }
+    printf("%s: %d -> %d nodes, ok\n", name, ref_nodes, fused_nodes);
+
+    free(ref_buffer);
+    free(fused_buffer);
+}
+
+int main(int argc, const char ** argv) {
+    srand(0);
+    struct ggml_context * ctx = make_ctx(false);
+    struct inputs in = make_inputs(ctx);
+
+    check(&in, "linear_relu", build_linear_relu, 2);
+    check(&in, "batched_linear_gelu", build_batched_linear_gelu, 2);
+    check(&in, "layer_norm", build_layer_norm, 1);
+    check(&in, "masked_soft_max", build_masked_soft_max, 1);
+    check(&in, "rel_pos_soft_max", build_rel_pos_soft_max, 1);
+
+    ggml_free(ctx);
+    return 0;
+}
@@ -0,0 +1,180 @@
+#include "ggml/ggml.h"
+#include "ggml/ggml-alloc.h"
+
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// checks that graphs with independent single-task branches, which the scheduler
+// runs concurrently, compute the same values as a single-threaded run, with both
+// spinning and sleeping waits between nodes
+
+struct ggml_context * make_ctx(bool no_alloc) {
+    struct ggml_init_params params = {
+        .mem_size = 16 * 1024 * 1024,
+        .no_alloc = no_alloc,
+    };
+
+    return ggml_init(params);
+}
+
+struct inputs {
+    struct ggml_tensor * x;      // (32, 6)
+    struct ggml_tensor * wq;     // (32, 32)
+    struct ggml_tensor * wk;     // (32, 32)
+    struct ggml_tensor * wv;     // (32, 32)
+    struct ggml_tensor * embed;  // (32, 50)
+    struct ggml_tensor * tokens; // (6), I32
+    struct ggml_tensor * bias;   // (32)
+    struct ggml_tensor * scale;  // (1)
+    struct ggml_tensor * big;    // (16384, 16)
+};
+
+void fill_random(struct ggml_tensor * t) {
+    float * data = ggml_get_data_f32(t);
+    for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+        data[i] = (float)rand() / (float)RAND_MAX * 2.0f - 1.0f;
+    }
+}
+
+struct inputs make_inputs(struct ggml_context * ctx) {
+    struct inputs in;
+    in.x      = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 32, 6);
+    in.wq     = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 32, 32);
+    in.wk     = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 32, 32);
+    in.wv     = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 32, 32);
+    in.embed  = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 32, 50);
+    in.tokens = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 6);
+    in.bias   = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 32);
+    in.scale  = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 1);
+    in.big    = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 16384, 16);
+
+    fill_random(in.x);
+    fill_random(in.wq);
+    fill_random(in.wk);
+    fill_random(in.wv);
+    fill_random(in.embed);
+    fill_random(in.bias);
+    fill_random(in.big);
+    for (int i = 0; i < 6; ++i) {
+        ggml_set_i32_1d(in.tokens, i, (i * 7) % 50);
+    }
+    ggml_set_f32(in.scale, 0.125f);
+    return in;
+}
+
+// (32, 6) -> (6, 8, 4) contiguous heads, as in MultiheadAttention_forward
+struct ggml_tensor * split_heads(struct ggml_context * ctx, struct ggml_tensor * x) {
+    x = ggml_reshape_3d(ctx, x, 8, 4, 6);
+    return ggml_cont(ctx, ggml_permute(ctx, x, 0, 2, 1, 3));
+}
+
+// q/k/v projections, each followed by a head split and a single-task op
+struct ggml_tensor * build_attention(struct ggml_context * ctx, struct inputs * in) {
+    struct ggml_tensor * q = split_heads(ctx, ggml_mul_mat(ctx, in->wq, in->x));
+    struct ggml_tensor * k = split_heads(ctx, ggml_mul_mat(ctx, in->wk, in->x));
+    struct ggml_tensor * v = split_heads(ctx, ggml_mul_mat(ctx, in->wv, in->x));
+
+    q = ggml_scale_inplace(ctx, q, in->scale);
+    k = ggml_sqr(ctx, k);
+    v = ggml_abs(ctx, v);
+
+    struct ggml_tensor * qk = ggml_mul_mat(ctx, k, q);
+    struct ggml_tensor * v_t = ggml_cont(ctx, ggml_transpose(ctx, v));
+    return ggml_mul_mat(ctx, v_t, ggml_soft_max(ctx, qk));
+}
+
+// embedding lookup next to broadcast bias and an independent residual branch
+struct ggml_tensor * build_embedding(struct ggml_context * ctx, struct inputs * in) {
+    struct ggml_tensor * emb = ggml_get_rows(ctx, in->embed, in->tokens);
+    struct ggml_tensor * bias = ggml_repeat(ctx, in->bias, in->x);
+    struct ggml_tensor * res = ggml_neg(ctx, in->x);
+    struct ggml_tensor * t = ggml_cont(ctx, ggml_transpose(ctx, in->x));
+
+    emb = ggml_sub(ctx, emb, bias);
+    res = ggml_sqr(ctx, res);
+    t = ggml_sum_rows(ctx, ggml_sqrt(ctx, ggml_abs(ctx, t)));
+
+    struct ggml_tensor * out = ggml_add(ctx, emb, res);
+    return ggml_mul(ctx, out, ggml_repeat(ctx, ggml_reshape_2d(ctx, t, 32, 1), out));
+}
+
+// a slow and a fast node in the same wave, followed by a consumer of the slow one: the
+// thread that runs the fast node leaves the wave long before the other
+struct ggml_tensor * build_unbalanced(struct ggml_context * ctx, struct inputs * in) {
+    struct ggml_tensor * slow = ggml_tanh(ctx, in->big);
+    struct ggml_tensor * fast = ggml_abs(ctx, ggml_view_1d(ctx, in->big, in->big->ne[0], 0));
+
+    return ggml_mul_mat(ctx, slow, fast);
+}
+
+typedef struct ggml_tensor * (*build_fn)(struct ggml_context * ctx, struct inputs * in);
+
+struct ggml_tensor * compute(struct inputs * in, build_fn build, int n_threads, int spin_count, void * buffer, size_t buffer_size) {
+    struct ggml_context * ctx = make_ctx(true);
+    struct ggml_tensor * out = build(ctx, in);
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+
+    // ggml-alloc reuses the memory of intermediate results, which the scheduler must respect
+    ggml_allocr_t alloc = ggml_allocr_new(buffer, buffer_size, 32);
+    ggml_allocr_alloc_graph(alloc, gf);
+    ggml_allocr_free(alloc);
+
+    struct ggml_cplan plan = ggml_graph_plan(gf, n_threads);
+    plan.spin_count = spin_count;
+    void * work = malloc(plan.work_size > 0 ? plan.work_size : 1);
+    plan.work_data = work;
+    ggml_graph_compute(gf, &plan);
+    free(work);
+
+    // the graph context only holds tensor headers, the data lives in `buffer`
+    return out;
+}
+
+void check(struct inputs * in, const char * name, build_fn build) {
+    const size_t buffer_size = 4 * 1024 * 1024;
+    void * ref_buffer = malloc(buffer_size);
+    void * buffer = malloc(buffer_size);
+
+    struct ggml_tensor * ref = compute(in, build, 1, GGML_DEFAULT_SPIN_COUNT, ref_buffer, buffer_size);
+
+    const int spin_counts[] = { GGML_DEFAULT_SPIN_COUNT, 0, -1 };
+
+    for (int n_threads = 2; n_threads <= 4; ++n_threads) {
+        // repeat to give races a chance to show up
+        for (int run = 0; run < 30; ++run) {
+            const int spin_count = spin_counts[run % 3];
+            struct ggml_tensor * out = compute(in, build, n_threads, spin_count, buffer, buffer_size);
+
+            GGML_ASSERT(ggml_are_same_shape(ref, out));
+            for (int64_t i = 0; i < ggml_nelements(ref); ++i) {
+                const float expected = ggml_get_data_f32(ref)[i];
+                const float actual = ggml_get_data_f32(out)[i];
+                if (fabsf(expected - actual) > 1e-6f*fmaxf(1.0f, fabsf(expected))) {
+                    fprintf(stderr, "%s: mismatch at %d with %d threads, spin count %d: %f != %f\n",
+                            name, (int) i, n_threads, spin_count, actual, expected);
+                    GGML_ASSERT(false);
+                }
+            }
+        }
+    }
+    printf("%s: ok\n", name);
+
+    free(ref_buffer);
+    free(buffer);
+}
+
+int main(int argc, const char ** argv) {
+    srand(0);
+    struct ggml_context * ctx = make_ctx(false);
+    struct inputs in = make_inputs(ctx);
+
+    check(&in, "attention", build_attention);
+    check(&in, "embedding", build_embedding);
+    check(&in, "unbalanced", build_unbalanced);
+
+    ggml_free(ctx);
+    return 0;
+}
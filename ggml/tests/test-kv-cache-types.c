@@ -0,0 +1,178 @@
+#include "ggml/ggml.h"
+
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// checks the ops run on F16 and Q8_0 KV caches: concat of the new step (along dim 0 for the
+// transposed values), get_rows of the beam reordering, and the attention matmuls reading the
+// cache through views.
+// the results must match the same ops on the F32 cache rounded to the storage type.
+
+struct ggml_context * make_ctx(void) {
+    struct ggml_init_params params = {
+        .mem_size = 16 * 1024 * 1024,
+        .no_alloc = false,
+    };
+
+    return ggml_init(params);
+}
+
+void fill_random(struct ggml_tensor * t) {
+    float * data = ggml_get_data_f32(t);
+    for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+        data[i] = (float)rand() / (float)RAND_MAX * 2.0f - 1.0f;
+    }
+}
+
+struct ggml_tensor * to_type(struct ggml_context * ctx, struct ggml_tensor * x, enum ggml_type type) {
+    return ggml_cpy(ctx, x, ggml_new_tensor(ctx, type, x->n_dims, x->ne));
+}
+
+void compute(struct ggml_context * ctx, struct ggml_tensor * out) {
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+    ggml_graph_compute_with_ctx(ctx, gf, 2);
+}
+
+// computed contiguous `x` read back to F32, ggml can't convert Q8_0 to F32 in a graph
+struct ggml_tensor * to_f32(struct ggml_context * ctx, struct ggml_tensor * x) {
+    GGML_ASSERT(ggml_is_contiguous(x));
+    struct ggml_tensor * y = ggml_new_tensor(ctx, GGML_TYPE_F32, x->n_dims, x->ne);
+    if (x->type == GGML_TYPE_F32) {
+        memcpy(y->data, x->data, ggml_nbytes(y));
+    } else {
+        ggml_internal_get_type_traits(x->type).to_float(x->data, ggml_get_data_f32(y), ggml_nelements(y));
+    }
+    return y;
+}
+
+void check_close(const char * name, struct ggml_tensor * expected, struct ggml_tensor * actual, float tol) {
+    GGML_ASSERT(ggml_are_same_shape(expected, actual));
+    for (int64_t i = 0; i < ggml_nelements(expected); ++i) {
+        const float e = ggml_get_data_f32(expected)[i];
+        const float a = ggml_get_data_f32(actual)[i];
+        if (fabsf(e - a) > tol*fmaxf(1.0f, fabsf(e))) {
+            fprintf(stderr, "%s: mismatch at %d: %f != %f\n", name, (int) i, a, e);
+            GGML_ASSERT(false);
+        }
+    }
+}
+
+// (model_dim, steps, beams) cache, one step appended then the beams reordered
+void check_concat_get_rows(enum ggml_type type) {
+    struct ggml_context * ctx = make_ctx();
+    const int dim = 64, steps = 5, beams = 3;
+
+    struct ggml_tensor * cache = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, dim, steps, beams);
+    struct ggml_tensor * step = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, dim, 1, beams);
+    struct ggml_tensor * order = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, beams);
+    fill_random(cache);
+    fill_random(step);
+    ggml_set_i32_1d(order, 0, 2);
+    ggml_set_i32_1d(order, 1, 2);
+    ggml_set_i32_1d(order, 2, 0);
+
+    // the appended step goes along dim 1, which concat handles as dim 2 once unsqueezed
+    struct ggml_tensor * ref = ggml_concat(ctx,
+        ggml_reshape_4d(ctx, cache, dim, 1, steps, beams),
+        ggml_reshape_4d(ctx, step, dim, 1, 1, beams));
+    ref = ggml_reshape_2d(ctx, ggml_cont(ctx, ref), dim*(steps + 1), beams);
+    ref = to_type(ctx, ggml_get_rows(ctx, ref, order), type);
+
+    struct ggml_tensor * out = ggml_concat(ctx,
+        ggml_reshape_4d(ctx, to_type(ctx, cache, type), dim, 1, steps, beams),
+        ggml_reshape_4d(ctx, to_type(ctx, step, type), dim, 1, 1, beams));
+    out = ggml_reshape_2d(ctx, out, dim*(steps + 1), beams);
+    out = ggml_get_rows(ctx, out, order);
+    GGML_ASSERT(out->type == type);
+
+    compute(ctx, ref);
+    compute(ctx, out);
+    check_close(ggml_type_name(type), to_f32(ctx, ref), to_f32(ctx, out), 0.0f);
+    printf("concat/get_rows %s: ok\n", ggml_type_name(type));
+
+    ggml_free(ctx);
+}
+
+// (steps, model_dim, beams) transposed values cache, one step appended along dim 0
+void check_concat_0(enum ggml_type type) {
+    struct ggml_context * ctx = make_ctx();
+    const int dim = 64, steps = 5, beams = 3;
+
+    struct ggml_tensor * cache = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, dim, steps, beams);
+    struct ggml_tensor * step = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, dim, 1, beams);
+    fill_random(cache);
+    fill_random(step);
+
+    // reference: the step appended along dim 1, then transposed
+    struct ggml_tensor * ref = ggml_concat(ctx,
+        ggml_reshape_4d(ctx, cache, dim, 1, steps, beams),
+        ggml_reshape_4d(ctx, step, dim, 1, 1, beams));
+    ref = ggml_reshape_3d(ctx, ggml_cont(ctx, ref), dim, steps + 1, beams);
+    ref = to_type(ctx, ggml_transpose(ctx, ref), type);
+
+    struct ggml_tensor * out = ggml_concat_0(ctx,
+        to_type(ctx, ggml_transpose(ctx, cache), type),
+        to_type(ctx, ggml_transpose(ctx, step), type));
+    GGML_ASSERT(out->type == type && out->ne[0] == steps + 1 && out->ne[1] == dim && out->ne[2] == beams);
+
+    compute(ctx, ref);
+    compute(ctx, out);
+    check_close(ggml_type_name(type), to_f32(ctx, ref), to_f32(ctx, out), 0.0f);
+    printf("concat_0 %s: ok\n", ggml_type_name(type));
+
+    ggml_free(ctx);
+}
+
+// q.k over a (head_dim, heads, steps) view of the cache, then the values pre-transposed
+void check_attention(enum ggml_type k_type, enum ggml_type v_type) {
+    struct ggml_context * ctx = make_ctx();
+    const int head_dim = 32, heads = 4, steps = 7, beams = 2;
+
+    struct ggml_tensor * q = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, head_dim, 1, heads, beams);
+    struct ggml_tensor * k = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, head_dim*heads, steps, beams);
+    struct ggml_tensor * v = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, steps, head_dim, heads, beams);
+    fill_random(q);
+    fill_random(k);
+    fill_random(v);
+
+    struct ggml_tensor * k_cache = to_type(ctx, k, k_type);
+    struct ggml_tensor * v_cache = to_type(ctx, v, v_type);
+    compute(ctx, k_cache);
+    compute(ctx, v_cache);
+
+    // reference: the same rounded cache, read back to F32 and made contiguous
+    struct ggml_tensor * k_ref = ggml_cont(ctx, ggml_permute(ctx,
+        ggml_reshape_4d(ctx, to_f32(ctx, k_cache), head_dim, heads, steps, beams), 0, 2, 1, 3));
+    struct ggml_tensor * v_ref = to_f32(ctx, v_cache);
+    struct ggml_tensor * ref = ggml_mul_mat(ctx, v_ref, ggml_soft_max(ctx, ggml_mul_mat(ctx, k_ref, q)));
+
+    struct ggml_tensor * k_view = ggml_permute(ctx,
+        ggml_reshape_4d(ctx, k_cache, head_dim, heads, steps, beams), 0, 2, 1, 3);
+    struct ggml_tensor * out = ggml_mul_mat(ctx, v_cache, ggml_soft_max(ctx, ggml_mul_mat(ctx, k_view, q)));
+
+    compute(ctx, ref);
+    compute(ctx, out);
+    // q and the attention weights are rounded to the vec_dot type of the cache
+    check_close(ggml_type_name(k_type), ref, out, k_type == GGML_TYPE_Q8_0 ? 5e-2f : 1e-2f);
+    printf("attention %s/%s: ok\n", ggml_type_name(k_type), ggml_type_name(v_type));
+
+    ggml_free(ctx);
+}
+
+int main(int argc, const char ** argv) {
+    srand(0);
+
+    check_concat_get_rows(GGML_TYPE_F16);
+    check_concat_get_rows(GGML_TYPE_Q8_0);
+
+    check_concat_0(GGML_TYPE_F32);
+    check_concat_0(GGML_TYPE_F16);
+
+    check_attention(GGML_TYPE_F16, GGML_TYPE_F16);
+    check_attention(GGML_TYPE_Q8_0, GGML_TYPE_F16);
+
+    return 0;
+}
@@ -0,0 +1,104 @@
+#include "ggml/ggml.h"
+
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// checks ggml_layer_norm against a two-pass reference in double precision, with and without
+// gamma and beta, on row sizes with and without SIMD leftovers, and on rows whose mean is
+// large next to their spread
+
+struct ggml_context * make_ctx(void) {
+    struct ggml_init_params params = {
+        .mem_size = 16 * 1024 * 1024,
+        .no_alloc = false,
+    };
+
+    return ggml_init(params);
+}
+
+void fill_random(struct ggml_tensor * t, float offset) {
+    float * data = ggml_get_data_f32(t);
+    for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+        data[i] = offset + (float)rand() / (float)RAND_MAX * 2.0f - 1.0f;
+    }
+}
+
+void check(int dim, float offset, bool with_gamma, bool with_beta) {
+    struct ggml_context * ctx = make_ctx();
+    const int rows = 5;
+    const float eps = 1e-5f;
+
+    struct ggml_tensor * x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, dim, rows);
+    struct ggml_tensor * gamma = with_gamma ? ggml_new_tensor_1d(ctx, GGML_TYPE_F32, dim) : NULL;
+    struct ggml_tensor * beta = with_beta ? ggml_new_tensor_1d(ctx, GGML_TYPE_F32, dim) : NULL;
+    fill_random(x, offset);
+    if (gamma) {
+        fill_random(gamma, 1.0f);
+    }
+    if (beta) {
+        fill_random(beta, 0.0f);
+    }
+
+    struct ggml_tensor * out = ggml_layer_norm(ctx, x, gamma, beta, eps);
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+    ggml_graph_compute_with_ctx(ctx, gf, 2);
+
+    // the mean is rounded to float, which is off by up to half an ulp of the offset
+    // before the scaling by 1/stddev and gamma
+    const float tol = 1e-5f + 4e-7f*fabsf(offset);
+
+    for (int r = 0; r < rows; ++r) {
+        const float * xr = ggml_get_data_f32(x) + r*dim;
+        const float * yr = ggml_get_data_f32(out) + r*dim;
+
+        double mean = 0.0;
+        for (int i = 0; i < dim; ++i) {
+            mean += xr[i];
+        }
+        mean /= dim;
+        double variance = 0.0;
+        for (int i = 0; i < dim; ++i) {
+            variance += (xr[i] - mean)*(xr[i] - mean);
+        }
+        variance /= dim;
+
+        for (int i = 0; i < dim; ++i) {
+            double expected = (xr[i] - mean)/sqrt(variance + eps);
+            if (gamma) {
+                expected *= ggml_get_data_f32(gamma)[i];
+            }
+            if (beta) {
+                expected += ggml_get_data_f32(beta)[i];
+            }
+            if (fabs(expected - yr[i]) > tol) {
+                fprintf(stderr, "dim %d, offset %g, gamma %d, beta %d: mismatch at (%d, %d): %f != %f\n",
+                        dim, offset, with_gamma, with_beta, i, r, yr[i], expected);
+                GGML_ASSERT(false);
+            }
+        }
+    }
+
+    ggml_free(ctx);
+}
+
+int main(int argc, const char ** argv) {
+    srand(0);
+
+    const int dims[] = { 1, 7, 64, 1000, 1024 };
+    const float offsets[] = { 0.0f, 100.0f, 10000.0f };
+
+    for (size_t d = 0; d < sizeof(dims)/sizeof(dims[0]); ++d) {
+        for (size_t o = 0; o < sizeof(offsets)/sizeof(offsets[0]); ++o) {
+            check(dims[d], offsets[o], false, false);
+            check(dims[d], offsets[o], true,  false);
+            check(dims[d], offsets[o], false, true);
+            check(dims[d], offsets[o], true,  true);
+        }
+        printf("dim %d: ok\n", dims[d]);
+    }
+
+    return 0;
+}
@@ -124,7 +124,6 @@ GGML_QNT_VERSION_FACTOR = 1000
 
 # define GGML_MAX_DIMS           4
 # define GGML_MAX_PARAMS         2048
-# define GGML_MAX_CONTEXTS       64
 # define GGML_MAX_SRC            10
 # define GGML_MAX_NAME           64
 # define GGML_MAX_OP_PARAMS      64
@@ -132,7 +131,6 @@ GGML_QNT_VERSION_FACTOR = 1000
 # define GGML_DEFAULT_GRAPH_SIZE 2048
 GGML_MAX_DIMS = 4
 GGML_MAX_PARAMS = 2048
-GGML_MAX_CONTEXTS = 64
 GGML_MAX_SRC = 10
 GGML_MAX_NAME = 64
 GGML_MAX_OP_PARAMS = 64
@@ -653,6 +651,9 @@ Can be dereferenced to a [ggml_tensor][ggml.ggml_tensor] object using
 the `.contents` attribute."""
 
 abort_callback_t = ctypes.CFUNCTYPE(ctypes.c_bool, ctypes.c_void_p)
+node_callback_t = ctypes.CFUNCTYPE(
+    None, ctypes.c_void_p, ctypes.c_int64, ctypes.c_int64, ctypes.c_void_p
+)
 
 # // the compute plan that needs to be prepared for ggml_graph_compute()
 # // since https://github.com/ggerganov/ggml/issues/287
@@ -662,10 +663,22 @@ abort_callback_t = ctypes.CFUNCTYPE(ctypes.c_bool, ctypes.c_void_p)
 
 #     int n_threads;
 
+#     // NUMA node the threads are pinned to, -1 to spread them over all nodes (default)
+#     int numa_node;
+
+#     // how long the threads waiting for the next node spin before sleeping until it is ready,
+#     // in pause instructions: -1 to never sleep, 0 to sleep right away when other processes
+#     // need the cores (default: GGML_DEFAULT_SPIN_COUNT, 0 with BLAS)
+#     int spin_count;
 
-#     // abort ggml_graph_compute when true
+#     // abort ggml_graph_compute when true, checked before each node. The nodes left are not
+#     // computed and ggml_graph_compute returns GGML_EXIT_ABORTED
 #     bool (*abort_callback)(void * data);
 #     void * abort_callback_data;
+
+#     // called once each node has been computed, with the wall-clock start/end of the node in us
+#     void (*node_callback)(struct ggml_tensor * node, int64_t t_start_us, int64_t t_end_us, void * data);
+#     void * node_callback_data;
 # };
 class ggml_cplan(ctypes.Structure):
     """Compute plan for a ggml computation graph
@@ -674,19 +687,30 @@ class ggml_cplan(ctypes.Structure):
         work_size (int): size of work buffer
         work_data (ctypes.pointer[ctypes.c_uint8]): work buffer
         n_threads (int): number of threads
+        numa_node (int): NUMA node the threads are pinned to, -1 to spread them
+        spin_count (int): pause instructions spun waiting for the next node before sleeping, -1 to never sleep
         abort_callback (abort_callback_t): abort callback
         abort_callback_data (ctypes.c_void_p): abort callback data
+        node_callback (node_callback_t): per-node timing callback
+        node_callback_data (ctypes.c_void_p): per-node timing callback data
     """
 
     _fields_ = [
         ("work_size", ctypes.c_size_t),
         ("work_data", ctypes.POINTER(ctypes.c_uint8)),
         ("n_threads", ctypes.c_int),
+        ("numa_node", ctypes.c_int),
+        ("spin_count", ctypes.c_int),
         (
             "abort_callback",
             abort_callback_t,
         ),
         ("abort_callback_data", ctypes.c_void_p),
+        (
+            "node_callback",
+            node_callback_t,
+        ),
+        ("node_callback_data", ctypes.c_void_p),
     ]
 
 
@@ -926,6 +950,38 @@ lib.ggml_is_numa.argtypes = []
 lib.ggml_is_numa.restype = ctypes.c_bool
 
 
+# GGML_API int     ggml_numa_n_nodes(void); // NUMA nodes found by ggml_numa_init, 0 before
+def ggml_numa_n_nodes() -> int:
+    return lib.ggml_numa_n_nodes()
+
+
+lib.ggml_numa_n_nodes.argtypes = []
+lib.ggml_numa_n_nodes.restype = ctypes.c_int
+
+
+# GGML_API void    ggml_numa_set_thread_node(int node); // pin the calling thread to the CPUs of a node, -1 to unpin it
+def ggml_numa_set_thread_node(node: Union[ctypes.c_int, int]):
+    return lib.ggml_numa_set_thread_node(node)
+
+
+lib.ggml_numa_set_thread_node.argtypes = [ctypes.c_int]
+lib.ggml_numa_set_thread_node.restype = None
+
+
+# // place the pages of a buffer that are not touched yet on a node, or interleave them over all nodes if node < 0
+# GGML_API void    ggml_numa_set_memory_node(void * data, size_t size, int node);
+def ggml_numa_set_memory_node(
+    data: ctypes.c_void_p,
+    size: Union[ctypes.c_size_t, int],
+    node: Union[ctypes.c_int, int],
+):
+    return lib.ggml_numa_set_memory_node(data, size, node)
+
+
+lib.ggml_numa_set_memory_node.argtypes = [ctypes.c_void_p, ctypes.c_size_t, ctypes.c_int]
+lib.ggml_numa_set_memory_node.restype = None
+
+
 # GGML_API void    ggml_print_object (const struct ggml_object * obj);
 def ggml_print_object(obj: ggml_object_p):
     return lib.ggml_print_object(obj)